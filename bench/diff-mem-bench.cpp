@@ -0,0 +1,147 @@
+/**
+ * @file
+ * @brief Measure DiffMemory::add() with an overwrite-heavy workload
+ *        comparing with a reference implementation that copies IO data of every fragment.
+ */
+#include <map>
+#include <queue>
+#include <vector>
+#include "cybozu/option.hpp"
+#include "walb_diff_mem.hpp"
+#include "walb_util.hpp"
+#include "random.hpp"
+
+using namespace walb;
+
+struct Option
+{
+    uint64_t devMb;
+    uint32_t maxIoLb;
+    size_t nrIo;
+    size_t nrRound;
+
+    Option(int argc, char* argv[]) {
+        cybozu::Option opt;
+        opt.setDescription("Measure DiffMemory::add() with an overwrite-heavy workload.");
+        opt.appendOpt(&devMb, 8, "dev", ": device size [MiB]. (default: 8)");
+        opt.appendOpt(&maxIoLb, 32, "io", ": max IO size [logical block]. (default: 32)");
+        opt.appendOpt(&nrIo, 8000, "n", ": number of IOs in a round. (default: 8000)");
+        opt.appendOpt(&nrRound, 10, "r", ": number of rounds. (default: 10)");
+        opt.appendHelp("h", ": put this message.");
+        if (!opt.parse(argc, argv) || maxIoLb == 0 || nrRound == 0 ||
+            devMb * MEBI / LOGICAL_BLOCK_SIZE <= maxIoLb) {
+            opt.usage();
+            ::exit(1);
+        }
+    }
+};
+
+/**
+ * Reference implementation like the former DiffMemory.
+ */
+class CopyingDiffMemory
+{
+public:
+    using Item = std::pair<DiffRecord, AlignedArray>;
+    using Map = std::map<uint64_t, Item>;
+private:
+    Map map_;
+public:
+    void add(const DiffRecord& rec, AlignedArray &&buf) {
+        const uint64_t addr0 = rec.io_address;
+        const uint64_t addr1 = rec.endIoAddress();
+        Map::iterator it = map_.lower_bound(addr0);
+        if (it != map_.begin() && addr0 < std::prev(it)->second.first.endIoAddress()) --it;
+        std::queue<Item> q;
+        while (it != map_.end() && it->first < addr1) {
+            q.push(std::move(it->second));
+            it = map_.erase(it);
+        }
+        while (!q.empty()) {
+            const Item& item = q.front();
+            const uint64_t bgn = item.first.io_address;
+            const uint64_t end = item.first.endIoAddress();
+            if (bgn < addr0) addPart(item, bgn, addr0 - bgn);
+            if (addr1 < end) addPart(item, addr1, end - addr1);
+            q.pop();
+        }
+        map_.emplace(addr0, Item(rec, std::move(buf)));
+    }
+    size_t size() const { return map_.size(); }
+private:
+    void addPart(const Item& item, uint64_t addr, uint32_t blks) {
+        DiffRecord rec = item.first;
+        rec.io_address = addr;
+        rec.io_blocks = blks;
+        AlignedArray buf;
+        if (rec.isNormal()) {
+            rec.data_size = blks * LOGICAL_BLOCK_SIZE;
+            const size_t off = (addr - item.first.io_address) * LOGICAL_BLOCK_SIZE;
+            util::assignAlignedArray(buf, item.second.data() + off, rec.data_size);
+        }
+        map_.emplace(addr, Item(rec, std::move(buf)));
+    }
+};
+
+struct Input
+{
+    std::vector<DiffRecord> recV;
+    std::vector<AlignedArray> bufV;
+};
+
+void prepareInput(const Option& opt, cybozu::util::Random<uint64_t>& rand, Input& in)
+{
+    const uint64_t devLb = opt.devMb * MEBI / LOGICAL_BLOCK_SIZE;
+    in.recV.resize(opt.nrIo);
+    in.bufV.resize(opt.nrIo);
+    for (size_t i = 0; i < opt.nrIo; i++) {
+        DiffRecord &rec = in.recV[i];
+        rec.init();
+        rec.io_blocks = rand() % opt.maxIoLb + 1;
+        rec.io_address = rand() % (devLb - rec.io_blocks);
+        rec.data_size = rec.io_blocks * LOGICAL_BLOCK_SIZE;
+        AlignedArray &buf = in.bufV[i];
+        buf.resize(rec.data_size, false);
+        rand.fill(buf.data(), buf.size());
+    }
+}
+
+size_t getNrItems(const CopyingDiffMemory& diffM) { return diffM.size(); }
+size_t getNrItems(const DiffMemory& diffM) { return diffM.getNIos(); }
+
+template <typename DiffMem>
+double measure(const Option& opt, cybozu::util::Random<uint64_t>& rand, Input& in, size_t& nrItems)
+{
+    double elapsed = 0;
+    for (size_t r = 0; r < opt.nrRound; r++) {
+        prepareInput(opt, rand, in);
+        const double t0 = cybozu::util::getTime();
+        DiffMem diffM;
+        for (size_t i = 0; i < opt.nrIo; i++) {
+            diffM.add(in.recV[i], std::move(in.bufV[i]));
+        }
+        elapsed += cybozu::util::getTime() - t0;
+        nrItems = getNrItems(diffM);
+    }
+    return elapsed;
+}
+
+int doMain(int argc, char* argv[])
+{
+    Option opt(argc, argv);
+    Input in;
+    const uint64_t seed = cybozu::util::Random<uint64_t>().getSeed();
+    size_t nr0 = 0, nr1 = 0;
+    cybozu::util::Random<uint64_t> rand;
+    rand.setSeed(seed);
+    const double t0 = measure<CopyingDiffMemory>(opt, rand, in, nr0);
+    rand.setSeed(seed);
+    const double t1 = measure<DiffMemory>(opt, rand, in, nr1);
+    ::printf("devMb %" PRIu64 " maxIoLb %" PRIu32 " nrIo %zu nrRound %zu\n"
+             "CopyingDiffMemory %.6f sec %zu items\n"
+             "DiffMemory        %.6f sec %zu items\n"
+             , opt.devMb, opt.maxIoLb, opt.nrIo, opt.nrRound, t0, nr0, t1, nr1);
+    return 0;
+}
+
+DEFINE_ERROR_SAFE_MAIN("diff-mem-bench")
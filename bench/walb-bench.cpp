@@ -0,0 +1,521 @@
+/**
+ * @file
+ * @brief End-to-end throughput benchmark of the data path.
+ *
+ * Workloads are generated by WlogGenerator from fixed seeds,
+ * so the same options give the same input data in every run.
+ * Each stage is timed in isolation on the files prepared before it
+ * and the results are written in JSON.
+ */
+#include <future>
+#include <thread>
+#include <algorithm>
+#include <sys/utsname.h>
+#include "cybozu/option.hpp"
+#include "cybozu/socket.hpp"
+#include "cybozu/string_operation.hpp"
+#include "walb_util.hpp"
+#include "walb_log_gen.hpp"
+#include "walb_log_redo.hpp"
+#include "walb_diff_converter.hpp"
+#include "walb_diff_merge.hpp"
+#include "walb_diff_virt.hpp"
+#include "walb_diff_compressor.hpp"
+#include "wdiff_transfer.hpp"
+#include "file_path.hpp"
+#include "random.hpp"
+#include "version.hpp"
+
+using namespace walb;
+
+const char *const STAGE_CONVERT = "convert";
+const char *const STAGE_MERGE = "merge";
+const char *const STAGE_COMPRESS = "compress";
+const char *const STAGE_VIRT = "virt-full-scan";
+const char *const STAGE_REDO = "wlog-redo";
+const char *const STAGE_TRANSFER = "wdiff-transfer";
+
+const char *const ALL_STAGES = "convert,merge,compress,virt-full-scan,wlog-redo,wdiff-transfer";
+
+struct Workload
+{
+    const char *name;
+    WlogGenerator::AddrPattern addrPattern;
+    bool isAllZero;
+    uint32_t allZeroPct;
+    bool isDiscard;
+    uint32_t discardPct;
+};
+
+const Workload workloadTbl[] = {
+    {"random", WlogGenerator::AddrPattern::RANDOM, false, 0, false, 0},
+    {"sequential", WlogGenerator::AddrPattern::SEQUENTIAL, false, 0, false, 0},
+    {"overwrite", WlogGenerator::AddrPattern::HOT, false, 0, false, 0},
+    {"zero", WlogGenerator::AddrPattern::RANDOM, true, 80, false, 0},
+    {"discard", WlogGenerator::AddrPattern::RANDOM, false, 0, true, 60},
+};
+
+const Workload& getWorkload(const std::string &name)
+{
+    for (const Workload &w : workloadTbl) {
+        if (name == w.name) return w;
+    }
+    throw cybozu::Exception(__func__) << "bad workload" << name;
+}
+
+struct Option
+{
+    std::string baseDir;
+    std::string outPath;
+    StrVec workloadV;
+    StrVec stageV;
+    StrVec cmprV;
+    std::vector<size_t> threadsV;
+    uint64_t devSize;
+    uint64_t logSize;
+    size_t nrWlogs;
+    uint32_t seed;
+    size_t repeat;
+    uint16_t port;
+    bool isStamp;
+    bool dontUseAio;
+    bool doKeep;
+
+    Option(int argc, char* argv[]) {
+        std::string workloadStr, stageStr, cmprStr, threadsStr;
+        cybozu::Option opt;
+        opt.setDescription("walb-bench: measure throughput of each data path stage with deterministic workloads.");
+        opt.appendOpt(&baseDir, "/tmp", "d", "DIR: directory to create a work directory in. (default: /tmp)");
+        opt.appendOpt(&outPath, "walb-bench.json", "o", "PATH: output JSON path. (default: walb-bench.json)");
+        opt.appendOpt(&workloadStr, "random,sequential,overwrite,zero,discard", "w"
+                      , "LIST: comma-separated workloads. (default: random,sequential,overwrite,zero,discard)");
+        opt.appendOpt(&stageStr, ALL_STAGES, "stage", cybozu::format("LIST: comma-separated stages. (default: %s)", ALL_STAGES));
+        opt.appendOpt(&cmprStr, "none:0,snappy:0,lz4:0,zstd:3", "cmpr"
+                      , "LIST: comma-separated type:level for merge, compress and wdiff-transfer. (default: none:0,snappy:0,lz4:0,zstd:3)");
+        opt.appendOpt(&threadsStr, "1,2,4", "t", "LIST: comma-separated thread counts of compression. (default: 1,2,4)");
+        opt.appendOpt(&devSize, 64 * MEBI, "s", "SIZE: device size [byte]. (default: 64M)");
+        opt.appendOpt(&logSize, 16 * MEBI, "z", "SIZE: size of each wlog [byte]. (default: 16M)");
+        opt.appendOpt(&nrWlogs, 4, "k", "NUM: number of wlogs and wdiffs. (default: 4)");
+        opt.appendOpt(&seed, 1, "seed", "SEED: random seed of the first wlog. The i-th wlog uses SEED+i. (default: 1)");
+        opt.appendOpt(&repeat, 3, "r", "NUM: repeat each measurement and take the median. (default: 3)");
+        opt.appendOpt(&port, 10190, "port", "PORT: loopback TCP port for wdiff-transfer. (default: 10190)");
+        opt.appendBoolOpt(&isStamp, "stamp", ": use compressible data stamped with lsids instead of random data.");
+        opt.appendBoolOpt(&dontUseAio, "noaio", ": do not use aio in wlog-redo.");
+        opt.appendBoolOpt(&doKeep, "keep", ": keep the work directory.");
+        opt.appendHelp("h", ": show this message.");
+        if (!opt.parse(argc, argv)) {
+            opt.usage();
+            ::exit(1);
+        }
+        workloadV = cybozu::Split(workloadStr, ',');
+        for (const std::string &s : workloadV) getWorkload(s);
+        stageV = cybozu::Split(stageStr, ',');
+        const StrVec allStageV = cybozu::Split(std::string(ALL_STAGES), ',');
+        for (const std::string &s : stageV) {
+            if (std::find(allStageV.begin(), allStageV.end(), s) == allStageV.end()) {
+                throw cybozu::Exception("bad stage") << s;
+            }
+        }
+        cmprV = cybozu::Split(cmprStr, ',');
+        for (const std::string &s : cmprV) CompressOpt().parse(s + ":1");
+        for (const std::string &s : cybozu::Split(threadsStr, ',')) {
+            const size_t n = cybozu::atoi(s);
+            if (n == 0 || n > UINT8_MAX) throw cybozu::Exception("bad thread count") << s;
+            threadsV.push_back(n);
+        }
+        if (seed == 0) throw cybozu::Exception("seed must not be 0");
+        if (nrWlogs == 0) throw cybozu::Exception("number of wlogs must not be 0");
+        if (repeat == 0) throw cybozu::Exception("repeat must not be 0");
+        if (devSize < MEBI || devSize % LBS != 0) throw cybozu::Exception("bad device size") << devSize;
+    }
+    bool hasStage(const char *stage) const {
+        return std::find(stageV.begin(), stageV.end(), stage) != stageV.end();
+    }
+};
+
+struct Result
+{
+    std::string workload;
+    std::string stage;
+    std::string cmpr; // empty if not applicable.
+    size_t threads; // 0 if not applicable.
+    uint64_t inBytes;
+    uint64_t outBytes;
+    std::vector<double> secV;
+
+    double medianSec() const {
+        std::vector<double> v = secV;
+        std::sort(v.begin(), v.end());
+        return v[v.size() / 2];
+    }
+    double minSec() const {
+        return *std::min_element(secV.begin(), secV.end());
+    }
+    double mibps() const {
+        return inBytes / double(MEBI) / medianSec();
+    }
+};
+
+std::string jsonStr(const std::string &s)
+{
+    std::string ret = "\"";
+    for (const char c : s) {
+        if (c == '"' || c == '\\') ret += '\\';
+        ret += c;
+    }
+    return ret + "\"";
+}
+
+uint64_t getFileSize(const std::string &path)
+{
+    return cybozu::FilePath(path).stat().size();
+}
+
+uint64_t getTotalFileSize(const StrVec &pathV)
+{
+    uint64_t total = 0;
+    for (const std::string &path : pathV) total += getFileSize(path);
+    return total;
+}
+
+class Bench
+{
+    const Option &opt_;
+    const Workload &workload_;
+    cybozu::FilePath dir_;
+    StrVec wlogV_, wdiffV_;
+    std::vector<Result> &resV_;
+
+public:
+    Bench(const Option &opt, const Workload &workload, const cybozu::FilePath &dir, std::vector<Result> &resV)
+        : opt_(opt), workload_(workload), dir_(dir), resV_(resV) {
+        for (size_t i = 0; i < opt.nrWlogs; i++) {
+            wlogV_.push_back((dir_ + cybozu::util::formatString("%zu.wlog", i)).str());
+            wdiffV_.push_back((dir_ + cybozu::util::formatString("%zu.wdiff", i)).str());
+        }
+    }
+    void run() {
+        generateWlogs();
+        if (opt_.hasStage(STAGE_CONVERT)) {
+            measure(STAGE_CONVERT, "", 0, getTotalFileSize(wlogV_), [&]() {
+                    convertAll();
+                    return getTotalFileSize(wdiffV_);
+                });
+        } else {
+            convertAll();
+        }
+        if (opt_.hasStage(STAGE_MERGE)) benchMerge();
+        if (opt_.hasStage(STAGE_COMPRESS)) benchCompress();
+        if (opt_.hasStage(STAGE_VIRT)) benchVirtualFullScan();
+        if (opt_.hasStage(STAGE_REDO)) benchRedo();
+        if (opt_.hasStage(STAGE_TRANSFER)) benchTransfer();
+    }
+private:
+    WlogGenerator::Config getConfig(size_t i) const {
+        WlogGenerator::Config cfg;
+        cfg.devLb = opt_.devSize / LBS;
+        cfg.minIoLb = 4 * KIBI / LBS;
+        cfg.maxIoLb = 64 * KIBI / LBS;
+        cfg.minDiscardLb = 4 * KIBI / LBS;
+        cfg.maxDiscardLb = MEBI / LBS;
+        cfg.pbs = LBS;
+        cfg.maxPackPb = MEBI / LBS;
+        cfg.outLogPb = opt_.logSize / LBS;
+        cfg.lsid = 0;
+        cfg.isPadding = true;
+        cfg.isDiscard = workload_.isDiscard;
+        cfg.isAllZero = workload_.isAllZero;
+        cfg.isRandom = !opt_.isStamp;
+        cfg.isVerbose = false;
+        cfg.seed = opt_.seed + i;
+        cfg.addrPattern = workload_.addrPattern;
+        cfg.allZeroPct = workload_.allZeroPct;
+        cfg.discardPct = workload_.discardPct;
+        cfg.check();
+        return cfg;
+    }
+    void generateWlogs() {
+        for (size_t i = 0; i < wlogV_.size(); i++) {
+            const WlogGenerator::Config cfg = getConfig(i);
+            cybozu::util::File file(wlogV_[i], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            WlogGenerator(cfg).generate(file.fd());
+            file.close();
+        }
+    }
+    void convertAll() {
+        for (size_t i = 0; i < wlogV_.size(); i++) {
+            cybozu::util::File inFile(wlogV_[i], O_RDONLY);
+            cybozu::util::File outFile(wdiffV_[i], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            DiffConverter().convert(inFile.fd(), outFile.fd());
+            outFile.close();
+        }
+    }
+    /**
+     * func returns the output size [byte].
+     */
+    template <typename Func>
+    void measure(const char *stage, const std::string &cmpr, size_t threads, uint64_t inBytes, Func &&func) {
+        Result res{workload_.name, stage, cmpr, threads, inBytes, 0, {}};
+        for (size_t i = 0; i < opt_.repeat; i++) {
+            const double t0 = cybozu::util::getTime();
+            res.outBytes = func();
+            res.secV.push_back(cybozu::util::getTime() - t0);
+        }
+        ::fprintf(::stderr, "%s %s %s %zu in %" PRIu64 " out %" PRIu64 " sec %.3f MiBps %.1f\n"
+                  , res.workload.c_str(), res.stage.c_str(), res.cmpr.c_str(), res.threads
+                  , res.inBytes, res.outBytes, res.medianSec(), res.mibps());
+        resV_.push_back(std::move(res));
+    }
+    CompressOpt getCompressOpt(const std::string &cmpr, size_t threads) const {
+        CompressOpt c;
+        c.parse(cybozu::util::formatString("%s:%zu", cmpr.c_str(), threads));
+        return c;
+    }
+    void benchMerge() {
+        const std::string outPath = (dir_ + "merged.wdiff").str();
+        const uint64_t inBytes = getTotalFileSize(wdiffV_);
+        for (const std::string &cmprStr : opt_.cmprV) {
+            for (const size_t threads : opt_.threadsV) {
+                const CompressOpt cmpr = getCompressOpt(cmprStr, threads);
+                measure(STAGE_MERGE, cmprStr, threads, inBytes, [&]() {
+                        DiffMerger merger;
+                        merger.addWdiffs(wdiffV_);
+                        merger.setReadAheadThreads(std::max<size_t>(threads, DEFAULT_MERGE_READ_AHEAD_CPU));
+                        cybozu::util::File file(outPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+                        merger.mergeToFdInParallel(file.fd(), cmpr);
+                        file.close();
+                        return getFileSize(outPath);
+                    });
+            }
+        }
+    }
+    /**
+     * Uncompressed packs of all the wdiffs.
+     */
+    std::vector<AlignedArray> readRawPacks() const {
+        std::vector<AlignedArray> packV;
+        DiffPacker packer;
+        auto add = [&](const DiffRecord &rec, const char *data) {
+            if (packer.add(rec, data)) return;
+            packV.push_back(packer.getPackAsArray());
+            packer.clear();
+            packer.add(rec, data);
+        };
+        for (const std::string &path : wdiffV_) {
+            BothDiffReader reader;
+            reader.setFile(cybozu::util::File(path, O_RDONLY));
+            uint64_t addr;
+            uint32_t blks;
+            DiffRecType rtype;
+            AlignedArray buf;
+            while (reader.read(addr, blks, rtype, buf)) {
+                DiffRecord rec;
+                rec.io_address = addr;
+                rec.io_blocks = blks;
+                rec.compression_type = ::WALB_DIFF_CMPR_NONE;
+                rec.checksum = 0;
+                rec.data_size = 0;
+                if (rtype == DiffRecType::NORMAL) {
+                    rec.setNormal();
+                    rec.data_size = blks * LOGICAL_BLOCK_SIZE;
+                } else if (rtype == DiffRecType::ALLZERO) {
+                    rec.setAllZero();
+                } else {
+                    rec.setDiscard();
+                }
+                add(rec, buf.data());
+            }
+        }
+        if (!packer.empty()) packV.push_back(packer.getPackAsArray());
+        return packV;
+    }
+    void benchCompress() {
+        const std::vector<AlignedArray> packV = readRawPacks();
+        uint64_t inBytes = 0;
+        for (const AlignedArray &pack : packV) inBytes += pack.size();
+        for (const std::string &cmprStr : opt_.cmprV) {
+            for (const size_t threads : opt_.threadsV) {
+                const CompressOpt cmpr = getCompressOpt(cmprStr, threads);
+                std::vector<std::vector<AlignedArray>> inVV(opt_.repeat, packV); // inputs are consumed.
+                size_t rep = 0;
+                measure(STAGE_COMPRESS, cmprStr, threads, inBytes, [&]() {
+                        std::vector<AlignedArray> &inV = inVV[rep++];
+                        const size_t maxPushedNum = threads * 2 + 1;
+                        ConverterQueue conv(maxPushedNum, threads, true, cmpr.type, cmpr.level);
+                        uint64_t outBytes = 0;
+                        size_t pushedNum = 0;
+                        for (AlignedArray &pack : inV) {
+                            conv.push(std::move(pack));
+                            pushedNum++;
+                            if (pushedNum < maxPushedNum) continue;
+                            outBytes += conv.pop().size();
+                            pushedNum--;
+                        }
+                        conv.quit();
+                        for (compressor::Buffer pack = conv.pop(); !pack.empty(); pack = conv.pop()) {
+                            outBytes += pack.size();
+                        }
+                        inV.clear();
+                        return outBytes;
+                    });
+            }
+        }
+    }
+    void prepareBaseImage(const std::string &path) const {
+        cybozu::util::Random<uint64_t> rand;
+        rand.setSeed(opt_.seed);
+        cybozu::util::File file(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        AlignedArray buf(MEBI, false);
+        for (uint64_t off = 0; off < opt_.devSize; off += buf.size()) {
+            const size_t size = std::min<uint64_t>(buf.size(), opt_.devSize - off);
+            if (opt_.isStamp) {
+                ::memset(buf.data(), 0, size);
+                for (size_t i = 0; i < size; i += LBS) ::memcpy(buf.data() + i, &off, sizeof(off));
+            } else {
+                rand.fill(buf.data(), size);
+            }
+            file.write(buf.data(), size);
+        }
+        file.close();
+    }
+    void benchVirtualFullScan() {
+        const std::string basePath = (dir_ + "base.img").str();
+        const std::string outPath = (dir_ + "virt.img").str();
+        prepareBaseImage(basePath);
+        measure(STAGE_VIRT, "", 0, opt_.devSize, [&]() {
+                VirtualFullScanner virt;
+                virt.init(cybozu::util::File(basePath, O_RDONLY), wdiffV_);
+                cybozu::util::File outFile(outPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+                virt.readAndWriteTo(outFile.fd(), DEFAULT_BULK_LB * LBS);
+                return opt_.devSize;
+            });
+    }
+    template <typename BdevWriter>
+    void redo(const std::string &ddevPath, const std::string &wlogPath) {
+        cybozu::util::File wlogFile(wlogPath, O_RDONLY);
+        WlogFileHeader wh;
+        wh.readFrom(wlogFile);
+        WlogRedoConfig cfg;
+        cfg = {ddevPath, false, false, false, wh.pbs(), wh.salt(), wh.beginLsid(), false, false};
+        WlogApplyer<BdevWriter> applyer(cfg);
+        applyer.run(wlogFile);
+    }
+    /**
+     * Discards are ignored because the target is a regular file.
+     */
+    void benchRedo() {
+        const std::string ddevPath = (dir_ + "redo.img").str();
+        {
+            cybozu::util::File file(ddevPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            file.ftruncate(opt_.devSize);
+            file.close();
+        }
+        measure(STAGE_REDO, "", 0, getTotalFileSize(wlogV_), [&]() {
+                for (const std::string &wlogPath : wlogV_) {
+                    if (opt_.dontUseAio) {
+                        redo<SimpleBdevWriter>(ddevPath, wlogPath);
+                    } else {
+                        redo<AsyncBdevWriter>(ddevPath, wlogPath);
+                    }
+                }
+                return opt_.devSize;
+            });
+    }
+    /**
+     * The packet protocol of wdiff-transfer between a proxy and an archive,
+     * run over a loopback TCP connection.
+     */
+    void benchTransfer() {
+        const std::string outPath = (dir_ + "recv.wdiff").str();
+        const uint64_t inBytes = getTotalFileSize(wdiffV_);
+        cybozu::Socket server;
+        server.bind(opt_.port, cybozu::Socket::allowIPv4);
+        for (const std::string &cmprStr : opt_.cmprV) {
+            for (const size_t threads : opt_.threadsV) {
+                const CompressOpt cmpr = getCompressOpt(cmprStr, threads);
+                measure(STAGE_TRANSFER, cmprStr, threads, inBytes, [&]() {
+                        std::atomic<int> stopState(NotStopping);
+                        ProcessStatus ps;
+                        std::future<void> f = std::async(std::launch::async, [&]() {
+                                cybozu::Socket sock;
+                                server.accept(sock);
+                                packet::Packet pkt(sock);
+                                cybozu::util::File fileW(outPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+                                DiffFileHeader wdiffH;
+                                wdiffH.writeTo(fileW);
+                                wdiffTransferServer(pkt, fileW.fd(), stopState, ps, UINT64_MAX);
+                                fileW.close();
+                            });
+                        cybozu::Socket sock;
+                        sock.connect("127.0.0.1", opt_.port);
+                        packet::Packet pkt(sock);
+                        DiffMerger merger;
+                        merger.addWdiffs(wdiffV_);
+                        merger.setReadAheadThreads(std::max<size_t>(threads, DEFAULT_MERGE_READ_AHEAD_CPU));
+                        merger.prepare();
+                        DiffStatistics statOut;
+                        wdiffTransferClient(pkt, merger, cmpr, stopState, ps, statOut);
+                        f.get();
+                        return getFileSize(outPath);
+                    });
+            }
+        }
+    }
+};
+
+void writeJson(const Option &opt, const std::vector<Result> &resV)
+{
+    struct utsname uts;
+    if (::uname(&uts) < 0) throw cybozu::Exception("uname failed") << cybozu::ErrorNo();
+    cybozu::util::File file(opt.outPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    std::string s = "{\n";
+    s += cybozu::util::formatString(
+        "  \"version\": %s,\n"
+        "  \"commit\": %s,\n"
+        "  \"host\": {\"kernel\": %s, \"machine\": %s, \"cpus\": %u},\n"
+        "  \"config\": {\"seed\": %u, \"devSize\": %" PRIu64 ", \"logSize\": %" PRIu64
+        ", \"nrWlogs\": %zu, \"repeat\": %zu, \"data\": %s},\n"
+        "  \"results\": [\n"
+        , jsonStr(getWalbToolsVersion()).c_str(), jsonStr(getWalbToolsCommitId()).c_str()
+        , jsonStr(uts.release).c_str(), jsonStr(uts.machine).c_str(), std::thread::hardware_concurrency()
+        , opt.seed, opt.devSize, opt.logSize, opt.nrWlogs, opt.repeat
+        , opt.isStamp ? "\"stamp\"" : "\"random\"");
+    for (size_t i = 0; i < resV.size(); i++) {
+        const Result &res = resV[i];
+        s += cybozu::util::formatString(
+            "    {\"workload\": %s, \"stage\": %s, \"cmpr\": %s, \"threads\": %zu"
+            ", \"inBytes\": %" PRIu64 ", \"outBytes\": %" PRIu64
+            ", \"sec\": %.6f, \"minSec\": %.6f, \"MiBps\": %.3f}%s\n"
+            , jsonStr(res.workload).c_str(), jsonStr(res.stage).c_str(), jsonStr(res.cmpr).c_str(), res.threads
+            , res.inBytes, res.outBytes, res.medianSec(), res.minSec(), res.mibps()
+            , i + 1 < resV.size() ? "," : "");
+    }
+    s += "  ]\n}\n";
+    file.write(s.data(), s.size());
+    file.close();
+}
+
+int doMain(int argc, char* argv[])
+{
+    Option opt(argc, argv);
+    util::setLogSetting("-", false);
+    std::string dirStr = (cybozu::FilePath(opt.baseDir) + "walb-bench.XXXXXX").str();
+    if (::mkdtemp(&dirStr[0]) == nullptr) {
+        throw cybozu::Exception("mkdtemp failed") << dirStr << cybozu::ErrorNo();
+    }
+    const cybozu::FilePath dir(dirStr);
+    std::vector<Result> resV;
+    try {
+        for (const std::string &name : opt.workloadV) {
+            Bench(opt, getWorkload(name), dir, resV).run();
+        }
+    } catch (...) {
+        if (!opt.doKeep) dir.rmdirRecursive();
+        throw;
+    }
+    if (!opt.doKeep) dir.rmdirRecursive();
+    writeJson(opt, resV);
+    return 0;
+}
+
+DEFINE_ERROR_SAFE_MAIN("walb-bench")
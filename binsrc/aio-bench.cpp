@@ -0,0 +1,144 @@
+/**
+ * @file
+ * @brief Compare IOPS of asynchronous IO backends
+ *        by O_DIRECT reads from a file or a block device like a walb log device.
+ */
+#include <string>
+#include <vector>
+#include <queue>
+#include <unordered_map>
+#include "cybozu/option.hpp"
+#include "cybozu/array.hpp"
+#include "cybozu/string_operation.hpp"
+#include "aio_util.hpp"
+#include "bdev_util.hpp"
+#include "random.hpp"
+#include "walb_util.hpp"
+
+using namespace walb;
+
+struct Option
+{
+    std::string filePath;
+    std::string backendStr;
+    size_t queueSize;
+    size_t ios;
+    uint64_t scanSize;
+    size_t periodSec;
+    bool isRandom;
+    bool isRegistered;
+
+    Option(int argc, char* argv[]) {
+        cybozu::Option opt;
+        opt.setDescription("Read a file or a block device with O_DIRECT and put IOPS of each aio backend.");
+        opt.appendOpt(&backendStr, "libaio,uring", "b", ": comma-separated backends to compare. (default: libaio,uring)");
+        opt.appendOpt(&queueSize, 32, "q", ": queue depth. (default: 32)");
+        opt.appendOpt(&ios, 4096, "ios", ": read IO size [byte]. (default: 4K)");
+        opt.appendOpt(&scanSize, 0, "size", ": size of the target area from the beginning [byte]. (default: whole size)");
+        opt.appendOpt(&periodSec, 5, "sec", ": running period for each backend [sec]. (default: 5)");
+        opt.appendBoolOpt(&isRandom, "rand", ": random reads instead of sequential reads.");
+        opt.appendBoolOpt(&isRegistered, "reg", ": register IO buffers to the backend.");
+        opt.appendParam(&filePath, "FILE_PATH", ": path of a block device or a file.");
+        opt.appendHelp("h", ": put this message.");
+
+        if (!opt.parse(argc, argv)) {
+            opt.usage();
+            ::exit(1);
+        }
+        if (ios == 0 || ios % LOGICAL_BLOCK_SIZE != 0) {
+            throw cybozu::Exception("bad IO size") << ios;
+        }
+        if (queueSize == 0) {
+            throw cybozu::Exception("queue size must not be 0");
+        }
+    }
+};
+
+struct Result
+{
+    uint64_t nrIos;
+    double elapsed;
+};
+
+Result runBench(const Option &opt, cybozu::aio::AioBackend backend, uint64_t nrIosInArea)
+{
+    cybozu::util::File file(opt.filePath, O_RDONLY | O_DIRECT);
+    cybozu::aio::Aio aio(file.fd(), opt.queueSize, backend);
+    const size_t qs = aio.queueSize();
+    AlignedArray buf(opt.ios * qs, false);
+    if (opt.isRegistered && !aio.registerBuffer(buf.data(), buf.size())) {
+        ::printf("%s: could not register buffers\n", aio.backendName());
+    }
+    cybozu::util::Random<uint64_t> rand;
+    std::vector<size_t> freeIdxV; // free buffer indexes.
+    for (size_t i = 0; i < qs; i++) freeIdxV.push_back(i);
+    std::unordered_map<uint, size_t> idxOfKey; // buffer index of a key.
+    idxOfKey.reserve(qs * 2);
+    uint64_t nextIo = 0;
+    uint64_t nrIos = 0;
+    std::queue<uint> keyQ;
+
+    const double t0 = cybozu::util::getTime();
+    const double tEnd = t0 + opt.periodSec;
+    double t1 = t0;
+    for (;;) {
+        if (t1 < tEnd) {
+            size_t n = 0;
+            while (!freeIdxV.empty()) {
+                const size_t idx = freeIdxV.back();
+                const uint64_t ioId = opt.isRandom ? rand() % nrIosInArea : nextIo++ % nrIosInArea;
+                const uint key = aio.prepareRead(ioId * opt.ios, opt.ios, &buf[idx * opt.ios]);
+                if (key == 0) break;
+                freeIdxV.pop_back();
+                idxOfKey.emplace(key, idx);
+                n++;
+            }
+            if (n > 0) aio.submit();
+        }
+        if (freeIdxV.size() == qs) break;
+        aio.waitOneOrMore(keyQ);
+        while (!keyQ.empty()) {
+            std::unordered_map<uint, size_t>::iterator itr = idxOfKey.find(keyQ.front());
+            freeIdxV.push_back(itr->second);
+            idxOfKey.erase(itr);
+            keyQ.pop();
+            nrIos++;
+        }
+        t1 = cybozu::util::getTime();
+    }
+    return Result{nrIos, cybozu::util::getTime() - t0};
+}
+
+int doMain(int argc, char* argv[])
+{
+    Option opt(argc, argv);
+    uint64_t areaSize;
+    {
+        cybozu::util::File file(opt.filePath, O_RDONLY);
+        areaSize = cybozu::util::getBlockDeviceSize(file.fd());
+    }
+    if (opt.scanSize > 0) areaSize = std::min(areaSize, opt.scanSize);
+    const uint64_t nrIosInArea = areaSize / opt.ios;
+    if (nrIosInArea == 0) {
+        throw cybozu::Exception("too small target") << areaSize << opt.ios;
+    }
+    ::printf("file %s size %" PRIu64 " qd %zu ios %zu %s%s\n"
+             , opt.filePath.c_str(), areaSize, opt.queueSize, opt.ios
+             , opt.isRandom ? "rand" : "seq", opt.isRegistered ? " reg" : "");
+    for (const std::string &name : cybozu::Split(opt.backendStr, ',')) {
+        const cybozu::aio::AioBackend backend = cybozu::aio::parseAioBackend(name);
+        Result res;
+        try {
+            res = runBench(opt, backend, nrIosInArea);
+        } catch (std::exception &e) {
+            ::printf("backend %s failed: %s\n", name.c_str(), e.what());
+            continue;
+        }
+        const double iops = res.nrIos / res.elapsed;
+        ::printf("backend %s ios %" PRIu64 " elapsedSec %.3f iops %.1f MiBps %.1f\n"
+                 , name.c_str(), res.nrIos, res.elapsed, iops, iops * opt.ios / MEBI);
+    }
+    return 0;
+}
+
+DEFINE_ERROR_SAFE_MAIN("aio-bench")
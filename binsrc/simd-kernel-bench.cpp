@@ -0,0 +1,68 @@
+/**
+ * @file
+ * @brief Measure throughput of checksum and zero-detection kernels of each SIMD level.
+ */
+#include <vector>
+#include "cybozu/option.hpp"
+#include "simd_kernels.hpp"
+#include "walb_util.hpp"
+
+using namespace walb;
+
+struct Option
+{
+    std::vector<size_t> sizeV;
+    size_t totalMb;
+
+    Option(int argc, char* argv[]) {
+        cybozu::Option opt;
+        opt.setDescription("Measure throughput of checksum and zero-detection kernels.");
+        opt.appendVec(&sizeV, "s", ": data sizes [byte]. (default: 512 4096 65536 1048576)");
+        opt.appendOpt(&totalMb, 1024, "total", ": total size to process for each case [MiB]. (default: 1024)");
+        opt.appendHelp("h", ": put this message.");
+        if (!opt.parse(argc, argv)) {
+            opt.usage();
+            ::exit(1);
+        }
+        if (sizeV.empty()) sizeV = {512, 4096, 65536, 1048576};
+    }
+};
+
+template <typename F>
+double measureGBps(size_t size, size_t totalMb, F f)
+{
+    const size_t nr = std::max<size_t>(totalMb * MEBI / size, 1);
+    const double t0 = cybozu::util::getTime();
+    for (size_t i = 0; i < nr; i++) f();
+    const double elapsed = cybozu::util::getTime() - t0;
+    return double(nr) * size / elapsed / 1e9;
+}
+
+int doMain(int argc, char* argv[])
+{
+    Option opt(argc, argv);
+    using namespace cybozu::simd;
+    ::printf("dispatched %s\n", simdLevelName(kernels().level));
+    ::printf("%-8s %9s %12s %12s\n", "level", "size", "csum[GB/s]", "zero[GB/s]");
+    for (const size_t size : opt.sizeV) {
+        AlignedArray buf(size, true);
+        for (int i = 0; i < SIMD_MAX; i++) {
+            const SimdLevel level = SimdLevel(i);
+            if (!isSimdLevelSupported(level)) continue;
+            const Kernels k = getKernels(level);
+            volatile uint32_t csum = 0;
+            volatile bool isZero = false;
+            const double csumGBps = measureGBps(size, opt.totalMb, [&]() {
+                    csum = csum + k.checksumPartial(buf.data(), size, 0);
+                });
+            /* The worst case: all the data must be scanned. */
+            const double zeroGBps = measureGBps(size, opt.totalMb, [&]() {
+                    isZero = k.isAllZero(buf.data(), size);
+                });
+            ::printf("%-8s %9zu %12.2f %12.2f\n", simdLevelName(level), size, csumGBps, zeroGBps);
+        }
+    }
+    return 0;
+}
+
+DEFINE_ERROR_SAFE_MAIN("simd-kernel-bench")
@@ -0,0 +1,128 @@
+/**
+ * @file
+ * @brief Measure scheduling latency of background tasks
+ *        from pushing a task to starting its worker.
+ */
+#include <atomic>
+#include <algorithm>
+#include <vector>
+#include <mutex>
+#include <chrono>
+#include <thread>
+#include "cybozu/option.hpp"
+#include "walb_util.hpp"
+#include "server_util.hpp"
+
+using namespace walb;
+
+using Clock = std::chrono::steady_clock;
+using TimePoint = Clock::time_point;
+
+struct Option : public cybozu::Option
+{
+    size_t nrVol;
+    size_t nrRound;
+    size_t maxBgTasks;
+    size_t maxBgTasksPerVol;
+    size_t delayMs;
+    size_t workUs;
+
+    Option() {
+        setDescription("Measure latency from pushing a task to starting its worker.");
+        appendOpt(&nrVol, 2000, "v", "NUM: number of volumes (default: 2000).");
+        appendOpt(&nrRound, 5, "r", "NUM: number of rounds to push a task for each volume (default: 5).");
+        appendOpt(&maxBgTasks, 8, "bg", "NUM: num of max concurrent background tasks (default: 8).");
+        appendOpt(&maxBgTasksPerVol, 1, "bgvol", "NUM: num of max concurrent background tasks per volume (default: 1).");
+        appendOpt(&delayMs, 0, "delay", "PERIOD: delay of each task [msec] (default: 0).");
+        appendOpt(&workUs, 100, "work", "PERIOD: running time of each task [usec] (default: 100).");
+        appendHelp("h", ": put this message.");
+    }
+    bool parse(int argc, char *argv[]) {
+        if (!cybozu::Option::parse(argc, argv) || nrVol == 0 || maxBgTasks == 0) {
+            usage();
+            return false;
+        }
+        return true;
+    }
+};
+
+struct Bench
+{
+    std::vector<TimePoint> readyTs; // indexed by volume.
+    std::vector<double> latV; // [usec]
+    std::mutex mu;
+    std::atomic<size_t> nrDone;
+    size_t workUs;
+
+    static Bench& get() {
+        static Bench bench;
+        return bench;
+    }
+    static std::string volName(size_t i) {
+        return cybozu::util::formatString("vol%06zu", i);
+    }
+};
+
+struct BenchWorker
+{
+    const std::string volId;
+    explicit BenchWorker(const std::string &volId) : volId(volId) {}
+    void operator()() {
+        Bench &b = Bench::get();
+        const TimePoint now = Clock::now();
+        const size_t i = std::stoul(volId.substr(3));
+        const double us = std::chrono::duration<double, std::micro>(now - b.readyTs[i]).count();
+        {
+            std::lock_guard<std::mutex> lk(b.mu);
+            b.latV.push_back(us);
+        }
+        /* Background tasks mainly wait for IOs. */
+        if (b.workUs > 0) std::this_thread::sleep_for(std::chrono::microseconds(b.workUs));
+        b.nrDone++;
+    }
+};
+
+double percentile(const std::vector<double> &v, double p)
+{
+    if (v.empty()) return 0;
+    const size_t i = std::min<size_t>(v.size() * p / 100, v.size() - 1);
+    return v[i];
+}
+
+int doMain(int argc, char *argv[])
+{
+    Option opt;
+    if (!opt.parse(argc, argv)) return 1;
+    Bench &b = Bench::get();
+    b.readyTs.resize(opt.nrVol);
+    b.latV.reserve(opt.nrVol * opt.nrRound);
+    b.nrDone = 0;
+    b.workUs = opt.workUs;
+
+    TaskQueue<std::string> tq;
+    const double t0 = cybozu::util::getTime();
+    {
+        DispatchTask<std::string, BenchWorker> dispatcher(tq, opt.maxBgTasks, opt.maxBgTasksPerVol);
+        for (size_t r = 0; r < opt.nrRound; r++) {
+            for (size_t i = 0; i < opt.nrVol; i++) {
+                b.readyTs[i] = Clock::now() + std::chrono::milliseconds(opt.delayMs);
+                tq.push(Bench::volName(i), opt.delayMs);
+            }
+            while (b.nrDone < (r + 1) * opt.nrVol) util::sleepMs(1);
+        }
+        tq.quit();
+    }
+    const double elapsed = cybozu::util::getTime() - t0;
+
+    std::vector<double> &v = b.latV;
+    std::sort(v.begin(), v.end());
+    ::printf("nrVol %zu nrRound %zu bg %zu bgvol %zu delayMs %zu workUs %zu\n"
+             "elapsedSec %.3f tasksPerSec %.1f\n"
+             "latencyUs p50 %.1f p90 %.1f p99 %.1f max %.1f\n"
+             , opt.nrVol, opt.nrRound, opt.maxBgTasks, opt.maxBgTasksPerVol, opt.delayMs, opt.workUs
+             , elapsed, v.size() / elapsed
+             , percentile(v, 50), percentile(v, 90), percentile(v, 99), v.empty() ? 0 : v.back());
+    return 0;
+}
+
+DEFINE_ERROR_SAFE_MAIN("task-dispatch-bench")
@@ -17,6 +17,8 @@ struct Option : public cybozu::Option
     std::string outputPath;
     std::vector<std::string> inputWdiffs;
     uint32_t bufferSize;
+    uint64_t startLb;
+    uint64_t sizeLb;
     bool doStat;
     Option() {
         setUsage("virt-full-cat:\n"
@@ -28,12 +30,16 @@ struct Option : public cybozu::Option
                  "  -o arg:  Output full image path. '-' means stdout. (default '-')\n"
                  "  -w args: Input wdiff paths\n"
                  "  -b arg:  Buffer size [byte]. default: '64K'\n"
+                 "  -s arg:  Start offset [logical block]. (default 0)\n"
+                 "  -n arg:  Scanning size [logical block]. 0 means to the end. (default 0)\n"
                  "  -stat:   Put merging statistics.\n"
                  "  -h:      Show this help message.\n");
         appendOpt(&inputPath, "-", "i", "Input full image path. '-' means stdin. (default '-')");
         appendOpt(&outputPath, "-", "o", "Output full image path. '-' means stdout. (default '-')");
         appendVec(&inputWdiffs, "d", "Input wdiff paths");
         appendOpt(&bufferSize, 2 << 16, "b", "Buffer size [byte].");
+        appendOpt(&startLb, 0, "s", "Start offset [logical block].");
+        appendOpt(&sizeLb, 0, "n", "Scanning size [logical block]. 0 means to the end.");
         appendBoolOpt(&doStat, "stat");
         appendHelp("h");
     }
@@ -71,8 +77,8 @@ int doMain(int argc, char *argv[])
     cybozu::util::File inFile, outFile;
     setupFiles(inFile, outFile, opt);
     VirtualFullScanner virt;
-    virt.init(std::move(inFile), opt.inputWdiffs);
-    virt.readAndWriteTo(outFile.fd(), opt.bufferSize);
+    virt.init(std::move(inFile), opt.inputWdiffs, opt.startLb);
+    virt.readAndWriteTo(outFile.fd(), opt.bufferSize, opt.sizeLb == 0 ? UINT64_MAX : opt.sizeLb);
     if (opt.doStat) {
         std::cerr << "mergeIn  " << virt.statIn()  << std::endl
                   << "mergeOut " << virt.statOut() << std::endl
@@ -29,7 +29,12 @@ struct Option
     uint16_t port;
     std::string logFileStr;
     std::string discardTypeStr;
+    std::string mergeCmprStr;
+    std::string hashAlgoStr;
+    uint64_t diffCacheSize;
     bool isDebug;
+    std::string metricsFile;
+    size_t metricsIntervalSec;
     cybozu::Option opt;
 
     Option(int argc, char *argv[]) {
@@ -51,9 +56,25 @@ struct Option
         opt.appendOpt(&a.maxWdiffSendNr, DEFAULT_MAX_WDIFF_SEND_NR, "wn", "NUM : max number of wdiff files to send.");
         opt.appendOpt(&discardTypeStr, DEFAULT_DISCARD_TYPE_STR, "discard", ": discard behavior: ignore/passdown/zero.");
         opt.appendOpt(&a.fsyncIntervalSize, DEFAULT_FSYNC_INTERVAL_SIZE, "fi", "SIZE : fsync interval size [bytes].");
+        opt.appendOpt(&a.applyBufferSize, DEFAULT_APPLY_BUFFER_SIZE, "ab", "SIZE : max size of in-flight IOs to apply wdiffs [bytes].");
+        opt.appendOpt(&a.hashSyncCpu, DEFAULT_HASH_SYNC_CPU, "hcpu", "NUM : num of threads to hash/compress data in hash-sync.");
+        opt.appendOpt(&hashAlgoStr, DEFAULT_HASH_ALGO_STR, "halgo"
+                      , "NAME : block hash algorithm requested in hash-repl: murmur3/xxh3.");
+        opt.appendOpt(&a.fullSyncCpu, DEFAULT_FULL_SYNC_CPU, "fscpu", "NUM : num of threads to uncompress data in full-sync.");
+        opt.appendOpt(&mergeCmprStr, DEFAULT_MERGE_CMPR_STR, "mcmpr"
+                      , "TYPE:LEVEL:NUM : compression type, level, and num of threads of merged wdiffs.");
+        opt.appendBoolOpt(&a.storeIndexedDiff, "iwdiff", ": store merged and received wdiffs in indexed format.");
+        opt.appendOpt(&a.indexedDiffUnitSize, DEFAULT_INDEXED_DIFF_UNIT_SIZE, "iunit"
+                      , "SIZE : compression unit size of indexed wdiffs [bytes].");
+        opt.appendOpt(&diffCacheSize, INDEXED_DIFF_CACHE_SIZE, "dcache"
+                      , "SIZE : max size of uncompressed indexed wdiff data cached in the process [bytes].");
         opt.appendBoolOpt(&a.doAutoResize, "autoresize", ": resize base image automatically if necessary");
         opt.appendBoolOpt(&a.keepOneColdSnapshot, "keep-one-cold-snap", ": keep just one cold snapshot per volume.");
         opt.appendOpt(&a.maxOpenDiffs, DEFAULT_MAX_OPEN_DIFFS, "maxopen", "NUM : max number of wdiff files to open together.");
+        opt.appendOpt(&metricsFile, "", "metrics"
+                      , "PATH : file to write stage metrics in Prometheus text format periodically (optional).");
+        opt.appendOpt(&metricsIntervalSec, DEFAULT_METRICS_INTERVAL_SEC, "metricsintvl"
+                      , "PERIOD : interval to write the metrics file [sec].");
 #ifdef ENABLE_EXEC_PROTOCOL
         opt.appendBoolOpt(&a.allowExec, "allow-exec", ": allow exec protocol for test. This is NOT SECURE.");
 #endif
@@ -70,7 +91,20 @@ struct Option
         util::verifyNotZero(a.maxForegroundTasks, "maxForegroundTasks");
         util::verifyNotZero(a.maxWdiffSendNr, "maxWdiffSendNr");
         util::verifyNotZero(a.fsyncIntervalSize, "fsyncIntervalSize");
+        util::verifyNotZero(a.hashSyncCpu, "hashSyncCpu");
+        a.hashAlgo = cybozu::murmurhash3::parseHashAlgo(hashAlgoStr);
+        util::verifyNotZero(a.fullSyncCpu, "fullSyncCpu");
+        util::verifyNotZero(metricsIntervalSec, "metricsIntervalSec");
+        if (a.indexedDiffUnitSize < LBS || a.indexedDiffUnitSize > DEFAULT_MAX_IO_LB * LBS
+            || a.indexedDiffUnitSize % LBS != 0) {
+            throw cybozu::Exception(__func__) << "bad indexedDiffUnitSize" << a.indexedDiffUnitSize;
+        }
+        if (a.applyBufferSize < MEBI) {
+            throw cybozu::Exception(__func__) << "applyBufferSize must be at least 1MiB" << a.applyBufferSize;
+        }
         a.discardType = parseDiscardType(discardTypeStr, __func__);
+        a.mergeCmpr = parseCompressOpt(mergeCmprStr);
+        a.diffCache.setMaxSize(diffCacheSize);
         a.keepAliveParams.verify();
     }
 };
@@ -121,6 +155,7 @@ int main(int argc, char *argv[]) try
     LOGs.info() << opt.opt;
     initArchiveData();
     util::makeDir(ga.baseDirStr, "ArchiveServer", false);
+    metrics::PrometheusFileWriter metricsWriter(g.metrics, "archive", opt.metricsFile, opt.metricsIntervalSec);
     server::MultiThreadedServer server;
     const size_t concurrency = g.maxConnections;
     server.run(g.ps, opt.port, g.nodeId, archiveHandlerMap, g.handlerStatMgr,
@@ -29,6 +29,8 @@ struct Option
     std::string logFileStr;
     bool isDebug;
     bool isStopped;
+    std::string metricsFile;
+    size_t metricsIntervalSec;
     cybozu::Option opt;
 
     Option(int argc, char *argv[]) {
@@ -43,15 +45,22 @@ struct Option
         opt.appendOpt(&p.maxConnections, DEFAULT_MAX_CONNECTIONS, "maxconn", "NUM : num of max connections.");
         opt.appendOpt(&p.maxForegroundTasks, DEFAULT_MAX_FOREGROUND_TASKS, "fg", "NUM : num of max concurrent foreground tasks.");
         opt.appendOpt(&p.maxBackgroundTasks, DEFAULT_MAX_BACKGROUND_TASKS, "bg", "NUM : num of max concurrent background tasks.");
+        opt.appendOpt(&p.maxBackgroundTasksPerVolume, DEFAULT_PROXY_MAX_BACKGROUND_TASKS_PER_VOLUME, "bgvol"
+                      , "NUM : num of max concurrent background tasks per volume (0 means unlimited).");
         opt.appendOpt(&p.maxWdiffSendMb, DEFAULT_MAX_WDIFF_SEND_MB, "wd", "SIZE : max size of wdiff files to send [MiB].");
         opt.appendOpt(&p.maxWdiffSendNr, DEFAULT_MAX_WDIFF_SEND_NR, "wn", "NUM : max number of wdiff files to send.");
         opt.appendOpt(&p.delaySecForRetry, DEFAULT_DELAY_SEC_FOR_RETRY, "delay", "PERIOD : waiting time for next retry [sec].");
         opt.appendOpt(&p.retryTimeout, DEFAULT_RETRY_TIMEOUT_SEC, "rto", "PERIOD : retry timeout (total period) [sec].");
         opt.appendOpt(&p.baseDirStr, DEFAULT_BASE_DIR, "b", "PATH : base directory");
         opt.appendOpt(&p.maxConversionMb, DEFAULT_MAX_CONVERSION_MB, "wl", "SIZE : max memory size of wlog-wdiff conversion [MiB].");
+        opt.appendOpt(&p.wlogRecvCpu, DEFAULT_WLOG_RECV_CPU, "wlcpu", "NUM : num of threads to uncompress received wlogs.");
         std::string hostName = cybozu::net::getHostName();
         opt.appendOpt(&p.nodeId, hostName, "id", "STRING : node identifier");
         opt.appendOpt(&p.socketTimeout, DEFAULT_SOCKET_TIMEOUT_SEC, "to", "PERIOD : Socket timeout [sec].");
+        opt.appendOpt(&metricsFile, "", "metrics"
+                      , "PATH : file to write stage metrics in Prometheus text format periodically (optional).");
+        opt.appendOpt(&metricsIntervalSec, DEFAULT_METRICS_INTERVAL_SEC, "metricsintvl"
+                      , "PERIOD : interval to write the metrics file [sec].");
 #ifdef ENABLE_EXEC_PROTOCOL
         opt.appendBoolOpt(&p.allowExec, "allow-exec", ": allow exec protocol for test. This is NOT SECURE.");
 #endif
@@ -69,6 +78,8 @@ struct Option
         util::verifyNotZero(p.maxWdiffSendMb, "maxWdiffSendMb");
         util::verifyNotZero(p.maxWdiffSendNr, "maxWdiffSendNr");
         util::verifyNotZero(p.maxConversionMb, "maxConversionMb");
+        util::verifyNotZero(p.wlogRecvCpu, "wlogRecvCpu");
+        util::verifyNotZero(metricsIntervalSec, "metricsIntervalSec");
         p.keepAliveParams.verify();
     }
 };
@@ -94,7 +105,9 @@ struct ProxyThreads
 
         // Start a task dispatch thread.
         ProxySingleton &g = getProxyGlobal();
-        g.dispatcher.reset(new DispatchTask<ProxyTask, ProxyWorker>(g.taskQueue, g.maxBackgroundTasks));
+        g.dispatcher.reset(new DispatchTask<ProxyTask, ProxyWorker>(
+                               g.taskQueue, g.maxBackgroundTasks, g.maxBackgroundTasksPerVolume,
+                               [](const ProxyTask &task) { return TaskSchedAttr(task.volId); }));
     }
     ~ProxyThreads() try {
         // Stop the task dispatch thread.
@@ -115,6 +128,7 @@ int main(int argc, char *argv[]) try
     LOGs.info() << opt.opt;
     {
         ProxyThreads threads(opt);
+        metrics::PrometheusFileWriter metricsWriter(g.metrics, "proxy", opt.metricsFile, opt.metricsIntervalSec);
         server::MultiThreadedServer server;
         const size_t concurrency = g.maxConnections;
         server.run(g.ps, opt.port, g.nodeId, proxyHandlerMap, g.handlerStatMgr,
@@ -34,6 +34,10 @@ struct Option
     std::string multiProxyDStr;
     bool isDebug;
     uint64_t defaultFullScanBytesPerSec;
+    std::string fullSyncCmprStr;
+    std::string hashAlgoStr;
+    std::string metricsFile;
+    size_t metricsIntervalSec;
     cybozu::Option opt;
 
     Option(int argc, char *argv[]) {
@@ -49,16 +53,28 @@ struct Option
         opt.appendOpt(&s.maxConnections, DEFAULT_MAX_CONNECTIONS, "maxconn", "NUM : num of max connections.");
         opt.appendOpt(&s.maxForegroundTasks, DEFAULT_MAX_FOREGROUND_TASKS, "fg", "NUM : num of max concurrent foregroud tasks.");
         opt.appendOpt(&s.maxBackgroundTasks, DEFAULT_MAX_BACKGROUND_TASKS, "bg", "NUM : num of max concurrent background tasks.");
+        opt.appendOpt(&s.maxBackgroundTasksPerVolume, DEFAULT_MAX_BACKGROUND_TASKS_PER_VOLUME, "bgvol"
+                      , "NUM : num of max concurrent background tasks per volume (0 means unlimited).");
         opt.appendOpt(&s.baseDirStr, DEFAULT_BASE_DIR, "b", "PATH : base directory (full path)");
         std::string hostName = cybozu::net::getHostName();
         opt.appendOpt(&s.nodeId, hostName, "id", "STRING : node identifier");
         opt.appendOpt(&s.maxWlogSendMb, DEFAULT_MAX_WLOG_SEND_MB, "wl", "SIZE : max wlog size to send at once [MiB].");
+        opt.appendOpt(&s.wlogSendCpu, DEFAULT_WLOG_SEND_CPU, "wlcpu", "NUM : num of threads to compress wlogs to send.");
+        opt.appendOpt(&s.hashSyncCpu, DEFAULT_HASH_SYNC_CPU, "hcpu", "NUM : num of threads to hash/compress data in hash-sync.");
+        opt.appendOpt(&hashAlgoStr, DEFAULT_HASH_ALGO_STR, "halgo"
+                      , "NAME : block hash algorithm requested in hash-sync: murmur3/xxh3.");
+        opt.appendOpt(&fullSyncCmprStr, DEFAULT_FULL_SYNC_CMPR_STR, "fscmpr"
+                      , "TYPE:LEVEL:NUM : compression type, level, and num of threads in full-sync.");
         opt.appendOpt(&s.implicitSnapshotIntervalSec, DEFAULT_IMPLICIT_SNAPSHOT_INTERVAL_SEC, "snapintvl"
                       , "PERIOD : implicit snapshot interval [sec].");
         opt.appendOpt(&s.delaySecForRetry, DEFAULT_DELAY_SEC_FOR_RETRY, "delay", "PERIOD : waiting time for next retry [sec].");
         opt.appendOpt(&s.socketTimeout, DEFAULT_SOCKET_TIMEOUT_SEC, "to", "PERIOD : socket timeout [sec].");
         opt.appendOpt(&defaultFullScanBytesPerSec, DEFAULT_FULL_SCAN_BYTES_PER_SEC, "fst", "SIZE : default full scan throughput [bytes/s]");
         opt.appendOpt(&s.tsDeltaGetterIntervalSec, DEFAULT_TS_DELTA_INTERVAL_SEC, "tsdintvl", "PERIOD : ts-delta getter interval [sec].");
+        opt.appendOpt(&metricsFile, "", "metrics"
+                      , "PATH : file to write stage metrics in Prometheus text format periodically (optional).");
+        opt.appendOpt(&metricsIntervalSec, DEFAULT_METRICS_INTERVAL_SEC, "metricsintvl"
+                      , "PERIOD : interval to write the metrics file [sec].");
 #ifdef ENABLE_EXEC_PROTOCOL
         opt.appendBoolOpt(&s.allowExec, "allow-exec", ": allow exec protocol for test. This is NOT SECURE.");
 #endif
@@ -74,8 +90,13 @@ struct Option
         util::verifyNotZero(s.maxBackgroundTasks, "maxBackgroundTasks");
         util::verifyNotZero(s.maxForegroundTasks, "maxForegroundTasks");
         util::verifyNotZero(s.maxWlogSendMb, "maxWlogSendMb");
+        util::verifyNotZero(s.wlogSendCpu, "wlogSendCpu");
+        util::verifyNotZero(s.hashSyncCpu, "hashSyncCpu");
+        s.hashAlgo = cybozu::murmurhash3::parseHashAlgo(hashAlgoStr);
+        s.fullSyncCmpr = parseCompressOpt(fullSyncCmprStr);
         util::verifyNotZero(s.implicitSnapshotIntervalSec, "implicitSnapshotIntervalSec");
         util::verifyNotZero(s.tsDeltaGetterIntervalSec, "tsDeltaGetterIntervalSec");
+        util::verifyNotZero(metricsIntervalSec, "metricsIntervalSec");
         s.keepAliveParams.verify();
         s.fullScanLbPerSec = defaultFullScanBytesPerSec / LOGICAL_BLOCK_SIZE;
     }
@@ -99,7 +120,8 @@ struct StorageThreads {
             }
         }
 
-        g.dispatcher.reset(new DispatchTask<std::string, StorageWorker>(g.taskQueue, g.maxBackgroundTasks));
+        g.dispatcher.reset(new DispatchTask<std::string, StorageWorker>(
+                               g.taskQueue, g.maxBackgroundTasks, g.maxBackgroundTasksPerVolume, getTaskSchedAttr));
         g.wdevMonitor.reset(new std::thread(wdevMonitorWorker));
         g.proxyMonitor.reset(new std::thread(proxyMonitorWorker));
         g.tsDeltaGetter.reset(new std::thread(tsDeltaGetterWorker));
@@ -138,6 +160,7 @@ int main(int argc, char *argv[]) try
     LOGs.info() << opt.opt;
     {
         StorageThreads threads(opt);
+        metrics::PrometheusFileWriter metricsWriter(g.metrics, "storage", opt.metricsFile, opt.metricsIntervalSec);
         server::MultiThreadedServer server;
         const size_t concurrency = g.maxConnections;
         server.run(g.ps, opt.port, g.nodeId, storageHandlerMap, g.handlerStatMgr,
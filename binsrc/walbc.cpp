@@ -111,11 +111,17 @@ void setupVirtualFullScan(cybozu::Option& opt)
     setupVolIdGid(opt);
     setupOpt(opt, "(bulk size) (scanning size)");
 }
+void setupBlockHash(cybozu::Option& opt)
+{
+    setupVolIdGid(opt);
+    setupOpt(opt, "(bulk size) (scanning size) (hash algorithm: murmur3/xxh3)");
+}
 void setupVirtualFullScanCmd(cybozu::Option& opt)
 {
     static std::string devPath;
     opt.appendParam(&devPath, "devPath", ": specify 'stdout' to put image to stdout.");
-    setupVirtualFullScan(opt);
+    setupVolIdGid(opt);
+    setupOpt(opt, "(bulk size) (scanning size) (start offset)");
 }
 void setupUuid(cybozu::Option& opt)
 {
@@ -194,7 +200,7 @@ const CommandInfo g_cmdTbl[] = {
     { resizeCN, c2xResizeClient, setupResize, verifyResizeParam, "resize a volume in a storage or an archive." },
     { kickCN, c2xKickClient, setupKick, verifyKickParam, "kick background tasks if necessary." },
     { setFullScanBpsCN, c2sSetFullScanBpsClient, setupSetFullScanBps, verifySetFullScanBps, "set max full scan bytes per second parameter." },
-    { blockHashCN, c2aBlockHashClient, setupVirtualFullScan, verifyVirtualFullScanParam, "calculate block hash of a volume in an archive." },
+    { blockHashCN, c2aBlockHashClient, setupBlockHash, verifyBlockHashParam, "calculate block hash of a volume in an archive." },
     { virtualFullScanCN, c2aVirtualFullScanClient, setupVirtualFullScanCmd, verifyVirtualFullScanCmdParam, "virtual full scan of a volume in an archive." },
     { getCN, c2xGetClient, setupGet, verifyNoneParam, "get some information from a server." },
     { execCN, c2xGetStrVecClient, setupStrVec, verifyNoneParam, "execute a command-line at a server's side." },
@@ -67,6 +67,7 @@ int doMain(int argc, char *argv[])
     }
     merger.setMaxIoBlocks(opt.maxIoBlocks());
     merger.setShouldValidateUuid(false);
+    merger.setReadAheadThreads(std::max<size_t>(opt.cmpr.numCpu, DEFAULT_MERGE_READ_AHEAD_CPU));
 #if 0
     merger.mergeToFd(file.fd());
 #else
@@ -110,10 +110,17 @@ void runDummyProxy(const Option &opt)
 {
     // connect.
     cybozu::Socket sock;
-    util::connectWithTimeout(sock, cybozu::SocketAddr(opt.addr, opt.port), opt.timeoutSec);
+    const cybozu::SocketAddr server(opt.addr, opt.port);
+    util::connectWithTimeout(sock, server, opt.timeoutSec);
 
     // 1st negotiation.
-    const std::string serverId = protocol::run1stNegotiateAsClient(sock, opt.nodeId, wdiffTransferPN);
+    std::string serverId;
+    const bool canResume = protocol::tryRun1stNegotiateAsClient(sock, opt.nodeId, resumableWdiffTransferPN, serverId);
+    if (!canResume) {
+        sock.close();
+        util::connectWithTimeout(sock, server, opt.timeoutSec);
+        serverId = protocol::run1stNegotiateAsClient(sock, opt.nodeId, wdiffTransferPN);
+    }
     packet::Packet pkt(sock);
     ProtocolLogger logger(opt.nodeId, serverId);
 
@@ -137,7 +144,10 @@ void runDummyProxy(const Option &opt)
 
     // transfer diff data if necessary.
     if (res != msgAccept) return;
+    uint64_t resumeAddr = 0;
+    if (canResume) pkt.read(resumeAddr);
     DiffMerger merger;
+    merger.setStartAddr(resumeAddr);
     merger.addWdiffs({opt.wdiffPath});
     merger.prepare();
     const CompressOpt cmpr;
@@ -27,6 +27,8 @@ struct Option
     uint32_t maxPackSize; /* [byte]. */
     uint64_t outLogSize; /* Approximately output log size [byte]. */
     uint64_t lsid; /* start lsid [physical block]. */
+    uint32_t seed;
+    std::string patternStr;
     bool isNotPadding;
     bool isNotDiscard;
     bool isNotAllZero;
@@ -54,6 +56,8 @@ struct Option
         opt.appendOpt(&maxPackSize, 16 * 1024 * 1024, "-maxPackSize", "SIZE: maximum logpack size [byte]. (default: 16M)");
         opt.appendOpt(&outLogSize, 1024 * 1024, "z", "SIZE: total log size to generate [byte]. (default: 1M)");
         opt.appendOpt(&lsid, 0, "-lsid", "LSID: lsid of the first log. (default: 0)");
+        opt.appendOpt(&seed, 0, "-seed", "SEED: random seed to generate the same logs again. (default: 0 means random)");
+        opt.appendOpt(&patternStr, "rand", "-pattern", "PATTERN: IO address pattern: rand, seq or hot. (default: rand)");
         opt.appendBoolOpt(&isNotPadding, "-nopadding", "no padding. (default: randomly inserted)");
         opt.appendBoolOpt(&isNotDiscard, "-nodiscard", "no discard. (default: randomly inserted)");
         opt.appendBoolOpt(&isNotAllZero, "-noallzero", "no all-zero. (default: randomly inserted)");
@@ -101,6 +105,8 @@ struct Option
         cfg.isAllZero = !isNotAllZero;
         cfg.isRandom = isRandom;
         cfg.isVerbose = isVerbose;
+        cfg.seed = seed;
+        cfg.addrPattern = parseAddrPattern(patternStr);
         return cfg;
     }
 };
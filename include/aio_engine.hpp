@@ -0,0 +1,169 @@
+#pragma once
+/**
+ * @file
+ * @brief Backend interface of asynchronous IO and its libaio implementation.
+ */
+#include <vector>
+#include <cerrno>
+#include <cstring>
+#include <cassert>
+#include <cinttypes>
+
+#include <sys/types.h>
+#include <libaio.h>
+
+#include "util.hpp"
+
+namespace cybozu {
+namespace aio {
+
+enum AioType
+{
+    AIO_TYPE_READ = 0,
+    AIO_TYPE_WRITE = 1,
+    AIO_TYPE_FLUSH = 2,
+};
+
+/**
+ * An IO to submit.
+ * slot identifies the IO in the engine. It must be less than the number of slots
+ * given at construction of the engine
+ * and must not be reused until the completion of the IO has been got.
+ */
+struct AioRequest
+{
+    uint32_t slot;
+    int type;
+    off_t oft;
+    size_t size;
+    char *buf;
+};
+
+struct AioCompletion
+{
+    uint32_t slot;
+    int res; // transferred size in bytes or -errno.
+};
+
+/**
+ * Asynchronous IO engine for a file descriptor.
+ *
+ * submit() and wait() may be called from different threads at the same time,
+ * but each of them must not be called concurrently.
+ */
+class AioEngine
+{
+public:
+    virtual ~AioEngine() noexcept {}
+    virtual const char *name() const = 0;
+    /**
+     * Register a buffer used for IOs to avoid mapping its pages for each IO.
+     * Registration is just a hint and may be ignored.
+     * The buffer must be alive while the engine is alive.
+     * RETURN:
+     *   true if registered.
+     */
+    virtual bool registerBuffer(const void *buf, size_t size) {
+        unusedVar(buf);
+        unusedVar(size);
+        return false;
+    }
+    /**
+     * Submit IOs at once.
+     */
+    virtual void submit(const AioRequest *reqs, size_t nr) = 0;
+    /**
+     * Wait for completion of IOs.
+     * @minNr min number of IOs to wait for. 0 means no blocking.
+     * @out completions will be set. Its size must be >= maxNr.
+     * RETURN:
+     *   number of completions set to out.
+     */
+    virtual size_t wait(size_t minNr, AioCompletion *out, size_t maxNr) = 0;
+    /**
+     * Try to cancel a submitted IO.
+     * RETURN:
+     *   true if canceled. Its completion will not be got by wait().
+     */
+    virtual bool cancel(uint32_t slot) = 0;
+};
+
+/**
+ * Linux native aio.
+ */
+class LibaioEngine : public AioEngine
+{
+private:
+    const int fd_;
+    io_context_t ctx_;
+    std::vector<struct iocb> iocbs_; // indexed by slot.
+    std::vector<struct iocb *> iocbPtrs_; // temporal use for submit.
+    std::vector<struct io_event> ioEvents_; // temporal use for wait.
+
+public:
+    /**
+     * @queueSize max number of IOs in flight.
+     * @nrSlots number of slots. It must be >= queueSize.
+     */
+    LibaioEngine(int fd, size_t queueSize, size_t nrSlots)
+        : fd_(fd), ctx_(), iocbs_(nrSlots), iocbPtrs_(queueSize), ioEvents_(queueSize) {
+        assert(queueSize <= nrSlots);
+        const int err = ::io_queue_init(queueSize, &ctx_);
+        if (err < 0) {
+            throwLibcErrorWithNo("LibaioEngine: io_queue_init failed.", -err);
+        }
+    }
+    ~LibaioEngine() noexcept {
+        ::io_queue_release(ctx_);
+    }
+    const char *name() const override { return "libaio"; }
+    void submit(const AioRequest *reqs, size_t nr) override {
+        assert(nr <= iocbPtrs_.size());
+        for (size_t i = 0; i < nr; i++) {
+            const AioRequest &req = reqs[i];
+            struct iocb &iocb = iocbs_[req.slot];
+            ::memset(&iocb, 0, sizeof(iocb));
+            switch (req.type) {
+            case AIO_TYPE_READ:
+                ::io_prep_pread(&iocb, fd_, req.buf, req.size, req.oft);
+                break;
+            case AIO_TYPE_WRITE:
+                ::io_prep_pwrite(&iocb, fd_, req.buf, req.size, req.oft);
+                break;
+            default:
+                ::io_prep_fdsync(&iocb, fd_);
+            }
+            iocb.data = reinterpret_cast<void *>(uintptr_t(req.slot));
+            iocbPtrs_[i] = &iocb;
+        }
+        size_t done = 0;
+        while (done < nr) {
+            const int err = ::io_submit(ctx_, nr - done, &iocbPtrs_[done]);
+            if (err < 0) {
+                throwLibcErrorWithNo("LibaioEngine: io_submit failed.", -err);
+            }
+            done += err;
+        }
+    }
+    size_t wait(size_t minNr, AioCompletion *out, size_t maxNr) override {
+        maxNr = std::min(maxNr, ioEvents_.size());
+        assert(minNr <= maxNr);
+        const int nr = ::io_getevents(ctx_, minNr, maxNr, &ioEvents_[0], NULL);
+        if (nr < 0) {
+            throwLibcErrorWithNo("LibaioEngine: io_getevents failed.", -nr);
+        }
+        for (int i = 0; i < nr; i++) {
+            const struct iocb &iocb = *ioEvents_[i].obj;
+            out[i].slot = uint32_t(reinterpret_cast<uintptr_t>(iocb.data));
+            out[i].res = int(ioEvents_[i].res);
+        }
+        return nr;
+    }
+    bool cancel(uint32_t slot) override {
+        struct io_event event;
+        return ::io_cancel(ctx_, &iocbs_[slot], &event) == 0;
+    }
+};
+
+} // namespace aio
+} // namespace cybozu
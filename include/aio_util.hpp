@@ -20,6 +20,8 @@
 #include <cstdio>
 #include <cassert>
 #include <memory>
+#include <atomic>
+#include <algorithm>
 
 #include <unistd.h>
 #include <time.h>
@@ -29,16 +31,81 @@
 #include <sys/ioctl.h>
 #include <fcntl.h>
 #include <linux/fs.h>
-#include <libaio.h>
 
 #include "linux/walb/common.h"
 #include "util.hpp"
 #include "fileio.hpp"
 #include "memory_buffer.hpp"
+#include "aio_engine.hpp"
+#include "uring_util.hpp"
 
 namespace cybozu {
 namespace aio {
 
+enum AioBackend
+{
+    AIO_BACKEND_AUTO = 0, // io_uring if available, otherwise libaio.
+    AIO_BACKEND_LIBAIO = 1,
+    AIO_BACKEND_URING = 2,
+};
+
+inline AioBackend parseAioBackend(const std::string &s)
+{
+    if (s == "auto") return AIO_BACKEND_AUTO;
+    if (s == "libaio") return AIO_BACKEND_LIBAIO;
+    if (s == "uring") return AIO_BACKEND_URING;
+    throw RT_ERR("parseAioBackend: bad backend name: %s", s.c_str());
+}
+
+namespace aio_local {
+
+/**
+ * The initial value can be given by WALB_AIO_BACKEND environment variable.
+ */
+inline std::atomic<int>& defaultBackend()
+{
+    static std::atomic<int> backend([]() {
+            const char *s = ::getenv("WALB_AIO_BACKEND");
+            return int(s == nullptr ? AIO_BACKEND_AUTO : parseAioBackend(s));
+        }());
+    return backend;
+}
+
+} // namespace aio_local
+
+inline void setDefaultAioBackend(AioBackend backend)
+{
+    aio_local::defaultBackend() = backend;
+}
+
+inline AioBackend getDefaultAioBackend()
+{
+    return AioBackend(aio_local::defaultBackend().load());
+}
+
+/**
+ * Create an IO engine.
+ * AIO_BACKEND_AUTO falls back to libaio
+ * when io_uring is not supported or disabled in the system or in the build.
+ */
+inline std::unique_ptr<AioEngine> createAioEngine(int fd, size_t queueSize, size_t nrSlots, AioBackend backend)
+{
+#ifdef CYBOZU_AIO_URING
+    if (backend == AIO_BACKEND_AUTO) {
+        static const bool isUringAvailable = UringEngine::isAvailable();
+        backend = isUringAvailable ? AIO_BACKEND_URING : AIO_BACKEND_LIBAIO;
+    }
+    if (backend == AIO_BACKEND_URING) {
+        return std::unique_ptr<AioEngine>(new UringEngine(fd, queueSize));
+    }
+#else
+    if (backend == AIO_BACKEND_URING) {
+        throw RT_ERR("createAioEngine: io_uring is not supported in this build.");
+    }
+#endif
+    return std::unique_ptr<AioEngine>(new LibaioEngine(fd, queueSize, nrSlots));
+}
+
 /**
  * Asynchronous IO wrapper.
  *
@@ -52,6 +119,12 @@ namespace aio {
  * Do not use prepareFlush().
  * Currently aio flush is not supported by Linux kernel.
  *
+ * Each IO uses one of the slots allocated at construction,
+ * so there is no memory allocation per IO.
+ * Completed IOs keep their slots until they are waited for,
+ * so there are twice as many slots as 'queueSize'.
+ * The key of an IO consists of its slot index and the generation of the slot.
+ *
  * Thrown EofError and LibcError in waitFor()/waitOne()/wait(),
  * you can use the Aio instance continuously,
  * however, thrown other error(s),
@@ -60,29 +133,31 @@ namespace aio {
 class Aio
 {
 private:
-    enum IoType
+    enum State
     {
-        IOTYPE_READ = 0,
-        IOTYPE_WRITE = 1,
-        IOTYPE_FLUSH = 2,
+        FREE = 0,
+        PREPARED,
+        PENDING,
+        COMPLETED,
     };
 
     struct AioData
     {
         uint key;
-        IoType type;
-        struct iocb iocb;
+        int type;
+        State state;
         off_t oft;
         size_t size;
         char *buf;
         double beginTime;
         double endTime;
         int err;
+        size_t completedIdx; // index in completedV_.
 
-        void init(uint key, IoType type, off_t oft, size_t size, char *buf) {
+        void init(uint key, int type, off_t oft, size_t size, char *buf) {
             this->key = key;
             this->type = type;
-            ::memset(&iocb, 0, sizeof(iocb));
+            state = PREPARED;
             this->oft = oft;
             this->size = size;
             this->buf = buf;
@@ -92,37 +167,35 @@ private:
         }
     };
 
-    const int fd_;
     const size_t queueSize_;
-    io_context_t ctx_;
+    std::unique_ptr<AioEngine> engine_;
 
+    std::vector<AioData> slots_;
+    std::vector<uint> freeV_; // free slot indexes.
     /*
      * submitQ_ contains prepared but not submitted IOs.
-     * pendingIOs_ contains submitted but not completed IOs.
-     * completedIOs_ contains completed IOs.
-     *   Key: aiodata.key, value: aiodata ptr.
+     * completedV_ contains completed IOs.
+     *   Both contain slot indexes.
      */
-    using AioDataPtr = std::unique_ptr<AioData>;
-    std::deque<AioDataPtr> submitQ_;
-    using Umap = std::unordered_map<uint, AioDataPtr>;
-    Umap pendingIOs_;
-    Umap completedIOs_;
+    std::deque<uint> submitQ_;
+    size_t nrPending_;
+    std::vector<uint> completedV_;
 
     /* temporal use for submit. */
-    std::vector<struct iocb *> iocbs_;
+    std::vector<AioRequest> reqV_;
 
     /* temporal use for wait. */
-    std::vector<struct io_event> ioEvents_;
+    std::vector<AioCompletion> complV_;
 
     const bool isMeasureTime_;
-    bool isReleased_;
-    uint key_;
 
     /*
      * This must be not greater than /proc/sys/fs/aio-max-nr value.
      * Otherwise, io_queue_init() will fail with EAGAIN.
      */
     static constexpr size_t MAX_AIO_REQ_NR() { return 1024; }
+    static constexpr uint SLOT_BITS = 11;
+    static constexpr uint SLOT_MASK = (1U << SLOT_BITS) - 1;
 
 public:
     /**
@@ -130,53 +203,63 @@ public:
      *   You must open the file/device with O_DIRECT
      *   to work it really asynchronously.
      * @queueSize queue size for aio.
-     * @isMeasureTime true if you want to measure IO begein/end time.
+     * @backend IO engine to use.
      */
-    Aio(int fd, size_t queueSize)
-        : fd_(fd)
-        , queueSize_(std::min(MAX_AIO_REQ_NR(), queueSize))
+    Aio(int fd, size_t queueSize, AioBackend backend = getDefaultAioBackend())
+        : queueSize_(std::min(MAX_AIO_REQ_NR(), queueSize))
+        , engine_()
+        , slots_(queueSize_ * 2)
+        , freeV_()
         , submitQ_()
-        , pendingIOs_()
-        , completedIOs_()
-        , iocbs_(queueSize)
-        , ioEvents_(queueSize)
-        , isMeasureTime_(false)
-        , isReleased_(false)
-        , key_(1) {
-        assert(fd_ >= 0);
+        , nrPending_(0)
+        , completedV_()
+        , reqV_()
+        , complV_(queueSize_)
+        , isMeasureTime_(false) {
+        assert(fd >= 0);
         assert(queueSize > 0);
-        const int err = ::io_queue_init(queueSize_, &ctx_);
-        if (err < 0) {
-            throwLibcErrorWithNo("Aio: io_queue_init failed.", -err);
+        engine_ = createAioEngine(fd, queueSize_, slots_.size(), backend);
+        freeV_.reserve(slots_.size());
+        for (size_t i = 0; i < slots_.size(); i++) {
+            slots_[i].key = i; // generation 0 is never used.
+            slots_[i].state = FREE;
+            freeV_.push_back(slots_.size() - 1 - i);
         }
+        completedV_.reserve(slots_.size());
+        reqV_.reserve(queueSize_);
     }
     ~Aio() noexcept try {
         release();
     } catch (...) {
     }
     void release() {
-        if (isReleased_) return;
-        int err = ::io_queue_release(ctx_);
-        if (err < 0) {
-            throwLibcErrorWithNo("Aio: io_queue_release failed.", -err);
-        }
-        isReleased_ = true;
+        engine_.reset();
+    }
+    const char *backendName() const {
+        return engine_->name();
+    }
+    /**
+     * Register a buffer used for IOs. It is just a hint for the engine.
+     * The buffer must be alive while this is alive.
+     */
+    bool registerBuffer(const void *buf, size_t size) {
+        return engine_->registerBuffer(buf, size);
     }
     /**
      * If this returns true, the queue is full.
      * Call submit() and waitXXX() before calling additional prepareXXX().
      */
     bool isQueueFull() const {
-        return submitQ_.size() + pendingIOs_.size() >= queueSize_;
+        return submitQ_.size() + nrPending_ >= queueSize_;
     }
     size_t queueSize() const {
         return queueSize_;
     }
     size_t queueUsage() const {
-        return submitQ_.size() + pendingIOs_.size();
+        return submitQ_.size() + nrPending_;
     }
     bool empty() const {
-        return submitQ_.empty() && pendingIOs_.empty() && completedIOs_.empty();
+        return submitQ_.empty() && nrPending_ == 0 && completedV_.empty();
     }
     /**
      * Prepare a read IO.
@@ -184,28 +267,13 @@ public:
      *   Unique key (non-zero) to identify the IO in success, or 0.
      */
     uint prepareRead(off_t oft, size_t size, char* buf) {
-        if (isQueueFull()) return 0;
-        const uint key = getKey();
-        AioDataPtr iop(new AioData());
-        iop->init(key, IOTYPE_READ, oft, size, buf);
-        ::io_prep_pread(&iop->iocb, fd_, buf, size, oft);
-        iop->iocb.data = reinterpret_cast<void *>(key);
-        submitQ_.push_back(std::move(iop));
-        return key;
+        return prepare(AIO_TYPE_READ, oft, size, buf);
     }
     /**
      * Prepare a write IO.
      */
     uint prepareWrite(off_t oft, size_t size, const char* buf) {
-        if (isQueueFull()) return 0;
-        const uint key = getKey();
-        AioDataPtr iop(new AioData());
-        char* buf2 = const_cast<char *>(buf);
-        iop->init(key, IOTYPE_WRITE, oft, size, buf2);
-        ::io_prep_pwrite(&iop->iocb, fd_, buf2, size, oft);
-        iop->iocb.data = reinterpret_cast<void *>(key);
-        submitQ_.push_back(std::move(iop));
-        return key;
+        return prepare(AIO_TYPE_WRITE, oft, size, const_cast<char *>(buf));
     }
     /**
      * Prepare a flush IO.
@@ -214,14 +282,7 @@ public:
      * by almost all filesystems and block devices.
      */
     uint prepareFlush() {
-        if (isQueueFull()) return 0;
-        const uint key = getKey();
-        AioDataPtr iop(new AioData());
-        iop->init(key, IOTYPE_FLUSH, 0, 0, nullptr);
-        ::io_prep_fdsync(&iop->iocb, fd_);
-        iop->iocb.data = reinterpret_cast<void *>(key);
-        submitQ_.push_back(std::move(iop));
-        return key;
+        return prepare(AIO_TYPE_FLUSH, 0, 0, nullptr);
     }
     /**
      * Submit all prepared IO(s).
@@ -230,31 +291,21 @@ public:
      *   LibcError
      */
     void submit() {
-        size_t nr = submitQ_.size();
+        const size_t nr = submitQ_.size();
         if (nr == 0) return;
 
-        assert(iocbs_.size() >= nr);
         double beginTime = 0;
         if (isMeasureTime_) beginTime = util::getTime();
-        for (size_t i = 0; i < nr; i++) {
-            AioDataPtr iop = std::move(submitQ_.front());
-            submitQ_.pop_front();
-            iocbs_[i] = &iop->iocb;
-            iop->beginTime = beginTime;
-            const uint key = iop->key;
-            assert(pendingIOs_.find(key) == pendingIOs_.end());
-            pendingIOs_.emplace(key, std::move(iop));
-        }
-        assert(submitQ_.empty());
-
-        size_t done = 0;
-        while (done < nr) {
-            int err = ::io_submit(ctx_, nr - done, &iocbs_[done]);
-            if (err < 0) {
-                throwLibcErrorWithNo("Aio: io_submit failed.", -err);
-            }
-            done += err;
+        reqV_.clear();
+        for (const uint idx : submitQ_) {
+            AioData &io = slots_[idx];
+            io.state = PENDING;
+            io.beginTime = beginTime;
+            reqV_.push_back({idx, io.type, io.oft, io.size, io.buf});
         }
+        submitQ_.clear();
+        nrPending_ += nr;
+        engine_->submit(reqV_.data(), nr);
     }
     /**
      * Cancel an IO.
@@ -264,39 +315,25 @@ public:
      *   std::runtime_error
      */
     bool cancel(uint key) {
-        /* Submit queue. */
-        {
-            std::deque<AioDataPtr>::iterator it = submitQ_.begin();
-            while (it != submitQ_.end()) {
-                AioDataPtr& iop = *it;
-                if (iop->key == key) {
-                    submitQ_.erase(it);
-                    return true;
-                }
-                ++it;
-            }
-        }
-
-        /* Pending IOs. */
-        {
-            Umap::iterator it = pendingIOs_.find(key);
-            if (it != pendingIOs_.end()) {
-                AioDataPtr& iop = it->second;
-                if (::io_cancel(ctx_, &iop->iocb, &ioEvents_[0]) == 0) {
-                    pendingIOs_.erase(it);
-                    return true;
-                }
-                return false;
+        const uint idx = getSlot(key);
+        AioData &io = slots_[idx];
+        switch (io.state) {
+        case PREPARED:
+            submitQ_.erase(std::find(submitQ_.begin(), submitQ_.end(), idx));
+            freeSlot(idx);
+            return true;
+        case PENDING:
+            if (engine_->cancel(idx)) {
+                nrPending_--;
+                freeSlot(idx);
+                return true;
             }
-        }
-
-        /* Completed IOs. */
-        Umap::iterator it = completedIOs_.find(key);
-        if (it != completedIOs_.end()) {
             return false;
+        case COMPLETED:
+            return false;
+        default:
+            throw RT_ERR("Aio: key not found: %u", key);
         }
-
-        throw RT_ERR("Aio: key not found: %u", key);
     }
     /**
      * Wait for an IO.
@@ -310,11 +347,11 @@ public:
      */
     void waitFor(uint key) {
         verifyKeyExistance(key);
-        AioDataPtr iop;
-        while (!popCompleted(key, iop)) {
+        const uint idx = getSlot(key);
+        while (slots_[idx].state != COMPLETED) {
             wait_(1);
         }
-        verifyNoError(*iop);
+        popCompleted(idx);
     }
     /**
      * Check a given IO has been completed or not.
@@ -328,7 +365,7 @@ public:
     bool isCompleted(uint key) {
         verifyKeyExistance(key);
         wait_(0);
-        return completedIOs_.find(key) != completedIOs_.cend();
+        return slots_[getSlot(key)].state == COMPLETED;
     }
     /**
      * Wait several IO(s) completed.
@@ -347,22 +384,22 @@ public:
      */
     void wait(size_t nr, std::queue<uint>& queue) {
         verifyNr(nr);
-        while (completedIOs_.size() < nr) {
-            wait_(nr - completedIOs_.size());
+        while (completedV_.size() < nr) {
+            wait_(nr - completedV_.size());
         }
         bool isEofError = false;
         bool isLibcError = false;
         while (nr > 0) {
-            assert(!completedIOs_.empty());
-            AioDataPtr iop;
-            popAnyCompleted(iop);
-            if (iop->err == 0) {
+            assert(!completedV_.empty());
+            const uint idx = completedV_.back();
+            const AioData &io = slots_[idx];
+            if (io.err == 0) {
                 isEofError = true;
-            } else if (iop->err < 0) {
+            } else if (io.err < 0) {
                 isLibcError = true;
             }
-            assert(iop->iocb.u.c.nbytes == static_cast<uint>(iop->err));
-            queue.push(iop->key);
+            queue.push(io.key);
+            removeCompleted(idx);
             nr--;
         }
         if (isLibcError) {
@@ -384,30 +421,46 @@ public:
      *   std::runtime_error
      */
     uint waitOne() {
-        if (completedIOs_.empty()) wait_(1);
-        AioDataPtr iop;
-        popAnyCompleted(iop);
-        verifyNoError(*iop);
-        return iop->key;
+        if (completedV_.empty()) wait_(1);
+        const uint idx = completedV_.back();
+        const uint key = slots_[idx].key;
+        popCompleted(idx);
+        return key;
     }
     void waitOneOrMore(std::queue<uint>& queue) {
-        if (completedIOs_.empty()) wait_(1);
-        AioDataPtr iop;
-        while (popAnyCompleted(iop)) {
-            verifyNoError(*iop);
-            queue.push(iop->key);
+        if (completedV_.empty()) wait_(1);
+        while (!completedV_.empty()) {
+            const uint idx = completedV_.back();
+            queue.push(slots_[idx].key);
+            popCompleted(idx);
         }
     }
 private:
     /**
-     * Never return 0.
+     * RETURN:
+     *   non-zero key, or 0 if the queue is full.
      */
-    uint getKey() {
-        uint ret = key_;
-        key_++;
-        if (key_ == 0) key_++;
-        assert(ret != 0);
-        return ret;
+    uint prepare(int type, off_t oft, size_t size, char *buf) {
+        if (isQueueFull() || freeV_.empty()) return 0;
+        const uint idx = freeV_.back();
+        freeV_.pop_back();
+        AioData &io = slots_[idx];
+        uint gen = (io.key >> SLOT_BITS) + 1;
+        if ((gen << SLOT_BITS) >> SLOT_BITS != gen) gen = 1;
+        io.init((gen << SLOT_BITS) | idx, type, oft, size, buf);
+        submitQ_.push_back(idx);
+        return io.key;
+    }
+    uint getSlot(uint key) const {
+        const uint idx = key & SLOT_MASK;
+        if (idx >= slots_.size() || slots_[idx].key != key || (key >> SLOT_BITS) == 0) {
+            throw RT_ERR("Aio: key not found: %u", key);
+        }
+        return idx;
+    }
+    void freeSlot(uint idx) {
+        slots_[idx].state = FREE;
+        freeV_.push_back(idx);
     }
     /**
      * Wait IOs completion.
@@ -416,62 +469,46 @@ private:
      */
     size_t wait_(size_t minNr) {
         assert(minNr <= queueSize_);
-        const int nr = ::io_getevents(ctx_, minNr, queueSize_, &ioEvents_[0], NULL);
-        if (nr < 0) {
-            throwLibcErrorWithNo("Aio: io_getevents failed.", -nr);
-        }
-        if ((size_t)nr < minNr) {
-            throw RT_ERR("io_getevents returns bad value %d %u.", nr, minNr);
+        const size_t nr = engine_->wait(minNr, complV_.data(), complV_.size());
+        if (nr < minNr) {
+            throw RT_ERR("Aio: wait returns bad value %zu %zu.", nr, minNr);
         }
         double endTime = 0;
         if (isMeasureTime_) endTime = util::getTime();
-        for (int i = 0; i < nr; i++) {
-            const uint key = getKeyFromEvent(ioEvents_[i]);
-            Umap::iterator it = pendingIOs_.find(key);
-            assert(it != pendingIOs_.end());
-            AioDataPtr& iop = it->second;
-            assert(iop->key == key);
-            iop->endTime = endTime;
-            iop->err = ioEvents_[i].res;
-            completedIOs_.emplace(key, std::move(iop));
-            pendingIOs_.erase(it);
+        for (size_t i = 0; i < nr; i++) {
+            const uint idx = complV_[i].slot;
+            assert(idx < slots_.size());
+            AioData &io = slots_[idx];
+            assert(io.state == PENDING);
+            io.state = COMPLETED;
+            io.endTime = endTime;
+            io.err = complV_[i].res;
+            io.completedIdx = completedV_.size();
+            completedV_.push_back(idx);
         }
+        nrPending_ -= nr;
         return nr;
     }
-    static uint getKeyFromEvent(struct io_event &event) {
-        struct iocb &iocb = *static_cast<struct iocb *>(event.obj);
-        return static_cast<uint>(reinterpret_cast<uintptr_t>(iocb.data));
-    }
-    /**
-     * @iop poped data will be set.
-     * @return true if poped.
-     */
-    bool popAnyCompleted(AioDataPtr& iop) {
-        if (completedIOs_.empty()) return false;
-
-        Umap::iterator it = completedIOs_.begin();
-        iop = std::move(it->second);
-        completedIOs_.erase(it);
-        return true;
+    void removeCompleted(uint idx) {
+        const size_t i = slots_[idx].completedIdx;
+        assert(completedV_[i] == idx);
+        completedV_[i] = completedV_.back();
+        slots_[completedV_[i]].completedIdx = i;
+        completedV_.pop_back();
+        freeSlot(idx);
     }
     /**
-     * @key IO identifier
-     * @iop poped data will be set.
-     * @return found AioDataPtr or nullptr.
+     * Release the slot of a completed IO and check its result.
      */
-    bool popCompleted(uint key, AioDataPtr& iop) {
-        if (completedIOs_.empty()) return false;
-        Umap::iterator it = completedIOs_.find(key);
-        if (it == completedIOs_.end()) return false;
-
-        iop = std::move(it->second);
-        assert(iop->key == key);
-        completedIOs_.erase(it);
-        return true;
+    void popCompleted(uint idx) {
+        const int err = slots_[idx].err;
+        const size_t size = slots_[idx].size;
+        removeCompleted(idx);
+        verifyNoError(err, size);
     }
     void verifyKeyExistance(uint key) const {
-        if (completedIOs_.find(key) == completedIOs_.cend() &&
-            pendingIOs_.find(key) == pendingIOs_.cend()) {
+        const State st = slots_[getSlot(key)].state;
+        if (st != PENDING && st != COMPLETED) {
             throw RT_ERR("Aio: key not found: %u", key);
         }
     }
@@ -480,14 +517,15 @@ private:
             throw RT_ERR("Aio: bad nr. (nr must be <= %zu but %zu)", queueSize_, nr);
         }
     }
-    void verifyNoError(const AioData& io) const {
-        if (io.err == 0) {
+    void verifyNoError(int err, size_t size) const {
+        if (err == 0 && size > 0) {
             throw util::EofError();
         }
-        if (io.err < 0) {
-            throwLibcErrorWithNo("Aio: io failed.", -io.err);
+        if (err < 0) {
+            throwLibcErrorWithNo("Aio: io failed.", -err);
         }
-        assert(io.iocb.u.c.nbytes == static_cast<uint>(io.err));
+        unusedVar(size);
+        assert(size == static_cast<size_t>(err));
     }
 };
 
@@ -9,6 +9,7 @@
 #include <cstring>
 #include <cinttypes>
 #include <cassert>
+#include "simd_kernels.hpp"
 
 namespace cybozu {
 namespace util {
@@ -23,21 +24,9 @@ namespace util {
  */
 inline uint32_t checksumPartial(const void *data, size_t size, uint32_t csum)
 {
-    const char *p = (const char *)data;
-    uint32_t v;
-    while (sizeof(v) <= size) {
-        ::memcpy(&v, p, sizeof(v));
-        csum += v;
-        size -= sizeof(v);
-        p += sizeof(v);
-    }
-    assert(size < sizeof(v));
-    if (0 < size) {
-        uint32_t padding = 0;
-        ::memcpy(&padding, p, size);
-        csum += padding;
-    }
-    return csum;
+    /* Dispatching does not pay for tiny data. */
+    if (size < 64) return simd::checksumPartialScalar(data, size, csum);
+    return simd::kernels().checksumPartial(data, size, csum);
 }
 
 /**
@@ -0,0 +1,354 @@
+#pragma once
+/**
+ * @file
+ * @brief Checksum and zero-detection kernels with runtime SIMD dispatch.
+ *
+ * The checksum is the sum of 32-bit words in host byte order
+ * where the last partial word is padded with zeros.
+ * Every implementation returns the same value as the scalar one
+ * because the sum is taken modulo 2^32 in any order.
+ *
+ * x86_64 implementations are compiled with function target attributes,
+ * so no special compiler flags are required.
+ * Intrinsics in such functions require g++-4.9 or clang++-3.8 for SSE2 and AVX2,
+ * and g++-6 or clang++-4.0 for AVX-512. Older compilers use the generic one.
+ * The generic implementation uses 64-bit words and is vectorized by compilers
+ * on other architectures such as aarch64 NEON.
+ */
+#include <cstring>
+#include <cstdlib>
+#include <cinttypes>
+#include <string>
+#include <algorithm>
+
+#if defined(__x86_64__)
+#if defined(__clang__)
+#if __clang_major__ > 3 || (__clang_major__ == 3 && __clang_minor__ >= 8)
+#define CYBOZU_SIMD_X86
+#endif
+#if __clang_major__ >= 4
+#define CYBOZU_SIMD_X86_AVX512
+#endif
+#elif defined(__GNUC__)
+#if __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)
+#define CYBOZU_SIMD_X86
+#endif
+#if __GNUC__ >= 6
+#define CYBOZU_SIMD_X86_AVX512
+#endif
+#endif
+#endif
+
+#ifdef CYBOZU_SIMD_X86
+#include <immintrin.h>
+#endif
+
+namespace cybozu {
+namespace simd {
+
+enum SimdLevel
+{
+    SIMD_SCALAR = 0,
+    SIMD_GENERIC,
+    SIMD_SSE2,
+    SIMD_AVX2,
+    SIMD_AVX512,
+    SIMD_MAX,
+};
+
+inline const char *simdLevelName(SimdLevel level)
+{
+    static const char *const tbl[] = {"scalar", "generic", "sse2", "avx2", "avx512"};
+    return level < SIMD_MAX ? tbl[level] : "unknown";
+}
+
+/**
+ * Reference implementations.
+ */
+inline uint32_t checksumPartialScalar(const void *data, size_t size, uint32_t csum)
+{
+    const char *p = (const char *)data;
+    uint32_t v;
+    while (sizeof(v) <= size) {
+        ::memcpy(&v, p, sizeof(v));
+        csum += v;
+        size -= sizeof(v);
+        p += sizeof(v);
+    }
+    if (0 < size) {
+        uint32_t padding = 0;
+        ::memcpy(&padding, p, size);
+        csum += padding;
+    }
+    return csum;
+}
+
+inline bool isAllZeroScalar(const void *data, size_t size)
+{
+    uint64_t x;
+    const char *p = (const char *)data;
+    while (sizeof(x) <= size) {
+        ::memcpy(&x, p, sizeof(x));
+        if (x != 0) return false;
+        p += sizeof(x);
+        size -= sizeof(x);
+    }
+    while (size > 0) {
+        if (*(p++)) return false;
+        size--;
+    }
+    return true;
+}
+
+/**
+ * Independent lanes let compilers use vector registers of any width.
+ */
+inline uint32_t checksumPartialGeneric(const void *data, size_t size, uint32_t csum)
+{
+    const char *p = (const char *)data;
+    uint32_t s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+    while (16 <= size) {
+        uint32_t v0, v1, v2, v3;
+        ::memcpy(&v0, p, 4);
+        ::memcpy(&v1, p + 4, 4);
+        ::memcpy(&v2, p + 8, 4);
+        ::memcpy(&v3, p + 12, 4);
+        s0 += v0;
+        s1 += v1;
+        s2 += v2;
+        s3 += v3;
+        p += 16;
+        size -= 16;
+    }
+    csum += s0 + s1 + s2 + s3;
+    return checksumPartialScalar(p, size, csum);
+}
+
+inline bool isAllZeroGeneric(const void *data, size_t size)
+{
+    const char *p = (const char *)data;
+    while (64 <= size) {
+        uint64_t x[8];
+        ::memcpy(x, p, sizeof(x));
+        if ((x[0] | x[1] | x[2] | x[3] | x[4] | x[5] | x[6] | x[7]) != 0) return false;
+        p += 64;
+        size -= 64;
+    }
+    return isAllZeroScalar(p, size);
+}
+
+#ifdef CYBOZU_SIMD_X86
+
+__attribute__((target("sse2")))
+inline uint32_t checksumPartialSse2(const void *data, size_t size, uint32_t csum)
+{
+    const char *p = (const char *)data;
+    __m128i s0 = _mm_setzero_si128(), s1 = s0, s2 = s0, s3 = s0;
+    while (64 <= size) {
+        s0 = _mm_add_epi32(s0, _mm_loadu_si128((const __m128i *)p));
+        s1 = _mm_add_epi32(s1, _mm_loadu_si128((const __m128i *)(p + 16)));
+        s2 = _mm_add_epi32(s2, _mm_loadu_si128((const __m128i *)(p + 32)));
+        s3 = _mm_add_epi32(s3, _mm_loadu_si128((const __m128i *)(p + 48)));
+        p += 64;
+        size -= 64;
+    }
+    while (16 <= size) {
+        s0 = _mm_add_epi32(s0, _mm_loadu_si128((const __m128i *)p));
+        p += 16;
+        size -= 16;
+    }
+    __m128i s = _mm_add_epi32(_mm_add_epi32(s0, s1), _mm_add_epi32(s2, s3));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(1, 0, 3, 2)));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(2, 3, 0, 1)));
+    csum += uint32_t(_mm_cvtsi128_si32(s));
+    return checksumPartialScalar(p, size, csum);
+}
+
+__attribute__((target("sse2")))
+inline bool isAllZeroSse2(const void *data, size_t size)
+{
+    const char *p = (const char *)data;
+    const __m128i zero = _mm_setzero_si128();
+    while (64 <= size) {
+        const __m128i v = _mm_or_si128(
+            _mm_or_si128(_mm_loadu_si128((const __m128i *)p), _mm_loadu_si128((const __m128i *)(p + 16))),
+            _mm_or_si128(_mm_loadu_si128((const __m128i *)(p + 32)), _mm_loadu_si128((const __m128i *)(p + 48))));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)) != 0xffff) return false;
+        p += 64;
+        size -= 64;
+    }
+    return isAllZeroScalar(p, size);
+}
+
+__attribute__((target("avx2")))
+inline uint32_t checksumPartialAvx2(const void *data, size_t size, uint32_t csum)
+{
+    const char *p = (const char *)data;
+    __m256i s0 = _mm256_setzero_si256(), s1 = s0, s2 = s0, s3 = s0;
+    while (128 <= size) {
+        s0 = _mm256_add_epi32(s0, _mm256_loadu_si256((const __m256i *)p));
+        s1 = _mm256_add_epi32(s1, _mm256_loadu_si256((const __m256i *)(p + 32)));
+        s2 = _mm256_add_epi32(s2, _mm256_loadu_si256((const __m256i *)(p + 64)));
+        s3 = _mm256_add_epi32(s3, _mm256_loadu_si256((const __m256i *)(p + 96)));
+        p += 128;
+        size -= 128;
+    }
+    while (32 <= size) {
+        s0 = _mm256_add_epi32(s0, _mm256_loadu_si256((const __m256i *)p));
+        p += 32;
+        size -= 32;
+    }
+    const __m256i s = _mm256_add_epi32(_mm256_add_epi32(s0, s1), _mm256_add_epi32(s2, s3));
+    __m128i t = _mm_add_epi32(_mm256_castsi256_si128(s), _mm256_extracti128_si256(s, 1));
+    t = _mm_add_epi32(t, _mm_shuffle_epi32(t, _MM_SHUFFLE(1, 0, 3, 2)));
+    t = _mm_add_epi32(t, _mm_shuffle_epi32(t, _MM_SHUFFLE(2, 3, 0, 1)));
+    csum += uint32_t(_mm_cvtsi128_si32(t));
+    return checksumPartialScalar(p, size, csum);
+}
+
+__attribute__((target("avx2")))
+inline bool isAllZeroAvx2(const void *data, size_t size)
+{
+    const char *p = (const char *)data;
+    while (128 <= size) {
+        const __m256i v = _mm256_or_si256(
+            _mm256_or_si256(_mm256_loadu_si256((const __m256i *)p), _mm256_loadu_si256((const __m256i *)(p + 32))),
+            _mm256_or_si256(_mm256_loadu_si256((const __m256i *)(p + 64)), _mm256_loadu_si256((const __m256i *)(p + 96))));
+        if (!_mm256_testz_si256(v, v)) return false;
+        p += 128;
+        size -= 128;
+    }
+    return isAllZeroScalar(p, size);
+}
+
+#ifdef CYBOZU_SIMD_X86_AVX512
+
+__attribute__((target("avx512f")))
+inline uint32_t checksumPartialAvx512(const void *data, size_t size, uint32_t csum)
+{
+    const char *p = (const char *)data;
+    __m512i s0 = _mm512_setzero_si512(), s1 = s0, s2 = s0, s3 = s0;
+    while (256 <= size) {
+        s0 = _mm512_add_epi32(s0, _mm512_loadu_si512(p));
+        s1 = _mm512_add_epi32(s1, _mm512_loadu_si512(p + 64));
+        s2 = _mm512_add_epi32(s2, _mm512_loadu_si512(p + 128));
+        s3 = _mm512_add_epi32(s3, _mm512_loadu_si512(p + 192));
+        p += 256;
+        size -= 256;
+    }
+    while (64 <= size) {
+        s0 = _mm512_add_epi32(s0, _mm512_loadu_si512(p));
+        p += 64;
+        size -= 64;
+    }
+    const __m512i s = _mm512_add_epi32(_mm512_add_epi32(s0, s1), _mm512_add_epi32(s2, s3));
+    /* _mm512_reduce_add_epi32() is not available before g++-7. */
+    uint32_t a[16];
+    _mm512_storeu_si512(a, s);
+    for (size_t i = 0; i < 16; i++) csum += a[i];
+    return checksumPartialScalar(p, size, csum);
+}
+
+__attribute__((target("avx512f")))
+inline bool isAllZeroAvx512(const void *data, size_t size)
+{
+    const char *p = (const char *)data;
+    while (256 <= size) {
+        const __m512i v = _mm512_or_si512(
+            _mm512_or_si512(_mm512_loadu_si512(p), _mm512_loadu_si512(p + 64)),
+            _mm512_or_si512(_mm512_loadu_si512(p + 128), _mm512_loadu_si512(p + 192)));
+        if (_mm512_test_epi64_mask(v, v) != 0) return false;
+        p += 256;
+        size -= 256;
+    }
+    return isAllZeroScalar(p, size);
+}
+
+#endif // CYBOZU_SIMD_X86_AVX512
+#endif // CYBOZU_SIMD_X86
+
+/**
+ * RETURN:
+ *   true if the CPU and the OS support the level.
+ */
+inline bool isSimdLevelSupported(SimdLevel level)
+{
+    switch (level) {
+    case SIMD_SCALAR:
+    case SIMD_GENERIC:
+        return true;
+#ifdef CYBOZU_SIMD_X86
+    case SIMD_SSE2:
+        return true; // always available on x86_64.
+    case SIMD_AVX2:
+        return __builtin_cpu_supports("avx2");
+#endif
+#ifdef CYBOZU_SIMD_X86_AVX512
+    case SIMD_AVX512:
+        return __builtin_cpu_supports("avx512f");
+#endif
+    default:
+        return false;
+    }
+}
+
+struct Kernels
+{
+    SimdLevel level;
+    uint32_t (*checksumPartial)(const void *data, size_t size, uint32_t csum);
+    bool (*isAllZero)(const void *data, size_t size);
+};
+
+/**
+ * The level must be supported.
+ */
+inline Kernels getKernels(SimdLevel level)
+{
+    switch (level) {
+    case SIMD_SCALAR:
+        return Kernels{level, checksumPartialScalar, isAllZeroScalar};
+#ifdef CYBOZU_SIMD_X86
+    case SIMD_SSE2:
+        return Kernels{level, checksumPartialSse2, isAllZeroSse2};
+    case SIMD_AVX2:
+        return Kernels{level, checksumPartialAvx2, isAllZeroAvx2};
+#endif
+#ifdef CYBOZU_SIMD_X86_AVX512
+    case SIMD_AVX512:
+        return Kernels{level, checksumPartialAvx512, isAllZeroAvx512};
+#endif
+    default:
+        return Kernels{SIMD_GENERIC, checksumPartialGeneric, isAllZeroGeneric};
+    }
+}
+
+/**
+ * The best supported level.
+ * WALB_SIMD environment variable can lower it for debugging:
+ * scalar, generic, sse2, avx2 or avx512.
+ */
+inline SimdLevel detectSimdLevel()
+{
+    SimdLevel maxLevel = SimdLevel(SIMD_MAX - 1);
+    const char *s = ::getenv("WALB_SIMD");
+    if (s != nullptr) {
+        for (int i = 0; i < SIMD_MAX; i++) {
+            if (std::string(s) == simdLevelName(SimdLevel(i))) maxLevel = SimdLevel(i);
+        }
+    }
+    for (int i = maxLevel; i > SIMD_GENERIC; i--) {
+        if (isSimdLevelSupported(SimdLevel(i))) return SimdLevel(i);
+    }
+    return std::min(maxLevel, SIMD_GENERIC);
+}
+
+/**
+ * Kernels chosen at the first call.
+ */
+inline const Kernels& kernels()
+{
+    static const Kernels k = getKernels(detectSimdLevel());
+    return k;
+}
+
+}} // namespace cybozu::simd
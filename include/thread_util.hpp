@@ -1038,6 +1038,9 @@ class ParallelConverter
     uint64_t popId_;
     std::map<uint64_t, T2> map_;
 
+    std::mutex epMu_;
+    std::exception_ptr ep_; // the first error thrown by converters.
+
     BoundedQueue<Src> inQ_;
     BoundedQueue<Dst> outQ_;
     ThreadRunnerSet workerSet_;
@@ -1051,6 +1054,7 @@ public:
         : holderP_(new Holder<T1, T2, Converter>(std::forward<Converter>(conv)))
         , pushMu_(), pushId_(0)
         , popMu_(), popId_(0), map_()
+        , epMu_(), ep_()
         , inQ_(2), outQ_(2)
         , workerSet_() {
     }
@@ -1076,11 +1080,17 @@ public:
      */
     void push(T1&& t1) {
         std::lock_guard<std::mutex> lock(pushMu_);
-        inQ_.push(Src { pushId_, std::move(t1) });
+        try {
+            inQ_.push(Src { pushId_, std::move(t1) });
+        } catch (typename BoundedQueue<Src>::FailedError &) {
+            rethrowConverterError();
+            throw;
+        }
         pushId_++;
     }
     /**
      * Do not call this function from multiple threads.
+     * If a converter has thrown an error, it will be rethrown.
      */
     bool pop(T2& t2) {
         std::lock_guard<std::mutex> lock(popMu_);
@@ -1089,13 +1099,18 @@ public:
             popId_++;
             return true;
         }
-        while (outQ_.pop(dst)) {
-            if (dst.id == popId_) {
-                t2 = std::move(dst.t2);
-                popId_++;
-                return true;
+        try {
+            while (outQ_.pop(dst)) {
+                if (dst.id == popId_) {
+                    t2 = std::move(dst.t2);
+                    popId_++;
+                    return true;
+                }
+                map_.insert(std::make_pair(dst.id, std::move(dst.t2)));
             }
-            map_.insert(std::make_pair(dst.id, std::move(dst.t2)));
+        } catch (typename BoundedQueue<Dst>::FailedError &) {
+            rethrowConverterError();
+            throw;
         }
         return false;
     }
@@ -1131,6 +1146,14 @@ private:
         std::lock_guard<std::mutex> lock(pushMu_);
         workerSet_.join();
     }
+    void rethrowConverterError() {
+        std::exception_ptr ep;
+        {
+            std::lock_guard<std::mutex> lock(epMu_);
+            ep = ep_;
+        }
+        if (ep) std::rethrow_exception(ep);
+    }
     void runWorker() noexcept try {
         Src src;
         Dst dst;
@@ -1140,6 +1163,10 @@ private:
             outQ_.push(std::move(dst));
         }
     } catch (...) {
+        {
+            std::lock_guard<std::mutex> lock(epMu_);
+            if (!ep_) ep_ = std::current_exception();
+        }
         inQ_.fail();
         outQ_.fail();
     }
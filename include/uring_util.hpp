@@ -0,0 +1,282 @@
+#pragma once
+/**
+ * @file
+ * @brief io_uring engine of asynchronous IO.
+ *
+ * This uses the system calls directly, so liburing is not required.
+ * The engine is compiled only if the kernel headers are of Linux 5.6 or later,
+ * where IORING_REGISTER_PROBE and IORING_OP_READ/WRITE are defined.
+ * CYBOZU_AIO_URING will be defined then.
+ */
+#include <vector>
+#include <cerrno>
+#include <cstring>
+#include <cassert>
+
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#endif
+
+/* IO_URING_OP_SUPPORTED is defined with IORING_REGISTER_PROBE since Linux 5.6. */
+#if defined(IO_URING_OP_SUPPORTED) && defined(__NR_io_uring_setup)
+#define CYBOZU_AIO_URING
+#endif
+
+#include "aio_engine.hpp"
+
+#ifdef CYBOZU_AIO_URING
+
+namespace cybozu {
+namespace aio {
+
+/**
+ * Submission and completion queues are shared with the kernel by mmap(),
+ * so completed IOs are got without system calls if they are already available.
+ *
+ * All the IOs are submitted by one io_uring_enter() call.
+ * The file descriptor is registered to the ring.
+ * IOs to/from registered buffers use READ_FIXED/WRITE_FIXED.
+ */
+class UringEngine : public AioEngine
+{
+private:
+    int fd_;
+    int ringFd_;
+    bool isFileRegistered_;
+
+    void *sqPtr_;
+    size_t sqSize_;
+    void *cqPtr_;
+    size_t cqSize_;
+    struct io_uring_sqe *sqes_;
+    size_t sqesSize_;
+
+    unsigned *sqTail_;
+    unsigned sqMask_;
+    unsigned *sqArray_;
+    unsigned *cqHead_;
+    unsigned *cqTail_;
+    unsigned cqMask_;
+    struct io_uring_cqe *cqes_;
+
+    std::vector<struct iovec> bufV_; // registered buffers.
+
+public:
+    UringEngine(int fd, size_t queueSize)
+        : fd_(fd), ringFd_(-1), isFileRegistered_(false)
+        , sqPtr_(MAP_FAILED), sqSize_(0), cqPtr_(MAP_FAILED), cqSize_(0)
+        , sqes_(static_cast<struct io_uring_sqe *>(MAP_FAILED)), sqesSize_(0)
+        , sqTail_(nullptr), sqMask_(0), sqArray_(nullptr)
+        , cqHead_(nullptr), cqTail_(nullptr), cqMask_(0), cqes_(nullptr)
+        , bufV_() {
+        try {
+            init(queueSize);
+        } catch (...) {
+            release();
+            throw;
+        }
+    }
+    ~UringEngine() noexcept {
+        release();
+    }
+    const char *name() const override { return "uring"; }
+    /**
+     * Registered buffers are replaced as a whole,
+     * so call this before submitting IOs.
+     */
+    bool registerBuffer(const void *buf, size_t size) override {
+        if (bufV_.size() >= UIO_MAXIOV) return false;
+        if (!bufV_.empty() && registerRing(IORING_UNREGISTER_BUFFERS, nullptr, 0) < 0) return false;
+        bufV_.push_back({const_cast<void *>(buf), size});
+        if (registerRing(IORING_REGISTER_BUFFERS, bufV_.data(), bufV_.size()) < 0) {
+            /* Typically RLIMIT_MEMLOCK is too small. */
+            bufV_.pop_back();
+            if (!bufV_.empty() && registerRing(IORING_REGISTER_BUFFERS, bufV_.data(), bufV_.size()) < 0) {
+                bufV_.clear();
+            }
+            return false;
+        }
+        return true;
+    }
+    void submit(const AioRequest *reqs, size_t nr) override {
+        unsigned tail = *sqTail_; // only this thread updates the tail.
+        for (size_t i = 0; i < nr; i++) {
+            const unsigned idx = tail & sqMask_;
+            prepareSqe(sqes_[idx], reqs[i]);
+            sqArray_[idx] = idx;
+            tail++;
+        }
+        __atomic_store_n(sqTail_, tail, __ATOMIC_RELEASE);
+        size_t done = 0;
+        while (done < nr) {
+            const int ret = ioUringEnter(nr - done, 0, 0);
+            if (ret < 0) {
+                if (errno == EINTR) continue;
+                throwLibcErrorWithNo("UringEngine: io_uring_enter failed.", errno);
+            }
+            if (ret == 0) {
+                /* The kernel consumed no entry, so retrying would never progress. */
+                throw RT_ERR("UringEngine: io_uring_enter submitted no IO: %zu remaining.", nr - done);
+            }
+            done += ret;
+        }
+    }
+    size_t wait(size_t minNr, AioCompletion *out, size_t maxNr) override {
+        assert(minNr <= maxNr);
+        size_t nr = reap(out, maxNr);
+        while (nr < minNr) {
+            const int ret = ioUringEnter(0, minNr - nr, IORING_ENTER_GETEVENTS);
+            if (ret < 0 && errno != EINTR) {
+                throwLibcErrorWithNo("UringEngine: io_uring_enter failed.", errno);
+            }
+            nr += reap(out + nr, maxNr - nr);
+        }
+        return nr;
+    }
+    /**
+     * Submitted IOs can not be canceled synchronously.
+     */
+    bool cancel(uint32_t) override {
+        return false;
+    }
+    /**
+     * io_uring_setup() is available since Linux 5.1 but IORING_OP_READ/WRITE since 5.6,
+     * so the opcodes are probed. IORING_REGISTER_PROBE itself is available since 5.6.
+     * RETURN:
+     *   true if io_uring supports all the opcodes used in the system.
+     */
+    static bool isAvailable() {
+        struct io_uring_params p;
+        ::memset(&p, 0, sizeof(p));
+        const int fd = ::syscall(__NR_io_uring_setup, 1, &p);
+        if (fd < 0) return false;
+        const size_t nrOps = 256;
+        std::vector<char> buf(sizeof(struct io_uring_probe) + nrOps * sizeof(struct io_uring_probe_op));
+        struct io_uring_probe *probe = reinterpret_cast<struct io_uring_probe *>(buf.data());
+        const int ret = ::syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, nrOps);
+        ::close(fd);
+        if (ret < 0) return false;
+        for (int op : {IORING_OP_READ, IORING_OP_WRITE, IORING_OP_READ_FIXED, IORING_OP_WRITE_FIXED, IORING_OP_FSYNC}) {
+            if (op > probe->last_op || (probe->ops[op].flags & IO_URING_OP_SUPPORTED) == 0) return false;
+        }
+        return true;
+    }
+private:
+    void init(size_t queueSize) {
+        struct io_uring_params p;
+        ::memset(&p, 0, sizeof(p));
+        ringFd_ = ::syscall(__NR_io_uring_setup, unsigned(queueSize), &p);
+        if (ringFd_ < 0) {
+            throwLibcErrorWithNo("UringEngine: io_uring_setup failed.", errno);
+        }
+        sqSize_ = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        cqSize_ = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+        const bool isSingleMmap = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+        if (isSingleMmap) sqSize_ = cqSize_ = std::max(sqSize_, cqSize_);
+        sqPtr_ = mapRing(sqSize_, IORING_OFF_SQ_RING);
+        if (isSingleMmap) {
+            cqPtr_ = sqPtr_;
+        } else {
+            cqPtr_ = mapRing(cqSize_, IORING_OFF_CQ_RING);
+        }
+        sqesSize_ = p.sq_entries * sizeof(struct io_uring_sqe);
+        sqes_ = static_cast<struct io_uring_sqe *>(mapRing(sqesSize_, IORING_OFF_SQES));
+
+        char *sq = static_cast<char *>(sqPtr_);
+        sqTail_ = reinterpret_cast<unsigned *>(sq + p.sq_off.tail);
+        sqMask_ = *reinterpret_cast<unsigned *>(sq + p.sq_off.ring_mask);
+        sqArray_ = reinterpret_cast<unsigned *>(sq + p.sq_off.array);
+        char *cq = static_cast<char *>(cqPtr_);
+        cqHead_ = reinterpret_cast<unsigned *>(cq + p.cq_off.head);
+        cqTail_ = reinterpret_cast<unsigned *>(cq + p.cq_off.tail);
+        cqMask_ = *reinterpret_cast<unsigned *>(cq + p.cq_off.ring_mask);
+        cqes_ = reinterpret_cast<struct io_uring_cqe *>(cq + p.cq_off.cqes);
+
+        /* It saves fget()/fput() for each IO. */
+        isFileRegistered_ = registerRing(IORING_REGISTER_FILES, &fd_, 1) == 0;
+    }
+    void *mapRing(size_t size, off_t offset) {
+        void *ptr = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd_, offset);
+        if (ptr == MAP_FAILED) {
+            throwLibcErrorWithNo("UringEngine: mmap failed.", errno);
+        }
+        return ptr;
+    }
+    void release() noexcept {
+        if (sqes_ != MAP_FAILED) ::munmap(sqes_, sqesSize_);
+        if (cqPtr_ != MAP_FAILED && cqPtr_ != sqPtr_) ::munmap(cqPtr_, cqSize_);
+        if (sqPtr_ != MAP_FAILED) ::munmap(sqPtr_, sqSize_);
+        sqes_ = static_cast<struct io_uring_sqe *>(MAP_FAILED);
+        cqPtr_ = sqPtr_ = MAP_FAILED;
+        if (ringFd_ >= 0) ::close(ringFd_);
+        ringFd_ = -1;
+    }
+    int registerRing(unsigned opcode, const void *arg, unsigned nrArgs) {
+        return ::syscall(__NR_io_uring_register, ringFd_, opcode, arg, nrArgs);
+    }
+    int ioUringEnter(unsigned toSubmit, unsigned minComplete, unsigned flags) {
+        return ::syscall(__NR_io_uring_enter, ringFd_, toSubmit, minComplete, flags, nullptr, 0);
+    }
+    void prepareSqe(struct io_uring_sqe &sqe, const AioRequest &req) const {
+        ::memset(&sqe, 0, sizeof(sqe));
+        if (isFileRegistered_) {
+            sqe.fd = 0;
+            sqe.flags = IOSQE_FIXED_FILE;
+        } else {
+            sqe.fd = fd_;
+        }
+        sqe.user_data = req.slot;
+        if (req.type == AIO_TYPE_FLUSH) {
+            sqe.opcode = IORING_OP_FSYNC;
+            sqe.fsync_flags = IORING_FSYNC_DATASYNC;
+            return;
+        }
+        const bool isRead = req.type == AIO_TYPE_READ;
+        sqe.off = req.oft;
+        sqe.addr = reinterpret_cast<uintptr_t>(req.buf);
+        sqe.len = req.size;
+        const size_t bufIdx = findBuffer(req.buf, req.size);
+        if (bufIdx < bufV_.size()) {
+            sqe.opcode = isRead ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+            sqe.buf_index = bufIdx;
+        } else {
+            sqe.opcode = isRead ? IORING_OP_READ : IORING_OP_WRITE;
+        }
+    }
+    size_t findBuffer(const char *buf, size_t size) const {
+        for (size_t i = 0; i < bufV_.size(); i++) {
+            const char *p = static_cast<const char *>(bufV_[i].iov_base);
+            if (p <= buf && buf + size <= p + bufV_[i].iov_len) return i;
+        }
+        return bufV_.size();
+    }
+    /**
+     * Get available completions without system calls.
+     */
+    size_t reap(AioCompletion *out, size_t maxNr) {
+        unsigned head = *cqHead_; // only this thread updates the head.
+        const unsigned tail = __atomic_load_n(cqTail_, __ATOMIC_ACQUIRE);
+        size_t nr = 0;
+        while (head != tail && nr < maxNr) {
+            const struct io_uring_cqe &cqe = cqes_[head & cqMask_];
+            out[nr].slot = uint32_t(cqe.user_data);
+            out[nr].res = cqe.res;
+            nr++;
+            head++;
+        }
+        __atomic_store_n(cqHead_, head, __ATOMIC_RELEASE);
+        return nr;
+    }
+};
+
+} // namespace aio
+} // namespace cybozu
+
+#endif // CYBOZU_AIO_URING
@@ -24,6 +24,8 @@
 
 #include <sys/time.h>
 
+#include "simd_kernels.hpp"
+
 #ifdef _MSC_VER
 #define UNUSED
 #define DEPRECATED
@@ -422,29 +424,8 @@ void printList(const C &c)
 
 inline bool isAllZero(const void *data, size_t size)
 {
-#if 1
-    // Faster implementation.
-    uint64_t x;
-    const char *p = (const char *)data;
-    while (sizeof(x) <= size) {
-        ::memcpy(&x, p, sizeof(x));
-        if (x != 0) return false;
-        p += sizeof(x);
-        size -= sizeof(x);
-    }
-    while (size > 0) {
-        if (*(p++)) return false;
-        size--;
-    }
-    return true;
-#else
-    const char *p = (const char *)data;
-    while (size > 0) {
-        if (*(p++)) return false;
-        size--;
-    }
-    return true;
-#endif
+    if (size < 64) return simd::isAllZeroScalar(data, size);
+    return simd::kernels().isAllZero(data, size);
 }
 
 inline void parseStrVec(
@@ -730,7 +730,7 @@ class SyncOpt(object):
     Synchronization option.
     This is used for optional arguments of archive-info and replicate command.
     '''
-    def __init__(self, cmprOpt=None, delayS=0, maxWdiffMergeSizeU='1G', bulkSizeU='64K'):
+    def __init__(self, cmprOpt=None, delayS=0, maxWdiffMergeSizeU='1G', bulkSizeU='64K', useMerkleHash=False):
         '''
         cmprOpt :: CompressOpt or None - compression option.
         delayS :: int             - delay to forward diffs from proxy to archive [sec].
@@ -738,6 +738,7 @@ class SyncOpt(object):
                                     Unit suffix like '1G' is allowed.
         bulkSizeU :: str          - bulk size [byte]. can be like '64K'.
                                     Unit suffix like '64K' is allowed.
+        useMerkleHash :: bool     - use merkle hash trees for hash-repl.
         '''
         if cmprOpt is None:
             cmprOpt = CompressOpt()
@@ -745,10 +746,12 @@ class SyncOpt(object):
         verify_type(delayS, int)
         verify_size_unit(maxWdiffMergeSizeU)
         verify_size_unit(bulkSizeU)
+        verify_type(useMerkleHash, bool)
         self.cmprOpt = cmprOpt
         self.delayS = delayS
         self.maxWdiffMergeSizeU = maxWdiffMergeSizeU
         self.bulkSizeU = bulkSizeU
+        self.useMerkleHash = useMerkleHash
 
     def getArchiveInfoArgs(self):
         '''
@@ -760,9 +763,11 @@ class SyncOpt(object):
         '''
         return :: [str]
         '''
-        return [str(self.cmprOpt), self.maxWdiffMergeSizeU, self.bulkSizeU]
+        return [str(self.cmprOpt), self.maxWdiffMergeSizeU, self.bulkSizeU,
+                '1' if self.useMerkleHash else '0']
     def __str__(self):
-        return "cmpr={} merge={} bulk={}".format(self.cmprOpt, self.maxWdiffMergeSizeU, self.bulkSizeU)
+        return "cmpr={} merge={} bulk={} merkle={}".format(
+            self.cmprOpt, self.maxWdiffMergeSizeU, self.bulkSizeU, self.useMerkleHash)
 
 
 ########################################
@@ -2999,7 +3004,7 @@ class Controller(object):
             raise Exception('wait_for_resize:failed',
                             ax.name, vol, oldSizeMb, sizeMb, curSizeMb)
 
-    def get_block_hash(self, ax, vol, gid, bulkSizeU='64K', scanSizeU=None):
+    def get_block_hash(self, ax, vol, gid, bulkSizeU='64K', scanSizeU=None, hashAlgo=None):
         '''
         Get block hash for virtual
         ax :: ServerParams - archive server.
@@ -3008,6 +3013,7 @@ class Controller(object):
         bulkSizeU :: str - bulk size hash calculation (with unit suffix)
         scanSizeU :: str - scanning size (with unit suffix).
                            It must not exceeds the device size.
+        hashAlgo :: str  - 'murmur3' or 'xxh3'. None means 'murmur3'.
         return :: str - hash value as a string.
         '''
         verify_server_kind(ax, [K_ARCHIVE])
@@ -3016,8 +3022,11 @@ class Controller(object):
         verify_size_unit(bulkSizeU)
         verify_size_unit(scanSizeU, allowNone=True)
         args = ['bhash', vol, str(gid), bulkSizeU]
-        if scanSizeU is not None:
-            args.append(scanSizeU)
+        if scanSizeU is not None or hashAlgo is not None:
+            args.append('0' if scanSizeU is None else scanSizeU)
+        if hashAlgo is not None:
+            verify_type(hashAlgo, str)
+            args.append(hashAlgo)
         return self.run_ctl(ax, args)
 
     def get_ts_delta(self, ax):
@@ -1,13 +1,19 @@
 #include "aio2_util.hpp"
+#include "aio_util.hpp"
 #include "fileio.hpp"
 
+namespace {
+
+const uint32_t ANY_KEY = 0; // key 0 is never used.
+
+} // namespace
+
 void Aio2::AioData::init(uint32_t key, int type, off_t oft, walb::AlignedArray&& buf)
 {
     this->key = key;
     this->type = type;
-    ::memset(&iocb, 0, sizeof(iocb));
+    state = PREPARED;
     this->oft = oft;
-    this->size = buf.size();
     this->buf = std::move(buf);
     err = 0;
 }
@@ -18,12 +24,22 @@ void Aio2::init(int fd, size_t queueSize)
         throw cybozu::Exception("Aio2: do not call init() more than once");
     }
     assert(fd > 0);
+    if (queueSize == 0 || queueSize > MAX_QUEUE_SIZE) {
+        throw cybozu::Exception("Aio2: bad queue size") << queueSize;
+    }
     fd_ = fd;
     queueSize_ = queueSize;
-    int err = ::io_queue_init(queueSize_, &ctx_);
-    if (err < 0) {
-        throw cybozu::Exception("Aio2 init failed") << cybozu::ErrorNo(-err);
+    engine_ = cybozu::aio::createAioEngine(fd, queueSize, queueSize, cybozu::aio::getDefaultAioBackend());
+    slots_.resize(queueSize);
+    for (size_t i = 0; i < queueSize; i++) {
+        slots_[i].key = i; // generation 0 is never used.
+        slots_[i].state = FREE;
+        freeV_.push_back(queueSize - 1 - i);
     }
+    submitQ_.reserve(queueSize);
+    completedV_.reserve(queueSize);
+    reqV_.reserve(queueSize);
+    complV_.resize(queueSize);
 }
 
 uint32_t Aio2::prepareRead(off_t oft, size_t size)
@@ -32,13 +48,7 @@ uint32_t Aio2::prepareRead(off_t oft, size_t size)
         --nrIOs_;
         throw cybozu::Exception("prepareRead: queue is full");
     }
-    const uint32_t key = key_++;
-    AioDataPtr iop(new AioData());
-    iop->init(key, 0, oft, walb::AlignedArray(size));
-    ::io_prep_pread(&iop->iocb, fd_, iop->buf.data(), size, oft);
-    ::memcpy(&iop->iocb.data, &key, sizeof(key));
-    pushToSubmitQ(std::move(iop));
-    return key;
+    return prepare(cybozu::aio::AIO_TYPE_READ, oft, walb::AlignedArray(size));
 }
 
 uint32_t Aio2::prepareWrite(off_t oft, walb::AlignedArray&& buf)
@@ -47,113 +57,133 @@ uint32_t Aio2::prepareWrite(off_t oft, walb::AlignedArray&& buf)
         --nrIOs_;
         throw cybozu::Exception("prepareWrite: queue is full");
     }
-    const uint32_t key = key_++;
-    AioDataPtr iop(new AioData());
-    const size_t size = buf.size();
-    iop->init(key, 1, oft, std::move(buf));
-    ::io_prep_pwrite(&iop->iocb, fd_, iop->buf.data(), size, oft);
-    ::memcpy(&iop->iocb.data, &key, sizeof(key));
-    pushToSubmitQ(std::move(iop));
-    return key;
+    return prepare(cybozu::aio::AIO_TYPE_WRITE, oft, std::move(buf));
+}
+
+uint32_t Aio2::prepare(int type, off_t oft, walb::AlignedArray&& buf)
+{
+    AutoLock lk(mutex_);
+    assert(!freeV_.empty());
+    const uint32_t idx = freeV_.back();
+    freeV_.pop_back();
+    AioData &io = slots_[idx];
+    uint32_t gen = (io.key >> SLOT_BITS) + 1;
+    if ((gen << SLOT_BITS) >> SLOT_BITS != gen) gen = 1;
+    io.init((gen << SLOT_BITS) | idx, type, oft, std::move(buf));
+    submitQ_.push_back(idx);
+    return io.key;
 }
 
 void Aio2::submit()
 {
-    std::vector<AioDataPtr> submitQ;
-    {
-        AutoLock lk(mutex_);
-        submitQ = std::move(submitQ_);
-        submitQ_.clear();
-    }
-    const size_t nr = submitQ.size();
-    std::vector<struct iocb *> iocbs(nr);
-    for (size_t i = 0; i < nr; i++) {
-        iocbs[i] = &submitQ[i]->iocb;
-    }
-    {
-        AutoLock lk(mutex_);
-        for (size_t i = 0; i < nr; i++) {
-            AioDataPtr iop = std::move(submitQ[i]);
-            const uint32_t key = iop->key;
-            pendingIOs_.emplace(key, std::move(iop));
-        }
-    }
-    size_t done = 0;
-    while (done < nr) {
-        int err = ::io_submit(ctx_, nr - done, &iocbs[done]);
-        if (err < 0) {
-            throw cybozu::Exception("Aio2 submit failed") << cybozu::ErrorNo(-err);
-        }
-        done += err;
+    AutoLock lk(mutex_);
+    const size_t nr = submitQ_.size();
+    if (nr == 0) return;
+    reqV_.clear();
+    for (const uint32_t idx : submitQ_) {
+        AioData &io = slots_[idx];
+        io.state = PENDING;
+        reqV_.push_back({idx, io.type, io.oft, io.buf.size(), io.buf.data()});
     }
+    submitQ_.clear();
+    nrPending_ += nr;
+    engine_->submit(reqV_.data(), nr);
 }
 
 walb::AlignedArray Aio2::waitFor(uint32_t key)
 {
     verifyKeyExists(key);
-    AioDataPtr iop;
-    while (!popCompleted(key, iop)) {
-        waitDetail();
+    AioData io;
+    while (!popCompleted(key, io)) {
+        waitDetail(key);
     }
-    verifyNoError(*iop);
     --nrIOs_;
-    return std::move(iop->buf);
+    verifyNoError(io);
+    return std::move(io.buf);
 }
 
 walb::AlignedArray Aio2::waitAny(uint32_t* keyP)
 {
-    AioDataPtr iop;
-    while (!popCompletedAny(iop)) {
-        waitDetail();
+    AioData io;
+    while (!popCompletedAny(io)) {
+        waitDetail(ANY_KEY);
     }
-    verifyNoError(*iop);
     --nrIOs_;
-    if (keyP) *keyP = iop->key;
-    return std::move(iop->buf);
+    verifyNoError(io);
+    if (keyP) *keyP = io.key;
+    return std::move(io.buf);
 }
 
-bool Aio2::popCompleted(uint32_t key, AioDataPtr& iop)
+bool Aio2::popCompleted(uint32_t key, AioData& io)
 {
     AutoLock lk(mutex_);
-    Umap::iterator it = completedIOs_.find(key);
-    if (it == completedIOs_.end()) return false;
-    iop = std::move(it->second);
-    assert(iop->key == key);
-    completedIOs_.erase(it);
+    const uint32_t idx = getSlot(key);
+    AioData &io0 = slots_[idx];
+    if (io0.state == PENDING) return false;
+    if (io0.state != COMPLETED) {
+        throw cybozu::Exception("waitFor: key not found") << key;
+    }
+    io.key = io0.key;
+    io.err = io0.err;
+    io.buf = std::move(io0.buf);
+    removeCompleted(idx);
     return true;
 }
 
-bool Aio2::popCompletedAny(AioDataPtr& iop)
+bool Aio2::popCompletedAny(AioData& io)
 {
     AutoLock lk(mutex_);
-    if (completedIOs_.empty()) return false;
-    Umap::iterator it = completedIOs_.begin();
-    iop = std::move(it->second);
-    completedIOs_.erase(it);
+    if (completedV_.empty()) return false;
+    const uint32_t idx = completedV_.back();
+    AioData &io0 = slots_[idx];
+    io.key = io0.key;
+    io.err = io0.err;
+    io.buf = std::move(io0.buf);
+    removeCompleted(idx);
     return true;
 }
 
-size_t Aio2::waitDetail(size_t minNr)
+void Aio2::removeCompleted(uint32_t idx)
 {
-    size_t maxNr = nrIOs_;
-    if (maxNr < minNr) maxNr = minNr;
-    std::vector<struct io_event> ioEvents(maxNr);
-    int nr = ::io_getevents(ctx_, minNr, maxNr, &ioEvents[0], NULL);
-    if (nr < 0) {
-        throw cybozu::Exception("io_getevents failed") << cybozu::ErrorNo(-nr);
+    const size_t i = slots_[idx].completedIdx;
+    assert(completedV_[i] == idx);
+    completedV_[i] = completedV_.back();
+    slots_[completedV_[i]].completedIdx = i;
+    completedV_.pop_back();
+    slots_[idx].state = FREE;
+    freeV_.push_back(idx);
+}
+
+/**
+ * Completions are got only in this function with waitMutex_,
+ * so checking the target again here prevents waiting for an IO
+ * whose completion has been got by another thread.
+ *
+ * @key the IO to wait for, or ANY_KEY.
+ */
+void Aio2::waitDetail(uint32_t key)
+{
+    AutoLock waitLk(waitMutex_);
+    {
+        AutoLock lk(mutex_);
+        if (key == ANY_KEY) {
+            if (!completedV_.empty() || nrPending_ == 0) return;
+        } else {
+            if (slots_[getSlot(key)].state != PENDING) return;
+        }
     }
+    const size_t nr = engine_->wait(1, complV_.data(), complV_.size());
     AutoLock lk(mutex_);
-    for (int i = 0; i < nr; i++) {
-        const uint32_t key = getKeyFromEvent(ioEvents[i]);
-        Umap::iterator it = pendingIOs_.find(key);
-        assert(it != pendingIOs_.end());
-        AioDataPtr& iop = it->second;
-        assert(iop->key == key);
-        iop->err = ioEvents[i].res;
-        completedIOs_.emplace(key, std::move(iop));
-        pendingIOs_.erase(it);
+    for (size_t i = 0; i < nr; i++) {
+        const uint32_t idx = complV_[i].slot;
+        AioData &io = slots_[idx];
+        assert(io.state == PENDING);
+        io.state = COMPLETED;
+        io.err = complV_[i].res;
+        io.completedIdx = completedV_.size();
+        completedV_.push_back(idx);
     }
-    return nr;
+    nrPending_ -= nr;
 }
 
 void Aio2::verifyNoError(const AioData& io) const
@@ -164,7 +194,7 @@ void Aio2::verifyNoError(const AioData& io) const
     if (io.err < 0) {
         throw cybozu::Exception("Aio2: IO failed") << io.key << cybozu::ErrorNo(-io.err);
     }
-    assert(io.iocb.u.c.nbytes == static_cast<uint>(io.err));
+    assert(io.buf.size() == static_cast<uint>(io.err));
 }
 
 void Aio2::waitAll()
@@ -173,11 +203,11 @@ void Aio2::waitAll()
         size_t size;
         {
             AutoLock lk(mutex_);
-            size = pendingIOs_.size();
+            size = nrPending_;
         }
         if (size == 0) break;
         try {
-            waitDetail();
+            waitDetail(ANY_KEY);
         } catch (...) {
             break;
         }
@@ -2,65 +2,84 @@
 
 #include "walb_types.hpp"
 #include "cybozu/exception.hpp"
+#include "aio_engine.hpp"
 
 #include <memory>
 #include <mutex>
-#include <unordered_map>
+#include <vector>
 #include <cinttypes>
 #include <atomic>
 
-#include <libaio.h>
-
 /**
  * Thread-safe aio manager.
+ *
+ * Each IO uses one of 'queueSize' slots allocated at init().
+ * The IO engine is chosen by cybozu::aio::getDefaultAioBackend().
  */
 class Aio2
 {
+    enum State {
+        FREE = 0,
+        PREPARED,
+        PENDING,
+        COMPLETED,
+    };
     struct AioData {
         uint32_t key;
         int type;
-        struct iocb iocb;
+        State state;
         off_t oft;
-        size_t size;
         walb::AlignedArray buf;
         int err;
+        size_t completedIdx; // index in completedV_.
 
         void init(uint32_t key, int type, off_t oft, walb::AlignedArray&& buf);
     };
 
     int fd_;
     size_t queueSize_;
-    io_context_t ctx_;
-
-    using AioDataPtr = std::unique_ptr<AioData>;
-    using Umap = std::unordered_map<uint, AioDataPtr>;
+    std::unique_ptr<cybozu::aio::AioEngine> engine_;
 
+    /* mutex_ protects the slots and engine_->submit(). */
     mutable std::mutex mutex_;
-    std::vector<AioDataPtr> submitQ_;
-    Umap pendingIOs_;
-    Umap completedIOs_;
+    std::vector<AioData> slots_;
+    std::vector<uint32_t> freeV_;
+    std::vector<uint32_t> submitQ_;
+    std::vector<uint32_t> completedV_;
+    std::vector<cybozu::aio::AioRequest> reqV_;
+    size_t nrPending_;
+
+    /* waitMutex_ serializes engine_->wait(). */
+    std::mutex waitMutex_;
+    std::vector<cybozu::aio::AioCompletion> complV_;
 
     std::atomic_flag isInitialized_;
-    std::atomic_flag isReleased_;
-    std::atomic<uint> key_;
     std::atomic<size_t> nrIOs_;
 
+    static constexpr uint32_t SLOT_BITS = 16;
+    static constexpr uint32_t SLOT_MASK = (1U << SLOT_BITS) - 1;
+    /* io_uring_setup() rejects more entries (IORING_MAX_ENTRIES). */
+    static constexpr size_t MAX_QUEUE_SIZE = 32768;
+
     using AutoLock = std::lock_guard<std::mutex>;
 
 public:
     Aio2()
         : fd_(0)
         , queueSize_(0)
+        , engine_()
         , mutex_()
+        , slots_()
+        , freeV_()
         , submitQ_()
-        , pendingIOs_()
-        , completedIOs_()
+        , completedV_()
+        , reqV_()
+        , nrPending_(0)
+        , waitMutex_()
+        , complV_()
         , isInitialized_()
-        , isReleased_()
-        , key_(0)
         , nrIOs_(0) {
         isInitialized_.clear();
-        isReleased_.clear();
     }
     /**
      * You must call this in the thread which will run the destructor.
@@ -70,7 +89,7 @@ public:
     ~Aio2() noexcept try {
         if (isInitialized_.test_and_set()) {
             waitAll();
-            release();
+            engine_.reset();
         }
     } catch (...) {
     }
@@ -80,32 +99,25 @@ public:
     walb::AlignedArray waitFor(uint32_t key);
     walb::AlignedArray waitAny(uint32_t* keyP = nullptr);
 private:
+    uint32_t prepare(int type, off_t oft, walb::AlignedArray&& buf);
+    uint32_t getSlot(uint32_t key) const {
+        const uint32_t idx = key & SLOT_MASK;
+        if (idx >= slots_.size() || slots_[idx].key != key || (key >> SLOT_BITS) == 0) {
+            throw cybozu::Exception("Aio2: key not found") << key;
+        }
+        return idx;
+    }
     void verifyKeyExists(uint32_t key) {
         AutoLock lk(mutex_);
-        if (completedIOs_.find(key) == completedIOs_.cend() &&
-            pendingIOs_.find(key) == pendingIOs_.cend()) {
+        const State st = slots_[getSlot(key)].state;
+        if (st != PENDING && st != COMPLETED) {
             throw cybozu::Exception("waitFor: key not found") << key;
         }
     }
-    void release() {
-        if (isReleased_.test_and_set()) return;
-        int err = ::io_queue_release(ctx_);
-        if (err < 0) {
-            throw cybozu::Exception("Aio: release failed") << cybozu::ErrorNo(-err);
-        }
-    }
-    void pushToSubmitQ(AioDataPtr&& iop) {
-        AutoLock lk(mutex_);
-        submitQ_.push_back(std::move(iop));
-    }
-    bool popCompleted(uint32_t key, AioDataPtr& iop);
-    bool popCompletedAny(AioDataPtr& iop);
-    size_t waitDetail(size_t minNr = 1);
-    static uint32_t getKeyFromEvent(struct io_event &event) {
-        uint32_t key;
-        ::memcpy(&key, &event.obj->data, sizeof(key));
-        return key;
-    }
+    bool popCompleted(uint32_t key, AioData& io);
+    bool popCompletedAny(AioData& io);
+    void removeCompleted(uint32_t idx);
+    void waitDetail(uint32_t key);
     void verifyNoError(const AioData& io) const;
     void waitAll();
 };
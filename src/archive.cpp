@@ -28,9 +28,10 @@ void prepareRawFullScanner(
 }
 
 
-void prepareVirtualFullScanner(
+bool prepareVirtualFullScanner(
     VirtualFullScanner &virt, ArchiveVolState &volSt,
-    ArchiveVolInfo &volInfo, uint64_t sizeLb, const MetaSnap &snap)
+    ArchiveVolInfo &volInfo, uint64_t sizeLb, const MetaSnap &snap, MetaState *baseStP,
+    uint64_t startLb)
 {
     MetaState st0;
     bool isCold = false;
@@ -51,7 +52,44 @@ void prepareVirtualFullScanner(
         });
     LOGs.debug() << "virtual-full-scan-diffs" << st0 << diffV;
 
-    virt.init(std::move(fileR), std::move(fileV));
+    virt.setCache(getArchiveGlobal().diffCache);
+    virt.init(std::move(fileR), std::move(fileV), startLb);
+    if (baseStP) *baseStP = st0;
+    return !isCold;
+}
+
+/**
+ * Load the cached merkle hash tree of the snapshot image or build it.
+ * Trees of clean snapshots will be cached.
+ */
+bool prepareMerkleHashTree(
+    MerkleHashTree &tree, packet::Packet &pkt, ArchiveVolState &volSt, ArchiveVolInfo &volInfo,
+    uint64_t sizeLb, uint64_t bulkLb, uint32_t fanout, uint32_t hashSeed, cybozu::murmurhash3::HashAlgo hashAlgo,
+    const MetaSnap &snap, std::atomic<uint64_t> &progressLb, Logger &logger)
+{
+    const std::string &volId = volInfo.volId;
+    if (snap.isClean()) {
+        try {
+            if (volInfo.getMerkleHashTree(snap.gidB, tree) &&
+                tree.hasSameShape(sizeLb, bulkLb, fanout, hashSeed, hashAlgo)) {
+                logger.info() << "merkle-hash-tree cache hit" << volId << snap.gidB;
+                return true;
+            }
+        } catch (std::exception &e) {
+            logger.warn() << "merkle-hash-tree cache broken" << volId << snap.gidB << e.what();
+        }
+    }
+    cybozu::Stopwatch stopwatch;
+    tree.init(sizeLb, bulkLb, fanout, hashSeed, hashAlgo);
+    VirtualFullScanner virt;
+    prepareVirtualFullScanner(virt, volSt, volInfo, sizeLb, snap);
+    if (!buildMerkleHashTree(pkt, tree, virt, volSt.stopState, ga.ps, progressLb, ga.hashSyncCpu)) {
+        return false;
+    }
+    if (snap.isClean()) volInfo.setMerkleHashTree(snap.gidB, tree);
+    logger.info() << "merkle-hash-tree built" << volId << snap << cybozu::murmurhash3::hashAlgoName(hashAlgo)
+                  << tree.getMemoryUsage() << util::getElapsedTimeStr(stopwatch.get());
+    return true;
 }
 
 
@@ -69,19 +107,24 @@ void verifyApplicable(const std::string& volId, uint64_t gid)
 
 bool applyOpenedDiffs(std::vector<cybozu::util::File>&& fileV, cybozu::lvm::Lv& lv,
                       const std::atomic<int>& stopState,
-                      DiffStatistics& statIn, DiffStatistics& statOut, std::string& memUsageStr)
+                      DiffStatistics& statIn, DiffStatistics& statOut, std::string& memUsageStr,
+                      BlockHashIndex *index, std::atomic<uint64_t> *progressLb,
+                      metrics::VolMetrics *metrics)
 {
     const char *const FUNC = __func__;
     statOut.clear();
     DiffMerger merger;
+    merger.setCache(getArchiveGlobal().diffCache);
+    merger.setReadAheadThreads(std::max<size_t>(ga.mergeCmpr.numCpu, DEFAULT_MERGE_READ_AHEAD_CPU));
     merger.addWdiffs(std::move(fileV));
     merger.prepare();
     DiffRecIo recIo;
     const std::string lvPathStr = lv.path().str();
-    cybozu::util::File file(lvPathStr, O_RDWR);
-    AlignedArray zero;
+    cybozu::util::File file(lvPathStr, O_RDWR | O_DIRECT);
+    AsyncDiffIoWriter writer(file.fd(), ga.discardType, ga.applyBufferSize);
     const uint64_t lvSnapSizeLb = lv.sizeLb();
-    double t0 = cybozu::util::getTime();
+    const double tBegin = cybozu::util::getTime();
+    double t0 = tBegin;
     while (merger.getAndRemove(recIo)) {
         if (stopState == ForceStopping || ga.ps.isForceShutdown()) {
             return false;
@@ -95,7 +138,9 @@ bool applyOpenedDiffs(std::vector<cybozu::util::File>&& fileV, cybozu::lvm::Lv&
         if (ioAddress + ioBlocks > lvSnapSizeLb) {
             throw cybozu::Exception(FUNC) << "out of range" << ioAddress << ioBlocks << lvSnapSizeLb;
         }
-        issueIo(file, ga.discardType, rec, recIo.io().data(), zero);
+        writer.add(rec, recIo.data());
+        if (index) index->markDirty(ioAddress, ioBlocks);
+        if (progressLb) *progressLb = ioAddress;
 
         const double t1 = cybozu::util::getTime();
         if (t1 - t0 > PROGRESS_INTERVAL_SEC) {
@@ -104,8 +149,15 @@ bool applyOpenedDiffs(std::vector<cybozu::util::File>&& fileV, cybozu::lvm::Lv&
             t0 = t1;
         }
     }
+    writer.waitForAll();
+    metrics::StageTimer fsyncTimer(metrics, metrics::FSYNC);
     file.fdatasync();
+    fsyncTimer.record((statOut.normLb + statOut.zeroLb) * LOGICAL_BLOCK_SIZE);
+    if (index) index->updateDirty(file);
     file.close();
+    const double elapsed = cybozu::util::getTime() - tBegin;
+    LOGs.info() << FUNC << "write-io-stat" << lvPathStr << writer.getStat()
+                << cybozu::util::formatString("%.3fsec", elapsed);
     statIn = merger.statIn();
     statOut.wdiffNr = -1;
     statOut.dataSize = -1;
@@ -136,14 +188,32 @@ static ApplyState applyDiffsToVolumeOnce(const std::string& volId, const MetaSta
 
     LOGs.debug() << "apply-diffs" << volId << st0 << diffV;
     const MetaState st01 = beginApplying(st0, diffV);
-    volInfo.setMetaState(st01);
-
     cybozu::lvm::Lv lv = lvC.getLv(); // base image.
+
+    /*
+     * The block hash index will be updated only for the chunks the diffs touch
+     * if it is valid for the base image now.
+     */
+    BlockHashIndex index;
+    bool useIndex = false;
+    {
+        UniqueLock ul(volSt.mu);
+        volInfo.setMetaState(st01);
+        if (volInfo.openBlockHashIndex(index)) {
+            useIndex = index.isValidFor(st0, lv.sizeLb());
+            index.invalidate();
+        }
+    }
+
     DiffStatistics statIn, statOut;
     std::string memUsageStr;
-    if (!applyOpenedDiffs(std::move(fileV), lv, volSt.stopState, statIn, statOut, memUsageStr)) {
+    metrics::VolMetrics &vm = getArchiveGlobal().metrics.get(volId);
+    metrics::StageTimer timer(&vm, metrics::APPLY);
+    if (!applyOpenedDiffs(std::move(fileV), lv, volSt.stopState, statIn, statOut, memUsageStr,
+                          useIndex ? &index : nullptr, nullptr, &vm)) {
         return ApplyState::FAILURE;
     }
+    timer.record(statIn.dataSize);
     st1 = endApplying(st01, diffV);
 
     LOGs.info() << "apply-mergeIn " << volId << statIn;
@@ -151,7 +221,11 @@ static ApplyState applyDiffsToVolumeOnce(const std::string& volId, const MetaSta
     LOGs.info() << "apply-mergeMemUsage" << volId << memUsageStr;
     LOGs.info() << "apply-status" << volId << st0 << st1;
 
-    volInfo.setMetaState(st1);
+    {
+        UniqueLock ul(volSt.mu);
+        volInfo.setMetaState(st1);
+        if (useIndex) index.validate(st1);
+    }
     volInfo.removeBeforeGid(st1.snapB.gidB);
     return ApplyState::REMAINING;
 }
@@ -227,6 +301,96 @@ void verifyMergeable(const std::string &volId, uint64_t gid)
 }
 
 
+static void setupIndexedDiffStreamWriter(IndexedDiffStreamWriter &writer, const ArchiveVolInfo &volInfo)
+{
+    writer.setUnitLb(ga.indexedDiffUnitSize / LOGICAL_BLOCK_SIZE);
+    writer.setSpillDir(volInfo.volDir.str());
+    writer.setFsyncIntervalSize(ga.fsyncIntervalSize);
+}
+
+
+/**
+ * Store a received sorted wdiff in indexed format.
+ */
+static void convertToIndexedDiff(cybozu::util::File &fileR, int outFd, const cybozu::Uuid &uuid,
+                                 const ArchiveVolInfo &volInfo)
+{
+    IndexedDiffStreamWriter writer;
+    setupIndexedDiffStreamWriter(writer, volInfo);
+    DiffFileHeader fileH;
+    fileH.setUuid(uuid);
+    fileR.lseek(fileH.getSize(), SEEK_SET);
+    writer.start(outFd, fileH, ga.mergeCmpr);
+    try {
+        AlignedArray packHBuf(WALB_DIFF_PACK_SIZE);
+        DiffPackHeader &packH = *reinterpret_cast<DiffPackHeader *>(packHBuf.data());
+        AlignedArray pack;
+        for (;;) {
+            packH.readFrom(fileR);
+            if (packH.isEnd()) break;
+            pack.resize(WALB_DIFF_PACK_SIZE + packH.total_size);
+            ::memcpy(pack.data(), packHBuf.data(), packHBuf.size());
+            fileR.read(pack.data() + WALB_DIFF_PACK_SIZE, packH.total_size);
+            writer.addPack(pack.data(), pack.size());
+        }
+        writer.finalize();
+    } catch (...) {
+        writer.fail();
+        throw;
+    }
+}
+
+
+/**
+ * Receive a wdiff and save it as the file of diff.
+ * If canResume is true, the end address of IOs received before is sent first,
+ * then the rest will be appended to the partial wdiff
+ * so that a broken transfer can be resumed at pack granularity.
+ * Otherwise the partial wdiff is discarded because the client will send all the IOs.
+ * It will be stored in indexed format if ga.storeIndexedDiff is true.
+ *
+ * RETURN:
+ *   false if force stopped. The partial wdiff will be kept.
+ */
+static bool recvWdiff(packet::Packet &pkt, ArchiveVolState &volSt, ArchiveVolInfo &volInfo,
+                      MetaDiff &diff, const cybozu::Uuid &uuid, bool canResume, Logger &logger)
+{
+    const char *const FUNC = __func__;
+    cybozu::util::File fileW;
+    if (!canResume) volInfo.removePartialWdiff();
+    const uint64_t resumeAddr = volInfo.initPartialWdiffResume(diff, uuid, fileW);
+    if (canResume) {
+        pkt.write(resumeAddr);
+        pkt.flush();
+    }
+    if (resumeAddr > 0) {
+        logger.info() << FUNC << "resume" << volInfo.volId << diff << resumeAddr;
+    }
+    metrics::VolMetrics &vm = getArchiveGlobal().metrics.get(volInfo.volId);
+    if (!wdiffTransferServer(pkt, fileW.fd(), volSt.stopState, ga.ps, ga.fsyncIntervalSize, &vm)) {
+        return false;
+    }
+    metrics::StageTimer fsyncTimer(&vm, metrics::FSYNC);
+    fileW.fdatasync();
+    fsyncTimer.record();
+    const cybozu::FilePath fPath = volInfo.getDiffPath(diff);
+    if (ga.storeIndexedDiff) {
+        cybozu::TmpFile tmpFile(volInfo.volDir.str());
+        convertToIndexedDiff(fileW, tmpFile.fd(), uuid, volInfo);
+        diff.dataSize = cybozu::FileStat(tmpFile.fd()).size();
+        tmpFile.save(fPath.str());
+    } else {
+        diff.dataSize = cybozu::FileStat(fileW.fd()).size();
+        fileW.close();
+        if (!volInfo.getPartialWdiffPath().rename(fPath)) {
+            throw cybozu::Exception(FUNC) << "rename failed" << fPath << cybozu::ErrorNo();
+        }
+    }
+    volInfo.removePartialWdiff();
+    return true;
+}
+
+
 bool mergeDiffs(const std::string &volId, uint64_t gidB, bool isSize, uint64_t param3)
 {
     ArchiveVolState& volSt = getArchiveVolState(volId);
@@ -253,23 +417,24 @@ bool mergeDiffs(const std::string &volId, uint64_t gidB, bool isSize, uint64_t p
     LOGs.debug() << "merge-diffs" << mergedDiff << diffV;
     const cybozu::FilePath diffPath = volInfo.getDiffPath(mergedDiff);
     cybozu::TmpFile tmpFile(volInfo.volDir.str());
+    /* The shared cache is not used to avoid flushing it by this one-pass scan. */
     DiffMerger merger;
+    merger.setReadAheadThreads(std::max<size_t>(ga.mergeCmpr.numCpu, DEFAULT_MERGE_READ_AHEAD_CPU));
     merger.addWdiffs(std::move(fileV));
-    merger.prepare();
-
-    SortedDiffWriter writer;
-    writer.setFd(tmpFile.fd());
-    DiffFileHeader wdiffH = merger.header();
-    writer.writeHeader(wdiffH);
-    DiffRecIo recIo;
-    while (merger.getAndRemove(recIo)) {
-        if (volSt.stopState == ForceStopping || ga.ps.isForceShutdown()) {
-            return false;
-        }
-        // TODO: currently we can use snappy only.
-        writer.compressAndWriteDiff(recIo.record(), recIo.io().data());
+    auto shouldStop = [&]() {
+        return volSt.stopState == ForceStopping || ga.ps.isForceShutdown();
+    };
+    metrics::StageTimer timer(&getArchiveGlobal().metrics.get(volId), metrics::MERGE);
+    bool isOk;
+    if (ga.storeIndexedDiff) {
+        IndexedDiffStreamWriter writer;
+        setupIndexedDiffStreamWriter(writer, volInfo);
+        isOk = merger.mergeToIndexedFdInParallel(tmpFile.fd(), writer, ga.mergeCmpr, shouldStop);
+    } else {
+        isOk = merger.mergeToFdInParallel(tmpFile.fd(), ga.mergeCmpr, shouldStop);
     }
-    writer.close();
+    if (!isOk) return false;
+    timer.record(merger.statIn().dataSize);
 
     mergedDiff.dataSize = cybozu::FileStat(tmpFile.fd()).size();
     tmpFile.save(diffPath.str());
@@ -277,7 +442,7 @@ bool mergeDiffs(const std::string &volId, uint64_t gidB, bool isSize, uint64_t p
     volInfo.removeDiffs(diffV);
 
     LOGs.info() << "merge-mergeIn " << volId << merger.statIn();
-    LOGs.info() << "merge-mergeOut" << volId << writer.getStat();
+    LOGs.info() << "merge-mergeOut" << volId << merger.statOut();
     LOGs.info() << "merge-mergeMemUsage" << volId << merger.memUsageStr();
     LOGs.info() << "merged" << volId << diffV.size() << mergedDiff;
     return true;
@@ -332,22 +497,126 @@ static void removeColdSnapshotsExceptTheLatestOne(ArchiveVolInfo &volInfo)
 }
 
 
+/**
+ * Open wdiffs in the order of pathV.
+ * RETURN:
+ *   false if some of them could not be opened, e.g. removed by merge or gc meanwhile.
+ */
+static bool tryOpenWdiffs(std::vector<cybozu::util::File> &fileV, const StrVec &pathV)
+{
+    fileV.clear();
+    for (const std::string &path : pathV) {
+        cybozu::util::File file;
+        if (!file.open(path, O_RDONLY)) {
+            LOGs.warn() << __func__ << "open failed" << path;
+            fileV.clear();
+            return false;
+        }
+        fileV.push_back(std::move(file));
+    }
+    return true;
+}
+
+
+/**
+ * Merge wdiffs in tiers with the same settings as merge command
+ * until the number of wdiffs does not exceed ga.maxOpenDiffs.
+ * Each merge opens its input wdiffs just before it.
+ *
+ * @pathV wdiff paths in the order to apply.
+ * @tmpFileV temporary merged wdiffs referred in pathV.
+ * @isMissing set true if some input wdiff could not be opened.
+ * RETURN:
+ *   false if force stopped or some input wdiff is missing.
+ */
+static bool mergeDiffsInTiers(ArchiveVolState &volSt, const ArchiveVolInfo &volInfo, StrVec &pathV,
+                              std::vector<std::unique_ptr<cybozu::TmpFile> > &tmpFileV, bool &isMissing)
+{
+    const char *const FUNC = __func__;
+    if (ga.maxOpenDiffs == 0) return true;
+    const size_t fanIn = std::max<size_t>(ga.maxOpenDiffs, 2);
+    auto shouldStop = [&]() {
+        return volSt.stopState == ForceStopping || ga.ps.isForceShutdown();
+    };
+    metrics::VolMetrics &vm = getArchiveGlobal().metrics.get(volInfo.volId);
+    const size_t nr = pathV.size();
+    return mergeWdiffsInTiers(
+        pathV, tmpFileV, fanIn, volInfo.volDir.str(), [&](const StrVec &inPathV, int outFd) {
+            std::vector<cybozu::util::File> inV;
+            if (!tryOpenWdiffs(inV, inPathV)) {
+                isMissing = true;
+                return false;
+            }
+            /* The shared cache is not used to avoid flushing it by this one-pass scan. */
+            DiffMerger merger;
+            merger.setReadAheadThreads(std::max<size_t>(ga.mergeCmpr.numCpu, DEFAULT_MERGE_READ_AHEAD_CPU));
+            merger.addWdiffs(std::move(inV));
+            metrics::StageTimer timer(&vm, metrics::MERGE);
+            bool isOk;
+            if (ga.storeIndexedDiff) {
+                IndexedDiffStreamWriter writer;
+                setupIndexedDiffStreamWriter(writer, volInfo);
+                isOk = merger.mergeToIndexedFdInParallel(outFd, writer, ga.mergeCmpr, shouldStop);
+            } else {
+                isOk = merger.mergeToFdInParallel(outFd, ga.mergeCmpr, shouldStop);
+            }
+            if (!isOk) return false;
+            timer.record(merger.statIn().dataSize);
+            LOGs.info() << FUNC << "merged" << volInfo.volId << inPathV.size() << "of" << nr << merger.statOut();
+            return true;
+        });
+}
+
+
+/**
+ * Apply all the diffs to restore a snapshot at once.
+ * If there are more than ga.maxOpenDiffs wdiffs, they will be merged in tiers first.
+ * Apply or merge may remove some of the wdiffs meanwhile,
+ * then the diff list will be got again and the merges will be retried.
+ * The temporary lv is not touched until all the wdiffs to apply are opened.
+ */
 static bool applyDiffsToRestore(
     const std::string& volId, cybozu::lvm::Lv& tmpLv,
     const MetaState& st0, uint64_t gid, MetaState& st1)
 {
+    const char *const FUNC = __func__;
     ArchiveVolState &volSt = getArchiveVolState(volId);
     ArchiveVolInfo volInfo = getArchiveVolInfo(volId);
 
+    const int maxRetryNum = 10;
+    int retryNum = 0;
+    MetaDiffVec diffV;
     std::vector<cybozu::util::File> fileV;
-    MetaDiffVec diffV = tryOpenDiffs(
-        fileV, volInfo, !allowEmpty, st0, [&](const MetaState &st) {
-            return volSt.diffMgr.getDiffListToRestore(st, gid, ga.maxOpenDiffs);
-        });
-    LOGs.debug() << "restore-diffs" << volId << st0 << diffV;
+    for (;;) {
+        diffV = volSt.diffMgr.getDiffListToRestore(st0, gid);
+        if (diffV.empty()) {
+            throw cybozu::Exception(FUNC) << "diffV empty" << volId;
+        }
+        LOGs.debug() << "restore-diffs" << volId << st0 << diffV;
+        StrVec pathV;
+        for (const MetaDiff &diff : diffV) {
+            pathV.push_back(volInfo.getDiffPath(diff).str());
+        }
+        /* Opened fds keep the temporary wdiffs readable after they are removed. */
+        std::vector<std::unique_ptr<cybozu::TmpFile> > tmpFileV;
+        bool isMissing = false;
+        if (mergeDiffsInTiers(volSt, volInfo, pathV, tmpFileV, isMissing)) {
+            if (tryOpenWdiffs(fileV, pathV)) break;
+        } else if (!isMissing) {
+            return false;
+        }
+        retryNum++;
+        if (retryNum == maxRetryNum) {
+            throw cybozu::Exception(FUNC) << "exceed max retry" << volId;
+        }
+    }
+
     DiffStatistics statIn, statOut;
     std::string memUsageStr;
-    if (!applyOpenedDiffs(std::move(fileV), tmpLv, volSt.stopState, statIn, statOut, memUsageStr)) {
+    volSt.progressLb = 0;
+    ZeroResetter resetter(volSt.progressLb);
+    if (!applyOpenedDiffs(std::move(fileV), tmpLv, volSt.stopState, statIn, statOut, memUsageStr,
+                          nullptr, &volSt.progressLb, &getArchiveGlobal().metrics.get(volId))) {
         return false;
     }
     st1 = apply(st0, diffV);
@@ -384,6 +653,9 @@ bool restore(const std::string &volId, uint64_t gid)
     bool useCold;
     MetaState st0 = volInfo.getMetaStateForRestore(gid, useCold);
 
+    metrics::VolMetrics &vm = getArchiveGlobal().metrics.get(volId);
+    metrics::StageTimer wholeTimer(&vm, metrics::RESTORE);
+    metrics::StageTimer lvmTimer(&vm, metrics::LVM);
     cybozu::lvm::Lv tmpLv;
     if (isThinpool()) {
         if (useCold) {
@@ -402,6 +674,7 @@ bool restore(const std::string &volId, uint64_t gid)
         const uint64_t snapSizeLb = uint64_t((double)(baseLv.sizeLb()) * 1.2);
         tmpLv = baseLv.createLvSnap(tmpLvName, true, snapSizeLb);
     }
+    lvmTimer.record();
     TmpSnapshotDeleter deleter{baseLv.vgName(), tmpLvName};
 
     bool noNeedToApply =
@@ -412,6 +685,7 @@ bool restore(const std::string &volId, uint64_t gid)
         noNeedToApply = !st1.isApplying && st1.snapB.isClean() && st1.snapB.gidB == gid;
         st0 = st1;
     }
+    lvmTimer.reset();
     if (isThinpool()) {
         util::flushBdevBufs(tmpLv.path().str());
         const std::string coldLvName = volInfo.coldSnapshotName(gid);
@@ -422,11 +696,13 @@ bool restore(const std::string &volId, uint64_t gid)
         }
     }
     cybozu::lvm::Lv snapLv = cybozu::lvm::renameLv(baseLv.vgName(), tmpLvName, targetName);
+    lvmTimer.record();
     lvC.addRestored(gid, snapLv);
     util::flushBdevBufs(snapLv.path().str());
     if (isThinpool() && ga.keepOneColdSnapshot) {
         removeColdSnapshotsExceptTheLatestOne(volInfo);
     }
+    wholeTimer.record(tmpLv.sizeLb() * LOGICAL_BLOCK_SIZE);
     return true;
 }
 
@@ -512,7 +788,7 @@ void dbgVerifyLatestMetaState(const std::string &volId)
 }
 
 
-void backupServer(protocol::ServerParams &p, bool isFull)
+void backupServer(protocol::ServerParams &p, bool isFull, bool isParallel, bool hasHashAlgo)
 {
     const char *const FUNC = __func__;
     ProtocolLogger logger(ga.nodeId, p.clientId);
@@ -525,7 +801,12 @@ void backupServer(protocol::ServerParams &p, bool isFull)
     pkt.read(sizeLb);
     pkt.read(curTime);
     pkt.read(bulkLb);
-    logger.debug() << hostType << volId << sizeLb << curTime << bulkLb;
+    CompressOpt cmpr;
+    if (isParallel) pkt.read(cmpr);
+    std::string hashAlgoStr = cybozu::murmurhash3::hashAlgoName(cybozu::murmurhash3::HASH_ALGO_MURMUR3);
+    if (hasHashAlgo) pkt.read(hashAlgoStr);
+    const cybozu::murmurhash3::HashAlgo hashAlgo = cybozu::murmurhash3::selectHashAlgo(hashAlgoStr);
+    logger.debug() << hostType << volId << sizeLb << curTime << bulkLb << isParallel << cmpr << hashAlgoStr;
 
     ForegroundCounterTransaction foregroundTasksTran;
     ArchiveVolState &volSt = getArchiveVolState(volId);
@@ -554,6 +835,7 @@ void backupServer(protocol::ServerParams &p, bool isFull)
     ZeroResetter resetter(volSt.progressLb);
     pkt.write(msgAccept);
     if (!isFull) pkt.write(snapFrom);
+    if (hasHashAlgo) pkt.write(std::string(cybozu::murmurhash3::hashAlgoName(hashAlgo)));
     pkt.flush();
     cybozu::Uuid uuid;
     pkt.read(uuid);
@@ -569,24 +851,30 @@ void backupServer(protocol::ServerParams &p, bool isFull)
     if (st != stFrom) {
         throw cybozu::Exception(FUNC) << "state is not" << stFrom << "but" << st;
     }
-    logger.info() << (isFull ? dirtyFullSyncPN : dirtyHashSyncPN) << "started" << volId;
+    logger.info() << (isFull ? dirtyFullSyncPN : dirtyHashSyncPN) << "started" << volId
+                  << (isFull ? "" : cybozu::murmurhash3::hashAlgoName(hashAlgo));
     bool isOk;
     std::unique_ptr<cybozu::TmpFile> tmpFileP;
     if (isFull) {
         volInfo.createLv(sizeLb);
         const std::string lvPath = volSt.lvCache.getLv().path().str();
         const bool skipZero = isThinpool();
-        isOk = dirtyFullSyncServer(pkt, lvPath, 0, sizeLb, bulkLb, volSt.stopState, ga.ps, volSt.progressLb,
-                                   skipZero, ga.fsyncIntervalSize);
+        if (isParallel) {
+            isOk = parallelDirtyFullSyncServer(pkt, lvPath, 0, sizeLb, bulkLb, volSt.stopState, ga.ps, volSt.progressLb,
+                                               skipZero, ga.fsyncIntervalSize, cmpr.type, ga.fullSyncCpu);
+        } else {
+            isOk = dirtyFullSyncServer(pkt, lvPath, 0, sizeLb, bulkLb, volSt.stopState, ga.ps, volSt.progressLb,
+                                       skipZero, ga.fsyncIntervalSize);
+        }
     } else {
         doAutoResizeIfNecessary(volSt, volInfo, sizeLb);
         const uint32_t hashSeed = curTime;
         tmpFileP.reset(new cybozu::TmpFile(volInfo.volDir.str()));
         VirtualFullScanner virt;
         archive_local::prepareVirtualFullScanner(virt, volSt, volInfo, sizeLb, snapFrom);
-        isOk = dirtyHashSyncServer(pkt, virt, sizeLb, bulkLb, uuid, hashSeed, true, tmpFileP->fd(),
+        isOk = dirtyHashSyncServer(pkt, virt, sizeLb, bulkLb, uuid, hashSeed, hashAlgo, true, tmpFileP->fd(),
                                    ga.discardType, volSt.stopState, ga.ps, volSt.progressLb,
-                                   ga.fsyncIntervalSize);
+                                   ga.fsyncIntervalSize, ga.hashSyncCpu);
         if (isOk) {
             logger.info() << "hash-backup-mergeIn " << volId << virt.statIn();
             logger.info() << "hash-backup-mergeOut" << volId << virt.statOut();
@@ -777,30 +1065,74 @@ bool runFullReplServer(
 }
 
 
+/**
+ * Hash-repl with merkle hash trees.
+ * Only the ranges where the trees differ will be read and compared chunk by chunk.
+ */
+bool runMerkleHashReplClient(
+    const std::string &volId, ArchiveVolState &volSt, ArchiveVolInfo &volInfo,
+    packet::Packet &pkt, uint64_t sizeLb, uint64_t bulkLb, const MetaDiff &diff,
+    cybozu::murmurhash3::HashAlgo hashAlgo, Logger &logger)
+{
+    MerkleHashTree tree;
+    std::atomic<uint64_t> progressLb(0);
+    if (!archive_local::prepareMerkleHashTree(
+            tree, pkt, volSt, volInfo, sizeLb, bulkLb, MERKLE_HASH_FANOUT, MERKLE_HASH_SEED, hashAlgo,
+            diff.snapE, progressLb, logger)) {
+        return false;
+    }
+    merkleHashSyncReady(pkt);
+    const AddrRangeVec ranges = merkleHashDescentClient(pkt, tree);
+    logger.info() << "hash-repl-client-merkle" << volId << ranges.size() << getTotalRangeSize(ranges);
+
+    VirtualFullScanner virt;
+    archive_local::prepareVirtualFullScanner(virt, volSt, volInfo, sizeLb, diff.snapE);
+    const std::atomic<uint64_t> fullScanLbPerSec(0);
+    return dirtyHashSyncClient(pkt, virt, ranges, bulkLb, tree.hashSeed(), tree.hashAlgo(), volSt.stopState, ga.ps,
+                               fullScanLbPerSec, ga.hashSyncCpu);
+}
+
+
 bool runHashReplClient(
     const std::string &volId, ArchiveVolState &volSt, ArchiveVolInfo &volInfo, const std::string &dstId,
-    packet::Packet &pkt, uint64_t bulkLb, const MetaDiff &diff, Logger &logger)
+    packet::Packet &pkt, uint64_t bulkLb, const MetaDiff &diff, bool useMerkleHash,
+    cybozu::murmurhash3::HashAlgo hashAlgo, Logger &logger)
 {
     const char *const FUNC = __func__;
     const uint64_t sizeLb = volSt.lvCache.getLv().sizeLb();
     const cybozu::Uuid uuid = volInfo.getUuid();
-    const uint32_t hashSeed = diff.timestamp;
+    // The seed of merkle hash trees is fixed to reuse the cached ones.
+    const uint32_t hashSeed = useMerkleHash ? MERKLE_HASH_SEED : diff.timestamp;
     pkt.write(sizeLb);
     pkt.write(bulkLb);
     pkt.write(diff);
     pkt.write(uuid);
     pkt.write(hashSeed);
+    if (useMerkleHash) pkt.write(MERKLE_HASH_FANOUT);
     pkt.flush();
-    logger.debug() << "hash-repl-client" << sizeLb << bulkLb << diff << uuid << hashSeed;
+    logger.debug() << "hash-repl-client" << sizeLb << bulkLb << diff << uuid << hashSeed << useMerkleHash
+                   << cybozu::murmurhash3::hashAlgoName(hashAlgo);
 
     std::string res;
     pkt.read(res);
     if (res != msgOk) throw cybozu::Exception(FUNC) << "not ok" << res;
 
+    if (useMerkleHash) {
+        if (!runMerkleHashReplClient(volId, volSt, volInfo, pkt, sizeLb, bulkLb, diff, hashAlgo, logger)) {
+            logger.warn() << "hash-repl-client force-stopped" << volId;
+            return false;
+        }
+        logger.info() << "hash-repl-client done" << volId;
+        const MetaState dstMetaSt(diff.snapE, diff.timestamp);
+        getArchiveGlobal().remoteSnapshotManager.update(volId, dstId, dstMetaSt);
+        return true;
+    }
+
     VirtualFullScanner virt;
     archive_local::prepareVirtualFullScanner(virt, volSt, volInfo, sizeLb, diff.snapE);
     const std::atomic<uint64_t> fullScanLbPerSec(0);
-    if (!dirtyHashSyncClient(pkt, virt, sizeLb, bulkLb, hashSeed, volSt.stopState, ga.ps, fullScanLbPerSec)) {
+    if (!dirtyHashSyncClient(pkt, virt, sizeLb, bulkLb, hashSeed, hashAlgo, volSt.stopState, ga.ps, fullScanLbPerSec,
+                             ga.hashSyncCpu)) {
         logger.warn() << "hash-repl-client force-stopped" << volId;
         return false;
     }
@@ -816,24 +1148,53 @@ bool runHashReplClient(
 }
 
 
+/**
+ * The tree will be the one of diff.snapE if successfully done.
+ */
+bool runMerkleHashReplServer(
+    ArchiveVolState &volSt, ArchiveVolInfo &volInfo, packet::Packet &pkt,
+    uint64_t sizeLb, uint64_t bulkLb, uint32_t fanout, const MetaDiff &diff, const cybozu::Uuid &uuid,
+    uint32_t hashSeed, cybozu::murmurhash3::HashAlgo hashAlgo, int outFd, MerkleHashTree &tree, Logger &logger)
+{
+    if (!archive_local::prepareMerkleHashTree(
+            tree, pkt, volSt, volInfo, sizeLb, bulkLb, fanout, hashSeed, hashAlgo, diff.snapB,
+            volSt.progressLb, logger)) {
+        return false;
+    }
+    merkleHashSyncReady(pkt);
+    const AddrRangeVec ranges = merkleHashDescentServer(pkt, tree);
+    logger.info() << "hash-repl-server-merkle" << volInfo.volId << ranges.size() << getTotalRangeSize(ranges);
+
+    VirtualFullScanner virt;
+    archive_local::prepareVirtualFullScanner(virt, volSt, volInfo, sizeLb, diff.snapB);
+    return dirtyHashSyncServer(pkt, virt, ranges, bulkLb, uuid, hashSeed, hashAlgo, true, outFd,
+                               ga.discardType, volSt.stopState, ga.ps, volSt.progressLb,
+                               ga.fsyncIntervalSize, ga.hashSyncCpu);
+}
+
+
 bool runHashReplServer(
     const std::string &volId, ArchiveVolState &volSt, ArchiveVolInfo &volInfo,
-    packet::Packet &pkt, UniqueLock &ul, const MetaState &metaSt, Logger &logger)
+    packet::Packet &pkt, UniqueLock &ul, const MetaState &metaSt, bool useMerkleHash,
+    cybozu::murmurhash3::HashAlgo hashAlgo, Logger &logger)
 {
     const char *const FUNC = __func__;
     uint64_t sizeLb, bulkLb;
     MetaDiff diff;
     cybozu::Uuid uuid;
     uint32_t hashSeed;
+    uint32_t fanout = 0;
     try {
         pkt.read(sizeLb);
         pkt.read(bulkLb);
         pkt.read(diff);
         pkt.read(uuid);
         pkt.read(hashSeed);
-        logger.debug() << "hash-repl-server" << sizeLb << bulkLb << diff << uuid << hashSeed;
+        if (useMerkleHash) pkt.read(fanout);
+        logger.debug() << "hash-repl-server" << sizeLb << bulkLb << diff << uuid << hashSeed << fanout;
         if (sizeLb == 0) throw cybozu::Exception(FUNC) << "sizeLb must not be 0";
         if (bulkLb == 0) throw cybozu::Exception(FUNC) << "bulkLb must not be 0";
+        if (useMerkleHash && fanout < 2) throw cybozu::Exception(FUNC) << "bad fanout" << fanout;
         if (!canApply(metaSt, diff)) {
             throw cybozu::Exception(FUNC) << "diff is not applicable" << metaSt << diff;
         }
@@ -852,11 +1213,19 @@ bool runHashReplServer(
     StateMachineTransaction tran(volSt.sm, aArchived, atReplSync, FUNC);
     ul.unlock();
     VirtualFullScanner virt;
-    archive_local::prepareVirtualFullScanner(virt, volSt, volInfo, sizeLb, diff.snapB);
+    MerkleHashTree tree;
     cybozu::TmpFile tmpFile(volInfo.volDir.str());
-    if (!dirtyHashSyncServer(pkt, virt, sizeLb, bulkLb, uuid, hashSeed, true, tmpFile.fd(),
-                             ga.discardType, volSt.stopState, ga.ps, volSt.progressLb,
-                             ga.fsyncIntervalSize)) {
+    bool isOk;
+    if (useMerkleHash) {
+        isOk = runMerkleHashReplServer(
+            volSt, volInfo, pkt, sizeLb, bulkLb, fanout, diff, uuid, hashSeed, hashAlgo, tmpFile.fd(), tree, logger);
+    } else {
+        archive_local::prepareVirtualFullScanner(virt, volSt, volInfo, sizeLb, diff.snapB);
+        isOk = dirtyHashSyncServer(pkt, virt, sizeLb, bulkLb, uuid, hashSeed, hashAlgo, true, tmpFile.fd(),
+                                   ga.discardType, volSt.stopState, ga.ps, volSt.progressLb,
+                                   ga.fsyncIntervalSize, ga.hashSyncCpu);
+    }
+    if (!isOk) {
         logger.warn() << "hash-repl-server force-stopped" << volId;
         return false;
     }
@@ -869,9 +1238,13 @@ bool runHashReplServer(
     volInfo.setUuid(uuid);
     volSt.updateLastSyncTime();
     tran.commit(aArchived);
-    logger.info() << "hash-repl-server-mergeIn " << volId << virt.statIn();
-    logger.info() << "hash-repl-server-mergeOut" << volId << virt.statOut();
-    logger.info() << "hash-repl-server-mergeMemUsage" << volId << virt.memUsageStr();
+    if (useMerkleHash) {
+        if (diff.snapE.isClean()) volInfo.setMerkleHashTree(diff.snapE.gidB, tree);
+    } else {
+        logger.info() << "hash-repl-server-mergeIn " << volId << virt.statIn();
+        logger.info() << "hash-repl-server-mergeOut" << volId << virt.statOut();
+        logger.info() << "hash-repl-server-mergeMemUsage" << volId << virt.memUsageStr();
+    }
     const std::string elapsed = util::getElapsedTimeStr(stopwatch.get());
     logger.info() << "hash-repl-server done" << volId << elapsed;
     return true;
@@ -880,7 +1253,7 @@ bool runHashReplServer(
 
 bool runNoMergeDiffReplClient(
     const std::string &volId, ArchiveVolState &volSt, ArchiveVolInfo &volInfo, const std::string &dstId,
-    packet::Packet &pkt, const MetaSnap &srvLatestSnap, Logger &logger)
+    packet::Packet &pkt, const MetaSnap &srvLatestSnap, bool canResume, Logger &logger)
 {
     const char *const FUNC = __func__;
     MetaState st0 = volInfo.getMetaState();
@@ -914,8 +1287,26 @@ bool runNoMergeDiffReplClient(
     std::string res;
     pkt.read(res);
     if (res != msgOk) throw cybozu::Exception(FUNC) << "not ok" << res;
+    uint64_t resumeAddr = 0;
+    if (canResume) pkt.read(resumeAddr);
 
-    if (!wdiffTransferNoMergeClient(pkt, fileR, fileH, volSt.stopState, ga.ps)) {
+    bool sent;
+    if (resumeAddr == 0) {
+        sent = wdiffTransferNoMergeClient(pkt, fileR, fileH, volSt.stopState, ga.ps);
+    } else {
+        /* The merger can skip IOs before resumeAddr efficiently. */
+        logger.info() << "diff-repl-nomerge-client resume" << volId << diff << resumeAddr;
+        fileR.lseek(0, SEEK_SET);
+        DiffMerger merger;
+        merger.setCache(getArchiveGlobal().diffCache);
+        merger.setStartAddr(resumeAddr);
+        merger.addWdiffs(std::move(fileV));
+        merger.prepare();
+        DiffStatistics statOut;
+        sent = wdiffTransferClient(pkt, merger, CompressOpt(), volSt.stopState, ga.ps, statOut,
+                                   &getArchiveGlobal().metrics.get(volId));
+    }
+    if (!sent) {
         logger.warn() << "diff-repl-nomerge-client force-stopped" << volId;
         return false;
     }
@@ -931,7 +1322,8 @@ bool runNoMergeDiffReplClient(
 
 bool runDiffReplClient(
     const std::string &volId, ArchiveVolState &volSt, ArchiveVolInfo &volInfo, const std::string &dstId,
-    packet::Packet &pkt, const MetaSnap &srvLatestSnap, const CompressOpt &cmpr, uint64_t wdiffMergeSize, Logger &logger)
+    packet::Packet &pkt, const MetaSnap &srvLatestSnap, const CompressOpt &cmpr, uint64_t wdiffMergeSize,
+    bool canResume, Logger &logger)
 {
     const char *const FUNC = __func__;
     MetaState st0 = volInfo.getMetaState();
@@ -943,12 +1335,13 @@ bool runDiffReplClient(
 
     const MetaDiff mergedDiff = merge(diffV);
     LOGs.debug() << "diff-repl-diffs" << st0 << mergedDiff << diffV;
-    DiffMerger merger;
-    merger.addWdiffs(std::move(fileV));
-    merger.prepare();
+
+    /* The merged wdiff will have the uuid of the last wdiff. */
+    DiffFileHeader fileH;
+    fileH.readFrom(fileV.back());
+    fileV.back().lseek(0, SEEK_SET);
 
     const uint64_t sizeLb = volSt.lvCache.getLv().sizeLb();
-    const DiffFileHeader &fileH = merger.header();
     const uint32_t maxIoBlocks = 0; // unused
     const cybozu::Uuid uuid = fileH.getUuid();
     pkt.write(sizeLb);
@@ -961,9 +1354,19 @@ bool runDiffReplClient(
     std::string res;
     pkt.read(res);
     if (res != msgOk) throw cybozu::Exception(FUNC) << "not ok" << res;
+    uint64_t resumeAddr = 0;
+    if (canResume) pkt.read(resumeAddr);
+    if (resumeAddr > 0) logger.info() << "diff-repl-client resume" << volId << mergedDiff << resumeAddr;
+
+    DiffMerger merger;
+    merger.setCache(getArchiveGlobal().diffCache);
+    merger.setStartAddr(resumeAddr);
+    merger.addWdiffs(std::move(fileV));
+    merger.prepare();
 
     DiffStatistics statOut;
-    if (!wdiffTransferClient(pkt, merger, cmpr, volSt.stopState, ga.ps, statOut)) {
+    if (!wdiffTransferClient(pkt, merger, cmpr, volSt.stopState, ga.ps, statOut,
+                             &getArchiveGlobal().metrics.get(volId))) {
         logger.warn() << "diff-repl-client force-stopped" << volId;
         return false;
     }
@@ -982,7 +1385,7 @@ bool runDiffReplClient(
 
 bool runDiffReplServer(
     const std::string &volId, ArchiveVolState &volSt, ArchiveVolInfo &volInfo,
-    packet::Packet &pkt, UniqueLock &ul, const MetaState &metaSt, Logger &logger)
+    packet::Packet &pkt, UniqueLock &ul, const MetaState &metaSt, bool canResume, Logger &logger)
 {
     const char *const FUNC = __func__;
     uint64_t sizeLb;
@@ -1010,16 +1413,10 @@ bool runDiffReplServer(
     cybozu::Stopwatch stopwatch;
     StateMachineTransaction tran(volSt.sm, aArchived, atReplSync, FUNC);
     ul.unlock();
-    const cybozu::FilePath fPath = volInfo.getDiffPath(diff);
-    cybozu::TmpFile tmpFile(volInfo.volDir.str());
-    cybozu::util::File fileW(tmpFile.fd());
-    writeDiffFileHeader(fileW, uuid);
-    if (!wdiffTransferServer(pkt, tmpFile.fd(), volSt.stopState, ga.ps, ga.fsyncIntervalSize)) {
+    if (!recvWdiff(pkt, volSt, volInfo, diff, uuid, canResume, logger)) {
         logger.warn() << "diff-repl-server force-stopped" << volId;
         return false;
     }
-    diff.dataSize = cybozu::FileStat(tmpFile.fd()).size();
-    tmpFile.save(fPath.str());
     volSt.diffMgr.add(diff);
     volSt.setLatestMetaState(apply(metaSt, diff));
     dbgVerifyLatestMetaState(volId);
@@ -1037,7 +1434,7 @@ bool runDiffReplServer(
 
 bool runResyncReplClient(
     const std::string &volId, ArchiveVolState &volSt, ArchiveVolInfo &volInfo, const std::string &dstId,
-    packet::Packet &pkt, uint64_t bulkLb, Logger &logger)
+    packet::Packet &pkt, uint64_t bulkLb, cybozu::murmurhash3::HashAlgo hashAlgo, Logger &logger)
 {
     const char *const FUNC = __func__;
     const uint64_t sizeLb = volSt.lvCache.getLv().sizeLb();
@@ -1062,7 +1459,8 @@ bool runResyncReplClient(
     VirtualFullScanner virt;
     archive_local::prepareVirtualFullScanner(virt, volSt, volInfo, sizeLb, metaSt.snapB);
     const std::atomic<uint64_t> fullScanLbPerSec(0);
-    if (!dirtyHashSyncClient(pkt, virt, sizeLb, bulkLb, hashSeed, volSt.stopState, ga.ps, fullScanLbPerSec)) {
+    if (!dirtyHashSyncClient(pkt, virt, sizeLb, bulkLb, hashSeed, hashAlgo, volSt.stopState, ga.ps, fullScanLbPerSec,
+                             ga.hashSyncCpu)) {
         logger.warn() << "resync-repl-client force-stopped" << volId;
         return false;
     }
@@ -1079,7 +1477,7 @@ bool runResyncReplClient(
 
 bool runResyncReplServer(
     const std::string &volId, ArchiveVolState &volSt, ArchiveVolInfo &volInfo,
-    packet::Packet &pkt, UniqueLock &ul, Logger &logger)
+    packet::Packet &pkt, UniqueLock &ul, cybozu::murmurhash3::HashAlgo hashAlgo, Logger &logger)
 {
     const char *const FUNC = __func__;
     uint64_t sizeLb, bulkLb;
@@ -1127,9 +1525,9 @@ bool runResyncReplServer(
         cybozu::util::File writer(volSt.lvCache.getLv().path().str(), O_RDWR);
         /* Reader and writer indicates the same block device.
            We must have independent file descriptors for them. */
-        if (!dirtyHashSyncServer(pkt, reader, sizeLb, bulkLb, uuid, hashSeed, false, writer.fd(),
+        if (!dirtyHashSyncServer(pkt, reader, sizeLb, bulkLb, uuid, hashSeed, hashAlgo, false, writer.fd(),
                                  ga.discardType, volSt.stopState, ga.ps, volSt.progressLb,
-                                 ga.fsyncIntervalSize)) {
+                                 ga.fsyncIntervalSize, ga.hashSyncCpu)) {
             logger.warn() << "resync-repl-server force-stopped" << volId;
             return false;
         }
@@ -1150,7 +1548,8 @@ bool runResyncReplServer(
 
 
 bool runReplSyncClient(const std::string &volId, cybozu::Socket &sock, const HostInfoForRepl &hostInfo,
-                       bool isSize, uint64_t param, const std::string &dstId, Logger &logger)
+                       bool isSize, uint64_t param, const std::string &dstId, bool hasHashAlgo, bool canResume,
+                       Logger &logger)
 {
     const char *const FUNC = __func__;
     packet::Packet pkt(sock);
@@ -1161,6 +1560,7 @@ bool runReplSyncClient(const std::string &volId, cybozu::Socket &sock, const Hos
     cybozu::Uuid archiveUuid = volInfo.getArchiveUuid();
     pkt.write(archiveUuid);
     pkt.write(hostInfo.doResync);
+    if (hasHashAlgo) pkt.write(std::string(cybozu::murmurhash3::hashAlgoName(ga.hashAlgo)));
     pkt.flush();
 
     std::string res;
@@ -1168,6 +1568,13 @@ bool runReplSyncClient(const std::string &volId, cybozu::Socket &sock, const Hos
     if (res != msgAccept) {
         throw cybozu::Exception(FUNC) << "not accept" << volId << res;
     }
+    cybozu::murmurhash3::HashAlgo hashAlgo = cybozu::murmurhash3::HASH_ALGO_MURMUR3;
+    if (hasHashAlgo) {
+        std::string hashAlgoStr;
+        pkt.read(hashAlgoStr);
+        hashAlgo = cybozu::murmurhash3::parseHashAlgo(hashAlgoStr);
+    }
+    logger.debug() << "repl-sync-client hash algorithm" << volId << cybozu::murmurhash3::hashAlgoName(hashAlgo);
 
     bool runAtLeastOnce = false;
     int kind;
@@ -1182,7 +1589,7 @@ bool runReplSyncClient(const std::string &volId, cybozu::Socket &sock, const Hos
             throw cybozu::Exception(FUNC)
                 << "bad response: resync is not allowed" << volId;
         }
-        if (!runResyncReplClient(volId, volSt, volInfo, dstId, pkt, hostInfo.bulkLb, logger)) {
+        if (!runResyncReplClient(volId, volSt, volInfo, dstId, pkt, hostInfo.bulkLb, hashAlgo, logger)) {
             return false;
         }
         runAtLeastOnce = true;
@@ -1195,13 +1602,16 @@ bool runReplSyncClient(const std::string &volId, cybozu::Socket &sock, const Hos
         pkt.read(srvLatestState);
         const MetaSnap srvLatestSnap = srvLatestState.snapB;
         const MetaSnap cliLatestSnap = volSt.getLatestMetaState().snapB;
-        const int repl = volInfo.shouldDoRepl(srvLatestSnap, cliLatestSnap, isSize, param);
+        int repl = volInfo.shouldDoRepl(srvLatestSnap, cliLatestSnap, isSize, param);
+        if (repl == ArchiveVolInfo::DO_HASH_REPL && hostInfo.useMerkleHash) {
+            repl = ArchiveVolInfo::DO_MERKLE_HASH_REPL;
+        }
         logger.debug() << "srvLatestSnap" << srvLatestSnap << "cliLatestSnap" << cliLatestSnap
                        << repl;
         pkt.write(repl);
         pkt.flush();
         if (repl == ArchiveVolInfo::DONT_REPL) break;
-        if (repl == ArchiveVolInfo::DO_HASH_REPL) {
+        if (repl == ArchiveVolInfo::DO_HASH_REPL || repl == ArchiveVolInfo::DO_MERKLE_HASH_REPL) {
             const MetaState oldestMetaSt = volInfo.getOldestCleanState();
             const MetaSnap cliOldestSnap = oldestMetaSt.snapB;
             if (srvLatestSnap.gidB >= cliOldestSnap.gidB) {
@@ -1210,17 +1620,19 @@ bool runReplSyncClient(const std::string &volId, cybozu::Socket &sock, const Hos
             }
             MetaDiff diff(srvLatestSnap, cliOldestSnap, true, oldestMetaSt.timestamp);
             diff.isCompDiff = true;
-            if (!runHashReplClient(volId, volSt, volInfo, dstId, pkt, hostInfo.bulkLb, diff, logger)) {
+            const bool useMerkleHash = repl == ArchiveVolInfo::DO_MERKLE_HASH_REPL;
+            if (!runHashReplClient(volId, volSt, volInfo, dstId, pkt, hostInfo.bulkLb, diff,
+                                   useMerkleHash, hashAlgo, logger)) {
                 return false;
             }
         } else {
             if (hostInfo.dontMerge) {
                 if (!runNoMergeDiffReplClient(
-                        volId, volSt, volInfo, dstId, pkt, srvLatestSnap, logger)) return false;
+                        volId, volSt, volInfo, dstId, pkt, srvLatestSnap, canResume, logger)) return false;
             } else {
                 if (!runDiffReplClient(
                         volId, volSt, volInfo, dstId, pkt, srvLatestSnap,
-                        hostInfo.cmpr, hostInfo.maxWdiffMergeSize, logger)) return false;
+                        hostInfo.cmpr, hostInfo.maxWdiffMergeSize, canResume, logger)) return false;
             }
         }
         runAtLeastOnce = true;
@@ -1236,7 +1648,8 @@ bool runReplSyncClient(const std::string &volId, cybozu::Socket &sock, const Hos
 /**
  * ul is locked at the function beginning.
  */
-bool runReplSyncServer(const std::string &volId, cybozu::Socket &sock, UniqueLock &ul, Logger &logger)
+bool runReplSyncServer(const std::string &volId, cybozu::Socket &sock, UniqueLock &ul,
+                       bool hasHashAlgo, bool canResume, Logger &logger)
 {
     const char *const FUNC = __func__;
     packet::Packet pkt(sock);
@@ -1247,6 +1660,9 @@ bool runReplSyncServer(const std::string &volId, cybozu::Socket &sock, UniqueLoc
     pkt.read(archiveUuid);
     bool canResync;
     pkt.read(canResync);
+    std::string hashAlgoStr = cybozu::murmurhash3::hashAlgoName(cybozu::murmurhash3::HASH_ALGO_MURMUR3);
+    if (hasHashAlgo) pkt.read(hashAlgoStr);
+    const cybozu::murmurhash3::HashAlgo hashAlgo = cybozu::murmurhash3::selectHashAlgo(hashAlgoStr);
 
     int kind = DO_HASH_OR_DIFF_SYNC;
     const std::string state = volSt.sm.get();
@@ -1269,6 +1685,7 @@ bool runReplSyncServer(const std::string &volId, cybozu::Socket &sock, UniqueLoc
         throw cybozu::Exception(FUNC) << msg << volId;
     }
     pkt.write(msgAccept);
+    if (hasHashAlgo) pkt.write(std::string(cybozu::murmurhash3::hashAlgoName(hashAlgo)));
     pkt.write(kind);
     pkt.flush();
 
@@ -1277,7 +1694,7 @@ bool runReplSyncServer(const std::string &volId, cybozu::Socket &sock, UniqueLoc
             return false;
         }
     } else if (kind == DO_RESYNC) {
-        if (!runResyncReplServer(volId, volSt, volInfo, pkt, ul, logger)) {
+        if (!runResyncReplServer(volId, volSt, volInfo, pkt, ul, hashAlgo, logger)) {
             return false;
         }
     } else {
@@ -1292,10 +1709,13 @@ bool runReplSyncServer(const std::string &volId, cybozu::Socket &sock, UniqueLoc
         pkt.read(repl);
         if (repl == ArchiveVolInfo::DONT_REPL) break;
 
-        if (repl == ArchiveVolInfo::DO_HASH_REPL) {
-            if (!runHashReplServer(volId, volSt, volInfo, pkt, ul, latestMetaSt, logger)) return false;
+        if (repl == ArchiveVolInfo::DO_HASH_REPL || repl == ArchiveVolInfo::DO_MERKLE_HASH_REPL) {
+            const bool useMerkleHash = repl == ArchiveVolInfo::DO_MERKLE_HASH_REPL;
+            if (!runHashReplServer(volId, volSt, volInfo, pkt, ul, latestMetaSt, useMerkleHash, hashAlgo, logger)) {
+                return false;
+            }
         } else {
-            if (!runDiffReplServer(volId, volSt, volInfo, pkt, ul, latestMetaSt, logger)) return false;
+            if (!runDiffReplServer(volId, volSt, volInfo, pkt, ul, latestMetaSt, canResume, logger)) return false;
         }
     }
     packet::Ack(sock).sendFin();
@@ -1587,13 +2007,80 @@ void getBaseAll(protocol::GetCommandParams &p)
 }
 
 
+/**
+ * Build the block hash index of the base image and save it.
+ * Dummy messages are sent periodically to avoid socket timeout.
+ *
+ * RETURN:
+ *   false if force stopped or the base image has been changed during the build.
+ */
+static bool buildBlockHashIndex(
+    ArchiveVolState &volSt, ArchiveVolInfo &volInfo, const MetaState &baseSt, packet::StreamControl &ctrl)
+{
+    cybozu::lvm::Lv lv = volSt.lvCache.getLv();
+    cybozu::util::File file(lv.path().str(), O_RDONLY | O_DIRECT);
+    cybozu::TmpFile tmpFile(volInfo.volDir.str());
+    BlockHashIndex index;
+    index.create(tmpFile.fd(), lv.sizeLb(), BLOCK_HASH_INDEX_BULK_LB);
+
+    const uint64_t nrChunks = index.nrChunks();
+    const uint64_t step = 1024; // [chunks].
+    AlignedArray buf;
+    double t0 = cybozu::util::getTime();
+    for (uint64_t idx = 0; idx < nrChunks; idx += step) {
+        if (volSt.stopState == ForceStopping || ga.ps.isForceShutdown()) {
+            return false;
+        }
+        index.update(file, idx, std::min(idx + step, nrChunks), buf);
+        const double t1 = cybozu::util::getTime();
+        if (t1 - t0 > 1.0) { // to avoid timeout.
+            ctrl.dummy();
+            t0 = t1;
+        }
+    }
+    UniqueLock ul(volSt.mu);
+    const MetaState st = volInfo.getMetaState();
+    if (st != baseSt || st.timestamp != baseSt.timestamp) return false;
+    index.validate(baseSt);
+    tmpFile.save(volInfo.blockHashIndexPath());
+    return true;
+}
+
+
+/**
+ * Open the block hash index of the base image or build it.
+ *
+ * RETURN:
+ *   false if the index is not available.
+ */
+static bool prepareBlockHashIndex(
+    BlockHashIndex &index, ArchiveVolState &volSt, ArchiveVolInfo &volInfo,
+    const MetaState &baseSt, packet::StreamControl &ctrl, Logger &logger)
+{
+    if (baseSt.isApplying) return false;
+    const uint64_t devSizeLb = volSt.lvCache.getLv().sizeLb();
+    if (volInfo.openBlockHashIndex(index) && index.isValidFor(baseSt, devSizeLb)) return true;
+
+    cybozu::Stopwatch stopwatch;
+    if (!buildBlockHashIndex(volSt, volInfo, baseSt, ctrl)) return false;
+    logger.info() << "block-hash-index built" << volInfo.volId << baseSt
+                  << util::getElapsedTimeStr(stopwatch.get());
+    return volInfo.openBlockHashIndex(index) && index.isValidFor(baseSt, devSizeLb);
+}
+
+
 /**
  * Get block hash to verify block devices.
  * sizeLb: 0 means whole device size.
+ *
+ * Hashes of the base image chunks that the diffs do not touch
+ * will be taken from the block hash index without reading the base lv.
+ * The index holds murmur3 hashes only.
  */
 bool getBlockHash(
     const std::string &volId, uint64_t gid, uint64_t bulkLb, uint64_t sizeLb,
-    packet::Packet &pkt, Logger &, cybozu::murmurhash3::Hash &hash)
+    cybozu::murmurhash3::HashAlgo hashAlgo,
+    packet::Packet &pkt, Logger &logger, cybozu::murmurhash3::Hash &hash)
 {
     const char *const FUNC = __func__;
     ArchiveVolState &volSt = getArchiveVolState(volId);
@@ -1606,12 +2093,19 @@ bool getBlockHash(
     }
 
     VirtualFullScanner virt;
-    archive_local::prepareVirtualFullScanner(virt, volSt, volInfo, sizeLb, MetaSnap(gid));
+    MetaState baseSt;
+    const bool useBaseLv = archive_local::prepareVirtualFullScanner(
+        virt, volSt, volInfo, sizeLb, MetaSnap(gid), &baseSt);
 
     AlignedArray buf;
     packet::StreamControl ctrl(pkt.sock());
-    cybozu::murmurhash3::StreamHasher hasher(0); // seed is 0.
+    BlockHashIndex index;
+    const bool useIndex = useBaseLv && bulkLb == BLOCK_HASH_INDEX_BULK_LB &&
+        hashAlgo == cybozu::murmurhash3::HASH_ALGO_MURMUR3 &&
+        prepareBlockHashIndex(index, volSt, volInfo, baseSt, ctrl, logger);
+    cybozu::murmurhash3::StreamHasher hasher(0, hashAlgo); // seed is 0.
     uint64_t remaining = sizeLb;
+    uint64_t addr = 0, indexedLb = 0;
     double t0 = cybozu::util::getTime();
     double tx0 = t0;
     while (remaining > 0) {
@@ -1620,9 +2114,18 @@ bool getBlockHash(
             return false;
         }
         const uint64_t lb = std::min(remaining, bulkLb);
-        buf.resize(lb * LOGICAL_BLOCK_SIZE);
-        virt.read(buf.data(), buf.size());
-        hasher.push(buf.data(), buf.size());
+        const uint64_t idx = addr / bulkLb;
+        if (useIndex && lb == index.chunkLb(idx) && addr + lb <= virt.nextDiffAddr()) {
+            /* The chunk of the base image is not touched by the diffs. */
+            hasher.pushHash(index.get(idx));
+            virt.skip(lb);
+            indexedLb += lb;
+        } else {
+            buf.resize(lb * LOGICAL_BLOCK_SIZE);
+            virt.read(buf.data(), buf.size());
+            hasher.push(buf.data(), buf.size());
+        }
+        addr += lb;
         const double t1 = cybozu::util::getTime();
         if (t1 - t0 > 1.0) { // to avoid timeout.
             ctrl.dummy();
@@ -1637,32 +2140,37 @@ bool getBlockHash(
     }
     ctrl.end();
     hash = hasher.get();
+    logger.debug() << FUNC << "indexed" << volId << useIndex << indexedLb << sizeLb;
     return true;
 }
 
 
 /**
- * Do virtual full scan.
- * sizeLb: 0 means whole device size.
+ * Do virtual full scan of the range [startLb, startLb + sizeLb).
+ * sizeLb: 0 means up to the end of the device.
  */
 bool virtualFullScanServer(
-    const std::string &volId, uint64_t gid, uint64_t bulkLb, uint64_t sizeLb,
+    const std::string &volId, uint64_t gid, uint64_t bulkLb, uint64_t startLb, uint64_t sizeLb,
     packet::Packet &pkt, Logger &logger)
 {
     const char *const FUNC = __func__;
     ArchiveVolState &volSt = getArchiveVolState(volId);
     ArchiveVolInfo volInfo = getArchiveVolInfo(volId);
     const uint64_t devSizeLb = volSt.lvCache.getLv().sizeLb();
+    if (startLb >= devSizeLb) {
+        throw cybozu::Exception(FUNC) << "Specified start offset is too large" << startLb << devSizeLb;
+    }
     if (sizeLb == 0) {
-        sizeLb = devSizeLb;
-    } else if (sizeLb > devSizeLb) {
-        throw cybozu::Exception(FUNC) << "Specified size is too large" << sizeLb << devSizeLb;
+        sizeLb = devSizeLb - startLb;
+    } else if (sizeLb > devSizeLb - startLb) {
+        throw cybozu::Exception(FUNC) << "Specified size is too large" << startLb << sizeLb << devSizeLb;
     }
     pkt.write(sizeLb);
     pkt.flush();
 
     VirtualFullScanner virt;
-    archive_local::prepareVirtualFullScanner(virt, volSt, volInfo, sizeLb, MetaSnap(gid));
+    archive_local::prepareVirtualFullScanner(
+        virt, volSt, volInfo, startLb + sizeLb, MetaSnap(gid), nullptr, startLb);
 
     packet::StreamControl2 ctrl(pkt.sock());
     AlignedArray buf;
@@ -1698,7 +2206,7 @@ bool virtualFullScanServer(
     pkt.flush();
     packet::Ack(pkt.sock()).recv();
     logger.debug() << "number of sent bulks" << c;
-    logger.info() << "virt-full-scan sizeLb devSizeLb" << sizeLb << devSizeLb;
+    logger.info() << "virt-full-scan startLb sizeLb devSizeLb" << startLb << sizeLb << devSizeLb;
     logger.info() << "virt-full-scan-mergeIn " << volId << virt.statIn();
     logger.info() << "virt-full-scan-mergeOut" << volId << virt.statOut();
     logger.info() << "virt-full-scan-mergeMemUsage" << volId << virt.memUsageStr();
@@ -1830,6 +2338,22 @@ void getHandlerStat(protocol::GetCommandParams &p)
     p.logger.debug() << "get handler-stat succeeded";
 }
 
+void getMetrics(protocol::GetCommandParams &p)
+{
+    const VolIdOrAllParam param = parseVolIdOrAllParam(p.params, 1);
+    const metrics::MetricsRegistry &reg = getArchiveGlobal().metrics;
+    const StrVec ret = param.isAll ? reg.prettyPrintAll() : reg.prettyPrint(param.volId);
+    protocol::sendValueAndFin(p, ret);
+    p.logger.debug() << "get metrics succeeded";
+}
+
+void getDiffCacheStat(protocol::GetCommandParams &p)
+{
+    const IndexedDiffCache::Stat stat = getArchiveGlobal().diffCache.getStat();
+    protocol::sendValueAndFin(p, stat.str());
+    p.logger.debug() << "get diff-cache succeeded";
+}
+
 } // archive_local
 
 
@@ -2160,7 +2684,9 @@ void c2aReloadMetadataServer(protocol::ServerParams &p)
 }
 
 
-void p2aWdiffTransferServer(protocol::ServerParams &p)
+namespace archive_local {
+
+void wdiffRecvServer(protocol::ServerParams &p, bool canResume)
 {
     const char * const FUNC = __func__;
     ProtocolLogger logger(ga.nodeId, p.clientId);
@@ -2279,17 +2805,12 @@ void p2aWdiffTransferServer(protocol::ServerParams &p)
         ul.unlock();
         logger.debug() << "wdiff-transfer started" << volId;
         cybozu::Stopwatch stopwatch;
+        metrics::StageTimer timer(&getArchiveGlobal().metrics.get(volId), metrics::WDIFF_RECV);
 
-        const cybozu::FilePath fPath = volInfo.getDiffPath(diff);
-        cybozu::TmpFile tmpFile(volInfo.volDir.str());
-        cybozu::util::File fileW(tmpFile.fd());
-        writeDiffFileHeader(fileW, uuid);
-        if (!wdiffTransferServer(pkt, tmpFile.fd(), volSt.stopState, ga.ps, ga.fsyncIntervalSize)) {
+        if (!recvWdiff(pkt, volSt, volInfo, diff, uuid, canResume, logger)) {
             logger.warn() << FUNC << "force stopped" << volId;
             return;
         }
-        diff.dataSize = cybozu::FileStat(tmpFile.fd()).size();
-        tmpFile.save(fPath.str());
 
         ul.lock();
         volSt.diffMgr.add(diff);
@@ -2299,6 +2820,7 @@ void p2aWdiffTransferServer(protocol::ServerParams &p)
         volSt.updateLastWdiffReceivedTime();
         ul.unlock();
         packet::Ack(p.sock).sendFin();
+        timer.record(diff.dataSize);
         const std::string elapsed = util::getElapsedTimeStr(stopwatch.get());
         logger.debug() << "wdiff-transfer succeeded" << volId << elapsed;
     } catch (std::exception &e) {
@@ -2311,6 +2833,8 @@ void p2aWdiffTransferServer(protocol::ServerParams &p)
     }
 }
 
+} // archive_local
+
 
 /**
  * This function will Work as a repl-sync client.
@@ -2342,15 +2866,20 @@ void c2aReplicateServer(protocol::ServerParams &p)
         ul.unlock();
         cybozu::Socket aSock;
         std::string dstId;
-        archive_local::runReplSync1stNegotiation(volId, hostInfo.addrPort, aSock, dstId);
+        bool canResume;
+        const bool hasHashAlgo = archive_local::runReplSync1stNegotiation(
+            volId, hostInfo.addrPort, aSock, dstId, canResume);
         pkt.writeFin(msgAccept);
         sendErr = false;
         logger.info() << "replication as client started"
                       << volId << param.isSize << param.param2 << hostInfo;
-        if (!archive_local::runReplSyncClient(volId, aSock, hostInfo, isSize, param2, dstId, logger)) {
+        metrics::StageTimer timer(&getArchiveGlobal().metrics.get(volId), metrics::REPL_CLIENT);
+        if (!archive_local::runReplSyncClient(
+                volId, aSock, hostInfo, isSize, param2, dstId, hasHashAlgo, canResume, logger)) {
             logger.warn() << FUNC << "replication as client force stopped" << volId << hostInfo;
             return;
         }
+        timer.record();
         logger.info() << "replication as client succeeded" << volId;
     } catch (std::exception &e) {
         logger.error() << FUNC << e.what();
@@ -2359,7 +2888,9 @@ void c2aReplicateServer(protocol::ServerParams &p)
 }
 
 
-void a2aReplSyncServer(protocol::ServerParams &p)
+namespace archive_local {
+
+void replSyncServer(protocol::ServerParams &p, bool hasHashAlgo, bool canResume)
 {
     const char *const FUNC = __func__;
     ProtocolLogger logger(ga.nodeId, p.clientId);
@@ -2385,11 +2916,13 @@ void a2aReplSyncServer(protocol::ServerParams &p)
 
         logger.info() << "replication as server started" << volId;
         cybozu::Stopwatch stopwatch;
-        if (!archive_local::runReplSyncServer(volId, p.sock, ul, logger)) {
+        metrics::StageTimer timer(&getArchiveGlobal().metrics.get(volId), metrics::REPL_SERVER);
+        if (!runReplSyncServer(volId, p.sock, ul, hasHashAlgo, canResume, logger)) {
             logger.warn() << FUNC << "replication as server force stopped" << volId;
             return;
         }
         ul.unlock();
+        timer.record();
         const std::string elapsed = util::getElapsedTimeStr(stopwatch.get());
         logger.info() << "replication as server succeeded" << volId << elapsed;
     } catch (std::exception &e) {
@@ -2398,6 +2931,8 @@ void a2aReplSyncServer(protocol::ServerParams &p)
     }
 }
 
+} // archive_local
+
 
 void c2aApplyServer(protocol::ServerParams &p)
 {
@@ -2610,6 +3145,7 @@ void c2aVirtualFullScan(protocol::ServerParams &p)
         const std::string &volId = param.volId;
         const uint64_t gid = param.gid;
         const uint64_t bulkLb = param.bulkLb;
+        const uint64_t startLb = param.startLb;
         const uint64_t sizeLb = param.sizeLb;
 
         ForegroundCounterTransaction foregroundTasksTran;
@@ -2620,7 +3156,7 @@ void c2aVirtualFullScan(protocol::ServerParams &p)
         pkt.flush();
         sendErr = false;
 
-        if (!archive_local::virtualFullScanServer(volId, gid, bulkLb, sizeLb, pkt, logger)) {
+        if (!archive_local::virtualFullScanServer(volId, gid, bulkLb, startLb, sizeLb, pkt, logger)) {
             throw cybozu::Exception(FUNC) << "force stopped" << volId;
         }
         pkt.writeFin(msgOk);
@@ -2644,7 +3180,7 @@ void c2aBlockHashServer(protocol::ServerParams &p)
     bool sendErr = true;
 
     try {
-        const VirtualFullScanParam param = parseVirtualFullScanParam(protocol::recvStrVec(p.sock, 0, FUNC));
+        const BlockHashParam param = parseBlockHashParam(protocol::recvStrVec(p.sock, 0, FUNC));
         const std::string &volId = param.volId;
         const uint64_t gid = param.gid;
         const uint64_t bulkLb = param.bulkLb;
@@ -2657,13 +3193,13 @@ void c2aBlockHashServer(protocol::ServerParams &p)
         pkt.flush();
 
         cybozu::murmurhash3::Hash hash;
-        if (!archive_local::getBlockHash(volId, gid, bulkLb, sizeLb, pkt, logger, hash)) {
+        if (!archive_local::getBlockHash(volId, gid, bulkLb, sizeLb, param.hashAlgo, pkt, logger, hash)) {
             throw cybozu::Exception(FUNC) << "force stopped" << volId;
         }
         pkt.write(msgOk);
         sendErr = false;
         pkt.writeFin(hash);
-        logger.debug() << "bhash succeeded" << volId << hash;
+        logger.debug() << "bhash succeeded" << volId << cybozu::murmurhash3::hashAlgoName(param.hashAlgo) << hash;
     } catch (std::exception &e) {
         logger.error() << e.what();
         if (sendErr) pkt.write(e.what());
@@ -19,6 +19,7 @@
 #include "walb_diff_io.hpp"
 #include "snap_info.hpp"
 #include "ts_delta.hpp"
+#include "metrics.hpp"
 
 namespace walb {
 
@@ -151,6 +152,13 @@ struct ArchiveSingleton
     size_t maxWdiffSendNr;
     DiscardType discardType;
     uint64_t fsyncIntervalSize;
+    size_t applyBufferSize; // max size of in-flight IOs to apply wdiffs [bytes].
+    size_t hashSyncCpu;
+    cybozu::murmurhash3::HashAlgo hashAlgo; // requested in hash-repl and resync as a client.
+    size_t fullSyncCpu;
+    CompressOpt mergeCmpr; // compression for merged wdiffs.
+    bool storeIndexedDiff; // store merged and received wdiffs in indexed format.
+    uint64_t indexedDiffUnitSize; // compression unit of indexed wdiffs [bytes].
     KeepAliveParams keepAliveParams;
     bool doAutoResize;
     bool keepOneColdSnapshot;
@@ -164,6 +172,8 @@ struct ArchiveSingleton
     AtomicMap<ArchiveVolState> stMap;
     archive_local::RemoteSnapshotManager remoteSnapshotManager;
     protocol::HandlerStatMgr handlerStatMgr;
+    metrics::MetricsRegistry metrics; // per-volume stage latency histograms.
+    IndexedDiffCache diffCache; // shared by apply, restore, virtual full scan and diff-repl.
 
     void setSocketParams(cybozu::Socket& sock) const {
         util::setSocketParams(sock, keepAliveParams, socketTimeout);
@@ -236,13 +246,26 @@ const bool allowEmpty = true;
 
 void prepareRawFullScanner(
     cybozu::util::File &file, ArchiveVolState &volSt, uint64_t sizeLb, uint64_t gid = UINT64_MAX);
-void prepareVirtualFullScanner(
+/**
+ * @baseStP the state of the base image will be set if not null.
+ * @startLb scanning start address [logical block].
+ * RETURN:
+ *   false if a cold snapshot is used as the base image instead of the base lv.
+ */
+bool prepareVirtualFullScanner(
     VirtualFullScanner &virt, ArchiveVolState &volSt,
-    ArchiveVolInfo &volInfo, uint64_t sizeLb, const MetaSnap &snap);
+    ArchiveVolInfo &volInfo, uint64_t sizeLb, const MetaSnap &snap, MetaState *baseStP = nullptr,
+    uint64_t startLb = 0);
+bool prepareMerkleHashTree(
+    MerkleHashTree &tree, packet::Packet &pkt, ArchiveVolState &volSt, ArchiveVolInfo &volInfo,
+    uint64_t sizeLb, uint64_t bulkLb, uint32_t fanout, uint32_t hashSeed, cybozu::murmurhash3::HashAlgo hashAlgo,
+    const MetaSnap &snap, std::atomic<uint64_t> &progressLb, Logger &logger);
 void verifyApplicable(const std::string& volId, uint64_t gid);
 bool applyOpenedDiffs(std::vector<cybozu::util::File>&& fileV, cybozu::lvm::Lv& lv,
                       const std::atomic<int>& stopState,
-                      DiffStatistics& statIn, DiffStatistics& statOut, std::string& memUsageStr);
+                      DiffStatistics& statIn, DiffStatistics& statOut, std::string& memUsageStr,
+                      BlockHashIndex *index = nullptr, std::atomic<uint64_t> *progressLb = nullptr,
+                      metrics::VolMetrics *metrics = nullptr);
 bool applyDiffsToVolume(const std::string& volId, uint64_t gid);
 void verifyNotApplying(const std::string &volId);
 void verifyMergeable(const std::string &volId, uint64_t gid);
@@ -290,17 +313,47 @@ struct ZeroResetterT
 using ZeroResetter = ZeroResetterT<std::atomic<uint64_t>>;
 
 
-void backupServer(protocol::ServerParams &p, bool isFull);
+/**
+ * isParallel is valid only when isFull is true.
+ * hasHashAlgo is valid only when isFull is false.
+ */
+void backupServer(protocol::ServerParams &p, bool isFull, bool isParallel = false, bool hasHashAlgo = false);
 void delSnapshotServer(protocol::ServerParams &p, bool isCold);
 
 
-inline void runReplSync1stNegotiation(const std::string &volId, const AddrPort &addrPort, cybozu::Socket &sock, std::string &dstId)
+/**
+ * Try resumable-repl-sync, hash-algo-repl-sync, and repl-sync in order.
+ * resumable-repl-sync includes the hash algorithm negotiation.
+ *
+ * canResume will be set true if the server supports the diff-repl resume.
+ * RETURN:
+ *   true if the server supports the hash algorithm negotiation.
+ */
+inline bool runReplSync1stNegotiation(
+    const std::string &volId, const AddrPort &addrPort, cybozu::Socket &sock, std::string &dstId, bool &canResume)
 {
     const cybozu::SocketAddr server = addrPort.getSocketAddr();
-    util::connectWithTimeout(sock, server, ga.socketTimeout);
-    ga.setSocketParams(sock);
-    dstId = protocol::run1stNegotiateAsClient(sock, ga.nodeId, replSyncPN);
+    auto connect = [&]() {
+        util::connectWithTimeout(sock, server, ga.socketTimeout);
+        ga.setSocketParams(sock);
+    };
+    connect();
+    canResume = protocol::tryRun1stNegotiateAsClient(sock, ga.nodeId, resumableReplSyncPN, dstId);
+    bool hasHashAlgo = canResume;
+    if (!canResume) {
+        LOGs.info() << __func__ << "archive does not support" << resumableReplSyncPN << dstId;
+        sock.close();
+        connect();
+        hasHashAlgo = protocol::tryRun1stNegotiateAsClient(sock, ga.nodeId, hashAlgoReplSyncPN, dstId);
+    }
+    if (!hasHashAlgo) {
+        LOGs.info() << __func__ << "archive does not support" << hashAlgoReplSyncPN << dstId;
+        sock.close();
+        connect();
+        dstId = protocol::run1stNegotiateAsClient(sock, ga.nodeId, replSyncPN);
+    }
     protocol::sendStrVec(sock, {volId}, 1, __func__, msgAccept);
+    return hasHashAlgo;
 }
 
 
@@ -322,25 +375,28 @@ bool runFullReplServer(
     packet::Packet &pkt, const cybozu::Uuid &archiveUuid, UniqueLock &ul, Logger &logger);
 bool runHashReplClient(
     const std::string &volId, ArchiveVolState &volSt, ArchiveVolInfo &volInfo, const std::string &dstId,
-    packet::Packet &pkt, uint64_t bulkLb, const MetaDiff &diff, Logger &logger);
+    packet::Packet &pkt, uint64_t bulkLb, const MetaDiff &diff, bool useMerkleHash,
+    cybozu::murmurhash3::HashAlgo hashAlgo, Logger &logger);
 bool runHashReplServer(
     const std::string &volId, ArchiveVolState &volSt, ArchiveVolInfo &volInfo,
-    packet::Packet &pkt, UniqueLock &ul, const MetaState &metaSt, Logger &logger);
+    packet::Packet &pkt, UniqueLock &ul, const MetaState &metaSt, bool useMerkleHash,
+    cybozu::murmurhash3::HashAlgo hashAlgo, Logger &logger);
 bool runNoMergeDiffReplClient(
     const std::string &volId, ArchiveVolState &volSt, ArchiveVolInfo &volInfo, const std::string &dstId,
-    packet::Packet &pkt, const MetaSnap &srvLatestSnap, Logger &logger);
+    packet::Packet &pkt, const MetaSnap &srvLatestSnap, bool canResume, Logger &logger);
 bool runDiffReplClient(
     const std::string &volId, ArchiveVolState &volSt, ArchiveVolInfo &volInfo, const std::string &dstId,
-    packet::Packet &pkt, const MetaSnap &srvLatestSnap, const CompressOpt &cmpr, uint64_t wdiffMergeSize, Logger &logger);
+    packet::Packet &pkt, const MetaSnap &srvLatestSnap, const CompressOpt &cmpr, uint64_t wdiffMergeSize,
+    bool canResume, Logger &logger);
 bool runDiffReplServer(
     const std::string &volId, ArchiveVolState &volSt, ArchiveVolInfo &volInfo,
-    packet::Packet &pkt, UniqueLock &ul, const MetaState &metaSt, Logger &logger);
+    packet::Packet &pkt, UniqueLock &ul, const MetaState &metaSt, bool canResume, Logger &logger);
 bool runResyncReplClient(
     const std::string &volId, ArchiveVolState &volSt, ArchiveVolInfo &volInfo, const std::string &dstId,
-    packet::Packet &pkt, uint64_t bulkLb, Logger &logger);
+    packet::Packet &pkt, uint64_t bulkLb, cybozu::murmurhash3::HashAlgo hashAlgo, Logger &logger);
 bool runResyncReplServer(
     const std::string &volId, ArchiveVolState &volSt, ArchiveVolInfo &volInfo,
-    packet::Packet &pkt, UniqueLock &ul, Logger &logger);
+    packet::Packet &pkt, UniqueLock &ul, cybozu::murmurhash3::HashAlgo hashAlgo, Logger &logger);
 
 enum {
     DO_FULL_SYNC = 0,
@@ -348,9 +404,23 @@ enum {
     DO_HASH_OR_DIFF_SYNC = 2,
 };
 
+/**
+ * hasHashAlgo: true if the protocol is hash-algo-repl-sync or resumable-repl-sync,
+ * where the client requests its block hash algorithm and the server replies the one to use.
+ * canResume: true if the protocol is resumable-repl-sync,
+ * where the diff-repl server sends the end address of IOs received before.
+ */
 bool runReplSyncClient(const std::string &volId, cybozu::Socket &sock, const HostInfoForRepl &hostInfo,
-                       bool isSize, uint64_t param, const std::string &dstId, Logger &logger);
-bool runReplSyncServer(const std::string &volId, cybozu::Socket &sock, UniqueLock &ul, Logger &logger);
+                       bool isSize, uint64_t param, const std::string &dstId, bool hasHashAlgo, bool canResume,
+                       Logger &logger);
+bool runReplSyncServer(const std::string &volId, cybozu::Socket &sock, UniqueLock &ul,
+                       bool hasHashAlgo, bool canResume, Logger &logger);
+void replSyncServer(protocol::ServerParams &p, bool hasHashAlgo, bool canResume);
+
+/**
+ * canResume: true if the protocol is resumable-wdiff-transfer.
+ */
+void wdiffRecvServer(protocol::ServerParams &p, bool canResume);
 
 StrVec getAllStatusAsStrVec();
 StrVec getVolStatusAsStrVec(const std::string &volId);
@@ -457,9 +527,10 @@ void getBase(protocol::GetCommandParams &p);
 void getBaseAll(protocol::GetCommandParams &p);
 bool getBlockHash(
     const std::string &volId, uint64_t gid, uint64_t bulkLb, uint64_t sizeLb,
+    cybozu::murmurhash3::HashAlgo hashAlgo,
     packet::Packet &pkt, Logger &, cybozu::murmurhash3::Hash &hash);
 bool virtualFullScanServer(
-    const std::string &volId, uint64_t gid, uint64_t bulkLb, uint64_t sizeLb,
+    const std::string &volId, uint64_t gid, uint64_t bulkLb, uint64_t startLb, uint64_t sizeLb,
     packet::Packet &pkt, Logger &logger);
 void getVolSize(protocol::GetCommandParams &p);
 
@@ -513,6 +584,8 @@ std::string getLatestSnapForVolume(const std::string& volId);
 void getLatestSnap(protocol::GetCommandParams &p);
 void getTsDelta(protocol::GetCommandParams &p);
 void getHandlerStat(protocol::GetCommandParams &p);
+void getMetrics(protocol::GetCommandParams &p);
+void getDiffCacheStat(protocol::GetCommandParams &p);
 
 } // namespace archive_local
 
@@ -534,6 +607,16 @@ inline void s2aDirtyFullSyncServer(protocol::ServerParams &p)
     archive_local::backupServer(p, isFull);
 }
 
+/**
+ * Execute parallel dirty full sync protocol as server.
+ */
+inline void s2aParallelDirtyFullSyncServer(protocol::ServerParams &p)
+{
+    const bool isFull = true;
+    const bool isParallel = true;
+    archive_local::backupServer(p, isFull, isParallel);
+}
+
 /**
  * Execute dirty hash sync protocol as server.
  */
@@ -543,6 +626,17 @@ inline void s2aDirtyHashSyncServer(protocol::ServerParams &p)
     archive_local::backupServer(p, isFull);
 }
 
+/**
+ * Execute dirty hash sync protocol with the hash algorithm negotiation as server.
+ */
+inline void s2aHashAlgoDirtyHashSyncServer(protocol::ServerParams &p)
+{
+    const bool isFull = false;
+    const bool isParallel = false;
+    const bool hasHashAlgo = true;
+    archive_local::backupServer(p, isFull, isParallel, hasHashAlgo);
+}
+
 void c2aRestoreServer(protocol::ServerParams &p);
 
 inline void c2aDelRestoredServer(protocol::ServerParams &p)
@@ -558,9 +652,34 @@ inline void c2aDelColdServer(protocol::ServerParams &p)
 }
 
 void c2aReloadMetadataServer(protocol::ServerParams &p);
-void p2aWdiffTransferServer(protocol::ServerParams &p);
+
+inline void p2aWdiffTransferServer(protocol::ServerParams &p)
+{
+    archive_local::wdiffRecvServer(p, false);
+}
+
+inline void p2aResumableWdiffTransferServer(protocol::ServerParams &p)
+{
+    archive_local::wdiffRecvServer(p, true);
+}
+
 void c2aReplicateServer(protocol::ServerParams &p);
-void a2aReplSyncServer(protocol::ServerParams &p);
+
+inline void a2aReplSyncServer(protocol::ServerParams &p)
+{
+    archive_local::replSyncServer(p, false, false);
+}
+
+inline void a2aHashAlgoReplSyncServer(protocol::ServerParams &p)
+{
+    archive_local::replSyncServer(p, true, false);
+}
+
+inline void a2aResumableReplSyncServer(protocol::ServerParams &p)
+{
+    archive_local::replSyncServer(p, true, true);
+}
+
 void c2aApplyServer(protocol::ServerParams &p);
 void c2aMergeServer(protocol::ServerParams &p);
 void c2aResizeServer(protocol::ServerParams &p);
@@ -617,6 +736,8 @@ const protocol::GetCommandHandlerMap archiveGetHandlerMap = {
     { getLatestSnapTN, archive_local::getLatestSnap },
     { getTsDeltaTN, archive_local::getTsDelta },
     { getHandlerStatTN, archive_local::getHandlerStat },
+    { metricsTN, archive_local::getMetrics },
+    { diffCacheTN, archive_local::getDiffCacheStat },
 };
 
 inline void c2aGetServer(protocol::ServerParams &p)
@@ -661,9 +782,14 @@ const protocol::Str2ServerHandler archiveHandlerMap = {
 #endif
     // protocols.
     { dirtyFullSyncPN, s2aDirtyFullSyncServer },
+    { parallelDirtyFullSyncPN, s2aParallelDirtyFullSyncServer },
     { dirtyHashSyncPN, s2aDirtyHashSyncServer },
+    { hashAlgoDirtyHashSyncPN, s2aHashAlgoDirtyHashSyncServer },
     { wdiffTransferPN, p2aWdiffTransferServer },
+    { resumableWdiffTransferPN, p2aResumableWdiffTransferServer },
     { replSyncPN, a2aReplSyncServer },
+    { hashAlgoReplSyncPN, a2aHashAlgoReplSyncServer },
+    { resumableReplSyncPN, a2aResumableReplSyncServer },
     { gatherLatestSnapPN, s2aGatherLatestSnapServer },
 };
 
@@ -258,6 +258,8 @@ void ArchiveVolInfo::clearAllSnapLv()
         }
     }
     removeColdTimestampFilesBeforeGid(UINT64_MAX); // all
+    removeMerkleHashFilesBeforeGid(UINT64_MAX); // all
+    removeBlockHashIndex();
 }
 
 
@@ -283,6 +285,7 @@ void ArchiveVolInfo::removeBeforeGid(uint64_t gid)
 {
     wdiffs_.removeBeforeGid(gid);
     removeColdTimestampFilesBeforeGid(gid);
+    removeMerkleHashFilesBeforeGid(gid);
 
     std::vector<uint64_t> removed;
     VolLvCache::LvMap coldM = lvC_.getColdMap();
@@ -353,11 +356,53 @@ uint64_t ArchiveVolInfo::initFullReplResume(
 }
 
 
+void ArchiveVolInfo::removePartialWdiff()
+{
+    for (const cybozu::FilePath &path : {getPartialWdiffStateFilePath(), getPartialWdiffPath()}) {
+        if (!path.stat().exists()) continue;
+        if (!path.unlink()) {
+            throw cybozu::Exception("ArchiveVolInfo::removePartialWdiff:unlink failed")
+                << path << cybozu::ErrorNo();
+        }
+    }
+}
+
+
+uint64_t ArchiveVolInfo::initPartialWdiffResume(
+    const MetaDiff& diff, const cybozu::Uuid& uuid, cybozu::util::File& fileW)
+{
+    const cybozu::FilePath path = getPartialWdiffPath();
+    PartialWdiffState partialSt;
+    if (getPartialWdiffState(partialSt) && partialSt.isSame(diff, uuid)
+        && fileW.open(path.str(), O_RDWR)) {
+        // resume.
+        uint64_t endAddr;
+        const uint64_t off = findSortedDiffValidEnd(fileW, uuid, endAddr);
+        if (off > 0) {
+            fileW.ftruncate(off);
+            fileW.lseek(off, SEEK_SET);
+            return endAddr;
+        }
+    }
+    // restart.
+    removePartialWdiff();
+    fileW = cybozu::util::File(path.str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    writeDiffFileHeader(fileW, uuid);
+    fileW.fdatasync();
+    partialSt.diff = diff;
+    partialSt.uuid = uuid;
+    partialSt.timestamp = ::time(0);
+    setPartialWdiffState(partialSt);
+    return 0;
+}
+
+
 void ArchiveVolInfo::createLv(uint64_t sizeLb)
 {
     if (sizeLb == 0) {
         throw cybozu::Exception("ArchiveVolInfo::createLv:sizeLb is zero");
     }
+    removeBlockHashIndex(); // The base image will be overwritten.
     if (lvExists()) {
         cybozu::lvm::Lv lv;
         if (lvC_.exists()) {
@@ -402,6 +447,7 @@ void ArchiveVolInfo::growLv(uint64_t newSizeLb, bool doZeroClear)
         throw cybozu::Exception(
             "You tried to shrink the volume: " + lvPathStr);
     }
+    removeBlockHashIndex();
     lv.resize(newSizeLb);
     lvC_.resize(lv.sizeLb()); // newSizeLb =< lv.sizeLb().
     device::flushBufferCache(lvPathStr);
@@ -458,6 +504,13 @@ StrVec ArchiveVolInfo::getStatusAsStrVec() const
     } else {
         v.push_back(fmt("fullReplState None"));
     }
+    PartialWdiffState partialSt;
+    if (getPartialWdiffState(partialSt)) {
+        const uint64_t size = cybozu::FileStat(getPartialWdiffPath().str()).size();
+        v.push_back(fmt("partialWdiff %s %" PRIu64 "", partialSt.str().c_str(), size));
+    } else {
+        v.push_back(fmt("partialWdiff None"));
+    }
     return v;
 }
 
@@ -536,6 +589,7 @@ void ArchiveVolInfo::makeColdToBase(uint64_t gid)
     if (tmpLv.sizeLb() < lv.sizeLb()) {
         tmpLv.resize(lv.sizeLb());
     }
+    removeBlockHashIndex();
     lv.remove();
     /* CAN NOT ROLLBACK FROM NOW. */
     setMetaState(coldSt);
@@ -579,6 +633,7 @@ void ArchiveVolInfo::recoverColdToBaseIfNecessary()
     }
     assert(tmpLv.exists());
     MetaState coldSt(MetaSnap(coldGid), getColdTimestamp(coldGid));
+    removeBlockHashIndex();
     setMetaState(coldSt);
     cybozu::lvm::Lv baseLv = cybozu::lvm::renameLv(vgName, tmpLv.name(), lvName());
     lvC_.add(baseLv);
@@ -26,6 +26,9 @@
 #include "archive_constant.hpp"
 #include "random.hpp"
 #include "full_repl_state.hpp"
+#include "partial_wdiff_state.hpp"
+#include "merkle_hash.hpp"
+#include "block_hash_index.hpp"
 
 namespace walb {
 
@@ -322,6 +325,53 @@ public:
             removeFile(p);
         }
     }
+    std::string merkleHashFileName(uint64_t gid) const {
+        return cybozu::util::formatString("%" PRIu64 ".merkle", gid);
+    }
+    /**
+     * Merkle hash tree cache of the clean snapshot image of the gid.
+     * RETURN:
+     *   false if the cache does not exist.
+     */
+    bool getMerkleHashTree(uint64_t gid, MerkleHashTree &tree) const {
+        cybozu::FilePath p = volDir + merkleHashFileName(gid);
+        if (!p.stat().isFile()) return false;
+        util::loadFile(volDir, merkleHashFileName(gid), tree);
+        return true;
+    }
+    /**
+     * Only the latest cache will be kept.
+     */
+    void setMerkleHashTree(uint64_t gid, const MerkleHashTree &tree) {
+        util::saveFile(volDir, merkleHashFileName(gid), tree);
+        removeMerkleHashFilesBeforeGid(gid);
+    }
+    void removeMerkleHashFilesBeforeGid(uint64_t maxGid) {
+        for (std::string &fname : util::getFileNameList(volDir.str(), "merkle")) {
+            const uint64_t gid = cybozu::atoi(cybozu::util::removeSuffix(fname, ".merkle"));
+            if (gid >= maxGid) continue;
+            cybozu::FilePath p = volDir + fname;
+            removeFile(p);
+        }
+    }
+    std::string blockHashIndexPath() const {
+        return (volDir + "block_hash_index").str();
+    }
+    /**
+     * Block hash index of the base image.
+     * RETURN:
+     *   false if the index does not exist.
+     */
+    bool openBlockHashIndex(BlockHashIndex &index) const {
+        return index.open(blockHashIndexPath());
+    }
+    /**
+     * Call this before the base image is replaced or written without updating the index.
+     */
+    void removeBlockHashIndex() {
+        cybozu::FilePath p(blockHashIndexPath());
+        if (p.stat().isFile()) removeFile(p);
+    }
     MetaState getMetaStateForRestore(uint64_t gid, bool &useCold) const {
         return getMetaStateForDetail(gid, useCold, false);
     }
@@ -361,6 +411,40 @@ public:
     }
     uint64_t initFullReplResume(uint64_t sizeLb, const cybozu::Uuid& archiveUuid,
                                 const MetaState& metaSt, FullReplState& fullReplSt);
+    const char *getPartialWdiffStateFileName() const {
+        static const char name[] = "partial_wdiff_state";
+        return name;
+    }
+    cybozu::FilePath getPartialWdiffStateFilePath() const {
+        return volDir + cybozu::FilePath(getPartialWdiffStateFileName());
+    }
+    /**
+     * A wdiff being received. It does not have the wdiff extension.
+     */
+    cybozu::FilePath getPartialWdiffPath() const {
+        return volDir + cybozu::FilePath("partial_wdiff_data");
+    }
+    bool getPartialWdiffState(PartialWdiffState& partialSt) const {
+        const cybozu::FilePath path = getPartialWdiffStateFilePath();
+        if (!path.stat().exists()) return false;
+        util::loadFile(volDir, getPartialWdiffStateFileName(), partialSt);
+        return true;
+    }
+    void setPartialWdiffState(const PartialWdiffState& partialSt) {
+        util::saveFile(volDir, getPartialWdiffStateFileName(), partialSt);
+    }
+    /**
+     * Remove the state and the partial wdiff if exists.
+     */
+    void removePartialWdiff();
+    /**
+     * Open the partial wdiff to receive diff and seek to its end.
+     * The one received before will be resumed if it is for the same diff and uuid.
+     * Otherwise it will be discarded.
+     * RETURN:
+     *   end address of IOs received already.
+     */
+    uint64_t initPartialWdiffResume(const MetaDiff& diff, const cybozu::Uuid& uuid, cybozu::util::File& fileW);
     bool existsVolDir() const {
         return volDir.stat().isDirectory();
     }
@@ -448,7 +532,8 @@ public:
     enum {
         DONT_REPL = 0,
         DO_HASH_REPL = 1,
-        DO_DIFF_REPL = 2
+        DO_DIFF_REPL = 2,
+        DO_MERKLE_HASH_REPL = 3, // used instead of DO_HASH_REPL if HostInfoForRepl::useMerkleHash.
     };
     int shouldDoRepl(const MetaSnap &srvSnap, const MetaSnap &cliSnap, bool isSize, uint64_t param) const;
     /**
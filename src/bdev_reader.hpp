@@ -80,6 +80,9 @@ public:
     size_t getReadableSize() const {
         return readableSize_;
     }
+    const AlignedArray& getBuffer() const {
+        return buf_;
+    }
     size_t read(void *data, size_t size) {
         return consume(data, size, true);
     }
@@ -144,6 +147,7 @@ public:
         verifyMultiple(maxIoSize_, pbs_, "bad maxIoSize");
         verifyMultiple(bufferSize, pbs_, "bad bufferSize");
         ringBuf_.init(bufferSize);
+        aio_.registerBuffer(ringBuf_.getBuffer().data(), bufferSize);
         readAhead();
     }
     ~AsyncBdevReader() noexcept {
@@ -0,0 +1,135 @@
+#include "block_hash_index.hpp"
+
+namespace walb {
+
+bool BlockHashIndex::open(const std::string &path)
+{
+    cybozu::util::File file;
+    if (!file.open(path, O_RDWR)) return false;
+    Header header;
+    const off_t fileSize = file.lseek(0, SEEK_END);
+    if (fileSize < off_t(sizeof(header))) return false;
+    file.pread(&header, sizeof(header), 0);
+    if (header.magic != MAGIC || header.sizeLb == 0 || header.bulkLb == 0) return false;
+    header_ = header;
+    if (fileSize != entryOffset(nrChunks())) return false;
+    file_ = std::move(file);
+    dirty_.clear();
+    cache_.clear();
+    return true;
+}
+
+void BlockHashIndex::create(int fd, uint64_t sizeLb, uint64_t bulkLb)
+{
+    if (sizeLb == 0 || bulkLb == 0) {
+        throw cybozu::Exception("BlockHashIndex:create:bad parameters") << sizeLb << bulkLb;
+    }
+    file_ = cybozu::util::File(fd);
+    header_ = Header();
+    header_.magic = MAGIC;
+    header_.isValid = 0;
+    header_.sizeLb = sizeLb;
+    header_.bulkLb = bulkLb;
+    file_.ftruncate(entryOffset(nrChunks()));
+    writeHeader();
+    dirty_.clear();
+    cache_.clear();
+}
+
+void BlockHashIndex::invalidate()
+{
+    if (!isValid()) return;
+    header_.isValid = 0;
+    writeHeader();
+    file_.fdatasync();
+}
+
+void BlockHashIndex::validate(const MetaState &st)
+{
+    if (st.isApplying) {
+        throw cybozu::Exception("BlockHashIndex:validate:the state is applying") << st;
+    }
+    file_.fdatasync();
+    header_.isValid = 1;
+    header_.gidB = st.snapB.gidB;
+    header_.gidE = st.snapB.gidE;
+    header_.timestamp = st.timestamp;
+    writeHeader();
+    file_.fdatasync();
+}
+
+const BlockHashIndex::Hash& BlockHashIndex::get(uint64_t idx)
+{
+    verifyIdx(idx);
+    if (cache_.empty() || idx < cacheIdx_ || cacheIdx_ + cache_.size() <= idx) {
+        cache_.resize(std::min<uint64_t>(CACHE_SIZE, nrChunks() - idx));
+        file_.pread(cache_.data(), cache_.size() * sizeof(Hash), entryOffset(idx));
+        cacheIdx_ = idx;
+    }
+    return cache_[idx - cacheIdx_];
+}
+
+void BlockHashIndex::update(cybozu::util::File &file, uint64_t idxB, uint64_t idxE, AlignedArray &buf)
+{
+    const size_t maxNr = 64;
+    std::vector<Hash> hashV;
+    hashV.reserve(maxNr);
+    cache_.clear();
+    uint64_t idx = idxB;
+    while (idx < idxE) {
+        verifyIdx(idx);
+        const size_t nr = std::min<uint64_t>(maxNr, idxE - idx);
+        uint64_t lb = 0;
+        for (size_t i = 0; i < nr; i++) lb += chunkLb(idx + i);
+        buf.resize(lb * LOGICAL_BLOCK_SIZE, false);
+        file.pread(buf.data(), buf.size(), idx * header_.bulkLb * LOGICAL_BLOCK_SIZE);
+        hashV.clear();
+        const char *p = buf.data();
+        for (size_t i = 0; i < nr; i++) {
+            const size_t size = chunkLb(idx + i) * LOGICAL_BLOCK_SIZE;
+            hashV.push_back(cybozu::murmurhash3::Hasher(idx + i)(p, size));
+            p += size;
+        }
+        file_.pwrite(hashV.data(), hashV.size() * sizeof(Hash), entryOffset(idx));
+        idx += nr;
+    }
+}
+
+void BlockHashIndex::markDirty(uint64_t addr, uint64_t blks)
+{
+    if (blks == 0) return;
+    if (dirty_.empty()) dirty_.resize(nrChunks());
+    const uint64_t idxB = addr / header_.bulkLb;
+    const uint64_t idxE = std::min((addr + blks + header_.bulkLb - 1) / header_.bulkLb, nrChunks());
+    for (uint64_t idx = idxB; idx < idxE; idx++) dirty_[idx] = true;
+}
+
+AddrRangeVec BlockHashIndex::getDirtyRanges() const
+{
+    AddrRangeVec v;
+    for (uint64_t idx = 0; idx < dirty_.size(); idx++) {
+        if (!dirty_[idx]) continue;
+        if (!v.empty() && v.back().second == idx) {
+            v.back().second++;
+        } else {
+            v.emplace_back(idx, idx + 1);
+        }
+    }
+    return v;
+}
+
+void BlockHashIndex::updateDirty(cybozu::util::File &file)
+{
+    AlignedArray buf;
+    for (const AddrRange &r : getDirtyRanges()) {
+        update(file, r.first, r.second, buf);
+    }
+    dirty_.clear();
+}
+
+void BlockHashIndex::writeHeader()
+{
+    file_.pwrite(&header_, sizeof(header_), 0);
+}
+
+} // namespace walb
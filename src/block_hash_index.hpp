@@ -0,0 +1,130 @@
+#pragma once
+/**
+ * @file
+ * @brief Persistent chunk hash index of the base image of an archive volume.
+ */
+#include <vector>
+#include <string>
+#include "fileio.hpp"
+#include "meta.hpp"
+#include "walb_util.hpp"
+#include "murmurhash3.hpp"
+#include "merkle_hash.hpp"
+#include "cybozu/exception.hpp"
+
+namespace walb {
+
+/**
+ * Chunk hash index of a full image.
+ *
+ * The i-th entry is the hash of the i-th bulkLb chunk with seed i,
+ * which is the same value StreamHasher(0) calculates for the i-th push.
+ * The last chunk may be shorter than bulkLb.
+ *
+ * File format:
+ *   Header, then nrChunks() entries of Hash.
+ *
+ * The index is valid only for the base image state recorded in the header.
+ * Call invalidate() before modifying the image,
+ * then update touched chunks and call validate() after that.
+ */
+class BlockHashIndex
+{
+public:
+    using Hash = cybozu::murmurhash3::Hash;
+
+    struct Header
+    {
+        uint32_t magic;
+        uint32_t isValid;
+        uint64_t sizeLb;
+        uint64_t bulkLb;
+        uint64_t gidB; // base image state.
+        uint64_t gidE;
+        uint64_t timestamp;
+    };
+private:
+    static const uint32_t MAGIC = 0x78646968; // "hidx".
+    static const size_t CACHE_SIZE = 4096; // [entries].
+
+    cybozu::util::File file_;
+    Header header_;
+    std::vector<bool> dirty_; // chunks to update.
+
+    /* Read-ahead cache for get(). */
+    std::vector<Hash> cache_;
+    uint64_t cacheIdx_;
+public:
+    BlockHashIndex()
+        : file_(), header_(), dirty_(), cache_(), cacheIdx_(0) {
+    }
+    /**
+     * Open an existing index file.
+     * RETURN:
+     *   false if the file does not exist or it is broken.
+     */
+    bool open(const std::string &path);
+    /**
+     * Initialize an invalid index in an empty file. All entries must be updated before validate().
+     * @fd the file descriptor must be kept opened while using the index.
+     */
+    void create(int fd, uint64_t sizeLb, uint64_t bulkLb);
+
+    uint64_t sizeLb() const { return header_.sizeLb; }
+    uint64_t bulkLb() const { return header_.bulkLb; }
+    uint64_t nrChunks() const {
+        return (header_.sizeLb + header_.bulkLb - 1) / header_.bulkLb;
+    }
+    uint64_t chunkLb(uint64_t idx) const {
+        return std::min(header_.bulkLb, header_.sizeLb - idx * header_.bulkLb);
+    }
+    bool isValid() const { return header_.isValid != 0; }
+    /**
+     * The index can be used for the base image in the state.
+     */
+    bool isValidFor(const MetaState &st, uint64_t sizeLb) const {
+        return isValid() && !st.isApplying && header_.sizeLb == sizeLb
+            && header_.gidB == st.snapB.gidB && header_.gidE == st.snapB.gidE
+            && header_.timestamp == st.timestamp;
+    }
+    void invalidate();
+    /**
+     * Persist all the entries, then mark the index valid for the state.
+     */
+    void validate(const MetaState &st);
+
+    /**
+     * Get the hash of a chunk.
+     * This is efficient for sequential access.
+     */
+    const Hash& get(uint64_t idx);
+    /**
+     * Hash chunks [idxB, idxE) of the image and store them.
+     * @file the image opened with O_DIRECT.
+     */
+    void update(cybozu::util::File &file, uint64_t idxB, uint64_t idxE, AlignedArray &buf);
+
+    /**
+     * Mark chunks overlapping an IO as dirty.
+     * Call updateDirty() to hash them again.
+     */
+    void markDirty(uint64_t addr, uint64_t blks);
+    /**
+     * RETURN:
+     *   ranges of dirty chunk indexes.
+     */
+    AddrRangeVec getDirtyRanges() const;
+    void updateDirty(cybozu::util::File &file);
+private:
+    void writeHeader();
+    void verifyIdx(uint64_t idx) const {
+        if (idx >= nrChunks()) {
+            throw cybozu::Exception("BlockHashIndex:bad index") << idx << nrChunks();
+        }
+    }
+    static off_t entryOffset(uint64_t idx) {
+        return sizeof(Header) + idx * sizeof(Hash);
+    }
+};
+
+} // namespace walb
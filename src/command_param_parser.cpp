@@ -194,8 +194,8 @@ ResizeParam parseResizeParam(const StrVec &args, bool allowZeroClear, bool allow
 VirtualFullScanParam parseVirtualFullScanParam(const StrVec &args)
 {
     VirtualFullScanParam param;
-    std::string gidStr, bulkSizeU, sizeU;
-    cybozu::util::parseStrVec(args, 0, 2, {&param.volId, &gidStr, &bulkSizeU, &sizeU});
+    std::string gidStr, bulkSizeU, sizeU, startU;
+    cybozu::util::parseStrVec(args, 0, 2, {&param.volId, &gidStr, &bulkSizeU, &sizeU, &startU});
     verifyVolIdFormat(param.volId);
     param.gid = cybozu::atoi(gidStr);
     if (bulkSizeU.empty()) {
@@ -208,6 +208,11 @@ VirtualFullScanParam parseVirtualFullScanParam(const StrVec &args)
     } else {
         param.sizeLb = util::parseSizeLb(sizeU, __func__);
     }
+    if (startU.empty()) {
+        param.startLb = 0;
+    } else {
+        param.startLb = util::parseSizeLb(startU, __func__);
+    }
     return param;
 }
 
@@ -226,6 +231,32 @@ VirtualFullScanCmdParam parseVirtualFullScanCmdParam(const StrVec &args)
 }
 
 
+BlockHashParam parseBlockHashParam(const StrVec &args)
+{
+    BlockHashParam param;
+    std::string gidStr, bulkSizeU, sizeU, hashAlgoStr;
+    cybozu::util::parseStrVec(args, 0, 2, {&param.volId, &gidStr, &bulkSizeU, &sizeU, &hashAlgoStr});
+    verifyVolIdFormat(param.volId);
+    param.gid = cybozu::atoi(gidStr);
+    if (bulkSizeU.empty()) {
+        param.bulkLb = DEFAULT_BULK_LB;
+    } else {
+        param.bulkLb = util::parseBulkLb(bulkSizeU, __func__);
+    }
+    if (sizeU.empty()) {
+        param.sizeLb = 0;
+    } else {
+        param.sizeLb = util::parseSizeLb(sizeU, __func__);
+    }
+    if (hashAlgoStr.empty()) {
+        param.hashAlgo = cybozu::murmurhash3::HASH_ALGO_MURMUR3;
+    } else {
+        param.hashAlgo = cybozu::murmurhash3::parseHashAlgo(hashAlgoStr);
+    }
+    return param;
+}
+
+
 SetUuidParam parseSetUuidParam(const StrVec &args)
 {
     SetUuidParam param;
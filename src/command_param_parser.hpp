@@ -7,6 +7,7 @@
 #include "uuid.hpp"
 #include "meta.hpp"
 #include "stop_opt.hpp"
+#include "murmurhash3.hpp"
 #include "cybozu/exception.hpp"
 
 namespace walb {
@@ -136,7 +137,8 @@ struct VirtualFullScanParam
     std::string volId;
     uint64_t gid;
     uint64_t bulkLb;
-    uint64_t sizeLb; // 0 means whole device size.
+    uint64_t sizeLb; // 0 means up to the end of the device.
+    uint64_t startLb; // scanning start offset.
 };
 
 
@@ -153,6 +155,19 @@ struct VirtualFullScanCmdParam
 VirtualFullScanCmdParam parseVirtualFullScanCmdParam(const StrVec &args);
 
 
+struct BlockHashParam
+{
+    std::string volId;
+    uint64_t gid;
+    uint64_t bulkLb;
+    uint64_t sizeLb; // 0 means up to the end of the device.
+    cybozu::murmurhash3::HashAlgo hashAlgo;
+};
+
+
+BlockHashParam parseBlockHashParam(const StrVec &args);
+
+
 struct SetUuidParam
 {
     std::string volId;
@@ -243,6 +258,7 @@ inline void verifyMergeParam(const StrVec &args) { parseMergeParam(args); }
 inline void verifyResizeParam(const StrVec &args) { parseResizeParam(args, true, true); }
 inline void verifyVirtualFullScanParam(const StrVec &args) { parseVirtualFullScanParam(args); }
 inline void verifyVirtualFullScanCmdParam(const StrVec &args) { parseVirtualFullScanCmdParam(args); }
+inline void verifyBlockHashParam(const StrVec &args) { parseBlockHashParam(args); }
 inline void verifySetUuidParam(const StrVec &args) { parseSetUuidParam(args); }
 inline void verifySetStateParam(const StrVec &args) { parseSetStateParam(args); }
 inline void verifySetBaseParam(const StrVec &args) { parseSetBaseParam(args); }
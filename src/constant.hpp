@@ -19,11 +19,20 @@ const size_t DEFAULT_TIMEOUT_SEC = 60;
 const size_t DEFAULT_MAX_CONNECTIONS = 10;
 const size_t DEFAULT_MAX_FOREGROUND_TASKS = 2;
 const size_t DEFAULT_MAX_BACKGROUND_TASKS = 1;
+const size_t DEFAULT_MAX_BACKGROUND_TASKS_PER_VOLUME = 1;
+/* A proxy sends wdiffs of a volume to each archive in separate tasks. */
+const size_t DEFAULT_PROXY_MAX_BACKGROUND_TASKS_PER_VOLUME = 0;
 const size_t DEFAULT_MAX_WDIFF_SEND_MB = 128;
 const size_t DEFAULT_MAX_WDIFF_SEND_NR = 1000;
 const size_t DEFAULT_MAX_WDIFF_MERGE_MB = 1024;
 const size_t DEFAULT_MAX_WLOG_SEND_MB = 128;
+const size_t DEFAULT_WLOG_SEND_CPU = 2;
 const size_t DEFAULT_MAX_CONVERSION_MB = 1024;
+const size_t DEFAULT_WLOG_RECV_CPU = 2;
+const size_t DEFAULT_MERGE_READ_AHEAD_CPU = 2;
+const size_t DEFAULT_HASH_SYNC_CPU = 2;
+const size_t DEFAULT_FULL_SYNC_CPU = 2;
+const size_t MAX_MERGE_READ_AHEAD_SIZE = 64 * MEBI;
 const size_t DEFAULT_DELAY_SEC_FOR_RETRY = 20;
 const size_t DEFAULT_RETRY_TIMEOUT_SEC = 1800;
 const size_t DEFAULT_MAX_OPEN_DIFFS = 0; // 0 means unlimited.
@@ -36,12 +45,20 @@ const size_t DEFAULT_SOCKET_TIMEOUT_SEC = 10;
 const uint64_t DEFAULT_FULL_SCAN_BYTES_PER_SEC = 0; // unlimited.
 
 const uint64_t DEFAULT_FSYNC_INTERVAL_SIZE = 128 * MEBI;
+const size_t DEFAULT_APPLY_BUFFER_SIZE = 8 * MEBI;
 const size_t DEFAULT_MERGE_BUFFER_LB = 4 * MEBI / LBS;
 
 const char DEFAULT_DISCARD_TYPE_STR[] = "ignore";
+const char DEFAULT_FULL_SYNC_CMPR_STR[] = "snappy:0:2";
+const char DEFAULT_MERGE_CMPR_STR[] = "snappy:0:2";
+const char DEFAULT_HASH_ALGO_STR[] = "xxh3"; // older peers always use murmur3.
 
 const uint64_t DIRTY_HASH_SYNC_READ_AHEAD_LB = 256 * MEBI / LBS;
 const uint64_t DIRTY_HASH_SYNC_MAX_PACK_AREA_LB = 256 * MEBI / LBS;
+const uint32_t MERKLE_HASH_FANOUT = 64;
+const uint32_t MERKLE_HASH_SEED = 0; // fixed to reuse cached trees.
+const size_t MERKLE_HASH_HEARTBEAT_INTERVAL_MS = 1000;
+const uint64_t BLOCK_HASH_INDEX_BULK_LB = DEFAULT_BULK_LB;
 
 const int DEFAULT_TCP_KEEPIDLE = 60 * 30;
 const int DEFAULT_TCP_KEEPINTVL = 60;
@@ -54,10 +71,16 @@ const size_t PROGRESS_INTERVAL_SEC = 60;
 
 const size_t DEFAULT_TS_DELTA_INTERVAL_SEC = 60;
 
+const size_t DEFAULT_METRICS_INTERVAL_SEC = 10;
+
 const uint32_t DEFAULT_MAX_IO_LB = MEBI / LBS; // used as max diff IO size.
 
 const size_t DEFAULT_IMPLICIT_SNAPSHOT_INTERVAL_SEC = 10;
 
 const size_t INDEXED_DIFF_CACHE_SIZE = 32 * MEBI;
+const size_t MAX_WDIFF_HOLD_BACK_SIZE = 64 * MEBI;
+const uint64_t DEFAULT_INDEXED_DIFF_UNIT_SIZE = 64 * KIBI; // compression unit of streamed indexed wdiffs.
+const size_t MAX_INDEXED_DIFF_INDEX_MEM_SIZE = 4 * MEBI; // index records held in memory while streaming.
+const size_t INDEXED_DIFF_STREAM_BATCH_SIZE = MEBI; // IO data compressed by a thread at once.
 
 } // walb
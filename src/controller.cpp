@@ -91,7 +91,8 @@ void c2aBlockHashClient(protocol::ClientParams &p)
 }
 
 void virtualFullScanClient(
-    const std::string &devPath, packet::Packet& pkt, size_t bulkLb, uint64_t fsyncIntervalSize)
+    const std::string &devPath, packet::Packet& pkt, size_t bulkLb, uint64_t fsyncIntervalSize,
+    uint64_t startLb)
 {
     const char *const FUNC = __func__;
 
@@ -106,12 +107,16 @@ void virtualFullScanClient(
         if (stat.exists() && stat.isBlock()) {
             file.open(devPath, O_RDWR);
             const uint64_t devSizeLb = cybozu::util::getBlockDeviceSize(file.fd()) / LOGICAL_BLOCK_SIZE;
-            if (devSizeLb < sizeLb) {
-                throw cybozu::Exception(FUNC) << "too small device size" << sizeLb << devSizeLb;
+            if (devSizeLb < startLb + sizeLb) {
+                throw cybozu::Exception(FUNC) << "too small device size" << startLb << sizeLb << devSizeLb;
             }
-        } else {
+        } else if (startLb == 0) {
             file.open(devPath, O_WRONLY | O_TRUNC | O_CREAT, 0644);
+        } else {
+            /* Overwrite the range of an existing image. */
+            file.open(devPath, O_WRONLY | O_CREAT, 0644);
         }
+        if (startLb > 0) file.lseek(startLb * LOGICAL_BLOCK_SIZE);
     }
 
     const size_t bulkSize = bulkLb * LOGICAL_BLOCK_SIZE;
@@ -161,7 +166,8 @@ void c2aVirtualFullScanClient(protocol::ClientParams &p)
     protocol::sendStrVec(p.sock, args, 0, __func__, msgAccept);
     packet::Packet pkt(p.sock);
 
-    virtualFullScanClient(cmdParam.devPath, pkt, cmdParam.param.bulkLb, DEFAULT_FSYNC_INTERVAL_SIZE);
+    virtualFullScanClient(cmdParam.devPath, pkt, cmdParam.param.bulkLb, DEFAULT_FSYNC_INTERVAL_SIZE,
+                          cmdParam.param.startLb);
 
     std::string msg;
     pkt.read(msg);
@@ -203,6 +209,8 @@ const protocol::GetCommandInfoMap &getGetCommandInfoMap()
         {getLatestSnapTN, {protocol::StringVecType, verifyVolIdOrAllParamForGet, "[(volId)] get latest snapshot information for volume(s)."}},
         {getTsDeltaTN, {protocol::StringVecType, verifyNoneParam, "get timestamp delta information."}},
         {getHandlerStatTN, {protocol::StringVecType, verifyNoneParam, "get handler statistics."}},
+        {diffCacheTN, {protocol::StringType, verifyNoneParam, "get indexed diff cache statistics (archive)."}},
+        {metricsTN, {protocol::StringVecType, verifyVolIdOrAllParamForGet, "[(volId)] get stage latency and throughput metrics for volume(s)."}},
     };
     return m;
 }
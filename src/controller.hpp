@@ -254,8 +254,13 @@ inline void c2sSetFullScanBpsClient(protocol::ClientParams &p)
  */
 void c2aBlockHashClient(protocol::ClientParams &p);
 
+/**
+ * The received range will be written at startLb of the device or the file.
+ * It is written from the beginning for stdout.
+ */
 void virtualFullScanClient(
-    const std::string &devPath, packet::Packet& pkt, size_t bulkLb, uint64_t fsyncIntervalSize);
+    const std::string &devPath, packet::Packet& pkt, size_t bulkLb, uint64_t fsyncIntervalSize,
+    uint64_t startLb = 0);
 
 /**
  * params[0]: device path or '-' for stdout.
@@ -263,6 +268,7 @@ void virtualFullScanClient(
  * params[2]: gidStr
  * params[3] blkSizeU (optional)
  * params[4]: scanSizeU (optional)
+ * params[5]: startOffsetU (optional)
  */
 void c2aVirtualFullScanClient(protocol::ClientParams &p);
 
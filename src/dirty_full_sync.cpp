@@ -2,6 +2,37 @@
 
 namespace walb {
 
+namespace dirty_full_sync_local {
+
+void encodeBulk(Bulk &bulk, int type, int level)
+{
+    const size_t size = bulk.lb * LOGICAL_BLOCK_SIZE;
+    assert(bulk.data.size() == size);
+    if (cybozu::util::isAllZero(bulk.data.data(), size)) {
+        bulk.data.clear();
+        return;
+    }
+    AlignedArray encData;
+    size_t encSize;
+    compressData(bulk.data.data(), size, encData, encSize, type, level);
+    bulk.data = std::move(encData);
+}
+
+void decodeBulk(Bulk &bulk, int type)
+{
+    const size_t size = bulk.lb * LOGICAL_BLOCK_SIZE;
+    const size_t encSize = bulk.data.size();
+    if (encSize == 0 || encSize == size) return;
+    if (encSize > size) {
+        throw cybozu::Exception(__func__) << "too large encoded size" << encSize << size;
+    }
+    AlignedArray data(size, false);
+    uncompressData(bulk.data.data(), encSize, data, type);
+    bulk.data = std::move(data);
+}
+
+} // namespace dirty_full_sync_local
+
 bool dirtyFullSyncClient(
     packet::Packet &pkt, const std::string &bdevPath,
     uint64_t startLb, uint64_t sizeLb, uint64_t bulkLb,
@@ -110,4 +141,165 @@ bool dirtyFullSyncServer(
     return true;
 }
 
+bool parallelDirtyFullSyncClient(
+    packet::Packet &pkt, const std::string &bdevPath,
+    uint64_t startLb, uint64_t sizeLb, uint64_t bulkLb,
+    const std::atomic<int> &stopState, const ProcessStatus &ps,
+    const std::atomic<uint64_t>& maxLbPerSec, const CompressOpt &cmpr)
+{
+    using namespace dirty_full_sync_local;
+    using Converter = cybozu::thread::ParallelConverter<Bulk, Bulk>;
+    assert(startLb <= sizeLb);
+    const int type = cmpr.type;
+    const int level = cmpr.level;
+    Converter conv([type, level](Bulk &&bulk) {
+            encodeBulk(bulk, type, level);
+            return std::move(bulk);
+        });
+    conv.start(cmpr.numCpu);
+
+    uint64_t c = 0;
+    cybozu::thread::ThreadRunner sender([&]() {
+            try {
+                Bulk bulk;
+                while (conv.pop(bulk)) {
+                    pkt.write(bulk.data.size());
+                    if (!bulk.data.empty()) pkt.write(bulk.data.data(), bulk.data.size());
+                    c++;
+                }
+                pkt.flush();
+            } catch (...) {
+                conv.fail();
+                throw;
+            }
+        });
+    sender.start();
+
+    AsyncBdevReader reader(bdevPath, startLb);
+    ThroughputStabilizer thStab;
+    uint64_t remainingLb = sizeLb - startLb;
+    try {
+        while (0 < remainingLb) {
+            if (stopState == ForceStopping || ps.isForceShutdown()) {
+                conv.fail();
+                sender.joinNoThrow();
+                return false;
+            }
+            const uint32_t lb = std::min<uint64_t>(bulkLb, remainingLb);
+            Bulk bulk;
+            bulk.lb = lb;
+            bulk.data.resize(lb * LOGICAL_BLOCK_SIZE, false);
+            reader.read(bulk.data.data(), bulk.data.size());
+            conv.push(std::move(bulk));
+            remainingLb -= lb;
+            thStab.setMaxLbPerSec(maxLbPerSec.load());
+            thStab.addAndSleepIfNecessary(lb, 10, 100);
+        }
+        conv.sync();
+    } catch (...) {
+        conv.fail();
+        sender.join(); // the sender error will be thrown if exists.
+        throw;
+    }
+    sender.join();
+    packet::Ack(pkt.sock()).recv();
+    LOGs.debug() << "number of sent packets" << c;
+    return true;
+}
+
+bool parallelDirtyFullSyncServer(
+    packet::Packet &pkt, const std::string &bdevPath,
+    uint64_t startLb, uint64_t sizeLb, uint64_t bulkLb,
+    const std::atomic<int> &stopState, const ProcessStatus &ps, std::atomic<uint64_t> &progressLb,
+    bool skipZero, uint64_t fsyncIntervalSize, int cmprType, size_t concurrency)
+{
+    const char *const FUNC = __func__;
+    using namespace dirty_full_sync_local;
+    using Converter = cybozu::thread::ParallelConverter<Bulk, Bulk>;
+    assert(startLb <= sizeLb);
+    if (concurrency == 0) throw cybozu::Exception(FUNC) << "concurrency must not be 0";
+    Converter conv([cmprType](Bulk &&bulk) {
+            decodeBulk(bulk, cmprType);
+            return std::move(bulk);
+        });
+    conv.start(concurrency);
+
+    cybozu::thread::ThreadRunner receiver([&]() {
+            try {
+                uint64_t remainingLb = sizeLb - startLb;
+                while (0 < remainingLb) {
+                    const uint32_t lb = std::min<uint64_t>(bulkLb, remainingLb);
+                    const size_t size = lb * LOGICAL_BLOCK_SIZE;
+                    size_t encSize;
+                    pkt.read(encSize);
+                    if (encSize > size) {
+                        throw cybozu::Exception(FUNC) << "too large encoded size" << encSize << size;
+                    }
+                    Bulk bulk;
+                    bulk.lb = lb;
+                    bulk.data.resize(encSize, false);
+                    if (encSize > 0) pkt.read(bulk.data.data(), encSize);
+                    conv.push(std::move(bulk));
+                    remainingLb -= lb;
+                }
+                conv.sync();
+            } catch (...) {
+                conv.fail();
+                throw;
+            }
+        });
+    receiver.start();
+
+    cybozu::util::File file(bdevPath, O_RDWR | O_DIRECT);
+    const AlignedArray zeroBuf(bulkLb * LOGICAL_BLOCK_SIZE, true);
+    AsyncBdevWriter writer(file.fd(), std::max<size_t>(4 * MEBI, zeroBuf.size() * 4));
+
+    progressLb = startLb;
+    uint64_t c = 0;
+    uint64_t addr = startLb;
+    uint64_t writeSize = 0;
+    try {
+        Bulk bulk;
+        while (conv.pop(bulk)) {
+            if (stopState == ForceStopping || ps.isForceShutdown()) {
+                conv.fail();
+                receiver.joinNoThrow();
+                return false;
+            }
+            const size_t size = bulk.lb * LOGICAL_BLOCK_SIZE;
+            if (bulk.data.empty()) {
+                if (!skipZero) writer.prepare(addr, bulk.lb, zeroBuf.data());
+            } else {
+                assert(bulk.data.size() == size);
+                writer.prepare(addr, bulk.lb, std::move(bulk.data));
+            }
+            writer.submit();
+            addr += bulk.lb;
+            progressLb += bulk.lb;
+            writeSize += size;
+            if (writeSize >= fsyncIntervalSize) {
+                writer.waitForAll();
+                file.fdatasync();
+                writeSize = 0;
+            }
+            c++;
+        }
+    } catch (...) {
+        receiver.join();
+        throw;
+    }
+    receiver.join();
+    if (addr != sizeLb) {
+        throw cybozu::Exception(FUNC) << "received size differs" << addr << sizeLb;
+    }
+    writer.waitForAll();
+    LOGs.debug() << "fdatasync start";
+    file.fdatasync();
+    LOGs.debug() << "fdatasync end";
+    packet::Ack(pkt.sock()).send();
+    pkt.flush();
+    LOGs.debug() << "number of received packets" << c;
+    return true;
+}
+
 } // namespace walb
@@ -8,6 +8,10 @@
 #include "fileio.hpp"
 #include "walb_logger.hpp"
 #include "bdev_reader.hpp"
+#include "bdev_writer.hpp"
+#include "walb_diff_base.hpp"
+#include "host_info.hpp"
+#include "thread_util.hpp"
 #include "full_repl_state.hpp"
 #include "snappy_util.hpp"
 #include "cybozu/exception.hpp"
@@ -16,6 +20,27 @@
 
 namespace walb {
 
+namespace dirty_full_sync_local {
+
+/**
+ * A bulk of a full image.
+ *
+ * Encoded data format:
+ *   empty: all zero.
+ *   lb * LOGICAL_BLOCK_SIZE bytes: not compressed.
+ *   otherwise: compressed.
+ */
+struct Bulk
+{
+    uint32_t lb;
+    AlignedArray data;
+};
+
+void encodeBulk(Bulk &bulk, int type, int level);
+void decodeBulk(Bulk &bulk, int type);
+
+} // namespace dirty_full_sync_local
+
 /**
  * sizeLb is total size.
  *
@@ -45,4 +70,32 @@ bool dirtyFullSyncClient(
     FullReplState *fullReplSt = nullptr, const cybozu::FilePath &fullReplStDir = cybozu::FilePath(),
     const std::string &fullReplStFileName = "");
 
+/**
+ * Parallel version of dirtyFullSyncClient().
+ * Bulks are compressed by cmpr.numCpu threads using cmpr.type and cmpr.level.
+ * The stream format is different from dirtyFullSyncClient()'s one.
+ *
+ * RETURN:
+ *   false if force stopped.
+ */
+bool parallelDirtyFullSyncClient(
+    packet::Packet &pkt, const std::string &bdevPath,
+    uint64_t startLb, uint64_t sizeLb, uint64_t bulkLb,
+    const std::atomic<int> &stopState, const ProcessStatus &ps,
+    const std::atomic<uint64_t>& maxLbPerSec, const CompressOpt &cmpr);
+
+/**
+ * Parallel version of dirtyFullSyncServer().
+ * Bulks are uncompressed by concurrency threads,
+ * and written with O_DIRECT asynchronous IOs.
+ *
+ * RETURN:
+ *   false if force stopped.
+ */
+bool parallelDirtyFullSyncServer(
+    packet::Packet &pkt, const std::string &bdevPath,
+    uint64_t startLb, uint64_t sizeLb, uint64_t bulkLb,
+    const std::atomic<int> &stopState, const ProcessStatus &ps, std::atomic<uint64_t> &progressLb,
+    bool skipZero, uint64_t fsyncIntervalSize, int cmprType, size_t concurrency);
+
 } // namespace walb
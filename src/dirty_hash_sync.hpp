@@ -3,6 +3,7 @@
 #include <cassert>
 #include <mutex>
 #include <condition_variable>
+#include <chrono>
 #include "packet.hpp"
 #include "walb_diff_virt.hpp"
 #include "walb_diff_file.hpp"
@@ -12,6 +13,7 @@
 #include "fileio.hpp"
 #include "uuid.hpp"
 #include "murmurhash3.hpp"
+#include "merkle_hash.hpp"
 #include "server_util.hpp"
 #include "thread_util.hpp"
 #include "throughput_util.hpp"
@@ -20,14 +22,126 @@ namespace walb {
 
 namespace dirty_hash_sync_local {
 
-inline void compressAndSend(
-    packet::Packet &pkt, DiffPacker &packer, PackCompressor &compr)
+/**
+ * Skip blocks by reading and discarding them.
+ */
+template <typename Reader>
+void skipReader(Reader &reader, uint64_t lb)
+{
+    AlignedArray buf(std::min<uint64_t>(lb, DEFAULT_BULK_LB) * LOGICAL_BLOCK_SIZE, false);
+    while (lb > 0) {
+        const uint64_t lb0 = std::min<uint64_t>(lb, DEFAULT_BULK_LB);
+        reader.read(buf.data(), lb0 * LOGICAL_BLOCK_SIZE);
+        lb -= lb0;
+    }
+}
+
+inline void skipReader(VirtualFullScanner &virt, uint64_t lb)
 {
-    compressor::Buffer compBuf = compr.convert(packer.getPackAsArray().data());
-    pkt.write<size_t>(compBuf.size());
-    pkt.write(compBuf.data(), compBuf.size());
+    virt.skip(lb);
 }
 
+/**
+ * Read chunks of bulkLb from a reader and hash them in parallel.
+ *
+ * A reader thread reads chunks sequentially,
+ * worker threads calculate their hashes,
+ * and the caller pops them in the read order.
+ * Only the specified address ranges are read if given.
+ * Reader must have the member function: void read(void *data, size_t size).
+ */
+template <typename Reader>
+class ParallelChunkHasher
+{
+public:
+    struct Chunk {
+        uint64_t addr;
+        AlignedArray buf;
+        cybozu::murmurhash3::Hash hash;
+
+        Chunk() : addr(0), buf(), hash() {}
+    };
+private:
+    using Converter = cybozu::thread::ParallelConverter<Chunk, Chunk>;
+
+    Reader &reader_;
+    const AddrRangeVec ranges_;
+    const uint64_t bulkLb_;
+    const cybozu::murmurhash3::Hasher hasher_;
+    Converter conv_;
+    cybozu::thread::ThreadRunner readerTh_;
+public:
+    ParallelChunkHasher(Reader &reader, const AddrRangeVec &ranges, uint64_t bulkLb, uint32_t hashSeed,
+                        cybozu::murmurhash3::HashAlgo hashAlgo = cybozu::murmurhash3::HASH_ALGO_MURMUR3)
+        : reader_(reader), ranges_(ranges), bulkLb_(bulkLb), hasher_(hashSeed, hashAlgo)
+        , conv_([this](Chunk &&chunk) {
+                chunk.hash = hasher_(chunk.buf.data(), chunk.buf.size());
+                return std::move(chunk);
+            })
+        , readerTh_() {
+        verifyAddrRangeVec(ranges_, UINT64_MAX, "ParallelChunkHasher");
+    }
+    ParallelChunkHasher(Reader &reader, uint64_t sizeLb, uint64_t bulkLb, uint32_t hashSeed,
+                        cybozu::murmurhash3::HashAlgo hashAlgo = cybozu::murmurhash3::HASH_ALGO_MURMUR3)
+        : ParallelChunkHasher(
+            reader, sizeLb == 0 ? AddrRangeVec() : AddrRangeVec{{0, sizeLb}}, bulkLb, hashSeed, hashAlgo) {
+    }
+    ~ParallelChunkHasher() noexcept {
+        fail();
+    }
+    /**
+     * @concurrency number of hashing threads. It must be > 0.
+     */
+    void start(size_t concurrency) {
+        if (concurrency == 0) {
+            throw cybozu::Exception("ParallelChunkHasher") << "concurrency must not be 0";
+        }
+        conv_.start(concurrency);
+        readerTh_.set([this]() { runReader(); });
+        readerTh_.start();
+    }
+    /**
+     * RETURN:
+     *   false if all the chunks have been popped.
+     * If the reader thread has failed, its error will be thrown.
+     */
+    bool pop(Chunk &chunk) {
+        try {
+            return conv_.pop(chunk);
+        } catch (...) {
+            readerTh_.join();
+            throw;
+        }
+    }
+    void fail() noexcept {
+        conv_.fail();
+        readerTh_.joinNoThrow();
+    }
+private:
+    void runReader() try {
+        uint64_t lb = 0;
+        for (const AddrRange &range : ranges_) {
+            if (lb < range.first) {
+                skipReader(reader_, range.first - lb);
+                lb = range.first;
+            }
+            while (lb < range.second) {
+                const uint64_t chunkLb = std::min<uint64_t>(range.second - lb, bulkLb_);
+                Chunk chunk;
+                chunk.addr = lb;
+                chunk.buf.resize(chunkLb * LOGICAL_BLOCK_SIZE, false);
+                reader_.read(chunk.buf.data(), chunk.buf.size());
+                conv_.push(std::move(chunk));
+                lb += chunkLb;
+            }
+        }
+        conv_.sync();
+    } catch (...) {
+        conv_.fail();
+        throw;
+    }
+};
+
 /**
  * func must send/receive just one byte.
  */
@@ -55,6 +169,63 @@ void doRetrySockIo(size_t nr, const char *msg, Func&& func)
     if (failed) std::rethrow_exception(ep);
 }
 
+/**
+ * Compress diff packs in parallel and send them in the pushed order.
+ */
+class ParallelPackSender
+{
+private:
+    packet::Packet &pkt_;
+    packet::StreamControl2 &ctrl_;
+    ConverterQueue conv_;
+    const size_t maxPending_;
+    size_t nrPending_;
+    size_t &cSend_;
+public:
+    ParallelPackSender(packet::Packet &pkt, packet::StreamControl2 &ctrl, size_t concurrency, size_t &cSend)
+        : pkt_(pkt), ctrl_(ctrl)
+        , conv_(concurrency * 2 + 1, concurrency, true, ::WALB_DIFF_CMPR_SNAPPY)
+        , maxPending_(concurrency * 2), nrPending_(0), cSend_(cSend) {
+    }
+    /**
+     * The packer will be cleared.
+     */
+    void push(DiffPacker &packer) {
+        if (nrPending_ >= maxPending_) popAndSend();
+        if (!conv_.push(packer.getPackAsArray())) {
+            throw cybozu::Exception("ParallelPackSender:push:failed");
+        }
+        nrPending_++;
+    }
+    /**
+     * Send all the pushed packs.
+     */
+    void sync() {
+        while (nrPending_ > 0) popAndSend();
+    }
+private:
+    void popAndSend() {
+        assert(nrPending_ > 0);
+        compressor::Buffer compBuf = conv_.pop();
+        nrPending_--;
+        if (compBuf.empty()) throw cybozu::Exception("ParallelPackSender:pop:failed");
+        doRetrySockIo(4, "ctrl.send.next", [&]() { ctrl_.sendNext(); });
+        cSend_++;
+        pkt_.write<size_t>(compBuf.size());
+        pkt_.write(compBuf.data(), compBuf.size());
+    }
+};
+
+inline void sendHash(
+    uint64_t& hashLb,
+    packet::Packet& pkt, packet::StreamControl2& ctrl, uint64_t lb,
+    const cybozu::murmurhash3::Hash& hash)
+{
+    doRetrySockIo(2, "ctrl.send.next", [&]() { ctrl.sendNext(); });
+    pkt.write(hash);
+    hashLb += lb;
+}
+
 template <typename Reader>
 void readAndSendHash(
     uint64_t& hashLb,
@@ -66,9 +237,7 @@ void readAndSendHash(
     buf.resize(lb * LOGICAL_BLOCK_SIZE);
     reader.read(buf.data(), buf.size());
     const cybozu::murmurhash3::Hash hash = hasher(buf.data(), buf.size());
-    doRetrySockIo(2, "ctrl.send.next", [&]() { ctrl.sendNext(); });
-    pkt.write(hash);
-    hashLb += lb;
+    sendHash(hashLb, pkt, ctrl, lb, hash);
 }
 
 inline void readPackAndWrite(
@@ -102,26 +271,30 @@ inline void readPackAndWrite(
 
 /**
  * Reader must have the member function: void read(void *data, size_t size).
+ * Chunks are hashed and mismatched packs are compressed
+ * by concurrency threads respectively.
+ * Only the address ranges are compared, which must be the same as the server's ones.
  */
 template <typename Reader>
 bool dirtyHashSyncClient(
     packet::Packet &pkt, Reader &reader,
-    uint64_t sizeLb, uint64_t bulkLb, uint32_t hashSeed,
+    const AddrRangeVec &ranges, uint64_t bulkLb, uint32_t hashSeed, cybozu::murmurhash3::HashAlgo hashAlgo,
     const std::atomic<int> &stopState, const ProcessStatus &ps,
-    const std::atomic<uint64_t>& maxLbPerSec)
+    const std::atomic<uint64_t>& maxLbPerSec, size_t concurrency = 1)
 {
     const char *const FUNC = __func__;
     packet::StreamControl2 recvCtl(pkt.sock());
     packet::StreamControl2 sendCtl(pkt.sock());
     DiffPacker packer;
-    walb::PackCompressor compr(::WALB_DIFF_CMPR_SNAPPY);
-    cybozu::murmurhash3::Hasher hasher(hashSeed);
     ThroughputStabilizer thStab;
 
-    uint64_t addr = 0;
-    uint64_t remainingLb = sizeLb;
-    AlignedArray buf;
+    uint64_t remainingLb = getTotalRangeSize(ranges);
     size_t cHash = 0, cSend = 0, cDummy = 0;
+    using ChunkHasher = dirty_hash_sync_local::ParallelChunkHasher<Reader>;
+    ChunkHasher chunkHasher(reader, ranges, bulkLb, hashSeed, hashAlgo);
+    typename ChunkHasher::Chunk chunk;
+    dirty_hash_sync_local::ParallelPackSender packSender(pkt, sendCtl, concurrency, cSend);
+    chunkHasher.start(concurrency);
     try {
     for (;;) {
         if (stopState == ForceStopping || ps.isForceShutdown()) {
@@ -138,30 +311,26 @@ bool dirtyHashSyncClient(
         pkt.read(recvHash);
         cHash++;
 
-        const uint32_t lb = std::min<uint64_t>(remainingLb, bulkLb);
-        buf.resize(lb * LOGICAL_BLOCK_SIZE);
-        reader.read(buf.data(), buf.size());
+        if (!chunkHasher.pop(chunk)) {
+            throw cybozu::Exception(FUNC) << "chunk not found" << remainingLb;
+        }
+        const uint64_t addr = chunk.addr;
+        const uint32_t lb = chunk.buf.size() / LOGICAL_BLOCK_SIZE;
 
         // to avoid socket timeout.
         dirty_hash_sync_local::doRetrySockIo(4, "ctrl.send.dummy", [&]() { sendCtl.sendDummy(); });
         cDummy++; cSend++;
 
-        const cybozu::murmurhash3::Hash bdHash = hasher(buf.data(), buf.size());
         const uint64_t bgnAddr = packer.empty() ? addr : packer.header()[0].io_address;
         if (addr - bgnAddr >= DIRTY_HASH_SYNC_MAX_PACK_AREA_LB && !packer.empty()) {
-            dirty_hash_sync_local::doRetrySockIo(4, "ctrl.send.next0", [&]() { sendCtl.sendNext(); });
-            cSend++;
-            dirty_hash_sync_local::compressAndSend(pkt, packer, compr);
+            packSender.push(packer);
         }
-        if (recvHash != bdHash && !packer.add(addr, lb, buf.data())) {
-            dirty_hash_sync_local::doRetrySockIo(4, "ctrl.send.next1", [&]() { sendCtl.sendNext(); });
-            cSend++;
-            dirty_hash_sync_local::compressAndSend(pkt, packer, compr);
-            packer.add(addr, lb, buf.data());
+        if (recvHash != chunk.hash && !packer.add(addr, lb, chunk.buf.data())) {
+            packSender.push(packer);
+            packer.add(addr, lb, chunk.buf.data());
         }
         pkt.flush();
         remainingLb -= lb;
-        addr += lb;
         thStab.setMaxLbPerSec(maxLbPerSec.load());
         thStab.addAndSleepIfNecessary(lb, 10, 100);
     }
@@ -169,11 +338,8 @@ bool dirtyHashSyncClient(
         LOGs.warn() << "SEND_CTL" << cHash << cSend << cDummy;
         throw;
     }
-    if (!packer.empty()) {
-        dirty_hash_sync_local::doRetrySockIo(4, "ctrl.send.next2", [&]() { sendCtl.sendNext(); });
-        cSend++;
-        dirty_hash_sync_local::compressAndSend(pkt, packer, compr);
-    }
+    if (!packer.empty()) packSender.push(packer);
+    packSender.sync();
     if (recvCtl.isError()) {
         throw cybozu::Exception(FUNC) << "recvCtl";
     }
@@ -184,19 +350,32 @@ bool dirtyHashSyncClient(
     return true;
 }
 
+template <typename Reader>
+bool dirtyHashSyncClient(
+    packet::Packet &pkt, Reader &reader,
+    uint64_t sizeLb, uint64_t bulkLb, uint32_t hashSeed, cybozu::murmurhash3::HashAlgo hashAlgo,
+    const std::atomic<int> &stopState, const ProcessStatus &ps,
+    const std::atomic<uint64_t>& maxLbPerSec, size_t concurrency = 1)
+{
+    const AddrRangeVec ranges = sizeLb == 0 ? AddrRangeVec() : AddrRangeVec{{0, sizeLb}};
+    return dirtyHashSyncClient(
+        pkt, reader, ranges, bulkLb, hashSeed, hashAlgo, stopState, ps, maxLbPerSec, concurrency);
+}
+
 /**
  * doWriteDiff is true, outFd means oupput wdiff fd.
  * otherwise, outFd means block device fd of full image store.
  *
  * fsyncIntervalSize [bytes].
+ * Only the address ranges are compared, which must be the same as the client's ones.
  */
 template <typename Reader>
 bool dirtyHashSyncServer(
     packet::Packet &pkt, Reader &reader,
-    uint64_t sizeLb, uint64_t bulkLb, const cybozu::Uuid& uuid, uint32_t hashSeed,
-    bool doWriteDiff, int outFd, DiscardType discardType,
+    const AddrRangeVec &ranges, uint64_t bulkLb, const cybozu::Uuid& uuid,
+    uint32_t hashSeed, cybozu::murmurhash3::HashAlgo hashAlgo, bool doWriteDiff, int outFd, DiscardType discardType,
     const std::atomic<int> &stopState, const ProcessStatus &ps, std::atomic<uint64_t> &progressLb,
-    uint64_t fsyncIntervalSize)
+    uint64_t fsyncIntervalSize, size_t concurrency = 1)
 {
     const char *const FUNC = __func__;
 
@@ -208,21 +387,27 @@ bool dirtyHashSyncServer(
     };
 
     auto readVirtualFullImageAndSendHash = [&]() {
-        cybozu::murmurhash3::Hasher hasher(hashSeed);
+        using ChunkHasher = dirty_hash_sync_local::ParallelChunkHasher<Reader>;
+        ChunkHasher chunkHasher(reader, ranges, bulkLb, hashSeed, hashAlgo);
+        typename ChunkHasher::Chunk chunk;
         packet::StreamControl2 ctrl(pkt.sock());
-        AlignedArray buf;
+        const uint64_t totalLb = getTotalRangeSize(ranges);
         uint64_t hashLb = 0;
         size_t sHash = 0;
         try {
-            while (hashLb < sizeLb) {
+            chunkHasher.start(concurrency);
+            while (hashLb < totalLb) {
                 if (abortCondition()) {
                     quit = true;
                     return;
                 }
-                dirty_hash_sync_local::readAndSendHash(
-                    hashLb, pkt, ctrl, reader, sizeLb, bulkLb, hasher, buf);
+                if (!chunkHasher.pop(chunk)) {
+                    throw cybozu::Exception(FUNC) << "chunk not found" << hashLb << totalLb;
+                }
+                const uint64_t lb = chunk.buf.size() / LOGICAL_BLOCK_SIZE;
+                dirty_hash_sync_local::sendHash(hashLb, pkt, ctrl, lb, chunk.hash);
                 sHash++;
-                progressLb = hashLb;
+                progressLb = chunk.addr + lb;
             }
             ctrl.sendEnd();
             pkt.flush();
@@ -286,6 +471,55 @@ bool dirtyHashSyncServer(
     return !quit;
 }
 
+template <typename Reader>
+bool dirtyHashSyncServer(
+    packet::Packet &pkt, Reader &reader,
+    uint64_t sizeLb, uint64_t bulkLb, const cybozu::Uuid& uuid,
+    uint32_t hashSeed, cybozu::murmurhash3::HashAlgo hashAlgo, bool doWriteDiff, int outFd, DiscardType discardType,
+    const std::atomic<int> &stopState, const ProcessStatus &ps, std::atomic<uint64_t> &progressLb,
+    uint64_t fsyncIntervalSize, size_t concurrency = 1)
+{
+    const AddrRangeVec ranges = sizeLb == 0 ? AddrRangeVec() : AddrRangeVec{{0, sizeLb}};
+    return dirtyHashSyncServer(
+        pkt, reader, ranges, bulkLb, uuid, hashSeed, hashAlgo, doWriteDiff, outFd, discardType,
+        stopState, ps, progressLb, fsyncIntervalSize, concurrency);
+}
+
+/**
+ * Build a merkle hash tree by reading the whole image.
+ * The tree must have been initialized.
+ * Dummy messages are sent periodically to avoid socket timeout of the peer,
+ * which may be waiting for this side in merkleHashSyncReady().
+ */
+template <typename Reader>
+bool buildMerkleHashTree(
+    packet::Packet &pkt, MerkleHashTree &tree, Reader &reader,
+    const std::atomic<int> &stopState, const ProcessStatus &ps, std::atomic<uint64_t> &progressLb,
+    size_t concurrency = 1)
+{
+    using ChunkHasher = dirty_hash_sync_local::ParallelChunkHasher<Reader>;
+    using Clock = std::chrono::steady_clock;
+    ChunkHasher chunkHasher(reader, tree.sizeLb(), tree.bulkLb(), tree.hashSeed(), tree.hashAlgo());
+    typename ChunkHasher::Chunk chunk;
+    packet::StreamControl2 ctrl(pkt.sock());
+    const std::chrono::milliseconds interval(MERKLE_HASH_HEARTBEAT_INTERVAL_MS);
+    Clock::time_point ts = Clock::now();
+    chunkHasher.start(concurrency);
+    while (chunkHasher.pop(chunk)) {
+        if (stopState == ForceStopping || ps.isForceShutdown()) return false;
+        tree.addLeaf(chunk.hash);
+        progressLb = chunk.addr + chunk.buf.size() / LOGICAL_BLOCK_SIZE;
+        const Clock::time_point now = Clock::now();
+        if (now - ts >= interval) {
+            dirty_hash_sync_local::doRetrySockIo(4, "ctrl.send.dummy", [&]() { ctrl.sendDummy(); });
+            pkt.flush();
+            ts = now;
+        }
+    }
+    tree.finalize();
+    return true;
+}
+
 /**
  * Single-threaded version.
  * For test.
@@ -77,8 +77,10 @@ HostInfoForRepl parseHostInfoForRepl(const StrVec &v, size_t pos)
     std::string cmprStr = CompressOpt().str();
     std::string maxWdiffMergeSizeStr = cybozu::util::toUnitIntString(DEFAULT_MAX_WDIFF_MERGE_MB * MEBI);
     std::string bulkSizeStr = cybozu::util::toUnitIntString(DEFAULT_BULK_LB * LOGICAL_BLOCK_SIZE);
+    std::string useMerkleHashStr = "0";
     cybozu::util::parseStrVec(
-        v, pos, 1, {&addrPortStr, &doResyncStr, &dontMergeStr, &cmprStr, &maxWdiffMergeSizeStr, &bulkSizeStr});
+        v, pos, 1, {&addrPortStr, &doResyncStr, &dontMergeStr, &cmprStr, &maxWdiffMergeSizeStr, &bulkSizeStr,
+                &useMerkleHashStr});
 
     HostInfoForRepl hi;
     hi.addrPort = parseAddrPort(addrPortStr);
@@ -87,6 +89,7 @@ HostInfoForRepl parseHostInfoForRepl(const StrVec &v, size_t pos)
     hi.cmpr = parseCompressOpt(cmprStr);
     hi.maxWdiffMergeSize = cybozu::util::fromUnitIntString(maxWdiffMergeSizeStr);
     hi.bulkLb = util::parseBulkLb(bulkSizeStr, __func__);
+    hi.useMerkleHash = static_cast<int>(cybozu::atoi(useMerkleHashStr)) != 0;
     hi.verify();
     return hi;
 }
@@ -94,13 +97,14 @@ HostInfoForRepl parseHostInfoForRepl(const StrVec &v, size_t pos)
 std::string HostInfoForRepl::str() const
 {
     return cybozu::util::formatString(
-        "%s %d %d %s %s %s"
+        "%s %d %d %s %s %s %d"
         , addrPort.str().c_str()
         , doResync ? 1 : 0
         , dontMerge ? 1 : 0
         , cmpr.str().c_str()
         , cybozu::util::toUnitIntString(maxWdiffMergeSize).c_str()
-        , cybozu::util::toUnitIntString(bulkLb * LOGICAL_BLOCK_SIZE).c_str());
+        , cybozu::util::toUnitIntString(bulkLb * LOGICAL_BLOCK_SIZE).c_str()
+        , useMerkleHash ? 1 : 0);
 }
 
 } //namespace walb
@@ -196,17 +196,21 @@ struct HostInfoForRepl
     CompressOpt cmpr; // compression parameters for diff-repl.
     uint64_t maxWdiffMergeSize; // max wdiff size in bytes to merge for diff-repl.
     uint64_t bulkLb; // bulk size in logical block for full-repl/hash-repl. [logical block]
+    bool useMerkleHash; // use merkle hash trees for hash-repl. The destination must support it.
 
-    HostInfoForRepl() : addrPort(), doResync(false), dontMerge(false), cmpr(), maxWdiffMergeSize(0), bulkLb(0) {
+    HostInfoForRepl()
+        : addrPort(), doResync(false), dontMerge(false), cmpr(), maxWdiffMergeSize(0), bulkLb(0)
+        , useMerkleHash(false) {
     }
     HostInfoForRepl(const std::string &addr, uint64_t port, bool doResync = false, bool dontMerge = false,
                     const CompressOpt &cmpr = CompressOpt(),
                     uint64_t maxWdiffMergeSize = DEFAULT_MAX_WDIFF_MERGE_MB * MEBI,
-                    uint64_t bulkLb = DEFAULT_BULK_LB)
+                    uint64_t bulkLb = DEFAULT_BULK_LB, bool useMerkleHash = false)
         : addrPort(addr, port), doResync(doResync), dontMerge(dontMerge)
         , cmpr(cmpr)
         , maxWdiffMergeSize(maxWdiffMergeSize)
-        , bulkLb(bulkLb) {
+        , bulkLb(bulkLb)
+        , useMerkleHash(useMerkleHash) {
         verify();
     }
     bool operator==(const HostInfoForRepl &rhs) const {
@@ -215,7 +219,8 @@ struct HostInfoForRepl
             && dontMerge == rhs.dontMerge
             && cmpr == rhs.cmpr
             && maxWdiffMergeSize == rhs.maxWdiffMergeSize
-            && bulkLb == rhs.bulkLb;
+            && bulkLb == rhs.bulkLb
+            && useMerkleHash == rhs.useMerkleHash;
     }
     bool operator!=(const HostInfoForRepl &rhs) const {
         return !(*this == rhs);
@@ -235,6 +240,7 @@ struct HostInfoForRepl
         cybozu::save(os, cmpr);
         cybozu::save(os, maxWdiffMergeSize);
         cybozu::save(os, bulkLb);
+        cybozu::save(os, useMerkleHash);
     }
     template <typename InputStream>
     void load(InputStream &is) {
@@ -244,6 +250,7 @@ struct HostInfoForRepl
         cybozu::load(cmpr, is);
         cybozu::load(maxWdiffMergeSize, is);
         cybozu::load(bulkLb, is);
+        cybozu::load(useMerkleHash, is);
         verify();
     }
     std::string str() const;
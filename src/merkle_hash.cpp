@@ -0,0 +1,233 @@
+#include "merkle_hash.hpp"
+#include "walb_logger.hpp"
+
+namespace walb {
+
+void verifyAddrRangeVec(const AddrRangeVec &v, uint64_t maxAddr, const char *msg)
+{
+    uint64_t prevEnd = 0;
+    for (const AddrRange &r : v) {
+        if (r.first < prevEnd || r.second <= r.first || maxAddr < r.second) {
+            throw cybozu::Exception(msg) << "bad range" << r.first << r.second << prevEnd << maxAddr;
+        }
+        prevEnd = r.second;
+    }
+}
+
+void MerkleHashTree::init(uint64_t sizeLb, uint64_t bulkLb, uint32_t fanout, uint32_t hashSeed, HashAlgo hashAlgo)
+{
+    const char *const FUNC = __func__;
+    if (sizeLb == 0) throw cybozu::Exception(FUNC) << "sizeLb must not be 0";
+    if (bulkLb == 0) throw cybozu::Exception(FUNC) << "bulkLb must not be 0";
+    if (fanout < 2) throw cybozu::Exception(FUNC) << "fanout must be >= 2" << fanout;
+    sizeLb_ = sizeLb;
+    bulkLb_ = bulkLb;
+    fanout_ = fanout;
+    hashSeed_ = hashSeed;
+    hashAlgo_ = hashAlgo;
+    levels_.clear();
+    levels_.resize(1);
+    levels_[0].reserve((nrLeaves() + fanout_ - 1) / fanout_);
+    leaves_.clear();
+    leaves_.reserve(fanout_);
+    nrAddedLeaves_ = 0;
+    isFinalized_ = false;
+}
+
+void MerkleHashTree::addLeaf(const Hash &hash)
+{
+    if (isFinalized_ || nrAddedLeaves_ >= nrLeaves()) {
+        throw cybozu::Exception(__func__) << "too many leaves" << nrAddedLeaves_ << nrLeaves();
+    }
+    leaves_.push_back(hash);
+    nrAddedLeaves_++;
+    if (leaves_.size() == fanout_) {
+        levels_[0].push_back(calcParent(leaves_.data(), leaves_.size()));
+        leaves_.clear();
+    }
+}
+
+void MerkleHashTree::finalize()
+{
+    if (isFinalized_) return;
+    if (nrAddedLeaves_ != nrLeaves()) {
+        throw cybozu::Exception(__func__) << "too few leaves" << nrAddedLeaves_ << nrLeaves();
+    }
+    if (!leaves_.empty()) {
+        levels_[0].push_back(calcParent(leaves_.data(), leaves_.size()));
+        leaves_.clear();
+    }
+    leaves_.shrink_to_fit();
+    while (levels_.back().size() > 1) {
+        const std::vector<Hash> &children = levels_.back();
+        std::vector<Hash> parents;
+        parents.reserve((children.size() + fanout_ - 1) / fanout_);
+        for (size_t i = 0; i < children.size(); i += fanout_) {
+            const size_t nr = std::min<size_t>(fanout_, children.size() - i);
+            parents.push_back(calcParent(&children[i], nr));
+        }
+        levels_.push_back(std::move(parents));
+    }
+    isFinalized_ = true;
+}
+
+AddrRangeVec MerkleHashTree::getChildRanges(uint32_t level, const AddrRangeVec &v) const
+{
+    if (level == 0) throw cybozu::Exception(__func__) << "level-0 nodes have no children";
+    const uint64_t nrChildren = nrNodes(level - 1);
+    AddrRangeVec ret;
+    ret.reserve(v.size());
+    for (const AddrRange &r : v) {
+        ret.emplace_back(r.first * fanout_, std::min<uint64_t>(r.second * fanout_, nrChildren));
+    }
+    return ret;
+}
+
+AddrRangeVec MerkleHashTree::getLbRanges(uint32_t level, const AddrRangeVec &v) const
+{
+    uint64_t nodeLb = bulkLb_;
+    for (uint32_t i = 0; i < level; i++) nodeLb *= fanout_;
+    AddrRangeVec ret;
+    ret.reserve(v.size());
+    for (const AddrRange &r : v) {
+        ret.emplace_back(r.first * nodeLb, std::min<uint64_t>(r.second * nodeLb, sizeLb_));
+    }
+    return ret;
+}
+
+uint64_t MerkleHashTree::getMemoryUsage() const
+{
+    uint64_t nr = leaves_.capacity();
+    for (const std::vector<Hash> &level : levels_) nr += level.capacity();
+    return nr * sizeof(Hash);
+}
+
+void MerkleHashTree::verify() const
+{
+    const char *const FUNC = "MerkleHashTree::verify";
+    if (sizeLb_ == 0 || bulkLb_ == 0 || fanout_ < 2) {
+        throw cybozu::Exception(FUNC) << "bad parameters" << sizeLb_ << bulkLb_ << fanout_;
+    }
+    uint64_t nr = nrLeaves();
+    for (const std::vector<Hash> &level : levels_) {
+        nr = (nr + fanout_ - 1) / fanout_;
+        if (level.size() != nr) {
+            throw cybozu::Exception(FUNC) << "bad number of nodes" << level.size() << nr;
+        }
+    }
+    if (nr != 1) throw cybozu::Exception(FUNC) << "top level must have only one node" << nr;
+}
+
+namespace merkle_hash_local {
+
+void writeRanges(packet::Packet &pkt, const AddrRangeVec &v)
+{
+    pkt.write(v.size());
+    for (const AddrRange &r : v) {
+        pkt.write(r.first);
+        pkt.write(r.second);
+    }
+}
+
+void readRanges(packet::Packet &pkt, AddrRangeVec &v, uint64_t maxAddr)
+{
+    size_t nr;
+    pkt.read(nr);
+    if (nr > maxAddr) throw cybozu::Exception(__func__) << "too many ranges" << nr << maxAddr;
+    v.resize(nr);
+    for (AddrRange &r : v) {
+        pkt.read(r.first);
+        pkt.read(r.second);
+    }
+    verifyAddrRangeVec(v, maxAddr, __func__);
+}
+
+void addToRanges(AddrRangeVec &v, uint64_t idx)
+{
+    if (!v.empty() && v.back().second == idx) {
+        v.back().second++;
+    } else {
+        v.emplace_back(idx, idx + 1);
+    }
+}
+
+} // namespace merkle_hash_local
+
+AddrRangeVec merkleHashDescentServer(packet::Packet &pkt, MerkleHashTree &tree)
+{
+    namespace ml = merkle_hash_local;
+    packet::StreamControl2 ctrl(pkt.sock());
+    AddrRangeVec ranges{{0, 1}};
+    uint32_t level = tree.topLevel();
+    for (;;) {
+        ctrl.sendNext();
+        pkt.write(level);
+        ml::writeRanges(pkt, ranges);
+        pkt.flush();
+        AddrRangeVec diffRanges;
+        for (const AddrRange &r : ranges) {
+            for (uint64_t idx = r.first; idx < r.second; idx++) {
+                MerkleHashTree::Hash hash;
+                pkt.read(hash);
+                if (hash == tree.get(level, idx)) continue;
+                tree.set(level, idx, hash);
+                ml::addToRanges(diffRanges, idx);
+            }
+        }
+        LOGs.debug() << "merkle-hash-descent" << level << ranges.size() << diffRanges.size();
+        if (level == 1 || diffRanges.empty()) {
+            ranges = std::move(diffRanges);
+            break;
+        }
+        ranges = tree.getChildRanges(level, diffRanges);
+        level--;
+    }
+    ctrl.sendEnd();
+    const AddrRangeVec lbRanges = tree.getLbRanges(1, ranges);
+    ml::writeRanges(pkt, lbRanges);
+    pkt.flush();
+    return lbRanges;
+}
+
+AddrRangeVec merkleHashDescentClient(packet::Packet &pkt, const MerkleHashTree &tree)
+{
+    const char *const FUNC = __func__;
+    namespace ml = merkle_hash_local;
+    packet::StreamControl2 ctrl(pkt.sock());
+    AddrRangeVec ranges;
+    for (;;) {
+        ctrl.recv();
+        if (ctrl.isEnd()) break;
+        if (!ctrl.isNext()) throw cybozu::Exception(FUNC) << "bad ctrl" << ctrl.toStr();
+        uint32_t level;
+        pkt.read(level);
+        if (level == 0 || level > tree.topLevel()) {
+            throw cybozu::Exception(FUNC) << "bad level" << level << tree.topLevel();
+        }
+        ml::readRanges(pkt, ranges, tree.nrNodes(level));
+        for (const AddrRange &r : ranges) {
+            for (uint64_t idx = r.first; idx < r.second; idx++) {
+                pkt.write(tree.get(level, idx));
+            }
+        }
+        pkt.flush();
+    }
+    ml::readRanges(pkt, ranges, tree.sizeLb());
+    return ranges;
+}
+
+void merkleHashSyncReady(packet::Packet &pkt)
+{
+    packet::StreamControl2 ctrl(pkt.sock());
+    ctrl.sendEnd();
+    pkt.flush();
+    for (;;) {
+        ctrl.recv();
+        if (ctrl.isEnd()) return;
+        if (!ctrl.isDummy()) {
+            throw cybozu::Exception(__func__) << "bad ctrl" << ctrl.toStr();
+        }
+    }
+}
+
+} // namespace walb
@@ -0,0 +1,196 @@
+#pragma once
+/**
+ * @file
+ * @brief Merkle hash tree of a full image for hash-repl.
+ */
+#include <vector>
+#include <utility>
+#include "murmurhash3.hpp"
+#include "packet.hpp"
+#include "constant.hpp"
+#include "cybozu/exception.hpp"
+#include "cybozu/serializer.hpp"
+
+namespace walb {
+
+/**
+ * [first, second).
+ * The unit depends on the context: logical blocks or node indexes.
+ */
+using AddrRange = std::pair<uint64_t, uint64_t>;
+using AddrRangeVec = std::vector<AddrRange>;
+
+inline uint64_t getTotalRangeSize(const AddrRangeVec &v)
+{
+    uint64_t total = 0;
+    for (const AddrRange &r : v) total += r.second - r.first;
+    return total;
+}
+
+/**
+ * Each range must be not empty and ranges must be sorted without overlap.
+ */
+void verifyAddrRangeVec(const AddrRangeVec &v, uint64_t maxAddr, const char *msg);
+
+/**
+ * Merkle hash tree.
+ *
+ * A level-0 node is the hash of a bulkLb chunk (leaf). Leaves are not kept in the tree.
+ * A level-k (k > 0) node is the hash of at most fanout level-(k-1) nodes.
+ * The top level has only one node.
+ *
+ * Memory usage is about HASH_SIZE / (fanout - 1) bytes per bulk,
+ * so the tree can be cached per snapshot.
+ *
+ * Serialized trees begin with FORMAT_MAGIC followed by the hash algorithm.
+ * Trees saved without them are loaded as murmur3 ones.
+ */
+class MerkleHashTree
+{
+public:
+    using Hash = cybozu::murmurhash3::Hash;
+    using HashAlgo = cybozu::murmurhash3::HashAlgo;
+private:
+    /* Never equals sizeLb_ of the old format. */
+    static constexpr uint64_t FORMAT_MAGIC = 0x3245455254484b4dULL; // "MKHTREE2"
+
+    uint64_t sizeLb_;
+    uint64_t bulkLb_;
+    uint32_t fanout_;
+    uint32_t hashSeed_;
+    HashAlgo hashAlgo_;
+    std::vector<std::vector<Hash> > levels_; // levels_[k - 1] is level k.
+    std::vector<Hash> leaves_; // leaves of the last level-1 node, while building.
+    uint64_t nrAddedLeaves_;
+    bool isFinalized_;
+public:
+    MerkleHashTree()
+        : sizeLb_(0), bulkLb_(0), fanout_(0), hashSeed_(0), hashAlgo_(cybozu::murmurhash3::HASH_ALGO_MURMUR3)
+        , levels_(), leaves_(), nrAddedLeaves_(0), isFinalized_(false) {
+    }
+    void init(uint64_t sizeLb, uint64_t bulkLb,
+              uint32_t fanout = MERKLE_HASH_FANOUT, uint32_t hashSeed = MERKLE_HASH_SEED,
+              HashAlgo hashAlgo = cybozu::murmurhash3::HASH_ALGO_MURMUR3);
+    /**
+     * Add leaf hashes in address order, then call finalize().
+     */
+    void addLeaf(const Hash &hash);
+    void finalize();
+
+    bool isFinalized() const { return isFinalized_; }
+    uint64_t sizeLb() const { return sizeLb_; }
+    uint64_t bulkLb() const { return bulkLb_; }
+    uint32_t fanout() const { return fanout_; }
+    uint32_t hashSeed() const { return hashSeed_; }
+    HashAlgo hashAlgo() const { return hashAlgo_; }
+    bool hasSameShape(uint64_t sizeLb, uint64_t bulkLb, uint32_t fanout, uint32_t hashSeed, HashAlgo hashAlgo) const {
+        return sizeLb_ == sizeLb && bulkLb_ == bulkLb && fanout_ == fanout
+            && hashSeed_ == hashSeed && hashAlgo_ == hashAlgo;
+    }
+    uint64_t nrLeaves() const {
+        return (sizeLb_ + bulkLb_ - 1) / bulkLb_;
+    }
+    uint32_t topLevel() const {
+        return levels_.size();
+    }
+    uint64_t nrNodes(uint32_t level) const {
+        if (level == 0) return nrLeaves();
+        return getLevel(level).size();
+    }
+    const Hash& get(uint32_t level, uint64_t idx) const {
+        return getLevel(level).at(idx);
+    }
+    /**
+     * Parent nodes will not be updated.
+     */
+    void set(uint32_t level, uint64_t idx, const Hash &hash) {
+        getLevel(level).at(idx) = hash;
+    }
+    /**
+     * Convert ranges of level-k nodes to ranges of level-(k-1) nodes.
+     */
+    AddrRangeVec getChildRanges(uint32_t level, const AddrRangeVec &v) const;
+    /**
+     * Convert ranges of level-k nodes to ranges of logical blocks.
+     */
+    AddrRangeVec getLbRanges(uint32_t level, const AddrRangeVec &v) const;
+    uint64_t getMemoryUsage() const;
+
+    template <typename InputStream>
+    void load(InputStream &is) {
+        cybozu::load(sizeLb_, is);
+        hashAlgo_ = cybozu::murmurhash3::HASH_ALGO_MURMUR3;
+        if (sizeLb_ == FORMAT_MAGIC) {
+            uint32_t algo;
+            cybozu::load(algo, is);
+            if (algo >= cybozu::murmurhash3::HASH_ALGO_MAX) {
+                throw cybozu::Exception("MerkleHashTree:load:bad hash algorithm") << algo;
+            }
+            hashAlgo_ = HashAlgo(algo);
+            cybozu::load(sizeLb_, is);
+        }
+        cybozu::load(bulkLb_, is);
+        cybozu::load(fanout_, is);
+        cybozu::load(hashSeed_, is);
+        size_t nr;
+        cybozu::load(nr, is);
+        levels_.resize(nr);
+        for (std::vector<Hash> &level : levels_) {
+            cybozu::loadPodVec(level, is);
+        }
+        leaves_.clear();
+        nrAddedLeaves_ = nrLeaves();
+        isFinalized_ = true;
+        verify();
+    }
+    template <typename OutputStream>
+    void save(OutputStream &os) const {
+        if (!isFinalized_) throw cybozu::Exception("MerkleHashTree:save:not finalized");
+        cybozu::save(os, uint64_t(FORMAT_MAGIC));
+        cybozu::save(os, uint32_t(hashAlgo_));
+        cybozu::save(os, sizeLb_);
+        cybozu::save(os, bulkLb_);
+        cybozu::save(os, fanout_);
+        cybozu::save(os, hashSeed_);
+        cybozu::save(os, levels_.size());
+        for (const std::vector<Hash> &level : levels_) {
+            cybozu::savePodVec(os, level);
+        }
+    }
+private:
+    const std::vector<Hash>& getLevel(uint32_t level) const {
+        if (level == 0 || level > levels_.size()) {
+            throw cybozu::Exception("MerkleHashTree:bad level") << level << levels_.size();
+        }
+        return levels_[level - 1];
+    }
+    std::vector<Hash>& getLevel(uint32_t level) {
+        const MerkleHashTree &self = *this;
+        return const_cast<std::vector<Hash>&>(self.getLevel(level));
+    }
+    Hash calcParent(const Hash *children, size_t nr) const {
+        return cybozu::murmurhash3::Hasher(hashSeed_, hashAlgo_)(children, nr * cybozu::murmurhash3::HASH_SIZE);
+    }
+    void verify() const;
+};
+
+/**
+ * Merkle hash descent protocol.
+ *
+ * The server requests hashes of the differing nodes level by level from the top,
+ * and the client replies its hashes. The server patches its tree with the received hashes
+ * so that the tree will be the same as the client's one.
+ *
+ * Both RETURN:
+ *   ranges of logical blocks where level-1 nodes differ.
+ */
+AddrRangeVec merkleHashDescentServer(packet::Packet &pkt, MerkleHashTree &tree);
+AddrRangeVec merkleHashDescentClient(packet::Packet &pkt, const MerkleHashTree &tree);
+
+/**
+ * Tell the peer that this side has prepared its tree,
+ * and wait for the peer ignoring its dummy messages.
+ */
+void merkleHashSyncReady(packet::Packet &pkt);
+
+} // namespace walb
@@ -0,0 +1,210 @@
+#include "metrics.hpp"
+#include <algorithm>
+#include <cassert>
+#include "util.hpp"
+#include "fileio.hpp"
+#include "tmp_file.hpp"
+#include "walb_logger.hpp"
+
+namespace walb {
+namespace metrics {
+
+const char *stageName(Stage stage)
+{
+    static const char *const tbl[] = {
+        "wlog_send", "wlog_recv", "wdiff_send", "wdiff_recv",
+        "apply", "restore", "repl_client", "repl_server",
+        "log_read", "compress", "uncompress", "sock_send", "sock_recv",
+        "fsync", "lvm", "merge",
+    };
+    static_assert(sizeof(tbl) / sizeof(tbl[0]) == STAGE_MAX, "stage name table size");
+    return stage < STAGE_MAX ? tbl[stage] : "unknown";
+}
+
+Histogram::Snapshot Histogram::snapshot() const
+{
+    Snapshot s;
+    s.buckets.resize(NR_BUCKETS);
+    /* count is the sum of the buckets so that they are consistent. */
+    s.count = 0;
+    for (size_t i = 0; i < NR_BUCKETS; i++) {
+        s.buckets[i] = buckets_[i].load(std::memory_order_relaxed);
+        s.count += s.buckets[i];
+    }
+    s.sumUs = sumUs_.load(std::memory_order_relaxed);
+    s.maxUs = maxUs_.load(std::memory_order_relaxed);
+    return s;
+}
+
+uint64_t Histogram::Snapshot::quantileUs(double q) const
+{
+    if (count == 0) return 0;
+    const uint64_t rank = std::max<uint64_t>(1, uint64_t(q * count + 0.5));
+    uint64_t c = 0;
+    for (size_t i = 0; i < buckets.size(); i++) {
+        c += buckets[i];
+        if (c >= rank) return std::min(bucketUpperUs(i), maxUs);
+    }
+    return maxUs;
+}
+
+uint64_t Histogram::Snapshot::countLt(size_t e) const
+{
+    assert(SUB_BITS <= e && e <= MAX_EXP);
+    const size_t end = (e - SUB_BITS + 1) * NR_SUB;
+    uint64_t c = 0;
+    for (size_t i = 0; i < end; i++) c += buckets[i];
+    return c;
+}
+
+VolMetrics &MetricsRegistry::get(const std::string &volId)
+{
+    std::lock_guard<std::mutex> lk(mu_);
+    std::unique_ptr<VolMetrics> &p = map_[volId];
+    if (!p) p.reset(new VolMetrics());
+    return *p;
+}
+
+bool MetricsRegistry::exists(const std::string &volId) const
+{
+    std::lock_guard<std::mutex> lk(mu_);
+    return map_.find(volId) != map_.end();
+}
+
+StrVec MetricsRegistry::getVolIdList() const
+{
+    std::lock_guard<std::mutex> lk(mu_);
+    StrVec ret;
+    for (const auto &pair : map_) ret.push_back(pair.first);
+    return ret;
+}
+
+StrVec MetricsRegistry::prettyPrint(const std::string &volId) const
+{
+    const VolMetrics *vm;
+    {
+        std::lock_guard<std::mutex> lk(mu_);
+        auto it = map_.find(volId);
+        if (it == map_.end()) return StrVec();
+        vm = it->second.get();
+    }
+    StrVec ret;
+    for (size_t i = 0; i < STAGE_MAX; i++) {
+        const StageMetrics &m = vm->get(Stage(i));
+        const Histogram::Snapshot s = m.latency.snapshot();
+        if (s.count == 0) continue;
+        const uint64_t bytes = m.bytes.load(std::memory_order_relaxed);
+        const double sumSec = s.sumUs / 1000000.0;
+        ret.push_back(cybozu::util::formatString(
+            "%s\t%s\tcount:%" PRIu64 "\tbytes:%" PRIu64 "\tsum:%.6f\tMBps:%.3f"
+            "\tp50:%.6f\tp90:%.6f\tp99:%.6f\tmax:%.6f"
+            , volId.c_str(), stageName(Stage(i)), s.count, bytes, sumSec
+            , sumSec > 0 ? bytes / sumSec / 1000000.0 : 0.0
+            , s.quantileUs(0.5) / 1000000.0, s.quantileUs(0.9) / 1000000.0
+            , s.quantileUs(0.99) / 1000000.0, s.maxUs / 1000000.0));
+    }
+    return ret;
+}
+
+StrVec MetricsRegistry::prettyPrintAll() const
+{
+    StrVec ret;
+    for (const std::string &volId : getVolIdList()) {
+        const StrVec v = prettyPrint(volId);
+        ret.insert(ret.end(), v.begin(), v.end());
+    }
+    return ret;
+}
+
+std::string MetricsRegistry::prometheusText(const std::string &nodeKind) const
+{
+    /* Bucket boundaries from 64us to about 4.8 hours. */
+    const size_t minExp = 6, maxExp = 34;
+
+    std::vector<std::pair<std::string, const VolMetrics *> > volV;
+    {
+        std::lock_guard<std::mutex> lk(mu_);
+        for (const auto &pair : map_) volV.emplace_back(pair.first, pair.second.get());
+    }
+    std::string durations, bytesTotal;
+    durations += "# HELP walb_stage_duration_seconds Duration of walb data path stages.\n";
+    durations += "# TYPE walb_stage_duration_seconds histogram\n";
+    bytesTotal += "# HELP walb_stage_bytes_total Bytes processed in walb data path stages.\n";
+    bytesTotal += "# TYPE walb_stage_bytes_total counter\n";
+    for (const auto &pair : volV) {
+        for (size_t i = 0; i < STAGE_MAX; i++) {
+            const StageMetrics &m = pair.second->get(Stage(i));
+            const Histogram::Snapshot s = m.latency.snapshot();
+            if (s.count == 0) continue;
+            const std::string labels = cybozu::util::formatString(
+                "daemon=\"%s\",volume=\"%s\",stage=\"%s\""
+                , nodeKind.c_str(), pair.first.c_str(), stageName(Stage(i)));
+            /* The bounds are in microseconds so %.6f shows them exactly. */
+            for (size_t e = minExp; e <= maxExp; e += 2) {
+                durations += cybozu::util::formatString(
+                    "walb_stage_duration_seconds_bucket{%s,le=\"%.6f\"} %" PRIu64 "\n"
+                    , labels.c_str(), (1ULL << e) / 1000000.0, s.countLt(e));
+            }
+            durations += cybozu::util::formatString(
+                "walb_stage_duration_seconds_bucket{%s,le=\"+Inf\"} %" PRIu64 "\n"
+                "walb_stage_duration_seconds_sum{%s} %.6f\n"
+                "walb_stage_duration_seconds_count{%s} %" PRIu64 "\n"
+                , labels.c_str(), s.count, labels.c_str(), s.sumUs / 1000000.0
+                , labels.c_str(), s.count);
+            bytesTotal += cybozu::util::formatString(
+                "walb_stage_bytes_total{%s} %" PRIu64 "\n"
+                , labels.c_str(), m.bytes.load(std::memory_order_relaxed));
+        }
+    }
+    return durations + bytesTotal;
+}
+
+PrometheusFileWriter::PrometheusFileWriter(
+    const MetricsRegistry &registry, const std::string &nodeKind,
+    const std::string &path, size_t intervalSec)
+    : registry_(registry), nodeKind_(nodeKind), path_(path)
+    , intervalSec_(intervalSec), mu_(), cv_(), quit_(false), th_()
+{
+    if (path_.empty()) return;
+    if (intervalSec_ == 0) {
+        throw cybozu::Exception("PrometheusFileWriter") << "interval must not be 0";
+    }
+    th_ = std::thread([this]() { run(); });
+}
+
+PrometheusFileWriter::~PrometheusFileWriter() noexcept
+{
+    if (!th_.joinable()) return;
+    {
+        std::lock_guard<std::mutex> lk(mu_);
+        quit_ = true;
+    }
+    cv_.notify_one();
+    th_.join();
+}
+
+void PrometheusFileWriter::writeOnce() const
+{
+    const std::string text = registry_.prometheusText(nodeKind_);
+    cybozu::TmpFile tmpFile(cybozu::FilePath(path_).parent().str());
+    cybozu::util::File file(tmpFile.fd());
+    file.write(text.data(), text.size());
+    tmpFile.save(path_);
+}
+
+void PrometheusFileWriter::run() noexcept
+{
+    std::unique_lock<std::mutex> lk(mu_);
+    for (;;) {
+        lk.unlock();
+        try {
+            writeOnce();
+        } catch (std::exception &e) {
+            LOGs.warn() << "PrometheusFileWriter" << path_ << e.what();
+        }
+        lk.lock();
+        if (cv_.wait_for(lk, std::chrono::seconds(intervalSec_), [this]() { return quit_; })) break;
+    }
+}
+
+}} // namespace walb::metrics
@@ -0,0 +1,226 @@
+#pragma once
+/**
+ * @file
+ * @brief Per-volume latency histograms and byte counters of data path stages.
+ *
+ * Recording is lock-free: every counter is an atomic variable updated with relaxed ordering,
+ * so worker threads of a transfer can record concurrently.
+ * A mutex is taken only to look up the metrics of a volume in the registry,
+ * which should be done once per operation.
+ */
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cinttypes>
+#include "walb_types.hpp"
+
+namespace walb {
+namespace metrics {
+
+/**
+ * The first ones are whole operations and the others are steps inside them.
+ */
+enum Stage : uint8_t
+{
+    WLOG_SEND = 0, // storage: extract and send wlogs to a proxy.
+    WLOG_RECV, // proxy: receive wlogs and write a wdiff.
+    WDIFF_SEND, // proxy/archive: send wdiffs.
+    WDIFF_RECV, // archive: receive wdiffs.
+    APPLY, // archive: apply wdiffs to a volume.
+    RESTORE, // archive: restore a snapshot.
+    REPL_CLIENT, // archive: replicate a volume to another archive.
+    REPL_SERVER, // archive: receive a replicated volume.
+
+    LOG_READ, // read logpacks from a log device.
+    COMPRESS, // compression, or waiting for compression workers in wdiff transfer.
+    UNCOMPRESS,
+    SOCK_SEND,
+    SOCK_RECV,
+    FSYNC,
+    LVM, // lvm command execution.
+    MERGE, // merge wdiffs into a new wdiff or a stream to send.
+
+    STAGE_MAX,
+};
+
+const char *stageName(Stage stage);
+
+/**
+ * Log-linear histogram of durations in microseconds like HdrHistogram.
+ * Values less than 2^SUB_BITS are counted exactly.
+ * Others are counted in 2^SUB_BITS sub-buckets per power of two,
+ * so the relative error is less than 1/2^SUB_BITS.
+ */
+class Histogram
+{
+public:
+    static constexpr size_t SUB_BITS = 3;
+    static constexpr size_t NR_SUB = 1 << SUB_BITS;
+    static constexpr size_t MAX_EXP = 40; // 2^40 usec is about 12 days.
+    static constexpr size_t NR_BUCKETS = (MAX_EXP - SUB_BITS + 2) * NR_SUB;
+
+    struct Snapshot
+    {
+        uint64_t count;
+        uint64_t sumUs;
+        uint64_t maxUs;
+        std::vector<uint64_t> buckets;
+
+        /**
+         * @q quantile in [0, 1].
+         * RETURN:
+         *   upper bound of the bucket containing the quantile [usec].
+         */
+        uint64_t quantileUs(double q) const;
+        /**
+         * Bucket boundaries are aligned to powers of two.
+         * RETURN:
+         *   number of values less than 2^e usec.
+         *   e must be in [SUB_BITS, MAX_EXP].
+         */
+        uint64_t countLt(size_t e) const;
+    };
+
+    Histogram() : sumUs_(0), maxUs_(0) {
+        for (std::atomic<uint64_t> &v : buckets_) v.store(0, std::memory_order_relaxed);
+    }
+    void record(uint64_t us) {
+        buckets_[bucketIndex(us)].fetch_add(1, std::memory_order_relaxed);
+        sumUs_.fetch_add(us, std::memory_order_relaxed);
+        uint64_t max = maxUs_.load(std::memory_order_relaxed);
+        while (max < us && !maxUs_.compare_exchange_weak(max, us, std::memory_order_relaxed)) {}
+    }
+    Snapshot snapshot() const;
+
+    static size_t bucketIndex(uint64_t us) {
+        if (us < NR_SUB) return us;
+        const size_t e = 63 - __builtin_clzll(us);
+        if (e > MAX_EXP) return NR_BUCKETS - 1;
+        const size_t sub = (us >> (e - SUB_BITS)) & (NR_SUB - 1);
+        return (e - SUB_BITS + 1) * NR_SUB + sub;
+    }
+    /**
+     * RETURN:
+     *   the largest value counted in the bucket [usec].
+     */
+    static uint64_t bucketUpperUs(size_t idx) {
+        if (idx < NR_SUB) return idx;
+        const size_t e = idx / NR_SUB + SUB_BITS - 1;
+        const uint64_t sub = idx % NR_SUB;
+        return ((NR_SUB + sub + 1) << (e - SUB_BITS)) - 1;
+    }
+private:
+    std::atomic<uint64_t> buckets_[NR_BUCKETS];
+    std::atomic<uint64_t> sumUs_;
+    std::atomic<uint64_t> maxUs_;
+};
+
+struct StageMetrics
+{
+    Histogram latency;
+    std::atomic<uint64_t> bytes;
+
+    StageMetrics() : latency(), bytes(0) {}
+};
+
+class VolMetrics
+{
+    StageMetrics stage_[STAGE_MAX];
+public:
+    void record(Stage stage, double sec, uint64_t bytes = 0) {
+        StageMetrics &m = stage_[stage];
+        m.latency.record(sec <= 0 ? 0 : uint64_t(sec * 1000000));
+        m.bytes.fetch_add(bytes, std::memory_order_relaxed);
+    }
+    const StageMetrics &get(Stage stage) const { return stage_[stage]; }
+};
+
+/**
+ * Measure elapsed time of a stage.
+ * Nothing is recorded if the metrics is null,
+ * so library functions can take an optional metrics pointer.
+ */
+class StageTimer
+{
+    using Clock = std::chrono::steady_clock;
+    VolMetrics *metrics_;
+    Stage stage_;
+    Clock::time_point t0_;
+public:
+    StageTimer(VolMetrics *metrics, Stage stage)
+        : metrics_(metrics), stage_(stage), t0_() {
+        if (metrics_) t0_ = Clock::now();
+    }
+    /**
+     * Record the time from the construction or the previous call.
+     */
+    void record(uint64_t bytes = 0) {
+        if (!metrics_) return;
+        const Clock::time_point t1 = Clock::now();
+        metrics_->record(stage_, std::chrono::duration<double>(t1 - t0_).count(), bytes);
+        t0_ = t1;
+    }
+    /**
+     * Start measuring again without recording.
+     */
+    void reset() {
+        if (metrics_) t0_ = Clock::now();
+    }
+};
+
+class MetricsRegistry
+{
+    mutable std::mutex mu_;
+    std::map<std::string, std::unique_ptr<VolMetrics> > map_; // key: volId.
+public:
+    /**
+     * The returned reference is valid while the registry lives.
+     */
+    VolMetrics &get(const std::string &volId);
+    bool exists(const std::string &volId) const;
+    StrVec getVolIdList() const;
+
+    /**
+     * Tab-separated lines of the stages of a volume that have been recorded.
+     * Durations are in seconds.
+     */
+    StrVec prettyPrint(const std::string &volId) const;
+    StrVec prettyPrintAll() const;
+    /**
+     * Prometheus text exposition format.
+     */
+    std::string prometheusText(const std::string &nodeKind) const;
+};
+
+/**
+ * Write the metrics in Prometheus text format to a file periodically,
+ * e.g. for node_exporter textfile collector.
+ * The file is replaced atomically.
+ * It does nothing if path is empty.
+ */
+class PrometheusFileWriter
+{
+    const MetricsRegistry &registry_;
+    const std::string nodeKind_;
+    const std::string path_;
+    const size_t intervalSec_;
+    std::mutex mu_;
+    std::condition_variable cv_;
+    bool quit_;
+    std::thread th_;
+public:
+    PrometheusFileWriter(const MetricsRegistry &registry, const std::string &nodeKind,
+                         const std::string &path, size_t intervalSec);
+    ~PrometheusFileWriter() noexcept;
+    void writeOnce() const;
+private:
+    void run() noexcept;
+};
+
+}} // namespace walb::metrics
@@ -5,8 +5,12 @@
  * @author HOSHINO Takashi
  *
  * (C) 2013 Cybozu Labs, Inc.
+ *
+ * XXH3-128 is also available as an alternative block hash algorithm.
  */
 #include "MurmurHash3.h"
+#define XXH_INLINE_ALL
+#include "xxhash.h"
 #include "cybozu/itoa.hpp"
 #include "cybozu/serializer.hpp"
 #include "util.hpp"
@@ -21,6 +25,59 @@ namespace murmurhash3 {
 
 const size_t HASH_SIZE = 16; /* 128 bits */
 
+/**
+ * Block hash algorithms.
+ * Both sides of a protocol must use the same one,
+ * so peers that do not know the algorithm negotiation use HASH_ALGO_MURMUR3.
+ */
+enum HashAlgo
+{
+    HASH_ALGO_MURMUR3 = 0, // MurmurHash3_x64_128.
+    HASH_ALGO_XXH3 = 1, // XXH3_128bits. Several times faster.
+    HASH_ALGO_MAX,
+};
+
+inline const char *hashAlgoName(HashAlgo algo)
+{
+    static const char *const tbl[] = {"murmur3", "xxh3"};
+    return algo < HASH_ALGO_MAX ? tbl[algo] : "unknown";
+}
+
+/**
+ * RETURN:
+ *   false if the name is unknown.
+ */
+inline bool tryParseHashAlgo(const std::string &s, HashAlgo &algo)
+{
+    for (int i = 0; i < HASH_ALGO_MAX; i++) {
+        if (s == hashAlgoName(HashAlgo(i))) {
+            algo = HashAlgo(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+inline HashAlgo parseHashAlgo(const std::string &s)
+{
+    HashAlgo algo;
+    if (!tryParseHashAlgo(s, algo)) {
+        throw cybozu::Exception("parseHashAlgo:bad hash algorithm name") << s;
+    }
+    return algo;
+}
+
+/**
+ * The algorithm a server uses for the one requested by a client.
+ * Names unknown to this version fall back to HASH_ALGO_MURMUR3.
+ */
+inline HashAlgo selectHashAlgo(const std::string &requested)
+{
+    HashAlgo algo;
+    if (!tryParseHashAlgo(requested, algo)) return HASH_ALGO_MURMUR3;
+    return algo;
+}
+
 struct Hash {
     uint8_t data[HASH_SIZE];
     std::string str() const {
@@ -52,6 +109,24 @@ struct Hash {
     }
 };
 
+/**
+ * XXH3 hashes are stored in the canonical (big-endian) representation.
+ */
+inline Hash calcHash(HashAlgo algo, const void *key, size_t len, uint32_t seed)
+{
+    Hash h;
+    if (algo == HASH_ALGO_XXH3) {
+        const XXH128_hash_t v = ::XXH3_128bits_withSeed(key, len, seed);
+        XXH128_canonical_t c;
+        ::XXH128_canonicalFromHash(&c, v);
+        static_assert(sizeof(c.digest) == HASH_SIZE, "bad XXH128 digest size");
+        ::memcpy(&h.data[0], c.digest, HASH_SIZE);
+    } else {
+        ::MurmurHash3_x64_128(key, len, seed, &h.data[0]);
+    }
+    return h;
+}
+
 /**
  * Hash calclator.
  */
@@ -59,15 +134,15 @@ class Hasher
 {
 private:
     uint32_t seed_;
+    HashAlgo algo_;
 public:
-    explicit Hasher(uint32_t seed = 0)
-        : seed_(seed) {}
+    explicit Hasher(uint32_t seed = 0, HashAlgo algo = HASH_ALGO_MURMUR3)
+        : seed_(seed), algo_(algo) {}
 
     Hash operator()(const void *key, size_t len) const {
-        Hash h;
-        ::MurmurHash3_x64_128(key, len, seed_, &h.data[0]);
-        return h;
+        return calcHash(algo_, key, len, seed_);
     }
+    HashAlgo algo() const { return algo_; }
 };
 
 /**
@@ -78,10 +153,11 @@ class StreamHasher
 private:
     uint32_t initSeed_;
     uint32_t seed_;
+    HashAlgo algo_;
     Hash hash_;
 public:
-    explicit StreamHasher(uint32_t initSeed = 0)
-        : initSeed_(initSeed) {
+    explicit StreamHasher(uint32_t initSeed = 0, HashAlgo algo = HASH_ALGO_MURMUR3)
+        : initSeed_(initSeed), algo_(algo) {
         reset();
     }
     void reset() {
@@ -89,11 +165,22 @@ public:
         hash_.zeroClear();
     }
     void push(const void *key, size_t len) {
-        Hash h;
-        ::MurmurHash3_x64_128(key, len, seed_, &h.data[0]);
+        hash_.doXor(calcHash(algo_, key, len, seed_));
+        seed_++;
+    }
+    /**
+     * Push a hash calculated by Hasher(seed, algo()) where seed is the value at the time.
+     */
+    void pushHash(const Hash &h) {
         hash_.doXor(h);
         seed_++;
     }
+    uint32_t seed() const {
+        return seed_;
+    }
+    HashAlgo algo() const {
+        return algo_;
+    }
     const Hash& get() const {
         return hash_;
     }
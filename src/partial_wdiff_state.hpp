@@ -0,0 +1,47 @@
+#pragma once
+#include "meta.hpp"
+#include "uuid.hpp"
+#include "walb_util.hpp"
+#include "cybozu/serializer.hpp"
+#include <sstream>
+#include <iostream>
+
+namespace walb {
+
+/**
+ * For wdiff-transfer and diff-repl resume.
+ * A partially received wdiff is identified by its meta diff and uuid.
+ */
+struct PartialWdiffState
+{
+    MetaDiff diff;
+    cybozu::Uuid uuid;
+    uint64_t timestamp; // when the transfer started first.
+
+    bool isSame(const MetaDiff &diff1, const cybozu::Uuid &uuid1) const {
+        return diff == diff1 && diff.timestamp == diff1.timestamp && uuid == uuid1;
+    }
+    template <typename InputStream>
+    void load(InputStream &is) {
+        cybozu::load(diff, is);
+        cybozu::load(uuid, is);
+        cybozu::load(timestamp, is);
+    }
+    template <typename OutputStream>
+    void save(OutputStream &os) const {
+        cybozu::save(os, diff);
+        cybozu::save(os, uuid);
+        cybozu::save(os, timestamp);
+    }
+    std::string str() const {
+        std::stringstream ss;
+        ss << diff << " " << uuid << " " << util::timeToPrintable(timestamp);
+        return ss.str();
+    }
+    friend inline std::ostream& operator<<(std::ostream& os, const PartialWdiffState& st) {
+        os << st.str();
+        return os;
+    }
+};
+
+} // namespace walb
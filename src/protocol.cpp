@@ -30,6 +30,18 @@ namespace protocol {
 std::string run1stNegotiateAsClient(
     cybozu::Socket &sock,
     const std::string &clientId, const std::string &protocolName)
+{
+    std::string serverId;
+    if (!tryRun1stNegotiateAsClient(sock, clientId, protocolName, serverId)) {
+        throw cybozu::Exception(__func__) << msgBadProtocol << protocolName << serverId;
+    }
+    return serverId;
+}
+
+
+bool tryRun1stNegotiateAsClient(
+    cybozu::Socket &sock,
+    const std::string &clientId, const std::string &protocolName, std::string &serverId)
 {
     packet::Packet pkt(sock);
     pkt.write(clientId);
@@ -37,14 +49,14 @@ std::string run1stNegotiateAsClient(
     packet::Version ver(sock);
     ver.send();
     pkt.flush();
-    std::string serverId;
     pkt.read(serverId);
 
     ProtocolLogger logger(clientId, serverId);
     std::string msg;
     pkt.read(msg);
-    if (msg != msgOk) throw cybozu::Exception(__func__) << msg;
-    return serverId;
+    if (msg == msgOk) return true;
+    if (msg.find(msgBadProtocol) != std::string::npos) return false;
+    throw cybozu::Exception("run1stNegotiateAsClient") << msg;
 }
 
 
@@ -139,7 +151,7 @@ ServerHandler findServerHandler(
     }
     Str2ServerHandler::const_iterator it = handlers.find(protocolName);
     if (it == handlers.cend()) {
-        throw cybozu::Exception(__func__) << "bad protocol" << protocolName;
+        throw cybozu::Exception(__func__) << msgBadProtocol << protocolName;
     }
     return it->second;
 }
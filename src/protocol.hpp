@@ -34,6 +34,7 @@ const char *const msgWdiffRecv = "wdiff-recv";
 const char *const msgSyncing = "syncing";
 const char *const msgArchiveNotFound = "archive-not-found";
 const char *const msgSmallerLvSize = "smaller-lv-size";
+const char *const msgBadProtocol = "bad protocol";
 
 /**
  * Host type.
@@ -115,15 +116,22 @@ const char *const getMetaStateTN = "meta-state";
 const char *const getLatestSnapTN = "latest-snap";
 const char *const getTsDeltaTN = "ts-delta";
 const char *const getHandlerStatTN = "handler-stat";
+const char *const diffCacheTN = "diff-cache";
+const char *const metricsTN = "metrics";
 
 /**
  * Internal protocol name.
  */
 const char *const dirtyFullSyncPN = "dirty-full-sync";
+const char *const parallelDirtyFullSyncPN = "parallel-dirty-full-sync";
 const char *const dirtyHashSyncPN = "dirty-hash-sync";
+const char *const hashAlgoDirtyHashSyncPN = "hash-algo-dirty-hash-sync";
 const char *const wlogTransferPN = "wlog-transfer";
 const char *const wdiffTransferPN = "wdiff-transfer";
+const char *const resumableWdiffTransferPN = "resumable-wdiff-transfer";
 const char *const replSyncPN = "repl-sync";
+const char *const hashAlgoReplSyncPN = "hash-algo-repl-sync";
+const char *const resumableReplSyncPN = "resumable-repl-sync";
 const char *const gatherLatestSnapPN = "gather-latest-snap";
 
 
@@ -142,6 +150,18 @@ std::string run1stNegotiateAsClient(
     cybozu::Socket &sock,
     const std::string &clientId, const std::string &protocolName);
 
+/**
+ * Same as run1stNegotiateAsClient() but an unknown protocol is not an error.
+ * serverId will be set.
+ *
+ * RETURN:
+ *   false if the server does not support the protocol.
+ *   The socket must not be used any more in that case.
+ */
+bool tryRun1stNegotiateAsClient(
+    cybozu::Socket &sock,
+    const std::string &clientId, const std::string &protocolName, std::string &serverId);
+
 /**
  * Parameters for commands as a client.
  */
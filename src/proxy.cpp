@@ -290,17 +290,23 @@ void s2pWlogTransferServer(protocol::ServerParams &p)
     ul.unlock();
 
     cybozu::Stopwatch stopwatch;
+    metrics::VolMetrics &vm = getProxyGlobal().metrics.get(volId);
+    metrics::StageTimer wholeTimer(&vm, metrics::WLOG_RECV);
     ProxyVolInfo volInfo = getProxyVolInfo(volId);
     cybozu::TmpFile tmpFile(volInfo.getReceivedDir().str());
     cybozu::TmpFile wlogTmpFile;
     const bool savesWlog = false; // for DEBUG.
     if (savesWlog) wlogTmpFile.prepare(volInfo.getReceivedDir().str());
+    proxy_local::WdiffWriteStat wstat{};
+    /* The hold-back buffer is within the reserved conversion memory. */
+    wstat.holdBackSize = std::min<uint64_t>(maxLogSizeMb * MEBI, MAX_WDIFF_HOLD_BACK_SIZE);
 #if 0 /* deprecated */
     const bool ret = proxy_local::recvWlogAndWriteDiff(
-        p.sock, tmpFile.fd(), uuid, pbs, salt, volSt.stopState, gp.ps, wlogTmpFile.fd());
+        p.sock, tmpFile.fd(), uuid, pbs, salt, volSt.stopState, gp.ps, gp.wlogRecvCpu, wlogTmpFile.fd());
 #else /* QQQ */
     const bool ret = proxy_local::recvWlogAndWriteDiff2(
-        p.sock, tmpFile.fd(), uuid, pbs, salt, volSt.stopState, gp.ps, wlogTmpFile.fd());
+        p.sock, tmpFile.fd(), uuid, pbs, salt, volSt.stopState, gp.ps, gp.wlogRecvCpu, wlogTmpFile.fd(),
+        wstat, &vm);
 #endif
     if (!ret) {
         logger.warn() << FUNC << "force stopped wlog receiving" << volId;
@@ -312,7 +318,9 @@ void s2pWlogTransferServer(protocol::ServerParams &p)
         throw cybozu::Exception(FUNC) << "diff is not clean" << diff;
     }
     diff.dataSize = cybozu::FileStat(tmpFile.fd()).size();
+    metrics::StageTimer fsyncTimer(&vm, metrics::FSYNC);
     tmpFile.save(volInfo.getDiffPath(diff).str());
+    fsyncTimer.record(diff.dataSize);
     if (savesWlog) {
         const std::string fname =
             cybozu::util::removeSuffix(createDiffFileName(diff), ".wdiff") + ".wlog";
@@ -324,6 +332,7 @@ void s2pWlogTransferServer(protocol::ServerParams &p)
     volInfo.addDiffToReceivedDir(diff);
     ul.unlock();
     packet::Ack(p.sock).sendFin();
+    wholeTimer.record(diff.dataSize);
 
     ul.lock();
     volSt.actionState.clearAll();
@@ -343,20 +352,20 @@ void s2pWlogTransferServer(protocol::ServerParams &p)
     volSt.lastWlogReceivedTime = ::time(0);
     tran.commit(pStarted);
     const std::string elapsed = util::getElapsedTimeStr(stopwatch.get());
-    logger.debug() << "wlog-transfer succeeded" << volId << elapsed;
+    logger.debug() << "wlog-transfer succeeded" << volId << elapsed << wstat;
 }
 
 
-void ProxyWorker::setupMerger(DiffMerger& merger, MetaDiffVec& diffV, MetaDiff& mergedDiff,
-                              const ProxyVolInfo& volInfo, const std::string& archiveName)
+void ProxyWorker::openWdiffsToSend(MetaDiffVec& diffV, MetaDiff& mergedDiff,
+                                   std::vector<cybozu::util::File>& fileV, DiffFileHeader& fileH,
+                                   const ProxyVolInfo& volInfo, const std::string& archiveName)
 {
     const char *const FUNC = __func__;
     const int maxRetryNum = 10;
     int retryNum = 0;
-    cybozu::Uuid uuid;
-    std::vector<cybozu::util::File> fileV;
 retry:
     {
+        fileV.clear();
         diffV = volInfo.getDiffListToSend(archiveName, gp.maxWdiffSendMb * MEBI, gp.maxWdiffSendNr);
         if (diffV.empty()) return;
         // apply wdiff files indicated by diffV to lvSnap.
@@ -367,17 +376,16 @@ retry:
                 if (retryNum == maxRetryNum) {
                     throw cybozu::Exception(FUNC) << "exceed max retry";
                 }
-                fileV.clear();
                 goto retry;
             }
 
             DiffFileHeader header;
             header.readFrom(file);
             if (fileV.empty()) {
-                uuid = header.getUuid();
+                fileH = header;
                 mergedDiff = diff;
             } else {
-                if (uuid != header.getUuid()) {
+                if (fileH.getUuid() != header.getUuid()) {
                     diffV.resize(fileV.size());
                     break;
                 }
@@ -387,6 +395,11 @@ retry:
             fileV.push_back(std::move(file));
         }
     }
+}
+
+
+void ProxyWorker::setupMerger(DiffMerger& merger, std::vector<cybozu::util::File>&& fileV)
+{
     merger.setMaxCacheSize(INDEXED_DIFF_CACHE_SIZE);
     merger.addWdiffs(std::move(fileV));
     merger.prepare();
@@ -424,9 +437,10 @@ int ProxyWorker::transferWdiffIfNecessary(PushOpt &pushOpt)
     ProxyVolInfo volInfo = getProxyVolInfo(volId);
 
     MetaDiffVec diffV;
-    DiffMerger merger;
     MetaDiff mergedDiff;
-    setupMerger(merger, diffV, mergedDiff, volInfo, archiveName);
+    std::vector<cybozu::util::File> fileV;
+    DiffFileHeader fileH;
+    openWdiffsToSend(diffV, mergedDiff, fileV, fileH, volInfo, archiveName);
     if (diffV.empty()) {
         LOGs.debug() << FUNC << "no need to send wdiffs" << volId << archiveName;
         return DONT_SEND;
@@ -440,13 +454,20 @@ int ProxyWorker::transferWdiffIfNecessary(PushOpt &pushOpt)
 
     ul.unlock();
     cybozu::Socket sock;
-    util::connectWithTimeout(sock, hi.addrPort.getSocketAddr(), gp.socketTimeout);
+    const cybozu::SocketAddr server = hi.addrPort.getSocketAddr();
+    util::connectWithTimeout(sock, server, gp.socketTimeout);
     gp.setSocketParams(sock);
-    const std::string serverId = protocol::run1stNegotiateAsClient(sock, gp.nodeId, wdiffTransferPN);
+    std::string serverId;
+    const bool canResume = protocol::tryRun1stNegotiateAsClient(sock, gp.nodeId, resumableWdiffTransferPN, serverId);
+    if (!canResume) {
+        LOGs.info() << FUNC << "archive does not support" << resumableWdiffTransferPN << serverId;
+        sock.close();
+        util::connectWithTimeout(sock, server, gp.socketTimeout);
+        gp.setSocketParams(sock);
+        serverId = protocol::run1stNegotiateAsClient(sock, gp.nodeId, wdiffTransferPN);
+    }
     ProtocolLogger logger(gp.nodeId, serverId);
 
-    const DiffFileHeader& fileH = merger.header();
-
     /* wdiff-send negotiation */
     packet::Packet pkt(sock);
     pkt.write(volId);
@@ -463,15 +484,43 @@ int ProxyWorker::transferWdiffIfNecessary(PushOpt &pushOpt)
     std::string res;
     pkt.read(res);
     if (res == msgAccept) {
+        /* The archive has received IOs before resumeAddr already. */
+        uint64_t resumeAddr = 0;
+        if (canResume) pkt.read(resumeAddr);
+        if (resumeAddr > 0) logger.info() << FUNC << "resume" << volId << mergedDiff << resumeAddr;
+        /*
+         * A single wdiff is sorted and not overlapped already
+         * so its packs can be sent without merging.
+         */
+        const bool isPassThrough = fileV.size() == 1 && resumeAddr == 0;
+        DiffMerger merger;
+        cybozu::util::File passThroughFile;
+        if (isPassThrough) {
+            passThroughFile = std::move(fileV[0]);
+            passThroughFile.lseek(fileH.getSize(), SEEK_SET);
+        } else {
+            merger.setStartAddr(resumeAddr);
+            setupMerger(merger, std::move(fileV));
+        }
         DiffStatistics statOut;
-        if (!wdiffTransferClient(pkt, merger, hi.cmpr, volSt.stopState, gp.ps, statOut)) {
+        metrics::VolMetrics &vm = getProxyGlobal().metrics.get(volId);
+        metrics::StageTimer wholeTimer(&vm, metrics::WDIFF_SEND);
+        const bool sent = isPassThrough
+            ? wdiffTransferPassThroughClient(pkt, passThroughFile, fileH, hi.cmpr, volSt.stopState, gp.ps, statOut, &vm)
+            : wdiffTransferClient(pkt, merger, hi.cmpr, volSt.stopState, gp.ps, statOut, &vm);
+        if (!sent) {
             logger.warn() << FUNC << "force stopped wdiff sending" << volId;
             return DONT_SEND;
         }
         packet::Ack(pkt.sock()).recv();
-        logger.debug() << "mergeIn " << volId << merger.statIn();
-        logger.debug() << "mergeOut" << volId << statOut;
-        logger.debug() << "mergeMemUsage" << volId << merger.memUsageStr();
+        wholeTimer.record(statOut.dataSize);
+        if (isPassThrough) {
+            logger.debug() << "passThrough" << volId << statOut;
+        } else {
+            logger.debug() << "mergeIn " << volId << merger.statIn();
+            logger.debug() << "mergeOut" << volId << statOut;
+            logger.debug() << "mergeMemUsage" << volId << merger.memUsageStr();
+        }
         ul.lock();
         volSt.lastWdiffSentTimeMap[archiveName] = ::time(0);
         ul.unlock();
@@ -674,6 +723,7 @@ StrVec getAllStatusAsStrVec()
     ret.push_back(fmt("maxConnections %zu", gp.maxConnections));
     ret.push_back(fmt("maxForegroundTasks %zu", gp.maxForegroundTasks));
     ret.push_back(fmt("maxBackgroundTasks %zu", gp.maxBackgroundTasks));
+    ret.push_back(fmt("maxBackgroundTasksPerVolume %zu", gp.maxBackgroundTasksPerVolume));
     ret.push_back(fmt("maxConversionMb %zu", gp.maxConversionMb));
     ret.push_back(fmt("socketTimeout %zu", gp.socketTimeout));
     ret.push_back(fmt("keepAlive %s", gp.keepAliveParams.toStr().c_str()));
@@ -689,6 +739,12 @@ StrVec getAllStatusAsStrVec()
            << " timeDiffMs " << timeDiffMs;
         ret.push_back(ss.str());
     }
+    if (gp.dispatcher) {
+        ret.push_back("-----Running-----");
+        for (const auto &pair : gp.dispatcher->getRunning()) {
+            ret.push_back(fmt("volume %s nrRunning %zu", pair.first.c_str(), pair.second));
+        }
+    }
 
     ret.push_back("-----Volume-----");
     for (const std::string &volId : gp.stMap.getKeyList()) {
@@ -980,13 +1036,14 @@ void deleteArchiveInfo(const std::string &volId, const std::string &archiveName)
  */
 bool recvWlogAndWriteDiff(
     cybozu::Socket &sock, int fd, const cybozu::Uuid &uuid, uint32_t pbs, uint32_t salt,
-    const std::atomic<int> &stopState, const ProcessStatus &ps, int wlogFd)
+    const std::atomic<int> &stopState, const ProcessStatus &ps, size_t concurrency, int wlogFd)
 {
     DiffMemory diffMem;
     diffMem.header().setUuid(uuid);
 
     LogPackHeader packH(pbs, salt);
     WlogReceiver receiver(sock, pbs, salt);
+    receiver.start(concurrency);
 
     bool isWlogHeaderWritten = false;
     std::unique_ptr<WlogWriter> wlogW;
@@ -1028,12 +1085,14 @@ bool recvWlogAndWriteDiff(
  */
 bool recvWlogAndWriteDiff2(
     cybozu::Socket &sock, int fd, const cybozu::Uuid &uuid, uint32_t pbs, uint32_t salt,
-    const std::atomic<int> &stopState, const ProcessStatus &ps, int wlogFd)
+    const std::atomic<int> &stopState, const ProcessStatus &ps, size_t concurrency, int wlogFd,
+    WdiffWriteStat &stat, metrics::VolMetrics *metrics)
 {
     unusedVar(wlogFd);
 
     IndexedDiffWriter writer;
     writer.setFd(fd);
+    writer.setMaxHoldBackSize(stat.holdBackSize);
 
     DiffFileHeader header;
     header.setUuid(uuid);
@@ -1042,6 +1101,8 @@ bool recvWlogAndWriteDiff2(
 
     LogPackHeader packH(pbs, salt);
     WlogReceiver receiver(sock, pbs, salt);
+    receiver.setMetrics(metrics);
+    receiver.start(concurrency);
 
     while (receiver.popHeader(packH)) {
         if (stopState == ForceStopping || ps.isForceShutdown()) {
@@ -1058,6 +1119,10 @@ bool recvWlogAndWriteDiff2(
         }
     }
     writer.finalize();
+    stat.peakHoldBackSize = writer.getPeakHoldBackSize();
+    stat.eliminatedSize = writer.getEliminatedSize();
+    stat.deadSize = writer.getDeadSize();
+    stat.deadRatio = writer.getDeadRatio();
     return true;
 }
 
@@ -1139,6 +1204,15 @@ void getHandlerStat(protocol::GetCommandParams &p)
     p.logger.debug() << "get handler-stat succeeded";
 }
 
+void getMetrics(protocol::GetCommandParams &p)
+{
+    const VolIdOrAllParam param = parseVolIdOrAllParam(p.params, 1);
+    const metrics::MetricsRegistry &reg = getProxyGlobal().metrics;
+    const StrVec ret = param.isAll ? reg.prettyPrintAll() : reg.prettyPrint(param.volId);
+    protocol::sendValueAndFin(p, ret);
+    p.logger.debug() << "get metrics succeeded";
+}
+
 static MetaDiffVec getAllWdiffDetail(protocol::GetCommandParams &p)
 {
     const KickParam param = parseVolIdAndArchiveNameParamForGet(p.params);
@@ -18,6 +18,7 @@
 #include "wdiff_transfer.hpp"
 #include "command_param_parser.hpp"
 #include "bdev_util.hpp"
+#include "metrics.hpp"
 
 namespace walb {
 
@@ -125,9 +126,14 @@ private:
     const ProxyTask task_;
 
     /**
-     * setupMerger currently supports sorted diffs only.
+     * Open wdiffs to send, which have the same uuid.
+     * fileV will be positioned at the beginning of each file.
+     * fileH will be the header of the first wdiff.
      */
-    void setupMerger(DiffMerger& merger, MetaDiffVec& diffV, MetaDiff& mergedDiff, const ProxyVolInfo& volInfo, const std::string& archiveName);
+    void openWdiffsToSend(MetaDiffVec& diffV, MetaDiff& mergedDiff,
+                          std::vector<cybozu::util::File>& fileV, DiffFileHeader& fileH,
+                          const ProxyVolInfo& volInfo, const std::string& archiveName);
+    void setupMerger(DiffMerger& merger, std::vector<cybozu::util::File>&& fileV);
 
 public:
     explicit ProxyWorker(const ProxyTask &task) : task_(task) {
@@ -161,7 +167,9 @@ struct ProxySingleton
     size_t maxConnections;
     size_t maxForegroundTasks;
     size_t maxBackgroundTasks;
+    size_t maxBackgroundTasksPerVolume;
     size_t maxConversionMb;
+    size_t wlogRecvCpu;
     size_t socketTimeout;
     KeepAliveParams keepAliveParams;
     bool allowExec;
@@ -175,6 +183,7 @@ struct ProxySingleton
     std::unique_ptr<DispatchTask<ProxyTask, ProxyWorker> > dispatcher;
     std::atomic<uint64_t> conversionUsageMb;
     protocol::HandlerStatMgr handlerStatMgr;
+    metrics::MetricsRegistry metrics; // per-volume stage latency histograms.
 
     void setSocketParams(cybozu::Socket& sock) const {
         util::setSocketParams(sock, keepAliveParams, socketTimeout);
@@ -273,10 +282,31 @@ void deleteArchiveInfo(const std::string &volId, const std::string &archiveName)
 
 bool recvWlogAndWriteDiff(
     cybozu::Socket &sock, int fd, const cybozu::Uuid &uuid, uint32_t pbs, uint32_t salt,
-    const std::atomic<int> &stopState, const ProcessStatus &ps, int wlogFd);
+    const std::atomic<int> &stopState, const ProcessStatus &ps, size_t concurrency, int wlogFd);
+
+/**
+ * Statistics of wlog-to-wdiff conversion in recvWlogAndWriteDiff2().
+ */
+struct WdiffWriteStat
+{
+    size_t holdBackSize; // memory limit of the hold-back buffer [byte].
+    size_t peakHoldBackSize; // [byte]
+    uint64_t eliminatedSize; // overwritten in memory and never written [byte].
+    uint64_t deadSize; // written but not referred from the index [byte].
+    double deadRatio; // deadSize / written size.
+
+    friend inline std::ostream& operator<<(std::ostream& os, const WdiffWriteStat& st) {
+        os << "holdBack " << st.peakHoldBackSize << "/" << st.holdBackSize
+           << " eliminated " << st.eliminatedSize
+           << " dead " << st.deadSize << " (" << st.deadRatio << ")";
+        return os;
+    }
+};
+
 bool recvWlogAndWriteDiff2(
     cybozu::Socket &sock, int fd, const cybozu::Uuid &uuid, uint32_t pbs, uint32_t salt,
-    const std::atomic<int> &stopState, const ProcessStatus &ps, int wlogFd);
+    const std::atomic<int> &stopState, const ProcessStatus &ps, size_t concurrency, int wlogFd,
+    WdiffWriteStat &stat, metrics::VolMetrics *metrics = nullptr);
 
 
 inline void getState(protocol::GetCommandParams &p)
@@ -304,6 +334,7 @@ void isWdiffSendError(protocol::GetCommandParams &p);
 StrVec getLatestSnapForVolume(const std::string& volId);
 void getLatestSnap(protocol::GetCommandParams &p);
 void getHandlerStat(protocol::GetCommandParams &p);
+void getMetrics(protocol::GetCommandParams &p);
 void getProxyDiffList(protocol::GetCommandParams &p);
 
 } // namespace proxy_local
@@ -316,6 +347,7 @@ const protocol::GetCommandHandlerMap proxyGetHandlerMap = {
     { isWdiffSendErrorTN, proxy_local::isWdiffSendError },
     { getLatestSnapTN, proxy_local::getLatestSnap },
     { getHandlerStatTN, proxy_local::getHandlerStat },
+    { metricsTN, proxy_local::getMetrics },
     { proxyDiffTN, proxy_local::getProxyDiffList },
 };
 
@@ -22,6 +22,8 @@
 #include "protocol.hpp"
 #include "easy_signal.hpp"
 #include "suppressed_logger.hpp"
+#include "task_queue.hpp"
+#include "task_scheduler.hpp"
 
 namespace walb {
 namespace server {
@@ -130,10 +132,14 @@ void waitUntil(Mutex &mu, Pred pred, const char *msg, size_t timeout = DEFAULT_T
  * This instance starts a worker thread in the constructor,
  * and joins it in the destructor.
  *
- * The worker thread will pop tasks from a task queue and
+ * The worker thread will pick ready tasks from a task queue and
  * run them using a thread pool.
  * Number of concurrent running tasks will be limited by
- * maxBackgroundTasks parameter.
+ * maxBackgroundTasks parameter, and ones of the same group (volume)
+ * will be limited by maxTasksPerGroup parameter (0 means unlimited).
+ * Which ready task runs next is decided by FairTaskScheduler
+ * with attributes given by getAttr().
+ * The worker thread wakes up immediately when a task is pushed or finished.
  *
  * User can specify Task data and Worker function object.
  *
@@ -146,26 +152,69 @@ void waitUntil(Mutex &mu, Pred pred, const char *msg, size_t timeout = DEFAULT_T
 template <typename Task, typename Worker>
 class DispatchTask
 {
+public:
+    using AttrGetter = std::function<TaskSchedAttr(const Task &)>;
 private:
     std::atomic<bool> shouldStop;
     TaskQueue<Task> &tq;
-    size_t maxBackgroundTasks;
+    AttrGetter getAttr;
+    mutable std::mutex mu; // for sched.
+    FairTaskScheduler sched;
+    using TimePoint = std::chrono::steady_clock::time_point;
+    using AttrCache = std::map<Task, std::pair<TaskSchedAttr, TimePoint> >;
+    AttrCache attrCache; // accessed by the dispatcher thread only.
     std::thread th;
 
     static const size_t SLEEP_MS = 1000;
+    static const size_t ATTR_CACHE_MS = 1000;
+    static const size_t ATTR_CACHE_MIN = 1000;
+
+    /**
+     * Notify the dispatcher of the end of a task even if it throws an error.
+     */
+    struct Finisher
+    {
+        DispatchTask &dispatcher;
+        const std::string group;
+        Finisher(DispatchTask &dispatcher, const std::string &group)
+            : dispatcher(dispatcher), group(group) {
+        }
+        ~Finisher() noexcept {
+            dispatcher.finish(group);
+        }
+    };
 
 public:
     DispatchTask(TaskQueue<Task> &tq,
-                 size_t maxBackgroundTasks)
+                 size_t maxBackgroundTasks,
+                 size_t maxTasksPerGroup = 0,
+                 const AttrGetter &getAttr = defaultAttr)
         : shouldStop(false)
         , tq(tq)
-        , maxBackgroundTasks(maxBackgroundTasks)
+        , getAttr(getAttr)
+        , mu()
+        , sched(maxBackgroundTasks, maxTasksPerGroup)
+        , attrCache()
         , th(std::ref(*this)) {
     }
     ~DispatchTask() noexcept {
         shouldStop = true;
+        tq.notify();
         th.join();
     }
+    static TaskSchedAttr defaultAttr(const Task &task) {
+        std::ostringstream ss;
+        ss << task;
+        return TaskSchedAttr(ss.str());
+    }
+    /**
+     * RETURN:
+     *   (group, number of running tasks) list.
+     */
+    std::vector<std::pair<std::string, size_t> > getRunning() const {
+        std::lock_guard<std::mutex> lk(mu);
+        return sched.getRunning();
+    }
     void logErrors(const std::vector<std::exception_ptr> &v) const {
         for (const std::exception_ptr &ep : v) {
             LOGs.error() << cybozu::thread::exceptionPtrToStr(ep);
@@ -174,20 +223,25 @@ public:
     void operator()() noexcept try {
         LOGs.info() << "dispatchTask begin";
         cybozu::thread::ThreadRunnerFixedPool pool;
-        pool.start(maxBackgroundTasks);
-        std::queue<Task> taskQ;
+        pool.start(sched.maxTasks());
+        std::queue<std::pair<Task, std::string> > taskQ; // tasks chosen but not added to the pool yet.
         while (!shouldStop) {
             LOGs.debug() << "dispatchTask nrRunning" << pool.nrRunning();
             logErrors(pool.gc());
-            if (taskQ.empty()) {
-                Task task;
-                if (!tq.pop(task, SLEEP_MS)) continue;
-                LOGs.debug() << "dispatchTask pop" << task;
-                taskQ.push(task);
+            uint64_t gen;
+            if (taskQ.empty() && !pickTasks(taskQ, gen)) {
+                tq.waitForChange(gen, SLEEP_MS);
+                continue;
             }
-            Task &task = taskQ.front();
-            if (!pool.add(Worker(task))) {
-                util::sleepMs(SLEEP_MS);
+            const Task &task = taskQ.front().first;
+            const std::string group = taskQ.front().second;
+            if (!pool.add([this, task, group]() {
+                        Finisher fin(*this, group);
+                        Worker worker(task);
+                        worker();
+                    })) {
+                /* The slot is being released by the pool thread. */
+                std::this_thread::yield();
                 continue;
             }
             LOGs.debug() << "dispatchTask dispatch task" << task;
@@ -203,6 +257,60 @@ public:
         LOGe("dispatchTask:unknown error");
         ::exit(1);
     }
+private:
+    /**
+     * Choose ready tasks for free slots and take them from the queue.
+     * @gen change counter of the queue to wait for if no task is chosen.
+     */
+    bool pickTasks(std::queue<std::pair<Task, std::string> > &taskQ, uint64_t &gen) {
+        {
+            std::lock_guard<std::mutex> lk(mu);
+            if (!sched.hasFreeSlot()) {
+                /* finish() will change gen. */
+                tq.getReady(gen);
+                return false;
+            }
+        }
+        const std::vector<Task> taskV = tq.getReady(gen);
+        if (attrCache.size() > taskV.size() * 2 + ATTR_CACHE_MIN) attrCache.clear();
+        if (taskV.empty()) return false;
+        const TimePoint now = std::chrono::steady_clock::now();
+        std::vector<TaskSchedAttr> attrV;
+        attrV.reserve(taskV.size());
+        for (const Task &task : taskV) attrV.push_back(getAttrCached(task, now));
+
+        std::lock_guard<std::mutex> lk(mu);
+        for (const size_t i : sched.chooseMulti(attrV)) {
+            /* If the task has been removed by another thread, it has changed gen. */
+            if (!tq.erase(taskV[i])) continue;
+            LOGs.debug() << "dispatchTask pop" << taskV[i] << attrV[i].group << attrV[i].priority;
+            sched.start(attrV[i]);
+            taskQ.emplace(taskV[i], attrV[i].group);
+            attrCache.erase(taskV[i]);
+        }
+        return !taskQ.empty();
+    }
+    /**
+     * getAttr() may be costly so its result is reused for a while.
+     */
+    const TaskSchedAttr& getAttrCached(const Task &task, const TimePoint &now) {
+        typename AttrCache::iterator itr = attrCache.find(task);
+        if (itr == attrCache.end()) {
+            itr = attrCache.emplace(task, std::make_pair(getAttr(task), now)).first;
+        } else if (now - itr->second.second > std::chrono::milliseconds(ATTR_CACHE_MS)) {
+            itr->second = std::make_pair(getAttr(task), now);
+        }
+        return itr->second.first;
+    }
+    void finish(const std::string &group) noexcept try {
+        {
+            std::lock_guard<std::mutex> lk(mu);
+            sched.finish(group);
+        }
+        tq.notify();
+    } catch (std::exception &e) {
+        LOGs.error() << "dispatchTask:finish" << e.what();
+    }
 };
 
 inline void verifyStopState(
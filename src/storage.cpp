@@ -286,6 +286,33 @@ void StorageWorker::operator()()
 }
 
 
+/**
+ * Volumes whose logs are about to overflow run first,
+ * and fuller logs get larger shares among the same priority class.
+ */
+TaskSchedAttr getTaskSchedAttr(const std::string &volId)
+{
+    TaskSchedAttr attr(volId);
+    try {
+        const StorageVolInfo volInfo(gs.baseDirStr, volId);
+        if (!volInfo.existsVolDir()) return attr;
+        const std::string wdevPath = volInfo.getWdevPath();
+        const uint64_t logCapacityPb = device::getLogCapacityPb(wdevPath);
+        if (logCapacityPb == 0) return attr;
+        const uint64_t pct = std::min<uint64_t>(device::getLogUsagePb(wdevPath) * 100 / logCapacityPb, 100);
+        if (pct >= LOG_USAGE_PCT_FOR_URGENT_TASK) {
+            attr.priority = URGENT_TASK_PRIORITY;
+        } else if (pct >= LOG_USAGE_PCT_FOR_HIGH_TASK) {
+            attr.priority = HIGH_TASK_PRIORITY;
+        }
+        attr.weight = 1 + pct / 10;
+    } catch (std::exception &e) {
+        LOGs.warn() << __func__ << volId << e.what();
+    }
+    return attr;
+}
+
+
 void wdevMonitorWorker() noexcept
 {
     const char *const FUNC = __func__;
@@ -574,6 +601,7 @@ StrVec getAllStatusAsStrVec()
     v.push_back(fmt("maxConnections %zu", gs.maxConnections));
     v.push_back(fmt("maxForegroundTasks %zu", gs.maxForegroundTasks));
     v.push_back(fmt("maxBackgroundTasks %zu", gs.maxBackgroundTasks));
+    v.push_back(fmt("maxBackgroundTasksPerVolume %zu", gs.maxBackgroundTasksPerVolume));
     v.push_back(fmt("socketTimeout %zu", gs.socketTimeout));
     v.push_back(fmt("keepAlive %s", gs.keepAliveParams.toStr().c_str()));
 
@@ -591,6 +619,12 @@ StrVec getAllStatusAsStrVec()
         const int64_t &timeDiffMs = pair.second;
         v.push_back(fmt("volume %s timeDiffMs %" PRIi64 "", volId.c_str(), timeDiffMs));
     }
+    if (gs.dispatcher) {
+        v.push_back("-----Running-----");
+        for (const auto &pair : gs.dispatcher->getRunning()) {
+            v.push_back(fmt("volume %s nrRunning %zu", pair.first.c_str(), pair.second));
+        }
+    }
 
     v.push_back("-----Volume-----");
     for (const std::string &volId : gs.stMap.getKeyList()) {
@@ -689,14 +723,29 @@ void backupClient(protocol::ServerParams &p, bool isFull)
         cybozu::Socket aSock;
         util::connectWithTimeout(aSock, archive, gs.socketTimeout);
         gs.setSocketParams(aSock);
-        const std::string &protocolName = isFull ? dirtyFullSyncPN : dirtyHashSyncPN;
-        archiveId = protocol::run1stNegotiateAsClient(aSock, gs.nodeId, protocolName);
+        bool isParallel = false;
+        bool hasHashAlgo = false;
+        const char *const newProtocolName = isFull ? parallelDirtyFullSyncPN : hashAlgoDirtyHashSyncPN;
+        const bool isNew = protocol::tryRun1stNegotiateAsClient(aSock, gs.nodeId, newProtocolName, archiveId);
+        if (isNew) {
+            isParallel = isFull;
+            hasHashAlgo = !isFull;
+        } else {
+            logger.info() << FUNC << "archive does not support" << newProtocolName << archiveId;
+            aSock.close();
+            util::connectWithTimeout(aSock, archive, gs.socketTimeout);
+            gs.setSocketParams(aSock);
+            const std::string &protocolName = isFull ? dirtyFullSyncPN : dirtyHashSyncPN;
+            archiveId = protocol::run1stNegotiateAsClient(aSock, gs.nodeId, protocolName);
+        }
         packet::Packet aPkt(aSock);
         aPkt.write(storageHT);
         aPkt.write(volId);
         aPkt.write(sizeLb);
         aPkt.write(curTime);
         aPkt.write(bulkLb);
+        if (isParallel) aPkt.write(gs.fullSyncCmpr);
+        if (hasHashAlgo) aPkt.write(std::string(cybozu::murmurhash3::hashAlgoName(gs.hashAlgo)));
         aPkt.flush();
         logger.debug() << "send" << storageHT << volId << sizeLb << curTime << bulkLb;
         {
@@ -714,6 +763,12 @@ void backupClient(protocol::ServerParams &p, bool isFull)
         }
         MetaSnap snap;
         if (!isFull) aPkt.read(snap);
+        cybozu::murmurhash3::HashAlgo hashAlgo = cybozu::murmurhash3::HASH_ALGO_MURMUR3;
+        if (hasHashAlgo) {
+            std::string hashAlgoStr;
+            aPkt.read(hashAlgoStr);
+            hashAlgo = cybozu::murmurhash3::parseHashAlgo(hashAlgoStr);
+        }
         const uint64_t gidB = isFull ? 0 : snap.gidE + 1;
         volInfo.resetWlog(gidB);
         const cybozu::Uuid uuid = volInfo.getUuid();
@@ -724,17 +779,23 @@ void backupClient(protocol::ServerParams &p, bool isFull)
 
         // (7) in storage-daemon.txt
         logger.info() << (isFull ? dirtyFullSyncPN : dirtyHashSyncPN)
-                      << "started" << volId << archiveId;
+                      << "started" << volId << archiveId
+                      << (isFull ? "" : cybozu::murmurhash3::hashAlgoName(hashAlgo));
         if (isFull) {
             const std::string bdevPath = volInfo.getWdevPath();
-            if (!dirtyFullSyncClient(aPkt, bdevPath, 0, sizeLb, bulkLb, volSt.stopState, gs.ps, gs.fullScanLbPerSec)) {
+            const bool isOk = isParallel
+                ? parallelDirtyFullSyncClient(aPkt, bdevPath, 0, sizeLb, bulkLb, volSt.stopState, gs.ps,
+                                              gs.fullScanLbPerSec, gs.fullSyncCmpr)
+                : dirtyFullSyncClient(aPkt, bdevPath, 0, sizeLb, bulkLb, volSt.stopState, gs.ps, gs.fullScanLbPerSec);
+            if (!isOk) {
                 logger.warn() << FUNC << "force stopped" << volId;
                 return;
             }
         } else {
             const uint32_t hashSeed = curTime;
             AsyncBdevReader reader(volInfo.getWdevPath());
-            if (!dirtyHashSyncClient(aPkt, reader, sizeLb, bulkLb, hashSeed, volSt.stopState, gs.ps, gs.fullScanLbPerSec)) {
+            if (!dirtyHashSyncClient(aPkt, reader, sizeLb, bulkLb, hashSeed, hashAlgo, volSt.stopState, gs.ps, gs.fullScanLbPerSec,
+                                     gs.hashSyncCpu)) {
                 logger.warn() << FUNC << "force stopped" << volId;
                 return;
             }
@@ -875,7 +936,11 @@ bool extractAndSendAndDeleteWlog(const std::string &volId)
     }
 
     ProtocolLogger logger(gs.nodeId, serverId);
+    metrics::VolMetrics &vm = getStorageGlobal().metrics.get(volId);
+    metrics::StageTimer wholeTimer(&vm, metrics::WLOG_SEND);
     WlogSender sender(sock, logger, pbs, salt);
+    sender.setMetrics(&vm);
+    sender.start(gs.wlogSendCpu);
 
     LogPackHeader packH(pbs, salt);
     reader.reset(lsidB, maxLogSizePb);
@@ -889,6 +954,7 @@ bool extractAndSendAndDeleteWlog(const std::string &volId)
                 throw cybozu::Exception(FUNC) << "force stopped" << volId;
             }
             if (lsid == lsidLimit) break;
+            metrics::StageTimer readTimer(&vm, metrics::LOG_READ);
             if (!readLogPackHeader(reader, packH, lsid)) {
                 dumpLogPackHeader(volId, lsid, packH); // for analysis.
                 throw cybozu::Exception(FUNC) << "invalid logpack header" << volId << lsid;
@@ -896,26 +962,29 @@ bool extractAndSendAndDeleteWlog(const std::string &volId)
             verifyMaxWlogSendPbIsNotTooSmall(maxWlogSendPb, packH.header().total_io_size + 1, FUNC);
             const uint64_t nextLsid =  packH.nextLogpackLsid();
             if (lsidLimit < nextLsid) break;
+            readTimer.record(pbs);
             sender.pushHeader(packH);
             for (size_t i = 0; i < packH.header().n_records; i++) {
+                readTimer.reset();
                 if (!readLogIo(reader, packH, i, buf)) {
                     throw cybozu::Exception(FUNC) << "invalid logpack IO" << volId << lsid << i;
                 }
-                sender.pushIo(packH, i, buf.data());
-                buf.clear();
+                if (!buf.empty()) readTimer.record(buf.size());
+                sender.pushIo(packH, i, std::move(buf));
             }
             lsid = nextLsid;
         }
+        sender.sync();
     } catch (...) {
         LOGs.info() << FUNC << volId << lsidB << lsid << lsidLimit;
         throw;
     }
-    sender.sync();
     const uint64_t lsidE = lsid;
     const MetaDiff diff = volInfo.getTransferDiff(rec0, rec1, lsidE);
     pkt.write(diff);
     pkt.flush();
     packet::Ack(sock).recv();
+    wholeTimer.record((lsidE - lsidB) * pbs);
     const bool isRemainingData = volInfo.finishWlogTransfer(rec0, rec1, lsidE);
     isRemainingGarbage = volInfo.deleteGarbageWlogs();
     LOGs.debug() << FUNC << "end  " << volId << lsidB << lsidE;
@@ -1205,6 +1274,15 @@ void getHandlerStat(protocol::GetCommandParams &p)
     p.logger.debug() << "get handler-stat succeeded";
 }
 
+void getMetrics(protocol::GetCommandParams &p)
+{
+    const VolIdOrAllParam param = parseVolIdOrAllParam(p.params, 1);
+    const metrics::MetricsRegistry &reg = getStorageGlobal().metrics;
+    const StrVec ret = param.isAll ? reg.prettyPrintAll() : reg.prettyPrint(param.volId);
+    protocol::sendValueAndFin(p, ret);
+    p.logger.debug() << "get metrics succeeded";
+}
+
 } // namespace storage_local
 
 } // namespace walb
@@ -19,6 +19,7 @@
 #include "command_param_parser.hpp"
 #include "snap_info.hpp"
 #include "ts_delta.hpp"
+#include "metrics.hpp"
 
 namespace walb {
 
@@ -172,11 +173,16 @@ struct StorageSingleton
     std::string nodeId;
     std::string baseDirStr;
     uint64_t maxWlogSendMb;
+    size_t wlogSendCpu;
+    size_t hashSyncCpu;
+    cybozu::murmurhash3::HashAlgo hashAlgo; // requested in hash-sync.
+    CompressOpt fullSyncCmpr;
     size_t implicitSnapshotIntervalSec;
     size_t delaySecForRetry;
     size_t maxConnections;
     size_t maxForegroundTasks;
     size_t maxBackgroundTasks;
+    size_t maxBackgroundTasksPerVolume;
     size_t socketTimeout;
     KeepAliveParams keepAliveParams;
     size_t tsDeltaGetterIntervalSec;
@@ -200,6 +206,7 @@ struct StorageSingleton
     storage_local::TsDeltaManager tsDeltaManager;
     std::atomic<uint64_t> fullScanLbPerSec; // 0 means unlimited.
     protocol::HandlerStatMgr handlerStatMgr;
+    metrics::MetricsRegistry metrics; // per-volume stage latency histograms.
 
     using Str2Str = std::map<std::string, std::string>;
     using AutoLock = std::lock_guard<std::mutex>;
@@ -344,6 +351,7 @@ void wdevMonitorWorker() noexcept;
 void proxyMonitorWorker() noexcept;
 void tsDeltaGetterWorker() noexcept;
 void startIfNecessary(const std::string &volId);
+TaskSchedAttr getTaskSchedAttr(const std::string &volId);
 void c2sResetVolServer(protocol::ServerParams &p);
 void c2sResizeServer(protocol::ServerParams &p);
 void c2sKickServer(protocol::ServerParams &p);
@@ -397,6 +405,7 @@ void getLatestSnap(protocol::GetCommandParams &p);
 void getUuid(protocol::GetCommandParams &p);
 void getTsDelta(protocol::GetCommandParams &p);
 void getHandlerStat(protocol::GetCommandParams &p);
+void getMetrics(protocol::GetCommandParams &p);
 
 } // namespace storage_local
 
@@ -411,6 +420,7 @@ const protocol::GetCommandHandlerMap storageGetHandlerMap = {
     { uuidTN, storage_local::getUuid },
     { getTsDeltaTN, storage_local::getTsDelta },
     { getHandlerStatTN, storage_local::getHandlerStat },
+    { metricsTN, storage_local::getMetrics },
 };
 
 inline void c2sGetServer(protocol::ServerParams &p)
@@ -59,4 +59,13 @@ const StrVec sAcceptForSnapshot = { sTarget, sStopped };
 const StrVec sAcceptForWlogAction = {sTarget, stFullSync, stHashSync, sStandby};
 const StrVec sAcceptForResize = {sSyncReady, sStopped, sTarget, sStandby};
 
+// background task priority classes by log usage [%].
+const uint64_t LOG_USAGE_PCT_FOR_URGENT_TASK = 80;
+const uint64_t LOG_USAGE_PCT_FOR_HIGH_TASK = 50;
+enum {
+    NORMAL_TASK_PRIORITY = 0,
+    HIGH_TASK_PRIORITY = 1,
+    URGENT_TASK_PRIORITY = 2,
+};
+
 } // namespace walb
@@ -11,6 +11,9 @@ namespace walb {
 
 /**
  * Task must be copyable and have operators "==" and "<".
+ *
+ * Tasks are ordered by their timestamps,
+ * so waiters sleep until a push or the earliest timestamp without polling.
  */
 template <typename Task>
 class TaskQueue
@@ -30,10 +33,11 @@ private:
     Map map_;
     Rmap rmap_;
     bool isStopped_;
+    uint64_t gen_; // incremented at every change to wake up waitForChange().
 
 public:
     TaskQueue()
-        : mu_(), cv_(), map_(), rmap_(), isStopped_(false) {
+        : mu_(), cv_(), map_(), rmap_(), isStopped_(false), gen_(0) {
     }
     /**
      * Push a task with current time (or with a delay).
@@ -50,6 +54,7 @@ public:
         std::tie(itr, maked) = map_.insert(std::make_pair(task, ts));
         if (maked) rmap_.insert(std::make_pair(ts, task));
         assert(map_.size() == rmap_.size());
+        gen_++;
         cv_.notify_all();
     }
     /**
@@ -71,33 +76,49 @@ public:
         }
         rmap_.insert(std::make_pair(ts, task));
         assert(map_.size() == rmap_.size());
+        gen_++;
         cv_.notify_all();
     }
     /**
      * Pop a task with the oldest timestamp and the timestamp
      * is not greater than now.
+     * If there is no such task, it waits for a push or the earliest timestamp
+     * until timeoutMs elapses.
      * RETURN:
      *   false if there is no task satisfying the condition.
      */
     bool pop(Task &task, size_t timeoutMs=0) {
         UniqueLock lk(mu_);
-        cv_.wait_for(lk, std::chrono::milliseconds(timeoutMs));
-
-        typename Rmap::iterator itr = rmap_.begin();
-        if (itr == rmap_.end()) return false;
-        if (!isStopped_ && Clock::now() < itr->first) return false;
-        task = itr->second;
-        rmap_.erase(itr);
-        map_.erase(task);
-        assert(map_.size() == rmap_.size());
+        if (!waitForReady(lk, timeoutMs)) return false;
+        popFront(task);
         return true;
     }
+    /**
+     * Pop at most maxNr tasks like pop().
+     * It waits for only the first one.
+     * RETURN:
+     *   number of popped tasks appended to taskV.
+     */
+    size_t popBatch(std::vector<Task> &taskV, size_t maxNr, size_t timeoutMs=0) {
+        UniqueLock lk(mu_);
+        if (maxNr == 0 || !waitForReady(lk, timeoutMs)) return 0;
+        const TimePoint now = Clock::now();
+        size_t nr = 0;
+        while (nr < maxNr && !rmap_.empty() && (isStopped_ || rmap_.begin()->first <= now)) {
+            Task task;
+            popFront(task);
+            taskV.push_back(std::move(task));
+            nr++;
+        }
+        return nr;
+    }
     /**
      * Push will do nothing after quit.
      */
     void quit() {
         AutoLock lk(mu_);
         isStopped_ = true;
+        gen_++;
         cv_.notify_all();
     }
     /**
@@ -118,8 +139,59 @@ public:
             }
         }
         assert(map_.size() == rmap_.size());
+        gen_++;
         cv_.notify_all();
     }
+    /**
+     * Get tasks whose timestamps are not greater than now, in time order.
+     * After quit, all the tasks are returned like pop().
+     * @gen current change counter to be passed to waitForChange().
+     */
+    std::vector<Task> getReady(uint64_t &gen) const {
+        AutoLock lk(mu_);
+        const TimePoint now = Clock::now();
+        std::vector<Task> ret;
+        for (const typename Rmap::value_type &pair : rmap_) {
+            if (!isStopped_ && now < pair.first) break;
+            ret.push_back(pair.second);
+        }
+        gen = gen_;
+        return ret;
+    }
+    /**
+     * Erase a task.
+     * RETURN:
+     *   false if the task does not exist.
+     */
+    bool erase(const Task &task) {
+        AutoLock lk(mu_);
+        typename Map::iterator itr = map_.find(task);
+        if (itr == map_.end()) return false;
+        eraseFromRmap(task, itr->second);
+        map_.erase(itr);
+        assert(map_.size() == rmap_.size());
+        return true;
+    }
+    /**
+     * Wake up threads in waitForChange() without changing tasks.
+     */
+    void notify() {
+        AutoLock lk(mu_);
+        gen_++;
+        cv_.notify_all();
+    }
+    /**
+     * Wait until the queue is changed since gen, a delayed task becomes ready,
+     * or timeout.
+     */
+    void waitForChange(uint64_t gen, size_t timeoutMs) const {
+        UniqueLock lk(mu_);
+        const TimePoint now = Clock::now();
+        TimePoint deadline = now + MilliSeconds(timeoutMs);
+        typename Rmap::const_iterator itr = rmap_.upper_bound(now);
+        if (itr != rmap_.end() && itr->first < deadline) deadline = itr->first;
+        cv_.wait_until(lk, deadline, [&]() { return gen_ != gen; });
+    }
     /**
      * RETURN:
      *   first: task
@@ -136,6 +208,32 @@ public:
         return ret;
     }
 private:
+    bool isFrontReady(TimePoint now) const {
+        return !rmap_.empty() && (isStopped_ || rmap_.begin()->first <= now);
+    }
+    /**
+     * Wait until the oldest task becomes ready.
+     * The lock will be released while waiting.
+     */
+    bool waitForReady(UniqueLock &lk, size_t timeoutMs) {
+        TimePoint now = Clock::now();
+        const TimePoint end = now + MilliSeconds(timeoutMs);
+        for (;;) {
+            if (isFrontReady(now)) return true;
+            if (isStopped_ || now >= end) return false;
+            TimePoint deadline = end;
+            if (!rmap_.empty() && rmap_.begin()->first < deadline) deadline = rmap_.begin()->first;
+            cv_.wait_until(lk, deadline);
+            now = Clock::now();
+        }
+    }
+    void popFront(Task &task) {
+        typename Rmap::iterator itr = rmap_.begin();
+        task = itr->second;
+        rmap_.erase(itr);
+        map_.erase(task);
+        assert(map_.size() == rmap_.size());
+    }
     void eraseFromRmap(const Task &task, TimePoint ts) {
         typename Rmap::iterator itr, end;
         std::tie(itr, end) = rmap_.equal_range(ts);
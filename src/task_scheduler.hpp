@@ -0,0 +1,192 @@
+#pragma once
+/**
+ * @file
+ * @brief Priority and fairness aware selection of background tasks.
+ */
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <cstdint>
+#include "cybozu/exception.hpp"
+#include "walb_types.hpp"
+
+namespace walb {
+
+/**
+ * Scheduling attributes of a task.
+ */
+struct TaskSchedAttr
+{
+    std::string group; // typically volume id. Concurrency limit and fair share are per group.
+    int priority; // a task with larger priority runs first.
+    uint32_t weight; // share of a group among ones with the same priority. Must be > 0.
+
+    TaskSchedAttr() : group(), priority(0), weight(1) {}
+    TaskSchedAttr(const std::string &group, int priority = 0, uint32_t weight = 1)
+        : group(group), priority(priority), weight(weight) {}
+};
+
+/**
+ * Chooses a task to run next from ready tasks.
+ *
+ * Tasks with higher priority run first.
+ * Among the same priority, groups share the slots by weighted fair queuing:
+ * each group has a virtual time advanced by VTIME_UNIT / weight at each dispatch,
+ * and a group with the smallest virtual time is chosen.
+ * A group that has been idle starts from the global virtual time,
+ * so it can not monopolize the slots with credits saved while idle.
+ * Ties are broken by the order of the input, that is the ready time.
+ *
+ * This is not thread-safe.
+ */
+class FairTaskScheduler
+{
+public:
+    static const uint64_t VTIME_UNIT = 1 << 16;
+private:
+    struct Group
+    {
+        size_t nrRunning;
+        uint64_t vtime;
+    };
+    using Map = std::map<std::string, Group>;
+    struct Candidate
+    {
+        int priority;
+        uint64_t tag;
+        size_t idx;
+        size_t nrRunning;
+        /* The top of the heap runs first. */
+        bool operator<(const Candidate &rhs) const {
+            if (priority != rhs.priority) return priority < rhs.priority;
+            if (tag != rhs.tag) return tag > rhs.tag;
+            return idx > rhs.idx;
+        }
+    };
+
+    Map map_;
+    size_t maxTasks_;
+    size_t maxTasksPerGroup_; // 0 means unlimited.
+    size_t nrRunning_;
+    uint64_t vtime_; // global virtual time.
+
+public:
+    explicit FairTaskScheduler(size_t maxTasks, size_t maxTasksPerGroup = 0)
+        : map_(), maxTasks_(maxTasks), maxTasksPerGroup_(maxTasksPerGroup)
+        , nrRunning_(0), vtime_(0) {
+        if (maxTasks == 0) throw cybozu::Exception("FairTaskScheduler:maxTasks must not be 0");
+    }
+    size_t maxTasks() const { return maxTasks_; }
+    bool hasFreeSlot() const { return nrRunning_ < maxTasks_; }
+    size_t nrRunning() const { return nrRunning_; }
+    size_t nrRunning(const std::string &group) const {
+        Map::const_iterator itr = map_.find(group);
+        return itr == map_.end() ? 0 : itr->second.nrRunning;
+    }
+    bool canRun(const std::string &group) const {
+        return hasFreeSlot() && (maxTasksPerGroup_ == 0 || nrRunning(group) < maxTasksPerGroup_);
+    }
+    /**
+     * RETURN:
+     *   index of the task to run next in attrV,
+     *   or attrV.size() if no task can run now.
+     */
+    size_t choose(const std::vector<TaskSchedAttr> &attrV) const {
+        const std::vector<size_t> v = chooseMulti(attrV, 1);
+        return v.empty() ? attrV.size() : v[0];
+    }
+    /**
+     * Choose tasks to fill free slots at once.
+     * Tasks of a group chosen in the same call are ordered by the group's current virtual time,
+     * which differs slightly from calling choose() and start() repeatedly.
+     * RETURN:
+     *   indexes of the tasks to run in attrV in the order to start.
+     *   It costs O(attrV.size() + returned size * log(attrV.size())).
+     */
+    std::vector<size_t> chooseMulti(const std::vector<TaskSchedAttr> &attrV, size_t maxNr = SIZE_MAX) const {
+        std::vector<size_t> ret;
+        maxNr = std::min(maxNr, maxTasks_ - nrRunning_);
+        if (maxNr == 0) return ret;
+        std::vector<Candidate> heap;
+        for (size_t i = 0; i < attrV.size(); i++) {
+            const TaskSchedAttr &attr = attrV[i];
+            Map::const_iterator itr = map_.find(attr.group);
+            const size_t nr = itr == map_.end() ? 0 : itr->second.nrRunning;
+            if (maxTasksPerGroup_ > 0 && nr >= maxTasksPerGroup_) continue;
+            const uint64_t tag = itr == map_.end() ? vtime_ : std::max(itr->second.vtime, vtime_);
+            heap.push_back(Candidate{attr.priority, tag, i, nr});
+        }
+        std::make_heap(heap.begin(), heap.end());
+        std::vector<std::pair<const std::string *, size_t> > chosen; // group and num of tasks to start.
+        while (!heap.empty() && ret.size() < maxNr) {
+            std::pop_heap(heap.begin(), heap.end());
+            const Candidate c = heap.back();
+            heap.pop_back();
+            const std::string &group = attrV[c.idx].group;
+            size_t j = 0;
+            while (j < chosen.size() && *chosen[j].first != group) j++;
+            if (j == chosen.size()) chosen.emplace_back(&group, 0);
+            if (maxTasksPerGroup_ > 0 && c.nrRunning + chosen[j].second >= maxTasksPerGroup_) continue;
+            chosen[j].second++;
+            ret.push_back(c.idx);
+        }
+        return ret;
+    }
+    /**
+     * Call this when a task has been dispatched.
+     */
+    void start(const TaskSchedAttr &attr) {
+        if (attr.weight == 0) throw cybozu::Exception("FairTaskScheduler:weight must not be 0") << attr.group;
+        const uint64_t tag = startTag(attr.group);
+        Group &g = map_[attr.group];
+        vtime_ = std::max(vtime_, tag);
+        g.vtime = tag + std::max<uint64_t>(VTIME_UNIT / attr.weight, 1);
+        g.nrRunning++;
+        nrRunning_++;
+    }
+    /**
+     * Call this when a task has finished.
+     */
+    void finish(const std::string &group) {
+        Map::iterator itr = map_.find(group);
+        if (itr == map_.end() || itr->second.nrRunning == 0) {
+            throw cybozu::Exception("FairTaskScheduler:finish:not running") << group;
+        }
+        itr->second.nrRunning--;
+        nrRunning_--;
+        gc();
+    }
+    /**
+     * RETURN:
+     *   (group, number of running tasks) list.
+     */
+    std::vector<std::pair<std::string, size_t> > getRunning() const {
+        std::vector<std::pair<std::string, size_t> > ret;
+        for (const Map::value_type &pair : map_) {
+            if (pair.second.nrRunning > 0) ret.emplace_back(pair.first, pair.second.nrRunning);
+        }
+        return ret;
+    }
+private:
+    uint64_t startTag(const std::string &group) const {
+        Map::const_iterator itr = map_.find(group);
+        if (itr == map_.end()) return vtime_;
+        return std::max(itr->second.vtime, vtime_);
+    }
+    /**
+     * Idle groups behind the global virtual time are no longer needed.
+     */
+    void gc() {
+        Map::iterator itr = map_.begin();
+        while (itr != map_.end()) {
+            if (itr->second.nrRunning == 0 && itr->second.vtime <= vtime_) {
+                itr = map_.erase(itr);
+            } else {
+                ++itr;
+            }
+        }
+    }
+};
+
+} // namespace walb
@@ -97,10 +97,15 @@ struct DiffRecord : public walb_diff_record
 };
 
 
+inline uint32_t calcDiffIoChecksum(const char *data, size_t size)
+{
+    if (size == 0) return 0;
+    return cybozu::util::calcChecksum(data, size, 0);
+}
+
 inline uint32_t calcDiffIoChecksum(const AlignedArray &io)
 {
-    if (io.empty()) return 0;
-    return cybozu::util::calcChecksum(io.data(), io.size(), 0);
+    return calcDiffIoChecksum(io.data(), io.size());
 }
 
 inline bool calcDiffIoIsAllZero(const AlignedArray &io)
@@ -68,11 +68,15 @@ Buffer g_convert(Convertor& conv, const char *inPackTop, size_t maxOutSize)
     return ret;
 }
 
-inline uint32_t calcTotalBlockNum(const walb_diff_pack& pack)
+/*
+ * Discard and all-zero records have no IO data so they are not counted.
+ */
+inline uint64_t calcTotalNormalBlockNum(const walb_diff_pack& pack)
 {
-    uint32_t num = 0;
-    for (int i = 0; i < pack.n_records; i++) {
-        num += pack.record[i].io_blocks;
+    const DiffPackHeader& packH = static_cast<const DiffPackHeader&>(pack);
+    uint64_t num = 0;
+    for (int i = 0; i < packH.n_records; i++) {
+        if (packH[i].isNormal()) num += packH[i].io_blocks;
     }
     return num;
 }
@@ -85,6 +89,10 @@ struct PackCompressorBase {
 
 } // compressor
 
+/**
+ * IOs already compressed with the type are copied as they are,
+ * and IOs compressed with another type are compressed again.
+ */
 class PackCompressor : public compressor::PackCompressorBase {
     int type_;
     walb::Compressor c_;
@@ -96,14 +104,28 @@ public:
     void convertRecord(char *out, size_t maxOutSize, walb_diff_record& outRecord, const char *in, const walb_diff_record& inRecord)
     {
         outRecord = inRecord;
-        const size_t inSize = inRecord.data_size;
+        if (inRecord.compression_type != WALB_DIFF_CMPR_NONE && inRecord.compression_type == type_) {
+            if (inRecord.data_size > maxOutSize) throw cybozu::Exception("PackCompressor:convertRecord:small maxOutSize") << inRecord.data_size << maxOutSize;
+            ::memcpy(out, in, inRecord.data_size);
+            outRecord.checksum = cybozu::util::calcChecksum(out, outRecord.data_size, 0);
+            return;
+        }
+        AlignedArray buf;
+        if (inRecord.compression_type != WALB_DIFF_CMPR_NONE) {
+            buf.resize(inRecord.io_blocks * 512, false);
+            uncompressData(in, inRecord.data_size, buf, inRecord.compression_type);
+            in = buf.data();
+        }
+        const size_t inSize = inRecord.io_blocks * 512;
         size_t encSize;
         if (c_.run(out, &encSize, maxOutSize, in, inSize) && encSize < inSize) {
             outRecord.compression_type = type_;
             outRecord.data_size = encSize;
         } else {
             // not compress
+            if (inSize > maxOutSize) throw cybozu::Exception("PackCompressor:convertRecord:small maxOutSize") << inSize << maxOutSize;
             outRecord.compression_type = WALB_DIFF_CMPR_NONE;
+            outRecord.data_size = inSize;
             ::memcpy(out, in, inSize);
         }
         outRecord.checksum = cybozu::util::calcChecksum(out, outRecord.data_size, 0);
@@ -117,7 +139,8 @@ public:
     {
         const walb_diff_pack& inPack = *reinterpret_cast<const walb_diff_pack*>(inPackTop);
         const size_t margin = 4096;
-        return compressor::g_convert(*this, inPackTop, inPack.total_size + margin);
+        const size_t uncompressedSize = compressor::calcTotalNormalBlockNum(inPack) * 512;
+        return compressor::g_convert(*this, inPackTop, std::max<size_t>(inPack.total_size, uncompressedSize) + margin);
     }
 };
 
@@ -154,7 +177,7 @@ public:
     compressor::Buffer convert(const char *inPackTop)
     {
         const walb_diff_pack& inPack = *reinterpret_cast<const walb_diff_pack*>(inPackTop);
-        const size_t uncompressedSize = compressor::calcTotalBlockNum(inPack) * 512;
+        const size_t uncompressedSize = compressor::calcTotalNormalBlockNum(inPack) * 512;
         return compressor::g_convert(*this, inPackTop, uncompressedSize);
     }
 };
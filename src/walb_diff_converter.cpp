@@ -128,6 +128,7 @@ void IndexedDiffConverter::convert(int inputLogFd, int outputWdiffFd, uint32_t m
     IndexedDiffWriter writer;
     writer.setFd(outputWdiffFd);
     writer.setMaxIoBlocks(maxIoBlocks);
+    writer.setMaxHoldBackSize(MAX_WDIFF_HOLD_BACK_SIZE);
     DiffFileHeader wdiffH;
 
     /* Loop */
@@ -1,4 +1,5 @@
 #include "walb_diff_file.hpp"
+#include "bdev_util.hpp"
 
 namespace walb {
 
@@ -55,6 +56,40 @@ std::string DiffFileHeader::typeStr() const
     }
 }
 
+uint64_t findSortedDiffValidEnd(cybozu::util::File &file, const cybozu::Uuid &uuid, uint64_t &endAddr)
+{
+    endAddr = 0;
+    const uint64_t fileSize = file.lseek(0, SEEK_END);
+    DiffFileHeader fileH;
+    if (fileSize < fileH.getSize()) return 0;
+    file.pread(&fileH, fileH.getSize(), 0);
+    if (!fileH.isValid() || fileH.isIndexed() || fileH.getUuid() != uuid) return 0;
+
+    uint64_t off = fileH.getSize();
+    AlignedArray buf;
+    while (off + WALB_DIFF_PACK_SIZE <= fileSize) {
+        buf.resize(WALB_DIFF_PACK_SIZE);
+        file.pread(buf.data(), buf.size(), off);
+        const DiffPackHeader *packH = reinterpret_cast<const DiffPackHeader *>(buf.data());
+        if (!packH->isValid() || packH->isEnd()) break;
+        const uint64_t size = WALB_DIFF_PACK_SIZE + packH->total_size;
+        if (off + size > fileSize) break;
+        buf.resize(size);
+        file.pread(buf.data(), buf.size(), off);
+        try {
+            verifyDiffPack(buf.data(), buf.size(), true);
+        } catch (std::exception &) {
+            break;
+        }
+        packH = reinterpret_cast<const DiffPackHeader *>(buf.data());
+        if (packH->n_records > 0) {
+            endAddr = (*packH)[packH->n_records - 1].endIoAddress();
+        }
+        off += size;
+    }
+    return off;
+}
+
 void SortedDiffWriter::close()
 {
     if (!isClosed_) {
@@ -185,7 +220,7 @@ void SortedDiffReader::readHeader(DiffFileHeader &head, bool doReadPackHeader)
     if (doReadPackHeader) readPackHeader();
 }
 
-bool SortedDiffReader::readDiff(DiffRecord &rec, AlignedArray &buf)
+bool SortedDiffReader::readDiff(DiffRecord &rec, AlignedArray &buf, bool verifyChecksum)
 {
     if (!prepareRead()) return false;
     assert(pack_.n_records == 0 || recIdx_ < pack_.n_records);
@@ -195,7 +230,7 @@ bool SortedDiffReader::readDiff(DiffRecord &rec, AlignedArray &buf)
         throw cybozu::Exception(__func__)
             << "invalid record" << fileR_.fd() << recIdx_ << rec;
     }
-    readDiffIo(rec, buf);
+    readDiffIo(rec, buf, verifyChecksum);
     return true;
 }
 
@@ -225,6 +260,30 @@ bool SortedDiffReader::prepareRead()
     return ret;
 }
 
+void SortedDiffReader::seek(uint64_t addr)
+{
+    if (!isReadHeader_) {
+        throw cybozu::Exception(NAME) << "seek: the header has not been read.";
+    }
+    if (recIdx_ != 0 || totalSize_ != 0) {
+        throw cybozu::Exception(NAME) << "seek: IOs have been read already.";
+    }
+    while (prepareRead()) {
+        if (pack_.n_records == 0) continue;
+        if (recIdx_ == 0 && pack_[pack_.n_records - 1].endIoAddress() <= addr) {
+            /* Skip the whole pack. */
+            fileR_.lseek(pack_.total_size, SEEK_CUR);
+            recIdx_ = pack_.n_records;
+            continue;
+        }
+        const DiffRecord &rec = pack_[recIdx_];
+        if (addr < rec.endIoAddress()) return;
+        fileR_.lseek(rec.data_size, SEEK_CUR);
+        totalSize_ += rec.data_size;
+        recIdx_++;
+    }
+}
+
 void SortedDiffReader::readDiffIo(const DiffRecord &rec, AlignedArray &buf, bool verifyChecksum)
 {
     if (rec.data_offset != totalSize_) {
@@ -346,10 +405,90 @@ void DiffIndexMem::addDetail(const IndexedDiffRecord &rec)
     index_.emplace(rec.io_address, rec);
 }
 
+size_t DiffHoldBackBuffer::trim(uint64_t ioAddr, uint32_t ioBlocks)
+{
+    if (map_.empty()) return 0;
+    const uint64_t endAddr = ioAddr + ioBlocks;
+
+    Map::iterator it = map_.lower_bound(ioAddr);
+    if (it != map_.begin()) {
+        Map::iterator prev = it;
+        --prev;
+        if (ioAddr < prev->first + prev->second.ioBlocks) it = prev;
+    }
+    size_t removed = 0;
+    while (it != map_.end() && it->first < endAddr) {
+        const uint64_t addr = it->first;
+        Map::iterator next = it;
+        ++next;
+        Extent ext = erase(it);
+        const uint64_t extEnd = addr + ext.ioBlocks;
+        const uint64_t overlapB = std::max(addr, ioAddr);
+        const uint64_t overlapE = std::min(extEnd, endAddr);
+        removed += (overlapE - overlapB) * LOGICAL_BLOCK_SIZE;
+        if (endAddr < extEnd) {
+            /* The right part survives. */
+            const size_t off = (endAddr - addr) * LOGICAL_BLOCK_SIZE;
+            Extent right{ext.seq, uint32_t(extEnd - endAddr), ext.cmprType, ext.cmprLevel, AlignedArray()};
+            right.data.resize(ext.data.size() - off, false);
+            ::memcpy(right.data.data(), ext.data.data() + off, right.data.size());
+            insert(endAddr, std::move(right));
+        }
+        if (addr < ioAddr) {
+            /* The left part survives. Copy it to release the unused area. */
+            Extent left{ext.seq, uint32_t(ioAddr - addr), ext.cmprType, ext.cmprLevel, AlignedArray()};
+            left.data.resize(left.ioBlocks * LOGICAL_BLOCK_SIZE, false);
+            ::memcpy(left.data.data(), ext.data.data(), left.data.size());
+            insert(addr, std::move(left));
+        }
+        it = next;
+    }
+    return removed;
+}
+
+size_t DiffHoldBackBuffer::add(uint64_t ioAddr, uint32_t ioBlocks, const char *data, int cmprType, int cmprLevel)
+{
+    const size_t removed = trim(ioAddr, ioBlocks);
+    Extent ext{seq_++, ioBlocks, cmprType, cmprLevel, AlignedArray()};
+    ext.data.resize(ioBlocks * LOGICAL_BLOCK_SIZE, false);
+    ::memcpy(ext.data.data(), data, ext.data.size());
+    insert(ioAddr, std::move(ext));
+    return removed;
+}
+
+bool DiffHoldBackBuffer::popOldest(uint64_t& ioAddr, Extent& ext)
+{
+    if (ageSet_.empty()) return false;
+    ioAddr = ageSet_.begin()->second;
+    Map::iterator it = map_.find(ioAddr);
+    assert(it != map_.end());
+    ext = erase(it);
+    return true;
+}
+
+void DiffHoldBackBuffer::insert(uint64_t ioAddr, Extent&& ext)
+{
+    curBytes_ += ext.data.size();
+    ageSet_.emplace(ext.seq, ioAddr);
+    map_.emplace(ioAddr, std::move(ext));
+}
+
+DiffHoldBackBuffer::Extent DiffHoldBackBuffer::erase(Map::iterator it)
+{
+    Extent ext = std::move(it->second);
+    ageSet_.erase(std::make_pair(ext.seq, it->first));
+    map_.erase(it);
+    assert(curBytes_ >= ext.data.size());
+    curBytes_ -= ext.data.size();
+    return ext;
+}
+
 void IndexedDiffWriter::finalize()
 {
     if (isClosed_) return;
 
+    flushHoldBack(0);
+
     /* Insert padding data for index records to be aligned to 8 bytes. */
     const size_t delta = offset_ % 8;
     if (delta > 0) {
@@ -382,6 +521,27 @@ void IndexedDiffWriter::writeHeader(DiffFileHeader &header)
 void IndexedDiffWriter::writeDiff(const IndexedDiffRecord &rec, const char *data)
 {
     checkWrittenHeader();
+    eliminatedSize_ += holdBuf_.trim(rec.io_address, rec.io_blocks);
+    writeDiffDetail(rec, data);
+}
+
+void IndexedDiffWriter::compressAndWriteDiff(
+    const IndexedDiffRecord &rec, const char *data, int type, int level)
+{
+    checkWrittenHeader();
+    if (maxHoldBackSize_ == 0 || !rec.isNormal() || rec.isCompressed()) {
+        eliminatedSize_ += holdBuf_.trim(rec.io_address, rec.io_blocks);
+        compressAndWriteDiffDetail(rec, data, type, level);
+        return;
+    }
+    assert(rec.io_offset == 0);
+    eliminatedSize_ += holdBuf_.add(rec.io_address, rec.io_blocks, data, type, level);
+    peakHoldBackSize_ = std::max(peakHoldBackSize_, holdBuf_.getBytes());
+    flushHoldBack(maxHoldBackSize_);
+}
+
+void IndexedDiffWriter::writeDiffDetail(const IndexedDiffRecord &rec, const char *data)
+{
     IndexedDiffRecord r = rec;
     r.data_offset = offset_;
     if (rec.isNormal()) {
@@ -391,20 +551,21 @@ void IndexedDiffWriter::writeDiff(const IndexedDiffRecord &rec, const char *data
         fileW_.write(data, rec.data_size);
         stat_.dataSize += rec.data_size;
         offset_ += rec.data_size;
+        writtenIoSize_ += rec.orig_blocks * LOGICAL_BLOCK_SIZE;
     }
     indexMem_.add(r);
     n_data_++;
 }
 
-void IndexedDiffWriter::compressAndWriteDiff(
+void IndexedDiffWriter::compressAndWriteDiffDetail(
     const IndexedDiffRecord &rec, const char *data, int type, int level)
 {
     if (!rec.isNormal()) {
-        writeDiff(rec, nullptr);
+        writeDiffDetail(rec, nullptr);
         return;
     }
     if (rec.isCompressed()) {
-        writeDiff(rec, data);
+        writeDiffDetail(rec, data);
         return;
     }
     size_t outSize = 0;
@@ -414,7 +575,26 @@ void IndexedDiffWriter::compressAndWriteDiff(
     r.compression_type = type;
     r.data_size = outSize;
     r.io_checksum = calcDiffIoChecksum(buf_);
-    writeDiff(r, buf_.data());
+    writeDiffDetail(r, buf_.data());
+}
+
+/**
+ * Buffered IOs do not overlap each other and they are newer than
+ * any written IOs in the same range, so they can be written in any order.
+ */
+void IndexedDiffWriter::flushHoldBack(size_t maxBytes)
+{
+    uint64_t addr;
+    DiffHoldBackBuffer::Extent ext;
+    while (holdBuf_.getBytes() > maxBytes && holdBuf_.popOldest(addr, ext)) {
+        IndexedDiffRecord rec;
+        rec.init();
+        rec.io_address = addr;
+        rec.io_blocks = ext.ioBlocks;
+        rec.orig_blocks = ext.ioBlocks;
+        rec.data_size = ext.data.size();
+        compressAndWriteDiffDetail(rec, ext.data.data(), ext.cmprType, ext.cmprLevel);
+    }
 }
 
 void IndexedDiffWriter::init()
@@ -426,6 +606,10 @@ void IndexedDiffWriter::init()
     isClosed_ = true;
     stat_.clear();
     stat_.wdiffNr = 1;
+    holdBuf_.clear();
+    peakHoldBackSize_ = 0;
+    eliminatedSize_ = 0;
+    writtenIoSize_ = 0;
 }
 
 void IndexedDiffWriter::writeSuper()
@@ -440,51 +624,123 @@ void IndexedDiffWriter::writeSuper()
     fileW_.write(&super, sizeof(super));
 }
 
-AlignedArray* IndexedDiffCache::find(Key key)
+std::string IndexedDiffCache::Stat::str() const
 {
-    auto it = map_.find(key);
-    if (it == map_.end()) return nullptr;
-    ListIt lit = it->second;
+    return cybozu::util::formatString(
+        "hit:%" PRIu64 "\tmiss:%" PRIu64 "\teviction:%" PRIu64
+        "\tbytes:%" PRIu64 "\tmax_bytes:%" PRIu64 "\titems:%" PRIu64 ""
+        , hits, misses, evictions, curBytes, maxBytes, nrItems);
+}
 
-    std::unique_ptr<AlignedArray> dataPtr = std::move(lit->dataPtr);
-    AlignedArray *ret = dataPtr.get();
+void IndexedDiffCache::setMaxSize(size_t bytes)
+{
+    maxBytes_ = bytes;
+    for (Shard &shard : shards_) {
+        std::lock_guard<std::mutex> lk(shard.mu);
+        shrink(shard, nullptr);
+    }
+}
 
-    lruList_.erase(lit);
-    lruList_.push_front({key, std::move(dataPtr)});
-    map_[key] = lruList_.begin(); // update.
+IndexedDiffCache::DataPtr IndexedDiffCache::find(const Key &key)
+{
+    Shard &shard = getShard(key);
+    std::lock_guard<std::mutex> lk(shard.mu);
+    auto it = shard.map.find(key);
+    if (it == shard.map.end()) {
+        misses_++;
+        return nullptr;
+    }
+    hits_++;
+    Item &item = *it->second;
+    item.referenced = true;
+    return item.dataPtr;
+}
 
-    return ret;
+bool IndexedDiffCache::exists(const Key &key) const
+{
+    Shard &shard = getShard(key);
+    std::lock_guard<std::mutex> lk(shard.mu);
+    return shard.map.find(key) != shard.map.end();
 }
 
-void IndexedDiffCache::add(Key key, std::unique_ptr<AlignedArray> &&dataPtr)
+IndexedDiffCache::DataPtr IndexedDiffCache::add(const Key &key, DataPtr &&dataPtr)
 {
-    if (map_.find(key) != map_.end()) {
-        throw cybozu::Exception("already in cache") << key;
+    Shard &shard = getShard(key);
+    std::lock_guard<std::mutex> lk(shard.mu);
+    auto it = shard.map.find(key);
+    if (it != shard.map.end()) {
+        /* Another reader has loaded the same data. */
+        it->second->referenced = true;
+        return it->second->dataPtr;
     }
+    shard.curBytes += dataPtr->size();
+    /* The new item will be checked at last by the clock hand. */
+    ItemList::iterator lit = shard.list.insert(shard.hand, Item{key, std::move(dataPtr), false});
+    shard.map.emplace(key, lit);
+    shrink(shard, &*lit);
+    return lit->dataPtr;
+}
 
-    curBytes_ += dataPtr->size();
-    lruList_.push_front({key, std::move(dataPtr)});
-    map_[key] = lruList_.begin();
+void IndexedDiffCache::clear()
+{
+    for (Shard &shard : shards_) {
+        std::lock_guard<std::mutex> lk(shard.mu);
+        shard.map.clear();
+        shard.list.clear();
+        shard.hand = shard.list.end();
+        shard.curBytes = 0;
+    }
+}
 
-    while (curBytes_ > maxBytes_ && map_.size() > 1) {
-        evictOne();
+IndexedDiffCache::Stat IndexedDiffCache::getStat() const
+{
+    Stat st;
+    st.hits = hits_;
+    st.misses = misses_;
+    st.evictions = evictions_;
+    st.maxBytes = maxBytes_;
+    st.curBytes = 0;
+    st.nrItems = 0;
+    for (Shard &shard : shards_) {
+        std::lock_guard<std::mutex> lk(shard.mu);
+        st.curBytes += shard.curBytes;
+        st.nrItems += shard.map.size();
     }
+    return st;
 }
 
-void IndexedDiffCache::clear()
+void IndexedDiffCache::evictOne(Shard &shard, const Item *keep)
 {
-    lruList_.clear();
-    map_.clear();
-    curBytes_ = 0;
+    for (;;) {
+        if (shard.hand == shard.list.end()) shard.hand = shard.list.begin();
+        Item &item = *shard.hand;
+        if (&item == keep) {
+            ++shard.hand;
+            continue;
+        }
+        if (item.referenced) {
+            item.referenced = false;
+            ++shard.hand;
+            continue;
+        }
+        shard.curBytes -= item.dataPtr->size();
+        shard.map.erase(item.key);
+        shard.hand = shard.list.erase(shard.hand);
+        evictions_++;
+        return;
+    }
 }
 
-void IndexedDiffCache::evictOne()
+void IndexedDiffCache::shrink(Shard &shard, const Item *keep)
 {
-    if (lruList_.empty()) return;
-    Item &item = lruList_.back();
-    map_.erase(item.key);
-    curBytes_ -= item.dataPtr->size();
-    lruList_.pop_back();
+    const size_t maxBytes = maxBytes_ / NR_SHARDS;
+    while (shard.curBytes > maxBytes && shard.map.size() > 1) {
+        evictOne(shard, keep);
+    }
+    if (keep == nullptr && shard.curBytes > maxBytes && shard.map.size() == 1) {
+        /* Not called by add(). */
+        evictOne(shard, nullptr);
+    }
 }
 
 void IndexedDiffReader::setFile(cybozu::util::File &&fileR, IndexedDiffCache &cache)
@@ -494,6 +750,13 @@ void IndexedDiffReader::setFile(cybozu::util::File &&fileR, IndexedDiffCache &ca
             << "non-seekable file descriptor is not supported" << fileR.fd();
     }
     cache_ = &cache;
+    struct stat st;
+    cybozu::util::fstat(fileR.fd(), st);
+    fileKey_.dev = st.st_dev;
+    fileKey_.ino = st.st_ino;
+    fileKey_.mtime = st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec;
+    fileKey_.addr = 0;
+    verifiedOffset_ = UINT64_MAX;
     memFile_.setReadOnly();
     memFile_.reset(std::move(fileR));
 
@@ -527,8 +790,7 @@ bool IndexedDiffReader::readDiffRecord(IndexedDiffRecord &rec, bool doVerify)
 
 bool IndexedDiffReader::isOnCache(const IndexedDiffRecord &rec) const
 {
-    const IndexedDiffCache::Key key{this, rec.data_offset};
-    return cache_->find(key) != nullptr;
+    return cache_->exists(getCacheKey(rec));
 }
 
 bool IndexedDiffReader::loadToCache(const IndexedDiffRecord &rec, bool throwError)
@@ -537,11 +799,10 @@ bool IndexedDiffReader::loadToCache(const IndexedDiffRecord &rec, bool throwErro
     if (!verifyIoData(rec.data_offset, rec.data_size, rec.io_checksum, throwError)) {
         return false;
     }
-    std::unique_ptr<AlignedArray> p(new AlignedArray());
+    std::shared_ptr<AlignedArray> p(new AlignedArray());
     p->resize(rec.orig_blocks * LOGICAL_BLOCK_SIZE);
     uncompressData(&memFile_[rec.data_offset], rec.data_size, *p, rec.compression_type);
-    const IndexedDiffCache::Key key{this, rec.data_offset};
-    cache_->add(key, std::move(p));
+    cache_->add(getCacheKey(rec), std::move(p));
     return true;
 }
 
@@ -551,21 +812,89 @@ bool IndexedDiffReader::loadToCache(const IndexedDiffRecord &rec, bool throwErro
 void IndexedDiffReader::readDiffIo(const IndexedDiffRecord &rec, AlignedArray &data)
 {
     if (!rec.isNormal()) return;
+    IoView view;
+    getDiffIoView(rec, view);
+    data.resize(view.size);
+    ::memcpy(data.data(), view.data, view.size);
+}
+
+void IndexedDiffReader::readWholeDiffIo(const IndexedDiffRecord &rec, AlignedArray &data) const
+{
+    assert(rec.isNormal());
+    verifyIoData(rec.data_offset, rec.data_size, rec.io_checksum, true);
+    data.resize(rec.orig_blocks * LOGICAL_BLOCK_SIZE, false);
+    uncompressData(&memFile_[rec.data_offset], rec.data_size, data, rec.compression_type);
+}
+
+IndexedDiffCache::DataPtr IndexedDiffReader::getWholeDiffIo(const IndexedDiffRecord &rec) const
+{
     if (cache_ == nullptr) {
         throw cybozu::Exception(NAME) << "BUG: cache_ must be set.";
     }
+    const IndexedDiffCache::Key key = getCacheKey(rec);
+    IndexedDiffCache::DataPtr dataPtr = cache_->find(key);
+    if (dataPtr) return dataPtr;
+    std::shared_ptr<AlignedArray> p(new AlignedArray());
+    readWholeDiffIo(rec, *p);
+    return cache_->add(key, std::move(p));
+}
 
-    const IndexedDiffCache::Key key{this, rec.data_offset};
-    AlignedArray *aryPtr = cache_->find(key);
-    if (aryPtr == nullptr) {
-        loadToCache(rec);
-        aryPtr = cache_->find(key);
+void IndexedDiffReader::getDiffIoView(const IndexedDiffRecord &rec, IoView &view) const
+{
+    view.pin.reset();
+    if (!rec.isNormal()) {
+        view.data = nullptr;
+        view.size = 0;
+        return;
     }
-
     const size_t offset = rec.io_offset * LOGICAL_BLOCK_SIZE;
-    const size_t size = rec.io_blocks * LOGICAL_BLOCK_SIZE;
-    data.resize(size);
-    ::memcpy(data.data(), &(*aryPtr)[offset], size);
+    view.size = rec.io_blocks * LOGICAL_BLOCK_SIZE;
+    if (rec.isCompressed()) {
+        view.pin = getWholeDiffIo(rec);
+        view.data = view.pin->data() + offset;
+        return;
+    }
+    if (offset + view.size > rec.data_size) {
+        throw cybozu::Exception(NAME) << "bad record" << rec;
+    }
+    /* Split records refer the same data so they will be verified once. */
+    if (verifiedOffset_ != rec.data_offset) {
+        verifyIoData(rec.data_offset, rec.data_size, rec.io_checksum, true);
+        verifiedOffset_ = rec.data_offset;
+    }
+    view.data = &memFile_[rec.data_offset + offset];
+}
+
+bool IndexedDiffReader::getStoredIoView(const IndexedDiffRecord &rec, IoView &view) const
+{
+    assert(rec.isNormal());
+    if (rec.io_offset != 0 || rec.io_blocks != rec.orig_blocks) return false;
+    if (rec.data_offset + rec.data_size > idxBgnOffset_) {
+        throw cybozu::Exception(NAME) << "bad record" << rec;
+    }
+    view.pin.reset();
+    view.data = &memFile_[rec.data_offset];
+    view.size = rec.data_size;
+    return true;
+}
+
+void IndexedDiffReader::seek(uint64_t addr)
+{
+    /* Records are sorted and not overlapped so their end addresses are sorted also. */
+    const size_t recSize = sizeof(IndexedDiffRecord);
+    size_t lo = (idxOffset_ - idxBgnOffset_) / recSize;
+    size_t hi = (idxEndOffset_ - idxBgnOffset_) / recSize;
+    while (lo < hi) {
+        const size_t mid = (lo + hi) / 2;
+        IndexedDiffRecord rec;
+        ::memcpy(&rec, &memFile_[idxBgnOffset_ + mid * recSize], recSize);
+        if (rec.endIoAddress() <= addr) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    idxOffset_ = idxBgnOffset_ + lo * recSize;
 }
 
 bool IndexedDiffReader::getNextRec(IndexedDiffRecord& rec)
@@ -4,6 +4,12 @@
  * @brief walb diff utiltities for files.
  */
 #include <unordered_map>
+#include <set>
+#include <list>
+#include <array>
+#include <mutex>
+#include <atomic>
+#include <memory>
 #include "walb_diff_pack.hpp"
 #include "walb_diff_stat.hpp"
 #include "uuid.hpp"
@@ -90,6 +96,17 @@ void writeDiffEofPack(Writer& writer)
     pack.writeTo(writer);
 }
 
+/**
+ * Find the end of valid packs in a sorted wdiff which may be written partially.
+ * Broken packs at the tail are ignored.
+ *
+ * RETURN:
+ *   file offset just after the last valid pack.
+ *   0 if the file header is broken or its uuid differs.
+ * endAddr: end address of the last valid IO, or 0 if there is no IO.
+ */
+uint64_t findSortedDiffValidEnd(cybozu::util::File &file, const cybozu::Uuid &uuid, uint64_t &endAddr);
+
 /**
  * Walb diff writer.
  */
@@ -272,12 +289,13 @@ public:
 
     /**
      * Read a diff IO.
+     * Set verifyChecksum false if you verify the data checksum by yourself.
      *
      * RETURN:
      *   false if the input stream reached the end,
      *   or the record/data is invalid (only when throwError is false).
      */
-    bool readDiff(DiffRecord &rec, AlignedArray &buf);
+    bool readDiff(DiffRecord &rec, AlignedArray &buf, bool verifyChecksum = true);
     /**
      * Read a diff IO and uncompress it.
      *
@@ -287,6 +305,12 @@ public:
     bool readAndUncompressDiff(DiffRecord &rec, AlignedArray &buf, bool calcChecksum = true);
 
     bool prepareRead();
+    /**
+     * Skip IOs which end address is not greater than addr.
+     * Only pack headers are read and IO data are skipped by lseek.
+     * Call this before reading any IO. The file must be seekable.
+     */
+    void seek(uint64_t addr);
     /**
      * Read a diff IO.
      * @rec diff record.
@@ -344,8 +368,70 @@ public:
 };
 
 
+/**
+ * Recently written normal IOs held back before compression.
+ * Buffered IOs never overlap each other.
+ * Overlapped parts of buffered IOs are eliminated by newer IOs,
+ * so overwritten data in the buffer will never reach the file.
+ */
+class DiffHoldBackBuffer
+{
+public:
+    struct Extent {
+        uint64_t seq;
+        uint32_t ioBlocks;
+        int cmprType;
+        int cmprLevel;
+        AlignedArray data;
+    };
+private:
+    using Map = std::map<uint64_t, Extent>; // key: io_address.
+    Map map_;
+    std::set<std::pair<uint64_t, uint64_t> > ageSet_; // (seq, io_address).
+    uint64_t seq_;
+    size_t curBytes_;
+
+public:
+    DiffHoldBackBuffer() : map_(), ageSet_(), seq_(0), curBytes_(0) {}
+    /**
+     * Remove the overlapped parts of buffered IOs.
+     * RETURN:
+     *   removed data size [byte].
+     */
+    size_t trim(uint64_t ioAddr, uint32_t ioBlocks);
+    /**
+     * Overlapped parts of buffered IOs will be removed.
+     * RETURN:
+     *   removed data size [byte].
+     */
+    size_t add(uint64_t ioAddr, uint32_t ioBlocks, const char *data, int cmprType, int cmprLevel);
+    /**
+     * Pop the oldest IO.
+     * RETURN:
+     *   false if empty.
+     */
+    bool popOldest(uint64_t& ioAddr, Extent& ext);
+    size_t getBytes() const { return curBytes_; }
+    bool empty() const { return map_.empty(); }
+    void clear() {
+        map_.clear();
+        ageSet_.clear();
+        curBytes_ = 0;
+    }
+private:
+    void insert(uint64_t ioAddr, Extent&& ext);
+    Extent erase(Map::iterator it);
+};
+
+
 /**
  * Indexed diff writer.
+ *
+ * If setMaxHoldBackSize() is called with non-zero value,
+ * normal IOs given to compressAndWriteDiff() are held back in memory
+ * until the buffer size exceeds the limit or finalize() is called.
+ * Data overwritten while held back will be never compressed or written,
+ * which reduces dead data in the file.
  */
 class IndexedDiffWriter /* final */
 {
@@ -359,8 +445,14 @@ private:
     DiffStatistics stat_;
     AlignedArray buf_;
 
+    DiffHoldBackBuffer holdBuf_;
+    size_t maxHoldBackSize_;
+    size_t peakHoldBackSize_;
+    uint64_t eliminatedSize_; // overwritten in holdBuf_ [byte].
+    uint64_t writtenIoSize_; // uncompressed size of written normal IOs [byte].
+
 public:
-    IndexedDiffWriter() {
+    IndexedDiffWriter() : maxHoldBackSize_(0) {
         init();
     }
     ~IndexedDiffWriter() noexcept try {
@@ -400,6 +492,24 @@ public:
     }
 
     void setMaxIoBlocks(uint32_t maxIoBlocks) { indexMem_.setMaxIoBlocks(maxIoBlocks); }
+    /**
+     * 0 means no hold-back (default).
+     */
+    void setMaxHoldBackSize(size_t bytes) { maxHoldBackSize_ = bytes; }
+
+    /**
+     * Data size overwritten in the hold-back buffer and never written [byte].
+     */
+    uint64_t getEliminatedSize() const { return eliminatedSize_; }
+    /**
+     * Uncompressed data size written to the file but not referred from the index [byte].
+     * Valid after finalize().
+     */
+    uint64_t getDeadSize() const { return writtenIoSize_ - stat_.normLb * LOGICAL_BLOCK_SIZE; }
+    double getDeadRatio() const {
+        return writtenIoSize_ == 0 ? 0.0 : double(getDeadSize()) / double(writtenIoSize_);
+    }
+    size_t getPeakHoldBackSize() const { return peakHoldBackSize_; }
 
     /**
      * for debug and test.
@@ -412,6 +522,9 @@ public:
 
 private:
     void init();
+    void writeDiffDetail(const IndexedDiffRecord &rec, const char *data);
+    void compressAndWriteDiffDetail(const IndexedDiffRecord &rec, const char *data, int type, int level);
+    void flushHoldBack(size_t maxBytes);
     void writeSuper();
     void checkWrittenHeader() const {
         if (!isWrittenHeader_) {
@@ -422,52 +535,120 @@ private:
 };
 
 
+/**
+ * Cache of uncompressed IO data of indexed diff files.
+ *
+ * This is thread-safe and can be shared by readers of different jobs.
+ * Items are distributed to shards by their keys. Each shard has its own lock
+ * and a budget of maxSize / NR_SHARDS bytes, and evicts items in CLOCK order,
+ * so a hit only sets a reference bit.
+ */
 class IndexedDiffCache /* final */
 {
 public:
+    /**
+     * An indexed diff file is identified by (dev, ino, mtime)
+     * because it is never modified after written.
+     */
     struct Key {
-        const void *tag;
-        uint64_t addr;
+        uint64_t dev;
+        uint64_t ino;
+        uint64_t mtime; // [ns]
+        uint64_t addr; // data offset in the file.
 
         friend inline std::ostream& operator<<(std::ostream& os, const Key& key) {
-            os << "(" << key.tag << "," << key.addr << ")";
+            os << "(" << key.dev << "," << key.ino << "," << key.mtime << "," << key.addr << ")";
             return os;
         }
     };
+    using DataPtr = std::shared_ptr<const AlignedArray>;
+
+    struct Stat {
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t evictions;
+        uint64_t curBytes;
+        uint64_t maxBytes;
+        uint64_t nrItems;
+
+        std::string str() const;
+    };
 private:
     struct HashKey {
-        size_t operator()(Key key) const {
-            size_t h0 = std::hash<uintptr_t>()(uintptr_t(key.tag));
-            size_t h1 = std::hash<uint64_t>()(key.addr);
-            // like boost::hash_combine().
-            return h0 ^ (h1 + 0x9e3779b9 + (h0 << 6) + (h0 >> 2));
+        size_t operator()(const Key &key) const {
+            size_t h = std::hash<uint64_t>()(key.addr);
+            for (uint64_t v : {key.dev, key.ino, key.mtime}) {
+                // like boost::hash_combine().
+                h ^= std::hash<uint64_t>()(v) + 0x9e3779b9 + (h << 6) + (h >> 2);
+            }
+            return h;
         }
     };
     struct EqualKey {
-        bool operator()(Key lhs, Key rhs) const {
-            return lhs.tag == rhs.tag && lhs.addr == rhs.addr;
+        bool operator()(const Key &lhs, const Key &rhs) const {
+            return lhs.addr == rhs.addr && lhs.ino == rhs.ino
+                && lhs.dev == rhs.dev && lhs.mtime == rhs.mtime;
         }
     };
     struct Item {
         Key key;
-        std::unique_ptr<AlignedArray> dataPtr;
+        DataPtr dataPtr;
+        bool referenced;
     };
+    using ItemList = std::list<Item>;
 
-    using ListIt = std::list<Item>::iterator;
+    struct Shard {
+        std::mutex mu;
+        size_t curBytes;
+        ItemList list; // circular order for CLOCK.
+        ItemList::iterator hand;
+        std::unordered_map<Key, ItemList::iterator, HashKey, EqualKey> map;
 
-    size_t maxBytes_;
-    size_t curBytes_;
-    std::list<Item> lruList_;
-    std::unordered_map<Key, ListIt, HashKey, EqualKey> map_;
+        Shard() : mu(), curBytes(0), list(), hand(list.end()), map() {}
+    };
+
+    static constexpr size_t NR_SHARDS = 16;
+
+    std::atomic<size_t> maxBytes_;
+    mutable std::array<Shard, NR_SHARDS> shards_;
+    std::atomic<uint64_t> hits_;
+    std::atomic<uint64_t> misses_;
+    std::atomic<uint64_t> evictions_;
 
 public:
-    IndexedDiffCache() : maxBytes_(0), curBytes_(0), lruList_(), map_() {}
-    void setMaxSize(size_t bytes) { maxBytes_ = bytes; }
-    AlignedArray* find(Key key);
-    void add(Key key, std::unique_ptr<AlignedArray> &&dataPtr);
+    IndexedDiffCache()
+        : maxBytes_(0), shards_(), hits_(0), misses_(0), evictions_(0) {
+    }
+    /**
+     * add() keeps the added item even if it exceeds the budget of the shard.
+     */
+    void setMaxSize(size_t bytes);
+    /**
+     * RETURN:
+     *   nullptr if not found.
+     */
+    DataPtr find(const Key &key);
+    /**
+     * This does not change the statistics nor the reference bit.
+     */
+    bool exists(const Key &key) const;
+    /**
+     * RETURN:
+     *   the cached data. It is the one added by another thread if exists.
+     */
+    DataPtr add(const Key &key, DataPtr &&dataPtr);
     void clear();
+    Stat getStat() const;
 private:
-    void evictOne();
+    Shard& getShard(const Key &key) const {
+        return shards_[HashKey()(key) % NR_SHARDS];
+    }
+    /**
+     * Call this with the shard lock held.
+     * @keep an item that must not be evicted.
+     */
+    void evictOne(Shard &shard, const Item *keep);
+    void shrink(Shard &shard, const Item *keep);
 };
 
 
@@ -486,13 +667,30 @@ private:
     size_t idxOffset_;
 
     IndexedDiffCache *cache_;
+    IndexedDiffCache::Key fileKey_; // addr is not used.
+    mutable std::atomic<uint64_t> verifiedOffset_; // uncompressed IO data verified last.
     DiffStatistics stat_;
 
 public:
     constexpr static const char *NAME = "IndexedDiffReader";
+
+    /**
+     * Read-only view of (uncompressed) IO data of a record.
+     * Uncompressed IO data are referred in the mmapped file directly,
+     * which are valid while the reader is opened.
+     * Otherwise pin keeps the cached data alive.
+     */
+    struct IoView {
+        const char *data;
+        size_t size;
+        IndexedDiffCache::DataPtr pin;
+
+        IoView() : data(nullptr), size(0), pin() {}
+    };
+
     IndexedDiffReader()
         : memFile_(), header_(), idxBgnOffset_(), idxEndOffset_()
-        , idxOffset_(), cache_(nullptr), stat_() {}
+        , idxOffset_(), cache_(nullptr), fileKey_(), verifiedOffset_(UINT64_MAX), stat_() {}
     void setFile(cybozu::util::File &&fileR, IndexedDiffCache &cache);
     const DiffFileHeader& header() const { return header_; }
 
@@ -506,8 +704,40 @@ public:
         readDiffIo(rec, data);
         return true;
     }
+    /**
+     * Verify and uncompress the whole IO data that rec refers,
+     * which size is rec.orig_blocks.
+     * The cache is not used so this is thread-safe.
+     */
+    void readWholeDiffIo(const IndexedDiffRecord &rec, AlignedArray &data) const;
+    /**
+     * Cached version of readWholeDiffIo(). This is also thread-safe.
+     */
+    IndexedDiffCache::DataPtr getWholeDiffIo(const IndexedDiffRecord &rec) const;
+    /**
+     * Get IO data of rec without copying them. This is thread-safe.
+     * Non-normal records get an empty view.
+     */
+    void getDiffIoView(const IndexedDiffRecord &rec, IoView &view) const;
+    /**
+     * Get IO data of rec as they are stored, which may be compressed.
+     * They are not verified here so the receiver must verify them with rec.io_checksum.
+     * RETURN:
+     *   false if rec refers a part of the stored data.
+     */
+    bool getStoredIoView(const IndexedDiffRecord &rec, IoView &view) const;
+    bool readDiff(IndexedDiffRecord &rec, IoView &view) {
+        if (!readDiffRecord(rec)) return false;
+        getDiffIoView(rec, view);
+        return true;
+    }
     const DiffStatistics& getStat() const { return stat_; }
     void close() { memFile_.reset(); }
+    /**
+     * Skip records which end address is not greater than addr
+     * with binary search of the index.
+     */
+    void seek(uint64_t addr);
 
     /*
      * isOnCache() and loadToCache() are special interface for wdiff-show command.
@@ -515,6 +745,11 @@ public:
     bool isOnCache(const IndexedDiffRecord &rec) const;
     bool loadToCache(const IndexedDiffRecord &rec, bool throwError = true);
 private:
+    IndexedDiffCache::Key getCacheKey(const IndexedDiffRecord &rec) const {
+        IndexedDiffCache::Key key = fileKey_;
+        key.addr = rec.data_offset;
+        return key;
+    }
     bool getNextRec(IndexedDiffRecord& rec);
     bool verifyIoData(uint64_t offset, uint32_t size, uint32_t csum, bool throwError) const;
 };
@@ -68,4 +68,80 @@ void issueDiffPack(cybozu::util::File& file, DiscardType discardType, MemoryDiff
     }
 }
 
+AsyncDiffIoWriter::AsyncDiffIoWriter(int fd, DiscardType discardType, size_t bufferSize, size_t maxIoSize)
+    : writer_(fd, bufferSize)
+    , discardType_(discardType)
+    , maxIoLb_(maxIoSize / LOGICAL_BLOCK_SIZE)
+    , pendingAddr_(0)
+    , pendingLb_(0)
+    , pendingBuf_()
+{
+    if (maxIoLb_ == 0) {
+        throw cybozu::Exception("AsyncDiffIoWriter:maxIoSize too small") << maxIoSize;
+    }
+}
+
+void AsyncDiffIoWriter::add(const DiffRecord& rec, const char *iodata)
+{
+    assert(!rec.isCompressed());
+    const int type = decideIoType(rec, discardType_);
+    if (type == Ignore) return;
+    if (type == Discard) {
+        flush();
+        writer_.discard(rec.io_address, rec.io_blocks);
+        return;
+    }
+    if (type == Normal) {
+        assert(iodata != nullptr);
+    } else {
+        assert(type == Zero);
+        iodata = nullptr;
+    }
+    addData(rec.io_address, rec.io_blocks, iodata);
+}
+
+void AsyncDiffIoWriter::waitForAll()
+{
+    flush();
+    writer_.waitForAll();
+}
+
+/**
+ * @data nullptr means zero-filled data.
+ */
+void AsyncDiffIoWriter::addData(uint64_t ioAddr, size_t ioBlocks, const char *data)
+{
+    while (ioBlocks > 0) {
+        if (pendingLb_ > 0 && (pendingAddr_ + pendingLb_ != ioAddr || pendingLb_ == maxIoLb_)) {
+            flush();
+        }
+        if (pendingLb_ == 0) {
+            pendingAddr_ = ioAddr;
+            pendingBuf_.resize(maxIoLb_ * LOGICAL_BLOCK_SIZE, false);
+        }
+        const size_t lb = std::min<size_t>(ioBlocks, maxIoLb_ - pendingLb_);
+        char *dst = pendingBuf_.data() + pendingLb_ * LOGICAL_BLOCK_SIZE;
+        const size_t size = lb * LOGICAL_BLOCK_SIZE;
+        if (data == nullptr) {
+            ::memset(dst, 0, size);
+        } else {
+            ::memcpy(dst, data, size);
+            data += size;
+        }
+        pendingLb_ += lb;
+        ioAddr += lb;
+        ioBlocks -= lb;
+    }
+}
+
+void AsyncDiffIoWriter::flush()
+{
+    if (pendingLb_ == 0) return;
+    pendingBuf_.resize(pendingLb_ * LOGICAL_BLOCK_SIZE);
+    writer_.prepare(pendingAddr_, pendingLb_, std::move(pendingBuf_));
+    writer_.submit();
+    pendingBuf_ = AlignedArray();
+    pendingLb_ = 0;
+}
+
 } // namespace walb
@@ -7,6 +7,7 @@
 #include "walb_diff_base.hpp"
 #include "walb_diff_pack.hpp"
 #include "discard_type.hpp"
+#include "bdev_writer.hpp"
 #include "cybozu/exception.hpp"
 
 namespace walb {
@@ -20,4 +21,44 @@ IoType decideIoType(const DiffRecord& rec, DiscardType discardType);
 void issueIo(cybozu::util::File& file, DiscardType discardType, const DiffRecord& rec, const char *iodata, AlignedArray& zero);
 void issueDiffPack(cybozu::util::File& file, DiscardType discardType, MemoryDiffPack& pack, AlignedArray& zero);
 
+/**
+ * Apply uncompressed diff IOs to a block device using aio.
+ * The device should be opened with O_DIRECT.
+ *
+ * Adjacent normal/zero IOs are coalesced into one IO up to maxIoSize.
+ * IO data are copied so that the caller can reuse its buffers just after add().
+ * Records should be added in ascending order of io_address to coalesce well.
+ */
+class AsyncDiffIoWriter
+{
+private:
+    AsyncBdevWriter writer_;
+    const DiscardType discardType_;
+    const size_t maxIoLb_;
+
+    uint64_t pendingAddr_; // [logical block]
+    size_t pendingLb_; // [logical block]
+    AlignedArray pendingBuf_;
+
+public:
+    /**
+     * @bufferSize max total size of IOs in flight [bytes].
+     * @maxIoSize max size of a coalesced IO [bytes].
+     */
+    AsyncDiffIoWriter(int fd, DiscardType discardType, size_t bufferSize, size_t maxIoSize = MEBI);
+    /**
+     * Caller must check the IO range is inside the device.
+     */
+    void add(const DiffRecord& rec, const char *iodata);
+    /**
+     * Submit all the IOs and wait for their completion.
+     * You must call fdatasync() by yourself if necessary.
+     */
+    void waitForAll();
+    const WriteIoStatistics &getStat() const { return writer_.getStat(); }
+private:
+    void addData(uint64_t ioAddr, size_t ioBlocks, const char *data);
+    void flush();
+};
+
 } // namespace walb
@@ -5,19 +5,21 @@ namespace walb {
 bool DiffRecIo::isValid(bool isChecksum) const
 {
     if (!rec_.isNormal()) {
-        if (!io_.empty()) {
+        if (shared_ || !buf_.empty()) {
             LOGd("Fro non-normal record, io.ioBlocks must be 0.\n");
             return false;
         }
         return true;
     }
-    if (rec_.data_size != io_.size()) {
-        LOGd("dataSize invalid %" PRIu32 " %zu\n", rec_.data_size, io_.size());
+    const size_t bufSize = shared_ ? shared_->size() : buf_.size();
+    if (bufSize < off_ + rec_.data_size) {
+        LOGd("dataSize invalid %" PRIu32 " %zu %zu\n"
+             , rec_.data_size, off_, bufSize);
         return false;
     }
     if (!isChecksum) return true;
 
-    const uint32_t csum = calcDiffIoChecksum(io_);
+    const uint32_t csum = calcDiffIoChecksum(data(), size());
     if (rec_.checksum != csum) {
         LOGd("checksum invalid %08x %08x\n", rec_.checksum, csum);
         return false;
@@ -25,30 +27,57 @@ bool DiffRecIo::isValid(bool isChecksum) const
     return true;
 }
 
-std::vector<DiffRecIo> DiffRecIo::splitAll(uint32_t ioBlocks) const
+void DiffRecIo::share()
 {
-    assert(isValid());
-    std::vector<DiffRecIo> v;
+    if (shared_ || buf_.empty()) return;
+    shared_ = std::make_shared<AlignedArray>(std::move(buf_));
+    buf_ = AlignedArray();
+    off_ = 0;
+}
 
-    std::vector<DiffRecord> recV = rec_.splitAll(ioBlocks);
-    std::vector<AlignedArray> ioV;
+DiffRecIo DiffRecIo::slice(uint64_t ioAddr, uint32_t ioBlocks)
+{
+    assert(0 < ioBlocks);
+    assert(rec_.io_address <= ioAddr);
+    assert(ioAddr + ioBlocks <= rec_.endIoAddress());
+    DiffRecIo r;
+    r.rec_ = rec_;
+    r.rec_.io_address = ioAddr;
+    r.rec_.io_blocks = ioBlocks;
     if (rec_.isNormal()) {
-        ioV = splitIoDataAll(io_, ioBlocks);
+        share();
+        r.rec_.data_size = ioBlocks * LOGICAL_BLOCK_SIZE;
+        r.shared_ = shared_;
+        r.off_ = off_ + (ioAddr - rec_.io_address) * LOGICAL_BLOCK_SIZE;
+    }
+    return r;
+}
+
+void DiffRecIo::shrinkToFit()
+{
+    if (!shared_) return;
+    if (shared_.use_count() == 1 && off_ == 0 && shared_->size() == rec_.data_size) {
+        buf_ = std::move(*shared_);
+    } else if (shared_->size() > rec_.data_size * 2) {
+        util::assignAlignedArray(buf_, data(), rec_.data_size);
     } else {
-        ioV.resize(recV.size());
+        return;
     }
-    assert(recV.size() == ioV.size());
-    auto it0 = recV.begin();
-    auto it1 = ioV.begin();
-    while (it0 != recV.end() && it1 != ioV.end()) {
-        v.emplace_back(*it0, std::move(*it1));
-        ++it0;
-        ++it1;
+    shared_.reset();
+    off_ = 0;
+}
+
+std::vector<DiffRecIo> DiffRecIo::splitAll(uint32_t ioBlocks)
+{
+    assert(isValid());
+    std::vector<DiffRecIo> v;
+    for (const DiffRecord &rec : rec_.splitAll(ioBlocks)) {
+        v.push_back(slice(rec.io_address, rec.io_blocks));
     }
     return v;
 }
 
-std::vector<DiffRecIo> DiffRecIo::minus(const DiffRecIo &rhs) const
+std::vector<DiffRecIo> DiffRecIo::minus(const DiffRecIo &rhs)
 {
     assert(isValid());
     assert(rhs.isValid());
@@ -56,171 +85,85 @@ std::vector<DiffRecIo> DiffRecIo::minus(const DiffRecIo &rhs) const
         throw RT_ERR("Non-overlapped.");
     }
     std::vector<DiffRecIo> v;
+    const uint64_t addr0 = rhs.rec_.io_address;
+    const uint64_t addr1 = rhs.rec_.endIoAddress();
     /*
-     * Pattern 1:
-     * __oo__ + xxxxxx = xxxxxx
-     */
-    if (rec_.isOverwrittenBy(rhs.rec_)) {
-        /* Empty */
-        return v;
-    }
-    /*
-     * Pattern 2:
+     * oooo__ + __xxxx = ooxxxx
      * oooooo + __xx__ = ooxxoo
      */
-    if (rhs.rec_.isOverwrittenBy(rec_)) {
-        uint32_t blks0 = rhs.rec_.io_address - rec_.io_address;
-        uint32_t blks1 = rec_.endIoAddress() - rhs.rec_.endIoAddress();
-        uint64_t addr0 = rec_.io_address;
-        uint64_t addr1 = rec_.endIoAddress() - blks1;
-
-        DiffRecord rec0 = rec_;
-        DiffRecord rec1 = rec_;
-        rec0.io_address = addr0;
-        rec0.io_blocks = blks0;
-        rec1.io_address = addr1;
-        rec1.io_blocks = blks1;
-
-        size_t size0 = 0;
-        size_t size1 = 0;
-        const bool recIsNormal = rec_.isNormal();
-        if (recIsNormal) {
-            size0 = blks0 * LOGICAL_BLOCK_SIZE;
-            size1 = blks1 * LOGICAL_BLOCK_SIZE;
-        }
-        rec0.data_size = size0;
-        rec1.data_size = size1;
-
-        AlignedArray data0, data1;
-        if (recIsNormal) {
-            size_t off1 = (addr1 - rec_.io_address) * LOGICAL_BLOCK_SIZE;
-            assert(size0 + rhs.rec_.io_blocks * LOGICAL_BLOCK_SIZE + size1 == rec_.data_size);
-            const char *p = io_.data();
-            util::assignAlignedArray(data0, p, size0);
-            p += off1;
-            util::assignAlignedArray(data1, p, size1);
-        }
-
-        if (0 < blks0) {
-            v.emplace_back(rec0, std::move(data0));
-        }
-        if (0 < blks1) {
-            v.emplace_back(rec1, std::move(data1));
-        }
-        return v;
+    if (rec_.io_address < addr0) {
+        v.push_back(slice(rec_.io_address, addr0 - rec_.io_address));
     }
     /*
-     * Pattern 3:
-     * oooo__ + __xxxx = ooxxxx
+     * __oooo + xxxx__ = xxxxoo
+     * oooooo + __xx__ = ooxxoo
      */
-    if (rec_.io_address < rhs.rec_.io_address) {
-        const uint64_t endIoAddr = rec_.endIoAddress();
-        assert(rhs.rec_.io_address < endIoAddr);
-        uint32_t rblks = endIoAddr - rhs.rec_.io_address;
-        assert(rhs.rec_.io_address + rblks == endIoAddr);
-
-        DiffRecord rec = rec_;
-        /* rec.io_address does not change. */
-        rec.io_blocks = rec_.io_blocks - rblks;
-        assert(rec.endIoAddress() == rhs.rec_.io_address);
-
-        size_t size = 0;
-        if (rec_.isNormal()) {
-            size = io_.size() - rblks * LOGICAL_BLOCK_SIZE;
-        }
-        AlignedArray data;
-        if (rec_.isNormal()) {
-            assert(rec_.data_size == io_.size());
-            rec.data_size = size;
-            util::assignAlignedArray(data, io_.data(), size);
-        }
-
-        v.emplace_back(rec, std::move(data));
-        return v;
+    if (addr1 < rec_.endIoAddress()) {
+        v.push_back(slice(addr1, rec_.endIoAddress() - addr1));
     }
     /*
-     * Pattern 4:
-     * __oooo + xxxx__ = xxxxoo
+     * __oo__ + xxxxxx = xxxxxx
+     * results in empty.
      */
-    const uint64_t rhsEndIoAddr = rhs.rec_.endIoAddress();
-    assert(rec_.io_address < rhsEndIoAddr);
-    uint32_t rblks = rhsEndIoAddr - rec_.io_address;
-    assert(rec_.io_address + rblks == rhsEndIoAddr);
-    size_t off = rblks * LOGICAL_BLOCK_SIZE;
-
-    DiffRecord rec = rec_;
-    rec.io_address = rec_.io_address + rblks;
-    rec.io_blocks = rec_.io_blocks - rblks;
-
-    size_t size = 0;
-    const bool isNormal = rec_.isNormal();
-    if (isNormal) {
-        size = io_.size() - off;
-    }
-    AlignedArray data;
-    if (isNormal) {
-        assert(rec_.data_size == io_.size());
-        rec.data_size = size;
-        util::assignAlignedArray(data, io_.data() + off, size);
-    }
-    assert(rhsEndIoAddr == rec.io_address);
-    v.emplace_back(rec, std::move(data));
     return v;
 }
 
+/**
+ * Overlapped items are trimmed in place.
+ * Their IO data are not copied unless most of them are overwritten.
+ */
 void DiffMemory::add(const DiffRecord& rec, AlignedArray &&buf)
 {
-    /* Decide key range to search overlapped items.
-     * We must start from the item which have max address
-     * in all the items that address is less than the addr0. */
+    /* The item just before addr0 may overlap. */
     const uint64_t addr0 = rec.io_address;
-    auto it = map_.lower_bound(addr0);
-    if (it == map_.end()) {
-        if (!map_.empty()) --it;
-    } else {
-        if (addr0 < it->first && it != map_.begin()) --it;
+    const uint64_t addr1 = rec.endIoAddress();
+    Map::iterator it = map_.lower_bound(addr0);
+    if (it != map_.begin()) {
+        Map::iterator prev = std::prev(it);
+        if (addr0 < prev->second.record().endIoAddress()) it = prev;
     }
 
-    /* Search overlapped items. */
-    const uint64_t addr1 = rec.endIoAddress();
-    std::queue<DiffRecIo> q;
+    /* Eliminate overlaps. */
     while (it != map_.end() && it->first < addr1) {
         DiffRecIo &r = it->second;
-        if (r.record().isOverlapped(rec)) {
-            nIos_--;
-            nBlocks_ -= r.record().io_blocks;
-            q.push(std::move(r));
-            it = map_.erase(it);
-        } else {
-            ++it;
+        const uint64_t bgn = it->first;
+        const uint64_t end = r.record().endIoAddress();
+        assert(addr0 < end);
+        nIos_--;
+        nBlocks_ -= end - bgn;
+        if (addr1 < end) {
+            /* The right part survives. */
+            DiffRecIo right = r.slice(addr1, end - addr1);
+            right.shrinkToFit();
+            nIos_++;
+            nBlocks_ += end - addr1;
+            map_.emplace_hint(std::next(it), addr1, std::move(right));
         }
-    }
-
-    /* Eliminate overlaps. */
-    DiffRecIo r0(rec, std::move(buf));
-    while (!q.empty()) {
-        std::vector<DiffRecIo> v = q.front().minus(r0);
-        for (DiffRecIo &r : v) {
-            const DiffRecord& dr = r.record();
+        if (bgn < addr0) {
+            /* The left part survives with the same key. */
+            r = r.slice(bgn, addr0 - bgn);
+            r.shrinkToFit();
             nIos_++;
-            nBlocks_ += dr.io_blocks;
-            map_.emplace(dr.io_address, std::move(r));
+            nBlocks_ += addr0 - bgn;
+            ++it;
+        } else {
+            it = map_.erase(it);
         }
-        q.pop();
     }
+
     /* Insert the item. */
-    nIos_++;
-    nBlocks_ += r0.record().io_blocks;
-    std::vector<DiffRecIo> rv;
+    DiffRecIo r0(rec, std::move(buf));
     if (maxIoBlocks_ > 0 && maxIoBlocks_ < rec.io_blocks) {
         // split a large IO into smaller IOs.
-        rv = r0.splitAll(maxIoBlocks_);
+        for (DiffRecIo &r : r0.splitAll(maxIoBlocks_)) {
+            nIos_++;
+            nBlocks_ += r.record().io_blocks;
+            map_.emplace_hint(it, r.record().io_address, std::move(r));
+        }
     } else {
-        rv.push_back(std::move(r0));
-    }
-    for (DiffRecIo &r : rv) {
-        uint64_t addr = r.record().io_address;
-        map_.emplace(addr, std::move(r));
+        nIos_++;
+        nBlocks_ += rec.io_blocks;
+        map_.emplace_hint(it, addr0, std::move(r0));
     }
 }
 
@@ -263,11 +206,11 @@ void DiffMemory::writeTo(int outFd, int cmprType)
         const DiffRecIo &r = it->second;
         assert(r.isValid());
         if (cmprType != ::WALB_DIFF_CMPR_NONE) {
-            writer.compressAndWriteDiff(r.record(), r.io().data(), cmprType);
+            writer.compressAndWriteDiff(r.record(), r.data(), cmprType);
         } else {
             DiffRecord rec = r.record();
-            rec.checksum = calcDiffIoChecksum(r.io());
-            writer.writeDiff(rec, r.io().data());
+            rec.checksum = calcDiffIoChecksum(r.data(), r.size());
+            writer.writeDiff(rec, r.data());
         }
         ++it;
     }
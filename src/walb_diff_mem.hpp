@@ -9,6 +9,7 @@
 #include <vector>
 #include <cassert>
 #include <map>
+#include <memory>
 #include "walb_diff_base.hpp"
 #include "walb_diff_file.hpp"
 
@@ -18,46 +19,70 @@ namespace walb {
  * Diff record and its IO data.
  * Data compression is not supported.
  * Checksum is not calculated.
+ *
+ * IO data buffer is owned by the record until it is sliced.
+ * Then it is shared by fragments of the same original IO.
+ * Fragments never refer overlapped areas of the buffer,
+ * so splitting and trimming do not copy IO data.
  */
 class DiffRecIo /* final */
 {
 private:
     DiffRecord rec_;
-    AlignedArray io_;
+    AlignedArray buf_; // IO data if not shared.
+    std::shared_ptr<AlignedArray> shared_;
+    size_t off_; // offset in *shared_ [byte].
 public:
     const DiffRecord &record() const { return rec_; }
-    const AlignedArray &io() const { return io_; }
+    const char *data() const {
+        if (shared_) return shared_->data() + off_;
+        return buf_.empty() ? nullptr : buf_.data();
+    }
+    size_t size() const { return (shared_ || !buf_.empty()) ? rec_.data_size : 0; }
 
-    DiffRecIo() {}
+    DiffRecIo() : rec_(), buf_(), shared_(), off_(0) {}
     DiffRecIo(const DiffRecord &rec, AlignedArray &&buf)
-        : rec_(rec) {
-        if (rec.isNormal()) {
-            io_ = std::move(buf);
-        } else {
-            io_.clear();
-        }
+        : rec_(rec), buf_(), shared_(), off_(0) {
+        if (rec.isNormal()) buf_ = std::move(buf);
         assert(isValid());
     }
     bool isValid(bool isChecksum = false) const;
 
     void print(::FILE *fp = ::stdout) const {
         rec_.printOneline(fp);
-        printOnelineDiffIo(io_, fp);
+        ::fprintf(fp, "size %zu checksum %08x\n"
+                  , size(), calcDiffIoChecksum(data(), size()));
     }
 
+    /**
+     * Get the fragment of [ioAddr, ioAddr + ioBlocks).
+     * The IO data will be shared.
+     */
+    DiffRecIo slice(uint64_t ioAddr, uint32_t ioBlocks);
+
+    /**
+     * Copy the IO data to a new buffer if the fragment refers
+     * less than a half of the shared buffer,
+     * in order to release overwritten data.
+     * The buffer is owned again if it is no longer shared.
+     */
+    void shrinkToFit();
+
     /**
      * Split the DiffRecIo into pieces
      * where each ioBlocks is <= a specified one.
      */
-    std::vector<DiffRecIo> splitAll(uint32_t ioBlocks) const;
+    std::vector<DiffRecIo> splitAll(uint32_t ioBlocks);
 
     /**
      * Create (IO portions of rhs) - (that of *this).
      * If non-overlapped, throw runtime error.
      * The overlapped data of rhs will be used.
-     * *this will not be changed.
+     * The IO data of *this will be shared with the results.
      */
-    std::vector<DiffRecIo> minus(const DiffRecIo &rhs) const;
+    std::vector<DiffRecIo> minus(const DiffRecIo &rhs);
+private:
+    void share();
 };
 
 /**
@@ -41,7 +41,9 @@ void DiffMerger::Wdiff::fill() const
     if (isEnd_ || isFilled_) return;
 
     bool success;
-    if (isIndexed_) {
+    if (pool_) {
+        success = readFromChunk();
+    } else if (isIndexed_) {
         success = readIndexedDiff();
     } else {
         success = sReader_.readAndUncompressDiff(rec_, buf_, false);
@@ -75,6 +77,112 @@ bool DiffMerger::Wdiff::readIndexedDiff() const
     return true;
 }
 
+bool DiffMerger::Wdiff::readFromChunk() const
+{
+    for (;;) {
+        if (chunk_ && chunk_->idx < chunk_->recV.size()) {
+            const size_t i = chunk_->idx++;
+            rec_ = chunk_->recV[i];
+            buf_ = std::move(chunk_->bufV[i]);
+            return true;
+        }
+        chunk_.reset();
+        readAhead();
+        if (chunkQ_.empty()) return false;
+        const uint32_t id = chunkQ_.front().first;
+        ChunkPtr chunk = std::move(chunkQ_.front().second);
+        chunkQ_.pop_front();
+        std::exception_ptr ep = pool_->waitFor(id);
+        if (ep) std::rethrow_exception(ep);
+        chunk_ = std::move(chunk);
+        readAhead();
+    }
+}
+
+void DiffMerger::Wdiff::readAhead() const
+{
+    while (!isReadEnd_ && chunkQ_.size() < maxChunks_) {
+        ChunkPtr chunk = std::make_shared<Chunk>();
+        if (!readChunk(*chunk)) {
+            isReadEnd_ = true;
+            if (chunk->recV.empty() && chunk->irecV.empty()) break;
+        }
+        const uint32_t id = pool_->add([this, chunk]() { decodeChunk(*chunk); });
+        chunkQ_.emplace_back(id, std::move(chunk));
+    }
+}
+
+/**
+ * This is called by the caller thread.
+ * RETURN:
+ *   false if the input reached the end.
+ */
+bool DiffMerger::Wdiff::readChunk(Chunk &chunk) const
+{
+    size_t total = 0;
+    while (total < chunkSize_) {
+        if (isIndexed_) {
+            IndexedDiffRecord irec;
+            if (!iReader_.readDiffRecord(irec)) return false;
+            total += irec.io_blocks * LOGICAL_BLOCK_SIZE;
+            chunk.irecV.push_back(irec);
+        } else {
+            DiffRecord rec;
+            AlignedArray buf;
+            if (!sReader_.readDiff(rec, buf, false)) return false;
+            total += rec.io_blocks * LOGICAL_BLOCK_SIZE;
+            chunk.recV.push_back(rec);
+            chunk.bufV.push_back(std::move(buf));
+        }
+    }
+    return true;
+}
+
+/**
+ * This is called by a worker thread.
+ */
+void DiffMerger::Wdiff::decodeChunk(Chunk &chunk) const
+{
+    if (!isIndexed_) {
+        for (size_t i = 0; i < chunk.recV.size(); i++) {
+            DiffRecord &rec = chunk.recV[i];
+            AlignedArray &buf = chunk.bufV[i];
+            if (!rec.isNormal()) continue;
+            const uint32_t csum = calcDiffIoChecksum(buf);
+            if (rec.checksum != csum) {
+                throw cybozu::Exception(NAME) << "checksum differ" << rec.checksum << csum;
+            }
+            if (!rec.isCompressed()) continue;
+            DiffRecord outRec;
+            AlignedArray outBuf;
+            uncompressDiffIo(rec, buf.data(), outRec, outBuf, false);
+            rec = outRec;
+            buf = std::move(outBuf);
+        }
+        return;
+    }
+
+    IndexedDiffReader::IoView view;
+    chunk.recV.resize(chunk.irecV.size());
+    chunk.bufV.resize(chunk.irecV.size());
+    for (size_t i = 0; i < chunk.irecV.size(); i++) {
+        const IndexedDiffRecord &irec = chunk.irecV[i];
+        DiffRecord &rec = chunk.recV[i];
+        rec.init();
+        rec.io_address = irec.io_address;
+        rec.io_blocks = irec.io_blocks;
+        rec.flags = irec.flags;
+        if (!irec.isNormal()) continue;
+
+        iReader_.getDiffIoView(irec, view);
+        rec.compression_type = ::WALB_DIFF_CMPR_NONE;
+        rec.data_size = irec.io_blocks * LOGICAL_BLOCK_SIZE;
+        rec.checksum = irec.io_checksum; // not set.
+        util::assignAlignedArray(chunk.bufV[i], view.data, view.size);
+    }
+    chunk.irecV.clear();
+}
+
 void DiffMerger::mergeToFd(int outFd)
 {
     prepare();
@@ -85,7 +193,7 @@ void DiffMerger::mergeToFd(int outFd)
     DiffRecIo d;
     while (getAndRemove(d)) {
         assert(d.isValid());
-        writer.compressAndWriteDiff(d.record(), d.io().data());
+        writer.compressAndWriteDiff(d.record(), d.data());
     }
 
     writer.close();
@@ -94,43 +202,85 @@ void DiffMerger::mergeToFd(int outFd)
     statOut_.update(writer.getStat());
 }
 
-void DiffMerger::mergeToFdInParallel(int outFd, const CompressOpt& cmpr)
+bool DiffMerger::mergeToFdInParallel(int outFd, const CompressOpt& cmpr, const std::function<bool()>& shouldStop)
 {
     cybozu::util::File file(outFd);
-    DiffFileHeader header;
-    header.type = ::WALB_DIFF_TYPE_SORTED;
-    header.writeTo(file);
-
     prepare();
+    wdiffH_.type = ::WALB_DIFF_TYPE_SORTED;
+    wdiffH_.writeTo(file);
+
+    statOut_.clear();
+    statOut_.wdiffNr = 1;
     const size_t maxPushedNr = cmpr.numCpu * 2 + 1;
     ConverterQueue conv(maxPushedNr, cmpr.numCpu, true, cmpr.type, cmpr.level);
 
+    /*
+     * Packs are compressed by the worker threads keeping their order,
+     * and written out by the writer thread while this thread merges the next ones.
+     */
+    cybozu::thread::ThreadRunner writer([&]() {
+            try {
+                for (AlignedArray pack = conv.pop(); !pack.empty(); pack = conv.pop()) {
+                    statOut_.update(*(const DiffPackHeader *)pack.data());
+                    file.write(pack.data(), pack.size());
+                }
+            } catch (...) {
+                conv.quit();
+                throw;
+            }
+        });
+    writer.start();
+
     DiffRecIo d;
     DiffPacker packer;
-    size_t pushedNr = 0;
-    while (getAndRemove(d)) {
-        assert(d.isValid());
-        const DiffRecord& rec = d.record();
-        const AlignedArray& buf = d.io();
-        if (packer.add(rec, buf.data())) continue;
-        conv.push(packer.getPackAsArray());
-        pushedNr++;
-        packer.clear();
-        packer.add(rec, buf.data());
-        if (pushedNr < maxPushedNr) continue;
-        AlignedArray pack(conv.pop());
-        file.write(pack.data(), pack.size());
-        pushedNr--;
-    }
-    if (!packer.empty()) {
-        conv.push(packer.getPackAsArray());
+    try {
+        while (getAndRemove(d)) {
+            if (shouldStop && shouldStop()) {
+                conv.quit();
+                writer.joinNoThrow();
+                return false;
+            }
+            assert(d.isValid());
+            const DiffRecord& rec = d.record();
+            if (packer.add(rec, d.data())) continue;
+            if (!conv.push(packer.getPackAsArray())) break; // the writer failed.
+            packer.add(rec, d.data());
+        }
+        if (!packer.empty()) conv.push(packer.getPackAsArray());
+    } catch (...) {
+        conv.quit();
+        writer.joinNoThrow();
+        throw;
     }
     conv.quit();
-    for (AlignedArray pack = conv.pop(); !pack.empty(); pack = conv.pop()) {
-        file.write(pack.data(), pack.size());
-    }
+    writer.join(); // the writer error will be thrown if exists.
 
     writeDiffEofPack(file);
+    return true;
+}
+
+bool DiffMerger::mergeToIndexedFdInParallel(
+    int outFd, IndexedDiffStreamWriter& writer, const CompressOpt& cmpr, const std::function<bool()>& shouldStop)
+{
+    prepare();
+    writer.start(outFd, wdiffH_, cmpr);
+    DiffRecIo d;
+    try {
+        while (getAndRemove(d)) {
+            if (shouldStop && shouldStop()) {
+                writer.fail();
+                return false;
+            }
+            assert(d.isValid());
+            writer.add(d.record(), d.data());
+        }
+        writer.finalize();
+    } catch (...) {
+        writer.fail();
+        throw;
+    }
+    statOut_ = writer.getStat();
+    return true;
 }
 
 void DiffMerger::prepare()
@@ -145,6 +295,10 @@ void DiffMerger::prepare()
         wdiffH_.init();
         wdiffH_.setUuid(uuid);
 
+        if (startAddr_ > 0) {
+            for (WdiffPtr &wdiffP : wdiffs_) wdiffP->seek(startAddr_);
+        }
+        startReadAhead();
         removeEndedWdiffs();
         doneAddr_ = getMinimumAddr();
         isHeaderPrepared_ = true;
@@ -179,6 +333,29 @@ uint64_t DiffMerger::getMinimumAddr() const
     return addr;
 }
 
+/**
+ * Total memory for read-ahead is limited by MAX_MERGE_READ_AHEAD_SIZE.
+ * Each wdiff holds the chunk being read and at most maxChunks chunks read ahead.
+ * If the wdiffs are too many to read ahead a chunk of minChunkSize for each,
+ * only the first ones within the limit read ahead.
+ */
+void DiffMerger::startReadAhead()
+{
+    if (readAheadThreads_ == 0 || wdiffs_.empty()) return;
+    const size_t minChunkSize = 64 * KIBI;
+    const size_t maxChunkSize = MEBI;
+    const size_t sizePerWdiff = MAX_MERGE_READ_AHEAD_SIZE / wdiffs_.size();
+    const size_t nrChunks = std::max<size_t>(2, std::min(readAheadThreads_ + 2, sizePerWdiff / minChunkSize));
+    const size_t chunkSize = std::max(minChunkSize, std::min(maxChunkSize, sizePerWdiff / nrChunks));
+    size_t nrReadAhead = MAX_MERGE_READ_AHEAD_SIZE / (nrChunks * chunkSize);
+    pool_.reset(new cybozu::thread::ThreadRunnerPool(readAheadThreads_));
+    for (WdiffPtr &wdiffP : wdiffs_) {
+        if (nrReadAhead == 0) break;
+        wdiffP->setReadAhead(*pool_, nrChunks - 1, chunkSize);
+        nrReadAhead--;
+    }
+}
+
 void DiffMerger::moveToDiffMemory()
 {
     size_t nr = tryMoveToDiffMemory();
@@ -334,4 +511,39 @@ void DiffMerger::verifyUuid(const cybozu::Uuid &uuid) const
     }
 }
 
+bool mergeWdiffsInTiers(StrVec &pathV, std::vector<std::unique_ptr<cybozu::TmpFile> > &tmpFileV,
+                        size_t fanIn, const std::string &tmpDir, const MergeWdiffsFunc &merge)
+{
+    if (fanIn < 2) {
+        throw cybozu::Exception(__func__) << "fanIn must be 2 or more" << fanIn;
+    }
+    while (pathV.size() > fanIn) {
+        size_t excess = pathV.size() - fanIn;
+        StrVec nextV;
+        size_t i = 0;
+        while (i < pathV.size()) {
+            const size_t n = std::min(std::min(fanIn, excess + 1), pathV.size() - i);
+            if (n == 1) {
+                nextV.push_back(pathV[i++]);
+                continue;
+            }
+            std::unique_ptr<cybozu::TmpFile> tmpFile(new cybozu::TmpFile(tmpDir));
+            const StrVec inV(pathV.begin() + i, pathV.begin() + i + n);
+            if (!merge(inV, tmpFile->fd())) return false;
+            nextV.push_back(tmpFile->path());
+            tmpFileV.push_back(std::move(tmpFile));
+            excess -= n - 1;
+            i += n;
+        }
+        pathV = std::move(nextV);
+        /* Temporary wdiffs of the previous tier are no longer necessary. */
+        tmpFileV.erase(std::remove_if(
+                           tmpFileV.begin(), tmpFileV.end(),
+                           [&](const std::unique_ptr<cybozu::TmpFile> &f) {
+                               return std::find(pathV.begin(), pathV.end(), f->path()) == pathV.end();
+                           }), tmpFileV.end());
+    }
+    return true;
+}
+
 } //namespace walb
@@ -11,24 +11,35 @@
 #include <vector>
 #include <queue>
 #include <list>
+#include <deque>
 #include <cassert>
 #include <cstring>
+#include <functional>
+#include <algorithm>
 
 #include "walb_diff_base.hpp"
 #include "walb_diff_file.hpp"
 #include "walb_diff_mem.hpp"
 #include "walb_diff_stat.hpp"
 #include "walb_diff_compressor.hpp"
+#include "walb_diff_stream.hpp"
 #include "host_info.hpp"
 #include "fileio.hpp"
+#include "thread_util.hpp"
+#include "tmp_file.hpp"
 
 namespace walb {
 
 /**
  * To merge walb diff files.
  *
+ * Input wdiffs are read ahead:
+ * IO data of each wdiff are uncompressed and verified in advance
+ * by a worker pool shared by all the wdiffs,
+ * so that merging many compressed wdiffs is not bound by the caller thread.
+ *
  * Usage:
- *   (1) call setMaxIoBlocks() and setShouldValidateUuid() if necessary.
+ *   (1) call setMaxIoBlocks(), setShouldValidateUuid() and setReadAheadThreads() if necessary.
  *   (2) add wdiffs by calling addWdiff() or addWdiffs().
  *   (3a) call mergeToFd() to write out the merged diff data.
  *   (3b) call prepare(), then call header() and getAndRemove() multiple times for other purpose.
@@ -47,10 +58,39 @@ private:
         mutable bool isFilled_;
         mutable bool isEnd_;
 
+        /*
+         * Read-ahead data.
+         * The caller thread reads records and raw IO data into a chunk,
+         * then a worker thread uncompresses and verifies them.
+         */
+        struct Chunk {
+            std::vector<DiffRecord> recV;
+            std::vector<AlignedArray> bufV;
+            std::vector<IndexedDiffRecord> irecV; // input for indexed diff.
+            size_t idx; // next item to get.
+            Chunk() : recV(), bufV(), irecV(), idx(0) {}
+        };
+        using ChunkPtr = std::shared_ptr<Chunk>;
+        using Pool = cybozu::thread::ThreadRunnerPool;
+        Pool *pool_; // nullptr means read-ahead is disabled.
+        size_t maxChunks_;
+        size_t chunkSize_; // [byte]
+        mutable std::deque<std::pair<uint32_t, ChunkPtr> > chunkQ_; // (task id, chunk).
+        mutable ChunkPtr chunk_; // current chunk.
+        mutable bool isReadEnd_;
+
     public:
         constexpr static const char *NAME = "DiffMerger::Wdiff";
         Wdiff() : sReader_(), iReader_(), isIndexed_(false)
-                , header_(), rec_(), buf_(), isFilled_(false), isEnd_(false) {
+                , header_(), rec_(), buf_(), isFilled_(false), isEnd_(false)
+                , pool_(nullptr), maxChunks_(0), chunkSize_(0)
+                , chunkQ_(), chunk_(), isReadEnd_(false) {
+        }
+        ~Wdiff() noexcept {
+            /* Worker threads may refer this. */
+            for (std::pair<uint32_t, ChunkPtr>& p : chunkQ_) {
+                if (pool_) pool_->waitFor(p.first);
+            }
         }
         void open(const std::string &wdiffPath, IndexedDiffCache *cache) {
             setFile(cybozu::util::File(wdiffPath, O_RDONLY), cache);
@@ -60,6 +100,27 @@ private:
          * isIndexed_ will be set.
          */
         void setFile(cybozu::util::File &&file, IndexedDiffCache *cache);
+        /**
+         * Enable read-ahead. Call this before reading IOs.
+         * @maxChunks max number of chunks read ahead.
+         * @chunkSize chunk size [byte].
+         */
+        void setReadAhead(Pool &pool, size_t maxChunks, size_t chunkSize) {
+            pool_ = &pool;
+            maxChunks_ = maxChunks;
+            chunkSize_ = chunkSize;
+        }
+        /**
+         * Skip IOs which end address is not greater than addr.
+         * Call this before reading IOs.
+         */
+        void seek(uint64_t addr) {
+            if (isIndexed_) {
+                iReader_.seek(addr);
+            } else {
+                sReader_.seek(addr);
+            }
+        }
 
         const DiffFileHeader &header() const { return header_; }
         DiffRecord getFrontRec() const {
@@ -93,6 +154,10 @@ private:
     private:
         void fill() const;
         bool readIndexedDiff() const;
+        bool readFromChunk() const;
+        void readAhead() const;
+        bool readChunk(Chunk &chunk) const;
+        void decodeChunk(Chunk &chunk) const;
 #ifdef DEBUG
         void verifyNotEnd(const char *msg) const {
             if (isEnd()) throw cybozu::Exception(msg) << "reached to end";
@@ -108,18 +173,22 @@ private:
 #endif
     };
     bool shouldValidateUuid_;
+    size_t readAheadThreads_;
 
     DiffFileHeader wdiffH_;
     bool isHeaderPrepared_;
 
     using WdiffPtr = std::unique_ptr<Wdiff>;
     using WdiffPtrList = std::list<WdiffPtr>;
+    std::unique_ptr<cybozu::thread::ThreadRunnerPool> pool_; // must be destroyed after wdiffs_.
     WdiffPtrList wdiffs_;
     DiffMemory diffMem_;
     std::queue<DiffRecIo> mergedQ_;
     uint64_t doneAddr_;
+    uint64_t startAddr_;
     size_t searchLen_;
     IndexedDiffCache cache_; // shared by indexed diff files.
+    IndexedDiffCache *sharedCache_; // used instead of cache_ if set.
 
     /**
      * Diff recIos will be read from wdiffs_,
@@ -152,13 +221,17 @@ private:
 public:
     explicit DiffMerger(size_t initSearchLen = DEFAULT_MERGE_BUFFER_LB)
         : shouldValidateUuid_(false)
+        , readAheadThreads_(DEFAULT_MERGE_READ_AHEAD_CPU)
         , wdiffH_()
         , isHeaderPrepared_(false)
+        , pool_()
         , wdiffs_()
         , diffMem_()
         , mergedQ_()
         , doneAddr_(0)
+        , startAddr_(0)
         , searchLen_(initSearchLen)
+        , cache_(), sharedCache_(nullptr)
         , statIn_(), statOut_() {
     }
     void setMaxIoBlocks(uint32_t maxIoBlocks) {
@@ -170,16 +243,40 @@ public:
     void setShouldValidateUuid(bool shouldValidateUuid) {
         shouldValidateUuid_ = shouldValidateUuid;
     }
+    /**
+     * Number of threads to uncompress and verify input IOs in advance.
+     * 0 means that the caller thread does them.
+     * Call this before prepare().
+     */
+    void setReadAheadThreads(size_t nrThreads) {
+        readAheadThreads_ = nrThreads;
+    }
     void setMaxCacheSize(size_t bytes) {
         cache_.setMaxSize(bytes);
     }
+    /**
+     * Use a cache shared with other mergers instead of the private one.
+     * Call this before adding wdiffs.
+     */
+    void setCache(IndexedDiffCache &cache) {
+        sharedCache_ = &cache;
+    }
+    /**
+     * IOs which end address is not greater than addr will be skipped
+     * without reading their data. Merged IOs may still start before addr.
+     * Call this before prepare().
+     */
+    void setStartAddr(uint64_t addr) {
+        startAddr_ = addr;
+    }
+    uint64_t getStartAddr() const { return startAddr_; }
     /**
      * Add a diff file.
      * Newer wdiff file must be added later.
      */
     void addWdiff(const std::string& wdiffPath) {
         wdiffs_.emplace_back(new Wdiff());
-        wdiffs_.back()->open(wdiffPath, &cache_);
+        wdiffs_.back()->open(wdiffPath, &getCache());
     }
     /**
      * Add diff files.
@@ -192,7 +289,7 @@ public:
     void addWdiffs(std::vector<cybozu::util::File> &&fileV) {
         for (cybozu::util::File &file : fileV) {
             wdiffs_.emplace_back(new Wdiff());
-            wdiffs_.back()->setFile(std::move(file), &cache_);
+            wdiffs_.back()->setFile(std::move(file), &getCache());
         }
         fileV.clear();
     }
@@ -203,7 +300,24 @@ public:
      * @outFd file descriptor for output wdiff.
      */
     void mergeToFd(int outFd);
-    void mergeToFdInParallel(int outFd, const CompressOpt& cmpr);
+    /**
+     * Parallel version of mergeToFd().
+     * Packs are compressed with cmpr.numCpu threads and written by another thread.
+     *
+     * @cmpr compression type, level and concurrency for output.
+     * @shouldStop merging will be stopped if it returns true.
+     * RETURN:
+     *   false if stopped.
+     */
+    bool mergeToFdInParallel(int outFd, const CompressOpt& cmpr,
+                             const std::function<bool()>& shouldStop = nullptr);
+    /**
+     * Indexed version of mergeToFdInParallel().
+     * The writer will be started with outFd and finalized inside.
+     * Its unit size and other parameters must be set before calling this.
+     */
+    bool mergeToIndexedFdInParallel(int outFd, IndexedDiffStreamWriter& writer, const CompressOpt& cmpr,
+                                    const std::function<bool()>& shouldStop = nullptr);
     /**
      * Prepare wdiff header and variables.
      */
@@ -227,7 +341,7 @@ public:
         return statIn_;
     }
     /**
-     * Use this only if you used mergeToFd().
+     * Use this only if you used mergeToFd() or mergeToFdInParallel().
      */
     const DiffStatistics& statOut() const {
         assert(wdiffs_.empty());
@@ -237,7 +351,11 @@ public:
         return cybozu::itoa(searchLen_ * LBS / KIBI) + "KiB";
     }
 private:
+    IndexedDiffCache& getCache() {
+        return sharedCache_ ? *sharedCache_ : cache_;
+    }
     uint64_t getMinimumAddr() const;
+    void startReadAhead();
     void moveToDiffMemory();
 
     /**
@@ -273,4 +391,23 @@ private:
     void verifyUuid(const cybozu::Uuid &uuid) const;
 };
 
+/**
+ * Merge consecutive wdiffs into temporary ones tier by tier
+ * until the number of wdiffs does not exceed fanIn,
+ * so that all of them can be applied in one pass.
+ * Each tier merges only the oldest wdiffs as needed to reduce the number,
+ * and each merge opens at most fanIn wdiffs.
+ *
+ * @pathV wdiff paths in the order to apply.
+ *   Merged ones will be replaced by temporary wdiffs in tmpDir.
+ * @tmpFileV temporary wdiffs referred in pathV. They will be removed at destruction.
+ * @fanIn max number of wdiffs. It must be 2 or more.
+ * @merge merge the input wdiffs into the output fd. It must return false if stopped.
+ * RETURN:
+ *   false if merge returned false.
+ */
+using MergeWdiffsFunc = std::function<bool(const StrVec &, int)>;
+bool mergeWdiffsInTiers(StrVec &pathV, std::vector<std::unique_ptr<cybozu::TmpFile> > &tmpFileV,
+                        size_t fanIn, const std::string &tmpDir, const MergeWdiffsFunc &merge);
+
 } //namespace walb
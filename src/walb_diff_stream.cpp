@@ -0,0 +1,269 @@
+#include "walb_diff_stream.hpp"
+#include "walb_diff_pack.hpp"
+
+namespace walb {
+
+void IndexedDiffStreamWriter::setUnitLb(uint32_t unitLb)
+{
+    if (unitLb == 0) {
+        throw cybozu::Exception(NAME) << "unitLb must not be 0";
+    }
+    unitLb_ = unitLb;
+}
+
+void IndexedDiffStreamWriter::start(int fd, DiffFileHeader &header, const CompressOpt &cmpr)
+{
+    if (isStarted_) {
+        throw cybozu::Exception(NAME) << "already started";
+    }
+    fileW_.setFd(fd);
+    header.type = ::WALB_DIFF_TYPE_INDEXED;
+    header.writeTo(fileW_);
+    offset_ = header.getSize();
+    n_data_ = 0;
+    n_records_ = 0;
+    unsyncedSize_ = 0;
+    indexV_.clear();
+    spilledSize_ = 0;
+    stat_.clear();
+    stat_.wdiffNr = 1;
+    batch_ = Batch();
+    endAddr_ = 0;
+
+    const int type = cmpr.type;
+    const int level = cmpr.level;
+    conv_.reset(new Converter([type, level](Batch &&batch) {
+                return compressBatch(std::move(batch), type, level);
+            }));
+    conv_->start(cmpr.numCpu);
+    writer_.set([this]() { runWriter(); });
+    writer_.start();
+    isStarted_ = true;
+}
+
+void IndexedDiffStreamWriter::add(const DiffRecord &rec, const char *data)
+{
+    if (!isStarted_) {
+        throw cybozu::Exception(NAME) << "not started";
+    }
+    if (rec.io_address < endAddr_) {
+        throw cybozu::Exception(NAME) << "IOs must be sorted and not overlapped" << endAddr_ << rec;
+    }
+    if (rec.io_blocks == 0) {
+        throw cybozu::Exception(NAME) << "io_blocks must not be 0" << rec;
+    }
+    endAddr_ = rec.endIoAddress();
+
+    IndexedDiffRecord irec;
+    irec.init();
+    irec.flags = rec.flags;
+    irec.io_address = rec.io_address;
+    irec.io_blocks = rec.io_blocks;
+    irec.orig_blocks = rec.io_blocks;
+    if (!rec.isNormal()) {
+        addToBatch(irec, AlignedArray());
+        return;
+    }
+    assert(data != nullptr);
+    if (rec.isCompressed()) {
+        /* The compression unit can not be changed without uncompressing it. */
+        irec.compression_type = rec.compression_type;
+        irec.data_size = rec.data_size;
+        irec.io_checksum = rec.checksum;
+        AlignedArray buf(rec.data_size, false);
+        ::memcpy(buf.data(), data, rec.data_size);
+        addToBatch(irec, std::move(buf));
+        return;
+    }
+    if (rec.data_size != rec.io_blocks * LOGICAL_BLOCK_SIZE) {
+        throw cybozu::Exception(NAME) << "bad data size" << rec;
+    }
+    for (uint32_t off = 0; off < rec.io_blocks; off += unitLb_) {
+        const uint32_t blks = std::min(unitLb_, rec.io_blocks - off);
+        irec.io_address = rec.io_address + off;
+        irec.io_blocks = blks;
+        irec.orig_blocks = blks;
+        irec.data_size = blks * LOGICAL_BLOCK_SIZE;
+        AlignedArray buf(irec.data_size, false);
+        ::memcpy(buf.data(), data + off * LOGICAL_BLOCK_SIZE, buf.size());
+        addToBatch(irec, std::move(buf));
+    }
+}
+
+void IndexedDiffStreamWriter::addPack(const char *pack, size_t size)
+{
+    MemoryDiffPack mpack(pack, size);
+    const DiffPackHeader &packH = mpack.header();
+    for (size_t i = 0; i < packH.n_records; i++) {
+        add(packH[i], mpack.data(i));
+    }
+}
+
+void IndexedDiffStreamWriter::finalize()
+{
+    if (!isStarted_) {
+        throw cybozu::Exception(NAME) << "not started";
+    }
+    pushBatch();
+    isStarted_ = false;
+    try {
+        conv_->sync();
+    } catch (...) {
+        conv_->fail();
+        writer_.join(); // the writer error will be thrown if exists.
+        throw;
+    }
+    writer_.join();
+    writeIndex();
+    writeSuper();
+    fileW_.fdatasync();
+}
+
+void IndexedDiffStreamWriter::fail() noexcept
+{
+    if (!isStarted_) return;
+    isStarted_ = false;
+    conv_->fail();
+    writer_.joinNoThrow();
+    batch_ = Batch();
+}
+
+void IndexedDiffStreamWriter::addToBatch(const IndexedDiffRecord &rec, AlignedArray &&data)
+{
+    batch_.bytes += data.size() + sizeof(rec);
+    batch_.recV.push_back(rec);
+    batch_.dataV.push_back(std::move(data));
+    if (batch_.bytes >= INDEXED_DIFF_STREAM_BATCH_SIZE) pushBatch();
+}
+
+void IndexedDiffStreamWriter::pushBatch()
+{
+    if (batch_.recV.empty()) return;
+    try {
+        conv_->push(std::move(batch_));
+    } catch (...) {
+        isStarted_ = false;
+        conv_->fail();
+        writer_.join(); // the writer error will be thrown if exists.
+        throw;
+    }
+    batch_ = Batch();
+}
+
+IndexedDiffStreamWriter::Batch IndexedDiffStreamWriter::compressBatch(Batch &&batch, int type, int level)
+{
+    size_t total = 0;
+    AlignedArray buf;
+    for (size_t i = 0; i < batch.recV.size(); i++) {
+        IndexedDiffRecord &rec = batch.recV[i];
+        AlignedArray &data = batch.dataV[i];
+        if (rec.isNormal() && !rec.isCompressed()) {
+            size_t outSize;
+            rec.compression_type = compressData(data.data(), data.size(), buf, outSize, type, level);
+            rec.data_size = outSize;
+            rec.io_checksum = calcDiffIoChecksum(buf);
+            data.swap(buf);
+        }
+        rec.data_offset = total;
+        total += data.size();
+    }
+    batch.out.resize(total, false);
+    for (size_t i = 0; i < batch.recV.size(); i++) {
+        const AlignedArray &data = batch.dataV[i];
+        if (data.empty()) continue;
+        ::memcpy(batch.out.data() + batch.recV[i].data_offset, data.data(), data.size());
+    }
+    batch.dataV.clear();
+    return std::move(batch);
+}
+
+void IndexedDiffStreamWriter::runWriter()
+{
+    try {
+        Batch batch;
+        while (conv_->pop(batch)) {
+            writeBatch(batch);
+        }
+    } catch (...) {
+        conv_->fail();
+        throw;
+    }
+}
+
+void IndexedDiffStreamWriter::writeBatch(Batch &batch)
+{
+    fileW_.write(batch.out.data(), batch.out.size());
+    for (IndexedDiffRecord &rec : batch.recV) {
+        rec.data_offset += offset_;
+        stat_.dataSize += rec.data_size;
+        n_data_++;
+        for (const IndexedDiffRecord &r : rec.split(unitLb_)) {
+            addIndex(r);
+        }
+    }
+    offset_ += batch.out.size();
+    unsyncedSize_ += batch.out.size();
+    if (fsyncIntervalSize_ > 0 && unsyncedSize_ >= fsyncIntervalSize_) {
+        fileW_.fdatasync();
+        unsyncedSize_ = 0;
+    }
+}
+
+void IndexedDiffStreamWriter::addIndex(const IndexedDiffRecord &rec)
+{
+    stat_.update(rec);
+    indexV_.push_back(rec);
+    n_records_++;
+    if (indexV_.size() * sizeof(rec) >= maxIndexMemSize_) spillIndex();
+}
+
+void IndexedDiffStreamWriter::spillIndex()
+{
+    if (indexV_.empty()) return;
+    if (spilledSize_ == 0) spillF_.prepare(spillDir_);
+    const size_t size = indexV_.size() * sizeof(IndexedDiffRecord);
+    cybozu::util::File file(spillF_.fd());
+    file.pwrite(indexV_.data(), size, spilledSize_);
+    spilledSize_ += size;
+    indexV_.clear();
+}
+
+void IndexedDiffStreamWriter::writeIndex()
+{
+    /* Index records must be aligned to 8 bytes. */
+    const size_t delta = offset_ % 8;
+    if (delta > 0) {
+        const size_t padding = 8 - delta;
+        fileW_.write(util::zeroedAlignedArray().data(), padding);
+        offset_ += padding;
+    }
+    if (spilledSize_ > 0) {
+        cybozu::util::File file(spillF_.fd());
+        AlignedArray buf(MEBI, false);
+        uint64_t off = 0;
+        while (off < spilledSize_) {
+            const size_t size = std::min<uint64_t>(buf.size(), spilledSize_ - off);
+            file.pread(buf.data(), size, off);
+            fileW_.write(buf.data(), size);
+            off += size;
+        }
+    }
+    fileW_.write(indexV_.data(), indexV_.size() * sizeof(IndexedDiffRecord));
+    indexV_.clear();
+}
+
+void IndexedDiffStreamWriter::writeSuper()
+{
+    if (n_records_ > UINT32_MAX || n_data_ > UINT32_MAX) {
+        throw cybozu::Exception(NAME) << "too many records" << n_records_ << n_data_;
+    }
+    DiffIndexSuper super;
+    super.init();
+    super.index_offset = offset_;
+    super.n_records = n_records_;
+    super.n_data = n_data_;
+    super.updateChecksum();
+    fileW_.write(&super, sizeof(super));
+}
+
+} // namespace walb
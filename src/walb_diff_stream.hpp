@@ -0,0 +1,145 @@
+#pragma once
+/**
+ * @file
+ * @brief Streaming indexed diff writer.
+ */
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "walb_diff_base.hpp"
+#include "walb_diff_file.hpp"
+#include "walb_diff_stat.hpp"
+#include "host_info.hpp"
+#include "fileio.hpp"
+#include "tmp_file.hpp"
+#include "thread_util.hpp"
+#include "constant.hpp"
+
+namespace walb {
+
+/**
+ * Indexed diff writer for sorted and non-overlapped IOs like merged diffs.
+ *
+ * Normal IOs are cut into compression units of at most unitLb blocks,
+ * which are compressed by worker threads and written by another thread.
+ * Readers need to uncompress only one unit to get any block in it.
+ *
+ * Unlike IndexedDiffWriter, index records are not kept in memory:
+ * they are spilled to a temporary file when they exceed maxIndexMemSize
+ * and copied to the tail of the diff file in finalize().
+ *
+ * Usage:
+ *   start(), add() for each IO in ascending address order, then finalize().
+ *   Call fail() to abandon writing.
+ */
+class IndexedDiffStreamWriter /* final */
+{
+public:
+    static constexpr const char *NAME = "IndexedDiffStreamWriter";
+private:
+    struct Batch
+    {
+        std::vector<IndexedDiffRecord> recV;
+        std::vector<AlignedArray> dataV; // uncompressed or already compressed data of each normal record.
+        AlignedArray out; // data to write. recV[i].data_offset is relative to it after compression.
+        size_t bytes;
+
+        Batch() : recV(), dataV(), out(), bytes(0) {}
+    };
+    using Converter = cybozu::thread::ParallelConverter<Batch, Batch>;
+
+    cybozu::util::File fileW_;
+    uint32_t unitLb_;
+    size_t maxIndexMemSize_;
+    std::string spillDir_;
+    uint64_t fsyncIntervalSize_;
+
+    std::unique_ptr<Converter> conv_;
+    cybozu::thread::ThreadRunner writer_;
+    bool isStarted_;
+    Batch batch_;
+    uint64_t endAddr_; // end address of the last added IO.
+
+    /* Accessed by the writer thread until finalize() joins it. */
+    uint64_t offset_;
+    uint64_t n_data_;
+    uint64_t n_records_;
+    uint64_t unsyncedSize_;
+    std::vector<IndexedDiffRecord> indexV_;
+    cybozu::TmpFile spillF_;
+    uint64_t spilledSize_;
+    DiffStatistics stat_;
+
+public:
+    IndexedDiffStreamWriter()
+        : fileW_()
+        , unitLb_(DEFAULT_INDEXED_DIFF_UNIT_SIZE / LOGICAL_BLOCK_SIZE)
+        , maxIndexMemSize_(MAX_INDEXED_DIFF_INDEX_MEM_SIZE)
+        , spillDir_(".")
+        , fsyncIntervalSize_(0)
+        , conv_(), writer_(), isStarted_(false), batch_(), endAddr_(0)
+        , offset_(0), n_data_(0), n_records_(0), unsyncedSize_(0)
+        , indexV_(), spillF_(), spilledSize_(0), stat_() {
+    }
+    ~IndexedDiffStreamWriter() noexcept {
+        fail();
+    }
+    /**
+     * Compression unit size [logical block]. It must not be 0.
+     */
+    void setUnitLb(uint32_t unitLb);
+    void setMaxIndexMemSize(size_t bytes) { maxIndexMemSize_ = bytes; }
+    /**
+     * Directory to put a temporary file for spilled index records.
+     */
+    void setSpillDir(const std::string &dir) { spillDir_ = dir; }
+    /**
+     * 0 means fdatasync() will be called only by the caller.
+     */
+    void setFsyncIntervalSize(uint64_t bytes) { fsyncIntervalSize_ = bytes; }
+
+    /**
+     * Write the header and start the threads.
+     * @fd output file descriptor. It will not be closed by this.
+     * @cmpr compression type, level and concurrency for uncompressed IOs.
+     */
+    void start(int fd, DiffFileHeader &header, const CompressOpt &cmpr);
+    /**
+     * Add an IO. Compressed IOs will be written as is.
+     * @rec its address must not be less than the end address of the previous IO.
+     * @data IO data with rec.data_size bytes. nullptr for non-normal IOs.
+     */
+    void add(const DiffRecord &rec, const char *data);
+    /**
+     * Add all the IOs in a diff pack.
+     */
+    void addPack(const char *pack, size_t size);
+    /**
+     * Wait for all IOs written, then write the index and the super block.
+     */
+    void finalize();
+    /**
+     * Stop the threads without finalizing. The file will be broken.
+     */
+    void fail() noexcept;
+
+    /**
+     * Valid after finalize().
+     */
+    const DiffStatistics& getStat() const { return stat_; }
+    uint64_t getSpilledSize() const { return spilledSize_; }
+
+private:
+    void addToBatch(const IndexedDiffRecord &rec, AlignedArray &&data);
+    void pushBatch();
+    static Batch compressBatch(Batch &&batch, int type, int level);
+    void runWriter();
+    void writeBatch(Batch &batch);
+    void addIndex(const IndexedDiffRecord &rec);
+    void spillIndex();
+    void writeIndex();
+    void writeSuper();
+};
+
+} // namespace walb
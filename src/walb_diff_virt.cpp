@@ -2,9 +2,9 @@
 
 namespace walb {
 
-void VirtualFullScanner::init(cybozu::util::File&& reader, const StrVec &wdiffPaths)
+void VirtualFullScanner::init(cybozu::util::File&& reader, const StrVec &wdiffPaths, uint64_t startLb)
 {
-    init_inner(std::move(reader));
+    init_inner(std::move(reader), startLb);
     emptyWdiff_ = wdiffPaths.empty();
     if (!emptyWdiff_) {
         merger_.addWdiffs(wdiffPaths);
@@ -13,9 +13,9 @@ void VirtualFullScanner::init(cybozu::util::File&& reader, const StrVec &wdiffPa
     statOut_.clear();
 }
 
-void VirtualFullScanner::init(cybozu::util::File&& reader, std::vector<cybozu::util::File> &&fileV)
+void VirtualFullScanner::init(cybozu::util::File&& reader, std::vector<cybozu::util::File> &&fileV, uint64_t startLb)
 {
-    init_inner(std::move(reader));
+    init_inner(std::move(reader), startLb);
     emptyWdiff_ = fileV.empty();
     if (!emptyWdiff_) {
         merger_.addWdiffs(std::move(fileV));
@@ -24,14 +24,17 @@ void VirtualFullScanner::init(cybozu::util::File&& reader, std::vector<cybozu::u
     statOut_.clear();
 }
 
-void VirtualFullScanner::readAndWriteTo(int outputFd, size_t bufSize)
+void VirtualFullScanner::readAndWriteTo(int outputFd, size_t bufSize, uint64_t sizeLb)
 {
     cybozu::util::File writer(outputFd);
     AlignedArray buf(bufSize, false);
-    for (;;) {
-        const size_t rSize = readSome(buf.data(), buf.size());
+    uint64_t remainingLb = sizeLb;
+    while (remainingLb > 0) {
+        const size_t size = std::min<uint64_t>(buf.size(), remainingLb * LOGICAL_BLOCK_SIZE);
+        const size_t rSize = readSome(buf.data(), size);
         if (rSize == 0) break;
         writer.write(buf.data(), rSize);
+        remainingLb -= rSize / LOGICAL_BLOCK_SIZE;
     }
     writer.fdatasync();
 }
@@ -76,6 +79,38 @@ void VirtualFullScanner::read(void *data, size_t size)
     }
 }
 
+void VirtualFullScanner::skip(uint64_t blks)
+{
+    while (0 < blks) {
+        fillDiffIo();
+        if (emptyWdiff_ || isEndDiff_) {
+            skipBase(blks);
+            addr_ += blks;
+            return;
+        }
+        const uint64_t diffAddr = currentDiffAddr();
+        assert(addr_ <= diffAddr);
+        uint64_t blks0;
+        if (addr_ == diffAddr) {
+            /* Skip the wdiff IO partially. */
+            blks0 = std::min<uint64_t>(blks, currentDiffBlocks());
+            offInIo_ += blks0;
+        } else {
+            blks0 = std::min<uint64_t>(blks, diffAddr - addr_);
+        }
+        skipBase(blks0);
+        addr_ += blks0;
+        blks -= blks0;
+    }
+}
+
+uint64_t VirtualFullScanner::nextDiffAddr()
+{
+    fillDiffIo();
+    if (emptyWdiff_ || isEndDiff_) return UINT64_MAX;
+    return currentDiffAddr();
+}
+
 size_t VirtualFullScanner::readBase(void *data, size_t blks)
 {
     char *p = (char *)data;
@@ -99,11 +134,10 @@ size_t VirtualFullScanner::readWdiff(void *data, size_t blks)
 {
     assert(recIo_.isValid());
     const DiffRecord& rec = recIo_.record();
-    const AlignedArray &buf = recIo_.io();
     assert(offInIo_ < rec.io_blocks);
     if (rec.isNormal()) {
         size_t off = offInIo_ * LOGICAL_BLOCK_SIZE;
-        ::memcpy(data, buf.data() + off, blks * LOGICAL_BLOCK_SIZE);
+        ::memcpy(data, recIo_.data() + off, blks * LOGICAL_BLOCK_SIZE);
     } else {
         /* Read zero image for both ALL_ZERO and DISCARD.. */
         assert(rec.isDiscard() || rec.isAllZero());
@@ -134,15 +168,21 @@ void VirtualFullScanner::fillDiffIo()
     const DiffRecord& rec = recIo_.record();
     /* At beginning time, rec.ioBlocks() returns 0. */
     assert(offInIo_ <= rec.io_blocks);
-    if (offInIo_ == rec.io_blocks) {
+    while (offInIo_ == rec.io_blocks) {
         offInIo_ = 0;
         if (!merger_.getAndRemove(recIo_)) {
             isEndDiff_ = true;
             recIo_ = DiffRecIo();
             statOut_.wdiffNr = -1;
             statOut_.dataSize = -1;
+            statOut_.update(recIo_.record());
+            return;
+        }
+        statOut_.update(rec);
+        if (rec.io_address < addr_) {
+            /* Merged IOs may start before the scanning start address. */
+            offInIo_ = std::min<uint64_t>(addr_ - rec.io_address, rec.io_blocks);
         }
-        statOut_.update(recIo_.record());
     }
 }
 
@@ -39,10 +39,13 @@ private:
     bool emptyWdiff_;
     DiffStatistics statOut_;
 
-    void init_inner(cybozu::util::File&& reader) {
+    void init_inner(cybozu::util::File&& reader, uint64_t startLb) {
         reader_ = std::move(reader);
         isInputFdSeekable_ = reader_.seekable();
         if (!isInputFdSeekable_) bufForSkip_.resize(LOGICAL_BLOCK_SIZE, false);
+        skipBase(startLb);
+        addr_ = startLb;
+        merger_.setStartAddr(startLb);
     }
 public:
     /**
@@ -62,16 +65,30 @@ public:
         , emptyWdiff_(false)
         , statOut_() {}
 
-    void init(cybozu::util::File&& reader, const StrVec &wdiffPaths);
-    void init(cybozu::util::File&& reader, std::vector<cybozu::util::File> &&fileV);
+    /**
+     * Use a cache shared with other jobs for indexed wdiffs.
+     * Call this before init().
+     */
+    void setCache(IndexedDiffCache &cache) {
+        merger_.setCache(cache);
+    }
+    /**
+     * @startLb scanning will start from the address [logical block].
+     *   The base image must be positioned at its beginning.
+     *   Wdiff IOs before the address will be skipped without reading their data
+     *   (by binary search of the index for indexed wdiffs).
+     */
+    void init(cybozu::util::File&& reader, const StrVec &wdiffPaths, uint64_t startLb = 0);
+    void init(cybozu::util::File&& reader, std::vector<cybozu::util::File> &&fileV, uint64_t startLb = 0);
 
     /**
      * Write all data to a specified fd.
      *
      * @outputFd output file descriptor.
      * @bufSize buffer size [byte].
+     * @sizeLb max size to write [logical block].
      */
-    void readAndWriteTo(int outputFd, size_t bufSize);
+    void readAndWriteTo(int outputFd, size_t bufSize, uint64_t sizeLb = UINT64_MAX);
 
     /**
      * Read a specified bytes.
@@ -93,6 +110,28 @@ public:
      */
     void read(void *data, size_t size);
 
+    /**
+     * Skip a specified size forward.
+     * The base image will not be read if it is seekable.
+     *
+     * @blks [logical block].
+     */
+    void skip(uint64_t blks);
+
+    /**
+     * RETURN:
+     *   current address [logical block].
+     */
+    uint64_t currentAddr() const { return addr_; }
+
+    /**
+     * RETURN:
+     *   address of the next wdiff IO [logical block].
+     *   UINT64_MAX if there is no more wdiff IO.
+     *   The blocks before the address will be read from the base image.
+     */
+    uint64_t nextDiffAddr();
+
     const DiffStatistics& statIn() const {
         return merger_.statIn();
     }
@@ -128,6 +167,7 @@ private:
 
     /**
      * Set recIo_ approximately.
+     * IOs before addr_ are skipped or cut.
      */
     void fillDiffIo();
 
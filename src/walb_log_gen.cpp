@@ -28,12 +28,20 @@ void WlogGenerator::Config::check() const
     if (lsid + outLogPb < lsid) {
         throw RT_ERR("lsid will overflow.");
     }
+    if (allZeroPct > 100) {
+        throw RT_ERR("allZeroPct must be <= 100.");
+    }
+    if (discardPct > 90) {
+        throw RT_ERR("discardPct must be <= 90.");
+    }
 }
 
 void WlogGenerator::generateAndWrite(int fd)
 {
     WlogWriter writer(fd);
     Rand rand;
+    if (config_.seed != 0) rand.setSeed(config_.seed);
+    nextAddr_ = 0;
     uint64_t writtenPb = 0;
     WlogFileHeader wlHead;
     cybozu::Uuid uuid;
@@ -63,7 +71,7 @@ void WlogGenerator::generateAndWrite(int fd)
             if (rec.hasData()) {
                 bool isAllZero = false;
                 if (config_.isAllZero) {
-                    isAllZero = rand.get32() % 100 < 10;
+                    isAllZero = rand.get32() % 100 < config_.allZeroPct;
                 }
                 ChecksumCalculator cc(rec.io_size, salt);
                 const uint32_t ioSizePb = rec.ioSizePb(pbs);
@@ -130,7 +138,7 @@ void WlogGenerator::generateLogpackHeader(
     const uint64_t devLb = config_.devLb;
 
     for (size_t i = 0; i < nRecords; i++) {
-        uint64_t offset = rand.get64() % devLb;
+        uint64_t offset = generateAddr(rand);
         /* Decide IO type. */
         bool isDiscard = false;
         bool isPadding = false;
@@ -140,7 +148,7 @@ void WlogGenerator::generateLogpackHeader(
             if (config_.isPadding && v < 10) {
                 isPadding = true;
                 if (v < 5) isPaddingZero = true;
-            } else if (config_.isDiscard && v < 30) {
+            } else if (config_.isDiscard && v < (config_.isPadding ? 10 : 0) + config_.discardPct) {
                 isDiscard = true;
             }
         }
@@ -161,6 +169,7 @@ void WlogGenerator::generateLogpackHeader(
         if (devLb < offset + ioSize) {
             ioSize = devLb - offset; /* clipping. */
         }
+        if (config_.addrPattern == AddrPattern::SEQUENTIAL) nextAddr_ = offset + ioSize;
         assert(0 < ioSize);
         /* Check total_io_size limitation. */
         if (0 < packH.totalIoSize() && 1 < nRecords && !isDiscard
@@ -185,4 +194,21 @@ void WlogGenerator::generateLogpackHeader(
     packH.isValid(false);
 }
 
+uint64_t WlogGenerator::generateAddr(Rand &rand)
+{
+    const uint64_t devLb = config_.devLb;
+    switch (config_.addrPattern) {
+    case AddrPattern::SEQUENTIAL:
+        if (nextAddr_ >= devLb) nextAddr_ = 0;
+        return nextAddr_;
+    case AddrPattern::HOT: {
+        const uint64_t hotLb = std::max<uint64_t>(devLb / 16, 1);
+        if (rand.get32() % 100 < 90) return rand.get64() % hotLb;
+        return rand.get64() % devLb;
+    }
+    default:
+        return rand.get64() % devLb;
+    }
+}
+
 } //namespace walb
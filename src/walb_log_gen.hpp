@@ -8,6 +8,7 @@
  */
 
 #include <vector>
+#include <string>
 #include <memory>
 #include <cassert>
 #include <cstdio>
@@ -26,6 +27,15 @@ namespace walb {
 class WlogGenerator
 {
 public:
+    /**
+     * How IO addresses are chosen.
+     * HOT: most IOs overwrite the first 1/16 of the device.
+     */
+    enum class AddrPattern : uint8_t
+    {
+        RANDOM, SEQUENTIAL, HOT,
+    };
+
     struct Config
     {
         uint64_t devLb;
@@ -42,15 +52,20 @@ public:
         bool isAllZero;
         bool isRandom;
         bool isVerbose;
+        uint32_t seed = 0; /* 0 means a random seed. */
+        AddrPattern addrPattern = AddrPattern::RANDOM;
+        uint32_t allZeroPct = 10; /* ratio of all-zero IOs [%] if isAllZero. */
+        uint32_t discardPct = 20; /* ratio of discard records [%] if isDiscard. */
 
         void check() const;
     };
 private:
     const Config& config_;
+    uint64_t nextAddr_; /* for AddrPattern::SEQUENTIAL. */
 
 public:
     WlogGenerator(const Config& config)
-        : config_(config) {
+        : config_(config), nextAddr_(0) {
     }
     void generate(int outFd) {
         generateAndWrite(outFd);
@@ -64,6 +79,25 @@ private:
      * Generate logpack header randomly.
      */
     void generateLogpackHeader(Rand &rand, LogPackHeader &packH, uint64_t lsid);
+    uint64_t generateAddr(Rand &rand);
 };
 
+inline const char *addrPatternName(WlogGenerator::AddrPattern pattern)
+{
+    switch (pattern) {
+    case WlogGenerator::AddrPattern::SEQUENTIAL: return "seq";
+    case WlogGenerator::AddrPattern::HOT: return "hot";
+    default: return "rand";
+    }
+}
+
+inline WlogGenerator::AddrPattern parseAddrPattern(const std::string &str)
+{
+    for (WlogGenerator::AddrPattern pattern : {WlogGenerator::AddrPattern::RANDOM,
+                WlogGenerator::AddrPattern::SEQUENTIAL, WlogGenerator::AddrPattern::HOT}) {
+        if (str == addrPatternName(pattern)) return pattern;
+    }
+    throw cybozu::Exception(__func__) << "bad address pattern" << str;
+}
+
 } //namespace walb
@@ -2,21 +2,34 @@
 
 namespace walb {
 
-void WlogSender::process(CompressedData& cd, bool doCompress) try
+void WlogSender::start(size_t concurrency)
 {
-    if (doCompress) cd.compress();
-    ctrl_.next();
-    cd.send(packet_);
-} catch (std::exception& e) {
-    try {
-        packet::StreamControl(packet_.sock()).error();
-    } catch (...) {}
-    logger_.error() << "WlogSender:process" << e.what();
+    if (concurrency == 0) {
+        throw cybozu::Exception(NAME()) << "concurrency must not be 0";
+    }
+    conv_.start(concurrency);
+    sender_.set([this]() { runSender(); });
+    sender_.start();
 }
 
 /**
  * Send padding IO data also so that the receiver can create wlog file for debug purpose.
  */
+void WlogSender::pushIo(const LogPackHeader &header, uint16_t recIdx, AlignedArray &&data)
+{
+    verifyPbsAndSalt(header);
+    const WlogRecord &rec = header.record(recIdx);
+    if (!rec.hasData()) return;
+
+    const size_t size = rec.ioSizePb(pbs_) * pbs_;
+    if (data.size() != size) {
+        throw cybozu::Exception(NAME()) << "invalid data size" << data.size() << size;
+    }
+    CompressedData cd;
+    cd.setUncompressed(std::move(data));
+    push(std::move(cd));
+}
+
 void WlogSender::pushIo(const LogPackHeader &header, uint16_t recIdx, const char *data)
 {
     verifyPbsAndSalt(header);
@@ -25,8 +38,52 @@ void WlogSender::pushIo(const LogPackHeader &header, uint16_t recIdx, const char
 
     const size_t size = rec.ioSizePb(pbs_) * pbs_;
     CompressedData cd;
-    cd.compressFrom(data, size);
-    process(cd, false);
+    cd.setUncompressed(data, size);
+    push(std::move(cd));
+}
+
+void WlogSender::sync()
+{
+    conv_.sync();
+    sender_.join();
+    ctrl_.end();
+}
+
+void WlogSender::fail() noexcept
+{
+    conv_.fail();
+    sender_.joinNoThrow();
+}
+
+/**
+ * If the sender thread has failed, its error will be thrown.
+ */
+void WlogSender::push(CompressedData &&cd)
+{
+    try {
+        conv_.push(std::move(cd));
+    } catch (...) {
+        sender_.join();
+        throw;
+    }
+}
+
+void WlogSender::runSender() try
+{
+    CompressedData cd;
+    while (conv_.pop(cd)) {
+        metrics::StageTimer timer(metrics_, metrics::SOCK_SEND);
+        ctrl_.next();
+        cd.send(packet_);
+        timer.record(cd.rawSize());
+    }
+} catch (std::exception& e) {
+    logger_.error() << "WlogSender:runSender" << e.what();
+    try {
+        packet::StreamControl(packet_.sock()).error();
+    } catch (...) {}
+    conv_.fail();
+    throw;
 }
 
 void WlogSender::verifyPbsAndSalt(const LogPackHeader &header) const
@@ -40,33 +97,25 @@ void WlogSender::verifyPbsAndSalt(const LogPackHeader &header) const
 }
 
 
-bool WlogReceiver::process(CompressedData& cd)
+void WlogReceiver::start(size_t concurrency)
 {
-    if (ctrl_.isNext()) {
-        cd.recv(packet_);
-        cd.uncompress();
-        ctrl_.reset();
-        return true;
+    if (concurrency == 0) {
+        throw cybozu::Exception(NAME()) << "concurrency must not be 0";
     }
-    if (ctrl_.isError()) {
-        throw cybozu::Exception("WlogReceiver:process:isError");
-    }
-    return false;
+    conv_.start(concurrency);
+    receiver_.set([this]() { runReceiver(); });
+    receiver_.start();
 }
 
 bool WlogReceiver::popHeader(LogPackHeader &header)
 {
     const char *const FUNC = __func__;
-    CompressedData cd;
-    if (!process(cd)) {
-        return false;
+    Frame frame;
+    if (!pop(frame)) return false;
+    if (!frame.isHeader) {
+        throw cybozu::Exception(FUNC) << "not pack header";
     }
-    assert(!cd.isCompressed());
-    if (cd.rawSize() != pbs_) {
-        throw cybozu::Exception(FUNC) << "invalid pack header size" << cd.rawSize() << pbs_;
-    }
-    header.copyFrom(cd.rawData(), pbs_);
-    if (header.isEnd()) throw cybozu::Exception(FUNC) << "end header is not permitted";
+    header.copyFrom(frame.cd.rawData(), pbs_);
     return true;
 }
 
@@ -78,19 +127,110 @@ void WlogReceiver::popIo(const WlogRecord &rec, AlignedArray &data)
     data.clear();
     if (!rec.hasData()) return;
 
-    CompressedData cd;
-    if (!process(cd)) {
+    Frame frame;
+    if (!pop(frame)) {
         throw cybozu::Exception("WlogReceiver:popIo:failed") << rec;
     }
-    assert(!cd.isCompressed());
-    cd.moveTo(data);
+    if (frame.isHeader || frame.rec.lsid != rec.lsid) {
+        throw cybozu::Exception("WlogReceiver:popIo:not IO data") << rec;
+    }
+    frame.cd.moveTo(data);
+}
+
+void WlogReceiver::fail() noexcept
+{
+    conv_.fail();
+    receiver_.joinNoThrow();
+}
+
+bool WlogReceiver::recv(CompressedData &cd)
+{
+    metrics::StageTimer timer(metrics_, metrics::SOCK_RECV);
+    if (ctrl_.isNext()) {
+        cd.recv(packet_);
+        ctrl_.reset();
+        timer.record(cd.rawSize());
+        return true;
+    }
+    if (ctrl_.isError()) {
+        throw cybozu::Exception("WlogReceiver:recv:isError");
+    }
+    return false;
+}
+
+/**
+ * This is called by worker threads.
+ */
+void WlogReceiver::convert(Frame &frame) const
+{
+    metrics::StageTimer timer(metrics_, metrics::UNCOMPRESS);
+    frame.cd.uncompress();
+    timer.record(frame.cd.rawSize());
+    if (frame.isHeader) return;
+
+    const WlogRecord &rec = frame.rec;
+    const size_t ioSizePb = rec.ioSizePb(pbs_);
+    if (frame.cd.rawSize() != ioSizePb * pbs_) {
+        throw cybozu::Exception("WlogReceiver:convert:invalid IO size")
+            << rec << frame.cd.rawSize() << ioSizePb * pbs_;
+    }
     if (!rec.hasDataForChecksum()) return;
 
     const size_t ioSizeB = rec.ioSizeLb() * LBS;
-    const uint32_t csum = cybozu::util::calcChecksum(data.data(), ioSizeB, salt_);
+    const uint32_t csum = cybozu::util::calcChecksum(frame.cd.rawData(), ioSizeB, salt_);
     if (csum != rec.checksum) {
-        throw cybozu::Exception("WlogReceiver:popIo:invalid checksum") << rec << salt_ << csum;
+        throw cybozu::Exception("WlogReceiver:convert:invalid checksum") << rec << salt_ << csum;
+    }
+}
+
+/**
+ * If the receiver thread has failed, its error will be thrown.
+ */
+bool WlogReceiver::pop(Frame &frame)
+{
+    try {
+        return conv_.pop(frame);
+    } catch (...) {
+        receiver_.join();
+        throw;
+    }
+}
+
+/**
+ * Pack headers are uncompressed here
+ * because their records are required to receive the following IOs.
+ */
+void WlogReceiver::runReceiver() try
+{
+    const char *const FUNC = __func__;
+    LogPackHeader packH(pbs_, salt_);
+    for (;;) {
+        Frame frame;
+        if (!recv(frame.cd)) break;
+        frame.cd.uncompress();
+        if (frame.cd.rawSize() != pbs_) {
+            throw cybozu::Exception(FUNC) << "invalid pack header size" << frame.cd.rawSize() << pbs_;
+        }
+        packH.copyFrom(frame.cd.rawData(), pbs_);
+        if (packH.isEnd()) throw cybozu::Exception(FUNC) << "end header is not permitted";
+        frame.isHeader = true;
+        conv_.push(std::move(frame));
+        for (size_t i = 0; i < packH.nRecords(); i++) {
+            const WlogRecord &rec = packH.record(i);
+            if (!rec.hasData()) continue;
+            Frame ioFrame;
+            if (!recv(ioFrame.cd)) {
+                throw cybozu::Exception(FUNC) << "IO data not found" << rec;
+            }
+            ioFrame.rec = rec;
+            ioFrame.isHeader = false;
+            conv_.push(std::move(ioFrame));
+        }
     }
+    conv_.sync();
+} catch (...) {
+    conv_.fail();
+    throw;
 }
 
 } //namespace walb
@@ -13,6 +13,8 @@
 #include "walb_log_file.hpp"
 #include "compressed_data.hpp"
 #include "walb_logger.hpp"
+#include "thread_util.hpp"
+#include "metrics.hpp"
 
 namespace walb {
 
@@ -22,27 +24,54 @@ constexpr size_t Q_SIZE = 16;
  * Walb log sender via TCP/IP connection.
  * This will send packets only, never receive packets.
  *
+ * Pushed data are compressed by worker threads in parallel,
+ * and sent by a sender thread in the pushed order.
+ * So reading logpacks, compressing and sending will be pipelined.
+ *
  * Usage:
- *   (1) call setParams() to set parameters.
- *   (2) call start() to start worker threads.
- *   (3) call pushHeader() and corresponding pushIo() multiple times.
- *   (4) repeat (3).
- *   (5) call sync() for normal finish, or fail().
+ *   (1) call start() to start worker threads.
+ *   (2) call pushHeader() and corresponding pushIo() multiple times.
+ *   (3) repeat (2).
+ *   (4) call sync() for normal finish, or fail().
  */
 class WlogSender
 {
 private:
+    using Converter = cybozu::thread::ParallelConverter<CompressedData, CompressedData>;
+
     packet::Packet packet_;
     packet::StreamControl ctrl_;
     Logger &logger_;
     uint32_t pbs_;
     uint32_t salt_;
+    metrics::VolMetrics *metrics_;
+    Converter conv_;
+    cybozu::thread::ThreadRunner sender_;
 public:
     static constexpr const char *NAME() { return "WlogSender"; }
     WlogSender(cybozu::Socket &sock, Logger &logger, uint32_t pbs, uint32_t salt)
-        : packet_(sock), ctrl_(sock), logger_(logger), pbs_(pbs), salt_(salt) {
+        : packet_(sock), ctrl_(sock), logger_(logger), pbs_(pbs), salt_(salt)
+        , metrics_(nullptr)
+        , conv_([this](CompressedData &&cd) {
+                metrics::StageTimer timer(metrics_, metrics::COMPRESS);
+                cd.compress();
+                timer.record(cd.originalSize());
+                return std::move(cd);
+            })
+        , sender_() {
+    }
+    ~WlogSender() noexcept {
+        fail();
     }
-    void process(CompressedData& cd, bool doCompress);
+    /**
+     * Record compression and socket send time to the metrics.
+     * Call this before start().
+     */
+    void setMetrics(metrics::VolMetrics *metrics) { metrics_ = metrics; }
+    /**
+     * @concurrency number of compression threads. It must be > 0.
+     */
+    void start(size_t concurrency = 1);
 
     /**
      * You must call pushHeader(h) and n times of pushIo(),
@@ -52,46 +81,87 @@ public:
         verifyPbsAndSalt(header);
         CompressedData cd;
         cd.setUncompressed(header.rawData(), pbs_);
-        process(cd, true);
+        push(std::move(cd));
     }
     /**
      * You must call this for discard/padding record also.
+     * data size must be rec.ioSizePb(pbs) * pbs.
      */
+    void pushIo(const LogPackHeader &header, uint16_t recIdx, AlignedArray &&data);
     void pushIo(const LogPackHeader &header, uint16_t recIdx, const char *data);
 
     /**
      * Notify the end of input.
+     * This will wait for all the pushed data to be sent.
      */
-    void sync() {
-        ctrl_.end();
-    }
+    void sync();
+    /**
+     * Stop all the threads without sending remaining data.
+     */
+    void fail() noexcept;
 private:
     void verifyPbsAndSalt(const LogPackHeader &header) const;
+    void push(CompressedData &&cd);
+    void runSender();
 };
 
 /**
  * Walb log receiver via TCP/IP connection.
  *
+ * A receiver thread reads packets from the socket,
+ * worker threads uncompress them and verify checksums of IOs in parallel,
+ * and the caller pops them in the received order.
+ *
  * Usage:
- *   (1) call setParams() to set parameters.
- *   (2) call start() to start worker threads.
- *   (3) call popHeader() and corresponding popIo() multiple times.
- *   (4) repeat (3) while popHeader() returns true.
+ *   (1) call start() to start worker threads.
+ *   (2) call popHeader() and corresponding popIo() multiple times.
+ *   (3) repeat (2) while popHeader() returns true.
  *   popHeader() will throw an error if something is wrong.
  */
 class WlogReceiver
 {
 private:
+    /**
+     * A received packet.
+     * rec is valid only when isHeader is false.
+     */
+    struct Frame {
+        CompressedData cd;
+        WlogRecord rec;
+        bool isHeader;
+    };
+    using Converter = cybozu::thread::ParallelConverter<Frame, Frame>;
+
     packet::Packet packet_;
     packet::StreamControl ctrl_;
     uint32_t pbs_;
     uint32_t salt_;
+    metrics::VolMetrics *metrics_;
+    Converter conv_;
+    cybozu::thread::ThreadRunner receiver_;
 public:
     static constexpr const char *NAME() { return "WlogReceiver"; }
     WlogReceiver(cybozu::Socket &sock, uint32_t pbs, uint32_t salt)
-        : packet_(sock), ctrl_(sock), pbs_(pbs), salt_(salt) {
+        : packet_(sock), ctrl_(sock), pbs_(pbs), salt_(salt)
+        , metrics_(nullptr)
+        , conv_([this](Frame &&frame) {
+                convert(frame);
+                return std::move(frame);
+            })
+        , receiver_() {
     }
-    bool process(CompressedData& cd);
+    ~WlogReceiver() noexcept {
+        fail();
+    }
+    /**
+     * Record socket receive and uncompression time to the metrics.
+     * Call this before start().
+     */
+    void setMetrics(metrics::VolMetrics *metrics) { metrics_ = metrics; }
+    /**
+     * @concurrency number of uncompression threads. It must be > 0.
+     */
+    void start(size_t concurrency = 1);
 
     /**
      * You must call popHeader(h) and its corresponding popIo() n times,
@@ -107,6 +177,16 @@ public:
      * You must call this for discard/padding record also.
      */
     void popIo(const WlogRecord &rec, AlignedArray &data);
+
+    /**
+     * Stop all the threads.
+     */
+    void fail() noexcept;
+private:
+    bool recv(CompressedData &cd);
+    void convert(Frame &frame) const;
+    bool pop(Frame &frame);
+    void runReceiver();
 };
 
 } //namespace walb
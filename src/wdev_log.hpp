@@ -303,6 +303,7 @@ public:
         verifyMultiple(maxIoSize_, pbs_, "bad maxIoSize");
         super_.read(file_.fd());
         ringBuf_.init(bufferSize);
+        aio_.registerBuffer(ringBuf_.getBuffer().data(), bufferSize);
     }
     AsyncWldevReader(const std::string &wldevPath,
                      size_t bufferSize = DEFAULT_BUFFER_SIZE,
@@ -5,14 +5,17 @@ namespace walb {
 bool wdiffTransferClient(
     packet::Packet &pkt, DiffMerger &merger, const CompressOpt &cmpr,
     const std::atomic<int> &stopState, const ProcessStatus &ps,
-    DiffStatistics &statOut)
+    DiffStatistics &statOut, metrics::VolMetrics *metrics)
 {
     const size_t maxPushedNum = cmpr.numCpu * 2 + 1;
     ConverterQueue conv(maxPushedNum, cmpr.numCpu, true, cmpr.type, cmpr.level);
     statOut.clear();
     statOut.wdiffNr = -1;
     packet::StreamControl ctrl(pkt.sock());
+    metrics::StageTimer mergeTimer(metrics, metrics::MERGE);
+    metrics::StageTimer cmprTimer(metrics, metrics::COMPRESS);
 
+    const uint64_t startAddr = merger.getStartAddr();
     DiffRecIo recIo;
     DiffPacker packer;
     size_t pushedNum = 0;
@@ -20,23 +23,39 @@ bool wdiffTransferClient(
         if (stopState == ForceStopping || ps.isForceShutdown()) {
             return false;
         }
+        if (recIo.record().io_address < startAddr) {
+            const uint64_t endAddr = recIo.record().endIoAddress();
+            if (endAddr <= startAddr) continue;
+            recIo = recIo.slice(startAddr, endAddr - startAddr);
+        }
         const DiffRecord& rec = recIo.record();
-        const AlignedArray& buf = recIo.io();
-        if (packer.add(rec, buf.data())) continue;
-        conv.push(packer.getPackAsArray());
+        if (packer.add(rec, recIo.data())) continue;
+        AlignedArray pack = packer.getPackAsArray();
+        mergeTimer.record(pack.size());
+        conv.push(std::move(pack));
         pushedNum++;
         packer.clear();
-        packer.add(rec, buf.data());
-        if (pushedNum < maxPushedNum) continue;
-        wdiff_transfer_local::sendPack(pkt, ctrl, statOut, conv.pop());
+        packer.add(rec, recIo.data());
+        if (pushedNum < maxPushedNum) {
+            mergeTimer.reset();
+            continue;
+        }
+        cmprTimer.reset();
+        const compressor::Buffer cpack = conv.pop();
+        cmprTimer.record(cpack.size());
+        wdiff_transfer_local::sendPack(pkt, ctrl, statOut, cpack, metrics);
         pushedNum--;
+        mergeTimer.reset();
     }
     if (!packer.empty()) {
         conv.push(packer.getPackAsArray());
     }
     conv.quit();
+    cmprTimer.reset();
     for (compressor::Buffer pack = conv.pop(); !pack.empty(); pack = conv.pop()) {
-        wdiff_transfer_local::sendPack(pkt, ctrl, statOut, pack);
+        cmprTimer.record(pack.size());
+        wdiff_transfer_local::sendPack(pkt, ctrl, statOut, pack, metrics);
+        cmprTimer.reset();
     }
     ctrl.end();
     pkt.flush();
@@ -88,10 +107,10 @@ static bool indexedWdiffTransferNoMergeClient(
     DiffStatistics statOut;
 
     IndexedDiffRecord irec;
-    AlignedArray data;
+    IndexedDiffReader::IoView view;
     DiffPacker packer;
     size_t pushedNum = 0;
-    while (reader.readDiff(irec, data)) {
+    while (reader.readDiff(irec, view)) {
         if (stopState == ForceStopping || ps.isForceShutdown()) {
             return false;
         }
@@ -105,7 +124,7 @@ static bool indexedWdiffTransferNoMergeClient(
             rec.data_offset = 0; // updated later.
             rec.data_size = irec.io_blocks * LOGICAL_BLOCK_SIZE;
             rec.checksum = irec.io_checksum;
-            dataPtr = data.data() + (irec.io_offset * LOGICAL_BLOCK_SIZE);
+            dataPtr = view.data;
         }
 
         if (packer.add(rec, dataPtr)) continue;
@@ -148,15 +167,215 @@ bool wdiffTransferNoMergeClient(
 }
 
 
+namespace wdiff_transfer_local {
+
+/**
+ * Send packs keeping their order where only some of them must be compressed.
+ */
+class PassThroughSender
+{
+    packet::Packet &pkt_;
+    packet::StreamControl ctrl_;
+    DiffStatistics &statOut_;
+    metrics::VolMetrics *metrics_;
+    const size_t maxPushedNum_;
+    ConverterQueue conv_;
+    size_t pushedNum_;
+public:
+    PassThroughSender(packet::Packet &pkt, const CompressOpt &cmpr, DiffStatistics &statOut,
+                      metrics::VolMetrics *metrics)
+        : pkt_(pkt), ctrl_(pkt.sock()), statOut_(statOut), metrics_(metrics)
+        , maxPushedNum_(cmpr.numCpu * 2 + 1)
+        , conv_(maxPushedNum_, cmpr.numCpu, true, cmpr.type, cmpr.level)
+        , pushedNum_(0) {
+    }
+    void pushToCompress(AlignedArray &&pack) {
+        conv_.push(std::move(pack));
+        pushedNum_++;
+        if (pushedNum_ < maxPushedNum_) return;
+        sendPack(pkt_, ctrl_, statOut_, conv_.pop(), metrics_);
+        pushedNum_--;
+    }
+    /**
+     * writeData() must write packH.total_size bytes to the packet.
+     */
+    template <typename WriteData>
+    void sendAsIs(const DiffPackHeader &packH, WriteData writeData) {
+        while (pushedNum_ > 0) {
+            sendPack(pkt_, ctrl_, statOut_, conv_.pop(), metrics_);
+            pushedNum_--;
+        }
+        metrics::StageTimer timer(metrics_, metrics::SOCK_SEND);
+        ctrl_.next();
+        pkt_.write<size_t>(WALB_DIFF_PACK_SIZE + packH.total_size);
+        pkt_.write(packH.data(), WALB_DIFF_PACK_SIZE);
+        writeData();
+        timer.record(WALB_DIFF_PACK_SIZE + packH.total_size);
+        statOut_.update(packH);
+    }
+    void end() {
+        conv_.quit();
+        for (compressor::Buffer pack = conv_.pop(); !pack.empty(); pack = conv_.pop()) {
+            sendPack(pkt_, ctrl_, statOut_, pack, metrics_);
+        }
+        ctrl_.end();
+        pkt_.flush();
+    }
+};
+
+inline bool isPackCompressedWith(const DiffPackHeader &packH, int type)
+{
+    for (size_t i = 0; i < packH.n_records; i++) {
+        const DiffRecord &rec = packH[i];
+        if (rec.isNormal() && rec.compression_type != type) return false;
+    }
+    return true;
+}
+
+} // namespace wdiff_transfer_local
+
+
+static bool sortedWdiffPassThroughClient(
+    packet::Packet &pkt, cybozu::util::File &fileR, const CompressOpt &cmpr,
+    const std::atomic<int> &stopState, const ProcessStatus &ps, DiffStatistics &statOut,
+    metrics::VolMetrics *metrics)
+{
+    wdiff_transfer_local::PassThroughSender sender(pkt, cmpr, statOut, metrics);
+    AlignedArray packHBuf(WALB_DIFF_PACK_SIZE);
+    DiffPackHeader &packH = *reinterpret_cast<DiffPackHeader *>(packHBuf.data());
+    AlignedArray pack;
+    for (;;) {
+        if (stopState == ForceStopping || ps.isForceShutdown()) {
+            return false;
+        }
+        try {
+            packH.readFrom(fileR);
+        } catch (cybozu::util::EofError &) {
+            packH.setEnd();
+        }
+        if (packH.isEnd()) break;
+        pack.resize(WALB_DIFF_PACK_SIZE + packH.total_size);
+        ::memcpy(pack.data(), packHBuf.data(), packHBuf.size());
+        fileR.read(pack.data() + WALB_DIFF_PACK_SIZE, packH.total_size);
+        verifyDiffPack(pack.data(), pack.size(), true);
+        if (wdiff_transfer_local::isPackCompressedWith(packH, cmpr.type)) {
+            sender.sendAsIs(packH, [&]() {
+                    pkt.write(pack.data() + WALB_DIFF_PACK_SIZE, packH.total_size);
+                });
+        } else {
+            sender.pushToCompress(std::move(pack));
+            pack = AlignedArray();
+        }
+    }
+    sender.end();
+    return true;
+}
+
+
+/**
+ * IO data which need not be compressed are written to the socket
+ * from the mmapped file directly without copying them to a pack buffer.
+ */
+static bool indexedWdiffPassThroughClient(
+    packet::Packet &pkt, IndexedDiffReader &reader, const CompressOpt &cmpr,
+    const std::atomic<int> &stopState, const ProcessStatus &ps, DiffStatistics &statOut,
+    metrics::VolMetrics *metrics)
+{
+    wdiff_transfer_local::PassThroughSender sender(pkt, cmpr, statOut, metrics);
+    AlignedArray packHBuf(WALB_DIFF_PACK_SIZE);
+    DiffPackHeader &packH = *reinterpret_cast<DiffPackHeader *>(packHBuf.data());
+    packH.clear();
+    std::vector<IndexedDiffReader::IoView> viewV;
+    bool isAsIs = true;
+
+    auto flushPack = [&]() {
+        if (packH.n_records == 0) return;
+        packH.updateChecksum();
+        if (isAsIs) {
+            sender.sendAsIs(packH, [&]() {
+                    for (const IndexedDiffReader::IoView &view : viewV) {
+                        if (view.size > 0) pkt.write(view.data, view.size);
+                    }
+                });
+        } else {
+            AlignedArray pack(WALB_DIFF_PACK_SIZE + packH.total_size, false);
+            ::memcpy(pack.data(), packHBuf.data(), packHBuf.size());
+            for (size_t i = 0; i < viewV.size(); i++) {
+                if (viewV[i].size == 0) continue;
+                ::memcpy(pack.data() + WALB_DIFF_PACK_SIZE + packH[i].data_offset, viewV[i].data, viewV[i].size);
+            }
+            sender.pushToCompress(std::move(pack));
+        }
+        packH.clear();
+        viewV.clear();
+        isAsIs = true;
+    };
+
+    IndexedDiffRecord irec;
+    while (reader.readDiffRecord(irec)) {
+        if (stopState == ForceStopping || ps.isForceShutdown()) {
+            return false;
+        }
+        DiffRecord rec;
+        rec.io_address = irec.io_address;
+        rec.io_blocks = irec.io_blocks;
+        rec.flags = irec.flags;
+        IndexedDiffReader::IoView view;
+        if (irec.isNormal()) {
+            if (irec.compression_type == cmpr.type && reader.getStoredIoView(irec, view)) {
+                rec.compression_type = irec.compression_type;
+                rec.data_size = irec.data_size;
+                rec.checksum = irec.io_checksum;
+            } else {
+                reader.getDiffIoView(irec, view);
+                rec.compression_type = ::WALB_DIFF_CMPR_NONE;
+                rec.data_size = view.size;
+                rec.checksum = 0; // calculated by the compressor.
+                isAsIs = false;
+            }
+        }
+        if (!packH.canAdd(rec.data_size)) flushPack();
+        if (!packH.add(rec)) {
+            throw cybozu::Exception(__func__) << "BUG: could not add a record" << rec;
+        }
+        viewV.push_back(std::move(view));
+    }
+    flushPack();
+    sender.end();
+    return true;
+}
+
+
+bool wdiffTransferPassThroughClient(
+    packet::Packet &pkt, cybozu::util::File &fileR, const DiffFileHeader &fileH,
+    const CompressOpt &cmpr, const std::atomic<int> &stopState, const ProcessStatus &ps,
+    DiffStatistics &statOut, metrics::VolMetrics *metrics)
+{
+    statOut.clear();
+    statOut.wdiffNr = 1;
+    if (fileH.isIndexed()) {
+        IndexedDiffReader reader;
+        IndexedDiffCache cache; // for IOs partially overwritten only.
+        cache.setMaxSize(INDEXED_DIFF_CACHE_SIZE);
+        reader.setFile(std::move(fileR), cache);
+        return indexedWdiffPassThroughClient(pkt, reader, cmpr, stopState, ps, statOut, metrics);
+    } else {
+        return sortedWdiffPassThroughClient(pkt, fileR, cmpr, stopState, ps, statOut, metrics);
+    }
+}
+
+
 bool wdiffTransferServer(
     packet::Packet &pkt, int wdiffOutFd,
-    const std::atomic<int> &stopState, const ProcessStatus &ps, uint64_t fsyncIntervalSize)
+    const std::atomic<int> &stopState, const ProcessStatus &ps, uint64_t fsyncIntervalSize,
+    metrics::VolMetrics *metrics)
 {
     const char *const FUNC = __func__;
     cybozu::util::File fileW(wdiffOutFd);
     AlignedArray buf;
     packet::StreamControl ctrl(pkt.sock());
     uint64_t writeSize = 0;
+    metrics::StageTimer recvTimer(metrics, metrics::SOCK_RECV);
     while (ctrl.isNext()) {
         if (stopState == ForceStopping || ps.isForceShutdown()) {
             return false;
@@ -166,14 +385,18 @@ bool wdiffTransferServer(
         verifyDiffPackSize(size, FUNC);
         buf.resize(size);
         pkt.read(buf.data(), buf.size());
+        recvTimer.record(buf.size());
         verifyDiffPack(buf.data(), buf.size(), true);
         fileW.write(buf.data(), buf.size());
         writeSize += buf.size();
         if (writeSize >= fsyncIntervalSize) {
+            metrics::StageTimer fsyncTimer(metrics, metrics::FSYNC);
             fileW.fdatasync();
+            fsyncTimer.record(writeSize);
             writeSize = 0;
         }
         ctrl.reset();
+        recvTimer.reset();
     }
     if (!ctrl.isEnd()) {
         throw cybozu::Exception(FUNC) << "bad ctrl not end";
@@ -182,4 +405,37 @@ bool wdiffTransferServer(
     return true;
 }
 
+bool wdiffTransferServer(
+    packet::Packet &pkt, IndexedDiffStreamWriter &writer,
+    const std::atomic<int> &stopState, const ProcessStatus &ps)
+{
+    const char *const FUNC = __func__;
+    AlignedArray buf;
+    packet::StreamControl ctrl(pkt.sock());
+    try {
+        while (ctrl.isNext()) {
+            if (stopState == ForceStopping || ps.isForceShutdown()) {
+                writer.fail();
+                return false;
+            }
+            size_t size;
+            pkt.read(size);
+            verifyDiffPackSize(size, FUNC);
+            buf.resize(size);
+            pkt.read(buf.data(), buf.size());
+            verifyDiffPack(buf.data(), buf.size(), true);
+            writer.addPack(buf.data(), buf.size());
+            ctrl.reset();
+        }
+        if (!ctrl.isEnd()) {
+            throw cybozu::Exception(FUNC) << "bad ctrl not end";
+        }
+        writer.finalize();
+    } catch (...) {
+        writer.fail();
+        throw;
+    }
+    return true;
+}
+
 } // namespace walb
@@ -4,32 +4,41 @@
 #include "walb_diff_merge.hpp"
 #include "walb_diff_compressor.hpp"
 #include "walb_diff_pack.hpp"
+#include "walb_diff_stream.hpp"
 #include "server_util.hpp"
 #include "host_info.hpp"
+#include "metrics.hpp"
 
 namespace walb {
 
 namespace wdiff_transfer_local {
 
 template <typename Buffer>
-inline void sendPack(packet::Packet& pkt, packet::StreamControl& ctrl, DiffStatistics& statOut, const Buffer& pack)
+inline void sendPack(packet::Packet& pkt, packet::StreamControl& ctrl, DiffStatistics& statOut, const Buffer& pack,
+                     metrics::VolMetrics *metrics = nullptr)
 {
+    metrics::StageTimer timer(metrics, metrics::SOCK_SEND);
     ctrl.next();
     pkt.write<size_t>(pack.size());
     pkt.write(pack.data(), pack.size());
+    timer.record(pack.size());
     statOut.update(*reinterpret_cast<const DiffPackHeader*>(pack.data()));
 }
 
 } // namespace wdiff_transfer_local
 
 /**
+ * IOs before merger.getStartAddr() will not be sent
+ * so that the receiver can resume a broken transfer.
+ * Merge, compression wait and socket send time will be recorded to metrics if not null.
+ *
  * RETURN:
  *   false if force stopped.
  */
 bool wdiffTransferClient(
     packet::Packet &pkt, DiffMerger &merger, const CompressOpt &cmpr,
     const std::atomic<int> &stopState, const ProcessStatus &ps,
-    DiffStatistics &statOut);
+    DiffStatistics &statOut, metrics::VolMetrics *metrics = nullptr);
 
 /**
  * fileH: the position must be the first pack header.
@@ -38,14 +47,43 @@ bool wdiffTransferNoMergeClient(
     packet::Packet &pkt, cybozu::util::File &fileR, const DiffFileHeader &fileH,
     const std::atomic<int> &stopState, const ProcessStatus &ps);
 
+/**
+ * Send a single wdiff without merging it.
+ * IO data already compressed with cmpr.type are sent as they are,
+ * directly from the mmapped file in the indexed format.
+ * Only packs containing other IOs are compressed again.
+ *
+ * fileH: the position must be the first pack header.
+ * RETURN:
+ *   false if force stopped.
+ */
+bool wdiffTransferPassThroughClient(
+    packet::Packet &pkt, cybozu::util::File &fileR, const DiffFileHeader &fileH,
+    const CompressOpt &cmpr, const std::atomic<int> &stopState, const ProcessStatus &ps,
+    DiffStatistics &statOut, metrics::VolMetrics *metrics = nullptr);
+
 /**
  * Wdiff header must have been written already before calling this.
+ * Socket receive and fsync time will be recorded to metrics if not null.
  *
  * RETURN:
  *   false if force stopped.
  */
 bool wdiffTransferServer(
     packet::Packet &pkt, int wdiffOutFd,
-    const std::atomic<int> &stopState, const ProcessStatus &ps, uint64_t fsyncIntervalSize);
+    const std::atomic<int> &stopState, const ProcessStatus &ps, uint64_t fsyncIntervalSize,
+    metrics::VolMetrics *metrics = nullptr);
+
+/**
+ * Indexed version of wdiffTransferServer().
+ * Received packs will be stored through the writer,
+ * which must have been started. It will be finalized inside.
+ *
+ * RETURN:
+ *   false if force stopped.
+ */
+bool wdiffTransferServer(
+    packet::Packet &pkt, IndexedDiffStreamWriter &writer,
+    const std::atomic<int> &stopState, const ProcessStatus &ps);
 
 } // namespace walb
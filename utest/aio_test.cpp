@@ -264,3 +264,40 @@ CYBOZU_TEST_AUTO(testAioWaitOne)
     std::sort(s1.begin(), s1.end());
     CYBOZU_TEST_ASSERT(s0 == s1);
 }
+
+CYBOZU_TEST_AUTO(testAioRegisteredBuffer)
+{
+    cybozu::TmpFile tmpF = prepareTmpFile(128);
+    Aio aio(tmpF.fd(), 8);
+
+    AArray v0(LBS * 128);
+    AArray v1(LBS * 128);
+    fillArray(v0);
+    /* IOs out of registered buffers must also work. */
+    aio.registerBuffer(v1.data(), v1.size());
+    writeArray(aio, v0);
+    readArray(aio, v1);
+    CYBOZU_TEST_EQUAL(::memcmp(v0.data(), v1.data(), v0.size()), 0);
+}
+
+CYBOZU_TEST_AUTO(testAioStaleKey)
+{
+    cybozu::TmpFile tmpF = prepareTmpFile(128);
+    Aio aio(tmpF.fd(), 8);
+
+    AArray v0(LBS);
+    const uint32_t key = aio.prepareRead(0, LBS, v0.data());
+    CYBOZU_TEST_ASSERT(key != 0);
+    aio.submit();
+    aio.waitFor(key);
+    CYBOZU_TEST_EXCEPTION(aio.waitFor(key), std::exception);
+
+    /* The same slot will be reused with another key. */
+    const uint32_t key1 = aio.prepareRead(0, LBS, v0.data());
+    CYBOZU_TEST_ASSERT(key1 != 0);
+    CYBOZU_TEST_ASSERT(key1 != key);
+    aio.submit();
+    CYBOZU_TEST_EXCEPTION(aio.waitFor(key), std::exception);
+    aio.waitFor(key1);
+    CYBOZU_TEST_ASSERT(aio.empty());
+}
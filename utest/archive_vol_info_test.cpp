@@ -0,0 +1,120 @@
+#include "cybozu/test.hpp"
+#include "archive_vol_info.hpp"
+#include "walb_diff_file.hpp"
+#include "random.hpp"
+
+using namespace walb;
+
+cybozu::util::Random<size_t> g_rand;
+
+/**
+ * Append a pack of random normal IOs beginning at addr.
+ * RETURN:
+ *   end address of the last IO.
+ */
+uint64_t appendPack(cybozu::util::File &file, uint64_t addr, size_t nr, bool isPartial = false)
+{
+    DiffPacker packer;
+    for (size_t i = 0; i < nr; i++) {
+        const uint32_t blks = g_rand() % 16 + 1;
+        AlignedArray data(blks * LOGICAL_BLOCK_SIZE);
+        g_rand.fill(data.data(), data.size());
+        DiffRecord rec;
+        rec.io_address = addr;
+        rec.io_blocks = blks;
+        rec.setNormal();
+        rec.data_size = data.size();
+        rec.checksum = calcDiffIoChecksum(data);
+        CYBOZU_TEST_ASSERT(packer.add(rec, data.data()));
+        addr += blks + g_rand() % 4;
+    }
+    const AlignedArray pack = packer.getPackAsArray();
+    const DiffPackHeader &packH = *(const DiffPackHeader *)pack.data();
+    file.write(pack.data(), isPartial ? pack.size() / 2 : pack.size());
+    return packH[packH.n_records - 1].endIoAddress();
+}
+
+uint64_t getFileSize(const cybozu::FilePath &path)
+{
+    return path.stat().size();
+}
+
+CYBOZU_TEST_AUTO(PartialWdiffResume)
+{
+    const cybozu::FilePath baseDir("archive_vol_info_test_dir");
+    if (baseDir.stat().exists()) CYBOZU_TEST_ASSERT(baseDir.rmdirRecursive());
+    CYBOZU_TEST_ASSERT(baseDir.mkdir());
+    MetaDiffManager diffMgr;
+    VolLvCache lvC;
+    ArchiveVolInfo volInfo(baseDir.str(), "vol0", "vg0", "", diffMgr, lvC);
+    volInfo.init();
+    const cybozu::FilePath path = volInfo.getPartialWdiffPath();
+    const uint64_t headerSize = DiffFileHeader().getSize();
+
+    const MetaDiff diff(0, 10, false, 12345);
+    cybozu::Uuid uuid;
+    uuid.setRand(g_rand);
+
+    /* The first transfer. */
+    uint64_t endAddr;
+    {
+        cybozu::util::File fileW;
+        CYBOZU_TEST_EQUAL(volInfo.initPartialWdiffResume(diff, uuid, fileW), 0u);
+        CYBOZU_TEST_EQUAL(getFileSize(path), headerSize);
+        uint64_t addr = 0;
+        for (size_t i = 0; i < 3; i++) {
+            addr = appendPack(fileW, addr, 10);
+        }
+        endAddr = addr;
+        appendPack(fileW, addr + 1, 10, true);
+    }
+    const uint64_t validSize = getFileSize(path);
+
+    /* Resume after the last complete pack. */
+    {
+        cybozu::util::File fileW;
+        CYBOZU_TEST_EQUAL(volInfo.initPartialWdiffResume(diff, uuid, fileW), endAddr);
+        const uint64_t off = fileW.lseek(0, SEEK_CUR);
+        CYBOZU_TEST_ASSERT(off < validSize);
+        CYBOZU_TEST_EQUAL(getFileSize(path), off);
+        endAddr = appendPack(fileW, endAddr, 10);
+    }
+    {
+        cybozu::util::File fileW;
+        CYBOZU_TEST_EQUAL(volInfo.initPartialWdiffResume(diff, uuid, fileW), endAddr);
+    }
+
+    /* Restart due to different uuid or diff. */
+    cybozu::Uuid uuid2;
+    uuid2.setRand(g_rand);
+    {
+        cybozu::util::File fileW;
+        CYBOZU_TEST_EQUAL(volInfo.initPartialWdiffResume(diff, uuid2, fileW), 0u);
+        CYBOZU_TEST_EQUAL(getFileSize(path), headerSize);
+        appendPack(fileW, 0, 10);
+    }
+    {
+        const MetaDiff diff2(0, 11, false, 12345);
+        cybozu::util::File fileW;
+        CYBOZU_TEST_EQUAL(volInfo.initPartialWdiffResume(diff2, uuid2, fileW), 0u);
+        CYBOZU_TEST_EQUAL(getFileSize(path), headerSize);
+        appendPack(fileW, 0, 10);
+    }
+
+    /* Restart due to no valid pack. */
+    {
+        cybozu::util::File fileW(path.str(), O_RDWR);
+        fileW.ftruncate(headerSize + 1);
+    }
+    {
+        const MetaDiff diff2(0, 11, false, 12345);
+        cybozu::util::File fileW;
+        CYBOZU_TEST_EQUAL(volInfo.initPartialWdiffResume(diff2, uuid2, fileW), 0u);
+        CYBOZU_TEST_EQUAL(getFileSize(path), headerSize);
+    }
+
+    volInfo.removePartialWdiff();
+    CYBOZU_TEST_ASSERT(!path.stat().exists());
+    CYBOZU_TEST_ASSERT(!volInfo.getPartialWdiffStateFilePath().stat().exists());
+    CYBOZU_TEST_ASSERT(baseDir.rmdirRecursive());
+}
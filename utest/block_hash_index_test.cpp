@@ -0,0 +1,106 @@
+#include "cybozu/test.hpp"
+#include "block_hash_index.hpp"
+#include "tmp_file.hpp"
+#include "random.hpp"
+
+using namespace walb;
+
+struct Image
+{
+    cybozu::TmpFile tmpF;
+    cybozu::util::File file;
+    std::vector<char> data;
+
+    explicit Image(uint64_t sizeLb)
+        : tmpF("."), file(tmpF.fd()), data(sizeLb * LOGICAL_BLOCK_SIZE) {
+        cybozu::util::Random<size_t> rand;
+        rand.fill(data.data(), data.size());
+        file.pwrite(data.data(), data.size(), 0);
+    }
+    void overwrite(uint64_t addr, uint64_t blks) {
+        cybozu::util::Random<size_t> rand;
+        char *p = &data[addr * LOGICAL_BLOCK_SIZE];
+        rand.fill(p, blks * LOGICAL_BLOCK_SIZE);
+        file.pwrite(p, blks * LOGICAL_BLOCK_SIZE, addr * LOGICAL_BLOCK_SIZE);
+    }
+    cybozu::murmurhash3::Hash calcHash(uint64_t bulkLb) const {
+        cybozu::murmurhash3::StreamHasher hasher(0);
+        for (size_t off = 0; off < data.size(); off += bulkLb * LOGICAL_BLOCK_SIZE) {
+            hasher.push(&data[off], std::min(bulkLb * LOGICAL_BLOCK_SIZE, data.size() - off));
+        }
+        return hasher.get();
+    }
+};
+
+cybozu::murmurhash3::Hash calcHashWithIndex(BlockHashIndex &index)
+{
+    cybozu::murmurhash3::StreamHasher hasher(0);
+    for (uint64_t idx = 0; idx < index.nrChunks(); idx++) {
+        CYBOZU_TEST_EQUAL(hasher.seed(), idx);
+        hasher.pushHash(index.get(idx));
+    }
+    return hasher.get();
+}
+
+CYBOZU_TEST_AUTO(BlockHashIndexBuildAndUpdate)
+{
+    const uint64_t sizeLb = 100000 - 3, bulkLb = 128;
+    Image img(sizeLb);
+    cybozu::TmpFile idxF(".");
+    BlockHashIndex index;
+    index.create(idxF.fd(), sizeLb, bulkLb);
+    CYBOZU_TEST_EQUAL(index.nrChunks(), 782u);
+    CYBOZU_TEST_EQUAL(index.chunkLb(781), sizeLb - 781 * bulkLb);
+    CYBOZU_TEST_ASSERT(!index.isValid());
+
+    AlignedArray buf;
+    index.update(img.file, 0, 500, buf);
+    index.update(img.file, 500, index.nrChunks(), buf);
+    const MetaState st0(MetaSnap(10), 1000);
+    index.validate(st0);
+    CYBOZU_TEST_ASSERT(index.isValidFor(st0, sizeLb));
+    CYBOZU_TEST_ASSERT(!index.isValidFor(st0, sizeLb + 1));
+    CYBOZU_TEST_ASSERT(!index.isValidFor(MetaState(MetaSnap(10), 1001), sizeLb));
+    CYBOZU_TEST_ASSERT(!index.isValidFor(MetaState(MetaSnap(10), MetaSnap(11), 1000), sizeLb));
+    CYBOZU_TEST_ASSERT(calcHashWithIndex(index) == img.calcHash(bulkLb));
+
+    index.invalidate();
+    CYBOZU_TEST_ASSERT(!index.isValidFor(st0, sizeLb));
+    img.overwrite(0, 1);
+    img.overwrite(bulkLb * 10 - 1, 2);
+    img.overwrite(sizeLb - 1, 1);
+    index.markDirty(0, 1);
+    index.markDirty(bulkLb * 10 - 1, 2);
+    index.markDirty(sizeLb - 1, 1);
+    const AddrRangeVec ranges = index.getDirtyRanges();
+    CYBOZU_TEST_EQUAL(ranges.size(), 3u);
+    CYBOZU_TEST_ASSERT(ranges[0] == AddrRange(0, 1));
+    CYBOZU_TEST_ASSERT(ranges[1] == AddrRange(9, 11));
+    CYBOZU_TEST_ASSERT(ranges[2] == AddrRange(781, 782));
+    index.updateDirty(img.file);
+    CYBOZU_TEST_ASSERT(index.getDirtyRanges().empty());
+    const MetaState st1(MetaSnap(12), 1002);
+    index.validate(st1);
+    CYBOZU_TEST_ASSERT(calcHashWithIndex(index) == img.calcHash(bulkLb));
+
+    BlockHashIndex index2;
+    CYBOZU_TEST_ASSERT(index2.open(idxF.path()));
+    CYBOZU_TEST_ASSERT(index2.isValidFor(st1, sizeLb));
+    CYBOZU_TEST_ASSERT(calcHashWithIndex(index2) == img.calcHash(bulkLb));
+    CYBOZU_TEST_EXCEPTION(index2.get(index2.nrChunks()), cybozu::Exception);
+}
+
+CYBOZU_TEST_AUTO(BlockHashIndexOpenBroken)
+{
+    BlockHashIndex index;
+    CYBOZU_TEST_ASSERT(!index.open("./not_existing_block_hash_index"));
+
+    cybozu::TmpFile idxF(".");
+    cybozu::util::File file(idxF.fd());
+    CYBOZU_TEST_ASSERT(!index.open(idxF.path())); // empty.
+
+    index.create(idxF.fd(), 1000, 128);
+    CYBOZU_TEST_ASSERT(index.open(idxF.path()));
+    file.ftruncate(100);
+    CYBOZU_TEST_ASSERT(!index.open(idxF.path()));
+}
@@ -84,9 +84,9 @@ std::vector<AlignedArray> generateRawPacks()
     const DiffMemory::Map& map = diffMem0.getMap();
     for (const auto& i : map) {
         const DiffRecIo& recIo = i.second;
-        if (!packer.add(recIo.record(), recIo.io().data())) {
+        if (!packer.add(recIo.record(), recIo.data())) {
             packV0.push_back(packer.getPackAsArray());
-            packer.add(recIo.record(), recIo.io().data());
+            packer.add(recIo.record(), recIo.data());
         }
     }
     if (!packer.empty()) {
@@ -163,6 +163,78 @@ CYBOZU_TEST_AUTO(walbDiffCompressor)
     testDiffCompression(::WALB_DIFF_CMPR_ZSTD);
 }
 
+void testPackRecompression(int type0, int type1, const char *rawPack, size_t size)
+{
+    PackCompressor compr0(type0), compr1(type1);
+    PackUncompressor ucompr(type1);
+
+    compressor::Buffer p0 = compr0.convert(rawPack);
+    compressor::Buffer p1 = compr1.convert(p0.data());
+    MemoryDiffPack mpack1(p1.data(), p1.size());
+    mpack1.verify(true);
+    if (type0 == type1) {
+        // IOs already compressed with the same type are kept as they are.
+        CYBOZU_TEST_EQUAL(p0.size(), p1.size());
+        CYBOZU_TEST_EQUAL(::memcmp(p0.data(), p1.data(), p0.size()), 0);
+    }
+    for (size_t i = 0; i < mpack1.header().n_records; i++) {
+        const DiffRecord &rec = mpack1.header()[i];
+        CYBOZU_TEST_ASSERT(!rec.isCompressed() || rec.compression_type == type1);
+    }
+    compressor::Buffer p2 = ucompr.convert(p1.data());
+    AlignedArray pack;
+    util::assignAlignedArray(pack, rawPack, size);
+    updateChecksumOfRawPack(pack.data(), size);
+    CYBOZU_TEST_EQUAL(p2.size(), size);
+    CYBOZU_TEST_EQUAL(::memcmp(pack.data(), p2.data(), size), 0);
+}
+
+CYBOZU_TEST_AUTO(walbDiffRecompressor)
+{
+    for (const AlignedArray &pk : generateRawPacks()) {
+        testPackRecompression(::WALB_DIFF_CMPR_SNAPPY, ::WALB_DIFF_CMPR_SNAPPY, pk.data(), pk.size());
+        testPackRecompression(::WALB_DIFF_CMPR_LZ4, ::WALB_DIFF_CMPR_SNAPPY, pk.data(), pk.size());
+        testPackRecompression(::WALB_DIFF_CMPR_ZSTD, ::WALB_DIFF_CMPR_LZ4, pk.data(), pk.size());
+    }
+}
+
+CYBOZU_TEST_AUTO(walbDiffCompressorLargeDiscard)
+{
+    /* Discard and all-zero records do not enlarge the output buffer. */
+    DiffPacker packer;
+    DiffRecord rec;
+    rec.io_address = 0;
+    rec.io_blocks = UINT32_MAX - 7;
+    rec.setDiscard();
+    rec.data_size = 0;
+    CYBOZU_TEST_ASSERT(packer.add(rec, nullptr));
+    rec.io_address = uint64_t(UINT32_MAX) * 2;
+    rec.io_blocks = 16;
+    rec.setAllZero();
+    CYBOZU_TEST_ASSERT(packer.add(rec, nullptr));
+    AlignedArray data(8 * LOGICAL_BLOCK_SIZE);
+    ::memset(data.data(), 'a', data.size());
+    rec.io_address = uint64_t(UINT32_MAX) * 3;
+    rec.io_blocks = 8;
+    rec.setNormal();
+    rec.data_size = data.size();
+    rec.checksum = calcDiffIoChecksum(data);
+    CYBOZU_TEST_ASSERT(packer.add(rec, data.data()));
+    const AlignedArray pack = packer.getPackAsArray();
+    CYBOZU_TEST_EQUAL(compressor::calcTotalNormalBlockNum(*(const walb_diff_pack *)pack.data()), 8u);
+
+    for (int type : {::WALB_DIFF_CMPR_NONE, ::WALB_DIFF_CMPR_SNAPPY, ::WALB_DIFF_CMPR_ZSTD}) {
+        PackCompressor compr(type);
+        PackUncompressor ucompr(type);
+        compressor::Buffer p1 = compr.convert(pack.data());
+        MemoryDiffPack mpack1(p1.data(), p1.size());
+        mpack1.verify(true);
+        compressor::Buffer p2 = ucompr.convert(p1.data());
+        CYBOZU_TEST_EQUAL(p2.size(), pack.size());
+        CYBOZU_TEST_EQUAL(::memcmp(p2.data(), pack.data(), pack.size()), 0);
+    }
+}
+
 static const uint32_t headerSize = 4;
 std::mutex g_mu;
 static cybozu::XorShift g_rg;
@@ -0,0 +1,50 @@
+#include "cybozu/test.hpp"
+#include "dirty_full_sync.hpp"
+#include "random.hpp"
+
+using namespace walb;
+using namespace walb::dirty_full_sync_local;
+
+void testEncodeDecodeBulk(const AlignedArray &orig, int type)
+{
+    Bulk bulk;
+    bulk.lb = orig.size() / LOGICAL_BLOCK_SIZE;
+    bulk.data = orig;
+    encodeBulk(bulk, type, 0);
+    if (cybozu::util::isAllZero(orig.data(), orig.size())) {
+        CYBOZU_TEST_ASSERT(bulk.data.empty());
+    } else {
+        CYBOZU_TEST_ASSERT(!bulk.data.empty());
+        CYBOZU_TEST_ASSERT(bulk.data.size() <= orig.size());
+    }
+    decodeBulk(bulk, type);
+    if (bulk.data.empty()) return;
+    CYBOZU_TEST_EQUAL(bulk.data.size(), orig.size());
+    CYBOZU_TEST_ASSERT(::memcmp(bulk.data.data(), orig.data(), orig.size()) == 0);
+}
+
+CYBOZU_TEST_AUTO(EncodeDecodeBulk)
+{
+    cybozu::util::Random<size_t> rand;
+    const size_t size = 64 * KIBI;
+    AlignedArray zero(size, true);
+    AlignedArray random(size, false);
+    rand.fill(random.data(), random.size());
+    AlignedArray half(size, true);
+    rand.fill(half.data(), size / 2);
+
+    for (int type : {::WALB_DIFF_CMPR_NONE, ::WALB_DIFF_CMPR_SNAPPY, ::WALB_DIFF_CMPR_GZIP,
+                ::WALB_DIFF_CMPR_LZMA, ::WALB_DIFF_CMPR_LZ4, ::WALB_DIFF_CMPR_ZSTD}) {
+        testEncodeDecodeBulk(zero, type);
+        testEncodeDecodeBulk(random, type);
+        testEncodeDecodeBulk(half, type);
+    }
+}
+
+CYBOZU_TEST_AUTO(DecodeTooLargeBulk)
+{
+    Bulk bulk;
+    bulk.lb = 1;
+    bulk.data.resize(LOGICAL_BLOCK_SIZE * 2);
+    CYBOZU_TEST_EXCEPTION(decodeBulk(bulk, ::WALB_DIFF_CMPR_SNAPPY), cybozu::Exception);
+}
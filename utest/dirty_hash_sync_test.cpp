@@ -0,0 +1,100 @@
+#include "cybozu/test.hpp"
+#include "dirty_hash_sync.hpp"
+#include "random.hpp"
+
+using namespace walb;
+
+struct MemoryReader
+{
+    const std::vector<char> &data;
+    size_t off;
+    size_t failOff; // read() will throw an error at the offset.
+
+    explicit MemoryReader(const std::vector<char> &data, size_t failOff = SIZE_MAX)
+        : data(data), off(0), failOff(failOff) {
+    }
+    void read(void *buf, size_t size) {
+        if (off + size > data.size()) throw cybozu::Exception("MemoryReader:out of range") << off << size;
+        if (off <= failOff && failOff < off + size) throw cybozu::Exception("MemoryReader:fail") << off;
+        ::memcpy(buf, &data[off], size);
+        off += size;
+    }
+};
+
+void testParallelChunkHasher(uint64_t sizeLb, uint64_t bulkLb, size_t concurrency,
+                             cybozu::murmurhash3::HashAlgo hashAlgo = cybozu::murmurhash3::HASH_ALGO_MURMUR3)
+{
+    cybozu::util::Random<size_t> rand;
+    std::vector<char> data(sizeLb * LOGICAL_BLOCK_SIZE);
+    rand.fill(data.data(), data.size());
+    const uint32_t hashSeed = rand.get32();
+    cybozu::murmurhash3::Hasher hasher(hashSeed, hashAlgo);
+
+    MemoryReader reader(data);
+    using ChunkHasher = dirty_hash_sync_local::ParallelChunkHasher<MemoryReader>;
+    ChunkHasher chunkHasher(reader, sizeLb, bulkLb, hashSeed, hashAlgo);
+    chunkHasher.start(concurrency);
+    ChunkHasher::Chunk chunk;
+    uint64_t lb = 0;
+    while (chunkHasher.pop(chunk)) {
+        const uint64_t chunkLb = std::min(sizeLb - lb, bulkLb);
+        CYBOZU_TEST_EQUAL(chunk.buf.size(), chunkLb * LOGICAL_BLOCK_SIZE);
+        const char *p = &data[lb * LOGICAL_BLOCK_SIZE];
+        CYBOZU_TEST_ASSERT(::memcmp(chunk.buf.data(), p, chunk.buf.size()) == 0);
+        CYBOZU_TEST_ASSERT(chunk.hash == hasher(p, chunkLb * LOGICAL_BLOCK_SIZE));
+        lb += chunkLb;
+    }
+    CYBOZU_TEST_EQUAL(lb, sizeLb);
+}
+
+CYBOZU_TEST_AUTO(ParallelChunkHasher)
+{
+    for (size_t concurrency : {1, 2, 4}) {
+        testParallelChunkHasher(1000, 128, concurrency);
+        testParallelChunkHasher(1024, 128, concurrency);
+        testParallelChunkHasher(1, 128, concurrency);
+        testParallelChunkHasher(0, 128, concurrency);
+        testParallelChunkHasher(1000, 128, concurrency, cybozu::murmurhash3::HASH_ALGO_XXH3);
+    }
+}
+
+CYBOZU_TEST_AUTO(ParallelChunkHasherReadError)
+{
+    const uint64_t sizeLb = 1000, bulkLb = 16;
+    std::vector<char> data(sizeLb * LOGICAL_BLOCK_SIZE);
+    MemoryReader reader(data, 500 * LOGICAL_BLOCK_SIZE);
+    using ChunkHasher = dirty_hash_sync_local::ParallelChunkHasher<MemoryReader>;
+    ChunkHasher chunkHasher(reader, sizeLb, bulkLb, 0);
+    chunkHasher.start(2);
+    ChunkHasher::Chunk chunk;
+    CYBOZU_TEST_EXCEPTION(while (chunkHasher.pop(chunk)) {}, cybozu::Exception);
+}
+
+CYBOZU_TEST_AUTO(ParallelChunkHasherWithRanges)
+{
+    const uint64_t sizeLb = 1000, bulkLb = 16;
+    cybozu::util::Random<size_t> rand;
+    std::vector<char> data(sizeLb * LOGICAL_BLOCK_SIZE);
+    rand.fill(data.data(), data.size());
+    const AddrRangeVec ranges{{0, 20}, {100, 101}, {500, 600}, {990, 1000}};
+    MemoryReader reader(data);
+    using ChunkHasher = dirty_hash_sync_local::ParallelChunkHasher<MemoryReader>;
+    ChunkHasher chunkHasher(reader, ranges, bulkLb, 0);
+    chunkHasher.start(2);
+    ChunkHasher::Chunk chunk;
+    uint64_t totalLb = 0;
+    size_t i = 0;
+    while (chunkHasher.pop(chunk)) {
+        while (i < ranges.size() && ranges[i].second <= chunk.addr) i++;
+        CYBOZU_TEST_ASSERT(i < ranges.size());
+        const uint64_t chunkLb = chunk.buf.size() / LOGICAL_BLOCK_SIZE;
+        CYBOZU_TEST_ASSERT(ranges[i].first <= chunk.addr);
+        CYBOZU_TEST_ASSERT(chunk.addr + chunkLb <= ranges[i].second);
+        const char *p = &data[chunk.addr * LOGICAL_BLOCK_SIZE];
+        CYBOZU_TEST_ASSERT(::memcmp(chunk.buf.data(), p, chunk.buf.size()) == 0);
+        totalLb += chunkLb;
+    }
+    CYBOZU_TEST_EQUAL(totalLb, getTotalRangeSize(ranges));
+
+    CYBOZU_TEST_EXCEPTION(ChunkHasher(reader, AddrRangeVec{{10, 20}, {0, 5}}, bulkLb, 0), cybozu::Exception);
+}
@@ -447,4 +447,45 @@ private:
     }
 };
 
+enum : char { BLK_NONE = 0, BLK_NORMAL, BLK_ZERO, BLK_DISCARD };
+
+/**
+ * Block types are compared as well as data.
+ */
+struct BlockImage
+{
+    std::vector<char> type;
+    AlignedArray data;
+
+    explicit BlockImage(size_t nrBlocks) : type(nrBlocks, BLK_NONE), data(nrBlocks * LOGICAL_BLOCK_SIZE) {
+        ::memset(data.data(), 0, data.size());
+    }
+    void apply(uint64_t addr, uint32_t blks, DiffRecType t, const char *p) {
+        for (size_t i = 0; i < blks; i++) {
+            char *dst = data.data() + (addr + i) * LOGICAL_BLOCK_SIZE;
+            if (t == DiffRecType::NORMAL) {
+                type[addr + i] = BLK_NORMAL;
+                ::memcpy(dst, p + i * LOGICAL_BLOCK_SIZE, LOGICAL_BLOCK_SIZE);
+            } else {
+                type[addr + i] = t == DiffRecType::ALLZERO ? BLK_ZERO : BLK_DISCARD;
+                ::memset(dst, 0, LOGICAL_BLOCK_SIZE);
+            }
+        }
+    }
+    void applySortedWdiff(const std::string &path) {
+        SortedDiffReader reader(path);
+        DiffFileHeader fileH;
+        reader.readHeader(fileH);
+        DiffRecord rec;
+        AlignedArray buf;
+        while (reader.readAndUncompressDiff(rec, buf, true)) {
+            apply(rec.io_address, rec.io_blocks, getDiffRecType(rec), buf.data());
+        }
+    }
+    bool operator==(const BlockImage& rhs) const {
+        return type == rhs.type && data.size() == rhs.data.size() &&
+            ::memcmp(data.data(), rhs.data.data(), data.size()) == 0;
+    }
+};
+
 } // namespace walb
@@ -24,3 +24,29 @@ CYBOZU_TEST_AUTO(hash)
     CYBOZU_TEST_EQUAL(h0, h1);
     CYBOZU_TEST_EQUAL(s0, s1);
 }
+
+CYBOZU_TEST_AUTO(xxh3)
+{
+    using namespace cybozu::murmurhash3;
+    CYBOZU_TEST_EQUAL(Hasher(0, HASH_ALGO_XXH3)("", 0).str(), "99aa06d3014798d86001c324468d497f");
+
+    std::vector<char> v(4096);
+    for (size_t i = 0; i < v.size(); i++) v[i] = char(i * 7);
+    CYBOZU_TEST_ASSERT(Hasher(0, HASH_ALGO_XXH3)(&v[0], v.size()) != Hasher(0)(&v[0], v.size()));
+    CYBOZU_TEST_ASSERT(Hasher(0, HASH_ALGO_XXH3)(&v[0], v.size()) != Hasher(1, HASH_ALGO_XXH3)(&v[0], v.size()));
+
+    StreamHasher sh(5, HASH_ALGO_XXH3);
+    Hash h;
+    h.zeroClear();
+    for (size_t i = 0; i < 4; i++) {
+        sh.push(&v[i * 1024], 1024);
+        h.doXor(Hasher(5 + i, HASH_ALGO_XXH3)(&v[i * 1024], 1024));
+    }
+    CYBOZU_TEST_EQUAL(sh.get(), h);
+
+    for (int i = 0; i < HASH_ALGO_MAX; i++) {
+        CYBOZU_TEST_EQUAL(parseHashAlgo(hashAlgoName(HashAlgo(i))), HashAlgo(i));
+    }
+    CYBOZU_TEST_EXCEPTION(parseHashAlgo("sha1"), cybozu::Exception);
+    CYBOZU_TEST_EQUAL(selectHashAlgo("sha1"), HASH_ALGO_MURMUR3);
+}
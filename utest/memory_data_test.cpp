@@ -56,8 +56,10 @@ void getFromDiffMemory(DiffMemory &diffMem, std::vector<DiffRecord> &recV, std::
     DiffMemory::Map &map = diffMem.getMap();
     DiffMemory::Map::iterator itr = map.begin();
     while (itr != map.end()) {
-        recV.push_back(itr->second.record());
-        ioV.push_back(itr->second.io());
+        const DiffRecIo &recIo = itr->second;
+        recV.push_back(recIo.record());
+        ioV.emplace_back(recIo.size());
+        if (recIo.size() > 0) ::memcpy(ioV.back().data(), recIo.data(), recIo.size());
         ++itr;
     }
 }
@@ -0,0 +1,193 @@
+#include "cybozu/test.hpp"
+#include "merkle_hash.hpp"
+#include "random.hpp"
+#include <sstream>
+
+using namespace walb;
+using Hash = MerkleHashTree::Hash;
+
+std::vector<Hash> makeLeaves(size_t nr)
+{
+    cybozu::util::Random<size_t> rand;
+    std::vector<Hash> v(nr);
+    for (Hash &h : v) rand.fill(h.data, cybozu::murmurhash3::HASH_SIZE);
+    return v;
+}
+
+void buildTree(MerkleHashTree &tree, uint64_t sizeLb, uint64_t bulkLb, uint32_t fanout,
+               const std::vector<Hash> &leaves,
+               cybozu::murmurhash3::HashAlgo hashAlgo = cybozu::murmurhash3::HASH_ALGO_MURMUR3)
+{
+    tree.init(sizeLb, bulkLb, fanout, 0, hashAlgo);
+    for (const Hash &h : leaves) tree.addLeaf(h);
+    tree.finalize();
+}
+
+/**
+ * The same procedure as merkleHashDescentServer() without network.
+ */
+AddrRangeVec descend(MerkleHashTree &srv, const MerkleHashTree &cli)
+{
+    AddrRangeVec ranges{{0, 1}};
+    uint32_t level = srv.topLevel();
+    for (;;) {
+        AddrRangeVec diffRanges;
+        for (const AddrRange &r : ranges) {
+            for (uint64_t idx = r.first; idx < r.second; idx++) {
+                const Hash &hash = cli.get(level, idx);
+                if (hash == srv.get(level, idx)) continue;
+                srv.set(level, idx, hash);
+                if (!diffRanges.empty() && diffRanges.back().second == idx) {
+                    diffRanges.back().second++;
+                } else {
+                    diffRanges.emplace_back(idx, idx + 1);
+                }
+            }
+        }
+        if (level == 1 || diffRanges.empty()) return srv.getLbRanges(1, diffRanges);
+        ranges = srv.getChildRanges(level, diffRanges);
+        level--;
+    }
+}
+
+bool isSameTree(const MerkleHashTree &t0, const MerkleHashTree &t1)
+{
+    if (t0.topLevel() != t1.topLevel()) return false;
+    for (uint32_t level = 1; level <= t0.topLevel(); level++) {
+        if (t0.nrNodes(level) != t1.nrNodes(level)) return false;
+        for (uint64_t i = 0; i < t0.nrNodes(level); i++) {
+            if (t0.get(level, i) != t1.get(level, i)) return false;
+        }
+    }
+    return true;
+}
+
+CYBOZU_TEST_AUTO(MerkleHashTreeShape)
+{
+    const uint64_t bulkLb = 8;
+    MerkleHashTree tree;
+    struct {
+        uint64_t sizeLb;
+        uint32_t fanout;
+        uint32_t topLevel;
+    } tbl[] = {
+        {1, 4, 1},
+        {8 * 4, 4, 1},
+        {8 * 4 + 1, 4, 2},
+        {8 * 16, 4, 2},
+        {8 * 100, 4, 4},
+        {8 * 100, 64, 2},
+    };
+    for (const auto &t : tbl) {
+        const uint64_t nrLeaves = (t.sizeLb + bulkLb - 1) / bulkLb;
+        buildTree(tree, t.sizeLb, bulkLb, t.fanout, makeLeaves(nrLeaves));
+        CYBOZU_TEST_EQUAL(tree.nrLeaves(), nrLeaves);
+        CYBOZU_TEST_EQUAL(tree.topLevel(), t.topLevel);
+        CYBOZU_TEST_EQUAL(tree.nrNodes(tree.topLevel()), 1u);
+    }
+    tree.init(8 * 10, bulkLb, 4, 0);
+    CYBOZU_TEST_EXCEPTION(tree.finalize(), cybozu::Exception);
+    for (const Hash &h : makeLeaves(10)) tree.addLeaf(h);
+    CYBOZU_TEST_EXCEPTION(tree.addLeaf(Hash()), cybozu::Exception);
+    tree.finalize();
+    CYBOZU_TEST_EXCEPTION(tree.get(0, 0), cybozu::Exception);
+    CYBOZU_TEST_EXCEPTION(tree.get(tree.topLevel() + 1, 0), cybozu::Exception);
+}
+
+CYBOZU_TEST_AUTO(MerkleHashTreeRanges)
+{
+    MerkleHashTree tree;
+    const uint64_t sizeLb = 8 * 100 - 3, bulkLb = 8;
+    buildTree(tree, sizeLb, bulkLb, 4, makeLeaves(100));
+    // nodes: level1 25, level2 7, level3 2, level4 1.
+    CYBOZU_TEST_EQUAL(tree.nrNodes(3), 2u);
+    const AddrRangeVec v0 = tree.getChildRanges(2, {{1, 2}, {6, 7}});
+    CYBOZU_TEST_EQUAL(v0.size(), 2u);
+    CYBOZU_TEST_ASSERT(v0[0] == AddrRange(4, 8));
+    CYBOZU_TEST_ASSERT(v0[1] == AddrRange(24, 25));
+    const AddrRangeVec v1 = tree.getLbRanges(1, {{0, 1}, {24, 25}});
+    CYBOZU_TEST_ASSERT(v1[0] == AddrRange(0, 32));
+    CYBOZU_TEST_ASSERT(v1[1] == AddrRange(8 * 96, sizeLb));
+
+    verifyAddrRangeVec({{0, 1}, {1, 3}}, 3, "test");
+    CYBOZU_TEST_EXCEPTION(verifyAddrRangeVec({{0, 2}, {1, 3}}, 3, "test"), cybozu::Exception);
+    CYBOZU_TEST_EXCEPTION(verifyAddrRangeVec({{1, 1}}, 3, "test"), cybozu::Exception);
+    CYBOZU_TEST_EXCEPTION(verifyAddrRangeVec({{0, 4}}, 3, "test"), cybozu::Exception);
+    CYBOZU_TEST_EQUAL(getTotalRangeSize({{0, 1}, {5, 8}}), 4u);
+}
+
+CYBOZU_TEST_AUTO(MerkleHashTreeSerialize)
+{
+    MerkleHashTree t0, t1;
+    buildTree(t0, 8 * 1000, 8, 16, makeLeaves(1000));
+    std::stringstream ss0;
+    cybozu::save(ss0, t0);
+    std::stringstream ss1(ss0.str());
+    cybozu::load(t1, ss1);
+    CYBOZU_TEST_ASSERT(t1.hasSameShape(8 * 1000, 8, 16, 0, cybozu::murmurhash3::HASH_ALGO_MURMUR3));
+    CYBOZU_TEST_ASSERT(isSameTree(t0, t1));
+
+    MerkleHashTree t2;
+    t2.init(8, 8, 16, 0);
+    std::stringstream ss2;
+    CYBOZU_TEST_EXCEPTION(cybozu::save(ss2, t2), cybozu::Exception);
+
+    const std::vector<Hash> leaves = makeLeaves(1000);
+    MerkleHashTree t3, t4;
+    buildTree(t3, 8 * 1000, 8, 16, leaves, cybozu::murmurhash3::HASH_ALGO_XXH3);
+    buildTree(t4, 8 * 1000, 8, 16, leaves);
+    CYBOZU_TEST_ASSERT(t3.get(t3.topLevel(), 0) != t4.get(t4.topLevel(), 0));
+    std::stringstream ss3;
+    cybozu::save(ss3, t3);
+    std::stringstream ss4(ss3.str());
+    cybozu::load(t1, ss4);
+    CYBOZU_TEST_ASSERT(t1.hasSameShape(8 * 1000, 8, 16, 0, cybozu::murmurhash3::HASH_ALGO_XXH3));
+    CYBOZU_TEST_ASSERT(!t1.hasSameShape(8 * 1000, 8, 16, 0, cybozu::murmurhash3::HASH_ALGO_MURMUR3));
+    CYBOZU_TEST_ASSERT(isSameTree(t1, t3));
+}
+
+/**
+ * Trees cached before the hash algorithm was recorded.
+ */
+CYBOZU_TEST_AUTO(MerkleHashTreeLoadOldFormat)
+{
+    MerkleHashTree t0, t1;
+    buildTree(t0, 8 * 100, 8, 4, makeLeaves(100));
+    std::stringstream ss0;
+    cybozu::save(ss0, t0.sizeLb());
+    cybozu::save(ss0, t0.bulkLb());
+    cybozu::save(ss0, t0.fanout());
+    cybozu::save(ss0, t0.hashSeed());
+    cybozu::save(ss0, size_t(t0.topLevel()));
+    for (uint32_t level = 1; level <= t0.topLevel(); level++) {
+        std::vector<Hash> v;
+        for (uint64_t i = 0; i < t0.nrNodes(level); i++) v.push_back(t0.get(level, i));
+        cybozu::savePodVec(ss0, v);
+    }
+    std::stringstream ss1(ss0.str());
+    cybozu::load(t1, ss1);
+    CYBOZU_TEST_ASSERT(t1.hasSameShape(8 * 100, 8, 4, 0, cybozu::murmurhash3::HASH_ALGO_MURMUR3));
+    CYBOZU_TEST_ASSERT(isSameTree(t0, t1));
+}
+
+CYBOZU_TEST_AUTO(MerkleHashTreeDescent)
+{
+    const uint64_t bulkLb = 8, nrLeaves = 10000, sizeLb = bulkLb * nrLeaves;
+    const uint32_t fanout = 8;
+    const std::vector<Hash> leaves0 = makeLeaves(nrLeaves);
+    MerkleHashTree srv, cli;
+    buildTree(srv, sizeLb, bulkLb, fanout, leaves0);
+    buildTree(cli, sizeLb, bulkLb, fanout, leaves0);
+    CYBOZU_TEST_ASSERT(descend(srv, cli).empty());
+
+    std::vector<Hash> leaves1 = leaves0;
+    for (size_t i : {0, 1, 7, 8, 5000, 9999}) leaves1[i].data[0]++;
+    buildTree(cli, sizeLb, bulkLb, fanout, leaves1);
+    const AddrRangeVec ranges = descend(srv, cli);
+    const uint64_t nodeLb = bulkLb * fanout;
+    CYBOZU_TEST_EQUAL(ranges.size(), 3u);
+    CYBOZU_TEST_ASSERT(ranges[0] == AddrRange(0, nodeLb * 2));
+    CYBOZU_TEST_ASSERT(ranges[1] == AddrRange(nodeLb * 625, nodeLb * 626));
+    CYBOZU_TEST_ASSERT(ranges[2] == AddrRange(nodeLb * 1249, sizeLb));
+    CYBOZU_TEST_ASSERT(isSameTree(srv, cli));
+}
@@ -0,0 +1,130 @@
+#include "cybozu/test.hpp"
+#include "metrics.hpp"
+#include "constant.hpp"
+#include "fileio.hpp"
+#include "random.hpp"
+#include <thread>
+#include <vector>
+#include <algorithm>
+
+using namespace walb::metrics;
+
+CYBOZU_TEST_AUTO(bucketIndex)
+{
+    /* Every value must be in the bucket whose upper bound is not less than it. */
+    size_t prev = 0;
+    for (uint64_t us = 0; us < (1 << 12); us++) {
+        const size_t idx = Histogram::bucketIndex(us);
+        CYBOZU_TEST_ASSERT(idx == prev || idx == prev + 1);
+        CYBOZU_TEST_ASSERT(us <= Histogram::bucketUpperUs(idx));
+        if (idx > 0) CYBOZU_TEST_ASSERT(Histogram::bucketUpperUs(idx - 1) < us);
+        prev = idx;
+    }
+    for (size_t e = Histogram::SUB_BITS; e <= Histogram::MAX_EXP; e++) {
+        const uint64_t us = uint64_t(1) << e;
+        const size_t idx = Histogram::bucketIndex(us);
+        CYBOZU_TEST_EQUAL(Histogram::bucketUpperUs(idx - 1), us - 1);
+        CYBOZU_TEST_ASSERT(idx < Histogram::NR_BUCKETS);
+        /* relative error */
+        CYBOZU_TEST_ASSERT(Histogram::bucketUpperUs(idx) - us < us / Histogram::NR_SUB);
+    }
+    CYBOZU_TEST_EQUAL(Histogram::bucketIndex(UINT64_MAX), Histogram::NR_BUCKETS - 1);
+}
+
+CYBOZU_TEST_AUTO(quantile)
+{
+    Histogram h;
+    for (uint64_t us = 1; us <= 1000; us++) h.record(us);
+    const Histogram::Snapshot s = h.snapshot();
+    CYBOZU_TEST_EQUAL(s.count, 1000u);
+    CYBOZU_TEST_EQUAL(s.sumUs, 500500u);
+    CYBOZU_TEST_EQUAL(s.maxUs, 1000u);
+    const uint64_t p50 = s.quantileUs(0.5);
+    CYBOZU_TEST_ASSERT(500 <= p50 && p50 < 500 + 500 / Histogram::NR_SUB);
+    const uint64_t p99 = s.quantileUs(0.99);
+    CYBOZU_TEST_ASSERT(990 <= p99 && p99 < 990 + 990 / Histogram::NR_SUB);
+    CYBOZU_TEST_EQUAL(s.quantileUs(1.0), 1000u);
+    CYBOZU_TEST_EQUAL(s.countLt(10), 1000u); // 1024
+    CYBOZU_TEST_EQUAL(s.countLt(9), 511u); // 512
+
+    const Histogram::Snapshot empty = Histogram().snapshot();
+    CYBOZU_TEST_EQUAL(empty.count, 0u);
+    CYBOZU_TEST_EQUAL(empty.quantileUs(0.5), 0u);
+}
+
+CYBOZU_TEST_AUTO(concurrentRecord)
+{
+    VolMetrics vm;
+    const size_t nrThreads = 4, nr = 100000;
+    std::vector<std::thread> thV;
+    for (size_t i = 0; i < nrThreads; i++) {
+        thV.emplace_back([&]() {
+                cybozu::util::Random<uint32_t> rand;
+                for (size_t j = 0; j < nr; j++) {
+                    vm.record(COMPRESS, (rand() % 100000) / 1000000.0, 10);
+                }
+            });
+    }
+    for (std::thread &th : thV) th.join();
+    const StageMetrics &m = vm.get(COMPRESS);
+    CYBOZU_TEST_EQUAL(m.latency.snapshot().count, nrThreads * nr);
+    CYBOZU_TEST_EQUAL(m.bytes.load(), nrThreads * nr * 10);
+    CYBOZU_TEST_ASSERT(m.latency.snapshot().maxUs < 100000);
+    CYBOZU_TEST_EQUAL(vm.get(SOCK_SEND).latency.snapshot().count, 0u);
+}
+
+CYBOZU_TEST_AUTO(registry)
+{
+    MetricsRegistry reg;
+    CYBOZU_TEST_ASSERT(!reg.exists("vol0"));
+    VolMetrics &vm0 = reg.get("vol0");
+    CYBOZU_TEST_EQUAL(&vm0, &reg.get("vol0"));
+    StageTimer timer(&vm0, WLOG_SEND);
+    timer.record(4096);
+    timer.record(4096);
+    reg.get("vol1").record(APPLY, 0.5, walb::MEBI);
+    StageTimer(nullptr, APPLY).record(1); // no effect.
+
+    CYBOZU_TEST_EQUAL(reg.getVolIdList().size(), 2u);
+    const walb::StrVec v0 = reg.prettyPrint("vol0");
+    CYBOZU_TEST_EQUAL(v0.size(), 1u);
+    CYBOZU_TEST_ASSERT(v0[0].find("vol0\twlog_send\tcount:2\tbytes:8192\t") == 0);
+    CYBOZU_TEST_ASSERT(reg.prettyPrint("vol2").empty());
+    CYBOZU_TEST_EQUAL(reg.prettyPrintAll().size(), 2u);
+
+    const std::string text = reg.prometheusText("archive");
+    CYBOZU_TEST_ASSERT(text.find("# TYPE walb_stage_duration_seconds histogram\n") != std::string::npos);
+    CYBOZU_TEST_ASSERT(text.find(
+        "walb_stage_duration_seconds_bucket{daemon=\"archive\",volume=\"vol1\",stage=\"apply\",le=\"+Inf\"} 1\n")
+                       != std::string::npos);
+    CYBOZU_TEST_ASSERT(text.find(
+        "walb_stage_duration_seconds_bucket{daemon=\"archive\",volume=\"vol1\",stage=\"apply\",le=\"1.048576\"} 1\n")
+                       != std::string::npos);
+    CYBOZU_TEST_ASSERT(text.find(
+        "walb_stage_duration_seconds_bucket{daemon=\"archive\",volume=\"vol1\",stage=\"apply\",le=\"0.262144\"} 0\n")
+                       != std::string::npos);
+    CYBOZU_TEST_ASSERT(text.find(
+        "walb_stage_bytes_total{daemon=\"archive\",volume=\"vol1\",stage=\"apply\"} 1048576\n")
+                       != std::string::npos);
+    CYBOZU_TEST_ASSERT(text.find("stage=\"restore\"") == std::string::npos);
+}
+
+CYBOZU_TEST_AUTO(fileWriter)
+{
+    MetricsRegistry reg;
+    reg.get("vol0").record(FSYNC, 0.001, 1);
+    const std::string path = "metrics_test.prom";
+    {
+        PrometheusFileWriter writer(reg, "proxy", path, 1);
+        writer.writeOnce();
+    }
+    cybozu::util::File file(path, O_RDONLY);
+    std::string s(4096, '\0');
+    s.resize(file.readsome(&s[0], s.size()));
+    CYBOZU_TEST_EQUAL(s, reg.prometheusText("proxy"));
+    file.close();
+    ::unlink(path.c_str());
+
+    /* Disabled. */
+    PrometheusFileWriter writer(reg, "proxy", "", 0);
+}
@@ -0,0 +1,75 @@
+#include "cybozu/test.hpp"
+#include "simd_kernels.hpp"
+#include "checksum.hpp"
+#include "util.hpp"
+#include "random.hpp"
+#include <vector>
+
+using namespace cybozu::simd;
+
+cybozu::util::Random<size_t> rand_;
+
+std::vector<SimdLevel> getSupportedLevels()
+{
+    std::vector<SimdLevel> v;
+    for (int i = 0; i < SIMD_MAX; i++) {
+        if (isSimdLevelSupported(SimdLevel(i))) v.push_back(SimdLevel(i));
+    }
+    return v;
+}
+
+CYBOZU_TEST_AUTO(checksumRandom)
+{
+    const size_t maxSize = 70000;
+    std::vector<char> buf(maxSize + 64);
+    for (char &c : buf) c = char(rand_());
+    for (const SimdLevel level : getSupportedLevels()) {
+        const Kernels k = getKernels(level);
+        CYBOZU_TEST_EQUAL(k.level, level);
+        for (size_t i = 0; i < 2000; i++) {
+            const size_t off = rand_() % 64; // unaligned data.
+            const size_t size = i < 600 ? i : rand_() % maxSize;
+            const uint32_t salt = uint32_t(rand_());
+            const uint32_t expected = checksumPartialScalar(&buf[off], size, salt);
+            const uint32_t csum = k.checksumPartial(&buf[off], size, salt);
+            if (csum != expected) {
+                ::printf("%s off %zu size %zu\n", simdLevelName(level), off, size);
+            }
+            CYBOZU_TEST_EQUAL(csum, expected);
+        }
+    }
+    /* The dispatched one. */
+    for (size_t i = 0; i < 100; i++) {
+        const size_t size = rand_() % maxSize;
+        CYBOZU_TEST_EQUAL(cybozu::util::checksumPartial(buf.data(), size, 17),
+                          checksumPartialScalar(buf.data(), size, 17));
+    }
+}
+
+CYBOZU_TEST_AUTO(isAllZeroRandom)
+{
+    const size_t maxSize = 70000;
+    std::vector<char> buf(maxSize + 64);
+    for (const SimdLevel level : getSupportedLevels()) {
+        const Kernels k = getKernels(level);
+        for (size_t i = 0; i < 2000; i++) {
+            const size_t off = rand_() % 64;
+            const size_t size = i < 600 ? i : rand_() % maxSize;
+            CYBOZU_TEST_ASSERT(k.isAllZero(&buf[off], size));
+            if (size == 0) continue;
+            /* A non-zero byte at any position including the head and the tail. */
+            const size_t pos = i % 3 == 0 ? 0 : i % 3 == 1 ? size - 1 : rand_() % size;
+            buf[off + pos] = char(1 + rand_() % 255);
+            CYBOZU_TEST_EQUAL(k.isAllZero(&buf[off], size), isAllZeroScalar(&buf[off], size));
+            CYBOZU_TEST_ASSERT(!k.isAllZero(&buf[off], size));
+            /* Non-zero bytes out of the range must not be seen. */
+            if (pos == 0 && size > 1) {
+                CYBOZU_TEST_ASSERT(k.isAllZero(&buf[off + 1], size - 1));
+            }
+            buf[off + pos] = 0;
+        }
+    }
+    CYBOZU_TEST_ASSERT(cybozu::util::isAllZero(buf.data(), buf.size()));
+    buf[buf.size() - 1] = 1;
+    CYBOZU_TEST_ASSERT(!cybozu::util::isAllZero(buf.data(), buf.size()));
+}
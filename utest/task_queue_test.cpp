@@ -1,6 +1,7 @@
 #include "cybozu/test.hpp"
 #include "task_queue.hpp"
 #include "walb_util.hpp"
+#include <thread>
 
 //using Task = std::pair<std::string, std::string>;
 using Task = std::string;
@@ -64,3 +65,91 @@ CYBOZU_TEST_AUTO(taskQueue)
     CYBOZU_TEST_EQUAL(task, "bbb");
     CYBOZU_TEST_ASSERT(!tq.pop(task));
 }
+
+CYBOZU_TEST_AUTO(taskQueueGetReady)
+{
+    walb::TaskQueue<Task> tq;
+    tq.push("aaa");
+    tq.push("bbb", 50);
+    tq.push("ccc");
+    uint64_t gen;
+    std::vector<Task> v = tq.getReady(gen);
+    CYBOZU_TEST_EQUAL(v.size(), 2u);
+    CYBOZU_TEST_EQUAL(v[0], "aaa");
+    CYBOZU_TEST_EQUAL(v[1], "ccc");
+    CYBOZU_TEST_ASSERT(tq.erase("ccc"));
+    CYBOZU_TEST_ASSERT(!tq.erase("ccc"));
+
+    /* It wakes up when the delayed task becomes ready. */
+    const double t0 = cybozu::util::getTime();
+    tq.waitForChange(gen, 1000);
+    CYBOZU_TEST_ASSERT(cybozu::util::getTime() - t0 < 0.5);
+    v = tq.getReady(gen);
+    CYBOZU_TEST_EQUAL(v.size(), 2u);
+    CYBOZU_TEST_EQUAL(v[1], "bbb");
+
+    /* It wakes up at notify. */
+    std::thread th([&]() {
+            walb::util::sleepMs(10);
+            tq.notify();
+        });
+    const double t1 = cybozu::util::getTime();
+    tq.waitForChange(gen, 1000);
+    CYBOZU_TEST_ASSERT(cybozu::util::getTime() - t1 < 0.5);
+    th.join();
+}
+
+CYBOZU_TEST_AUTO(taskQueuePopWait)
+{
+    walb::TaskQueue<Task> tq;
+    Task task;
+
+    /* It wakes up at the timestamp of the delayed task, not at the timeout. */
+    tq.push("aaa", 30);
+    double t0 = cybozu::util::getTime();
+    CYBOZU_TEST_ASSERT(tq.pop(task, 1000));
+    double elapsed = cybozu::util::getTime() - t0;
+    CYBOZU_TEST_EQUAL(task, "aaa");
+    CYBOZU_TEST_ASSERT(0.02 < elapsed && elapsed < 0.5);
+
+    /* A ready task does not wait at all. */
+    tq.push("bbb");
+    t0 = cybozu::util::getTime();
+    CYBOZU_TEST_ASSERT(tq.pop(task, 1000));
+    CYBOZU_TEST_ASSERT(cybozu::util::getTime() - t0 < 0.5);
+
+    /* It wakes up at push. */
+    std::thread th([&]() {
+            walb::util::sleepMs(10);
+            tq.push("ccc");
+        });
+    t0 = cybozu::util::getTime();
+    CYBOZU_TEST_ASSERT(tq.pop(task, 1000));
+    CYBOZU_TEST_ASSERT(cybozu::util::getTime() - t0 < 0.5);
+    CYBOZU_TEST_EQUAL(task, "ccc");
+    th.join();
+
+    CYBOZU_TEST_ASSERT(!tq.pop(task, 10));
+}
+
+CYBOZU_TEST_AUTO(taskQueuePopBatch)
+{
+    walb::TaskQueue<Task> tq;
+    std::vector<Task> v;
+    CYBOZU_TEST_EQUAL(tq.popBatch(v, 10), 0u);
+    tq.push("aaa");
+    tq.push("bbb");
+    tq.push("ccc");
+    tq.push("ddd", 1000);
+    CYBOZU_TEST_EQUAL(tq.popBatch(v, 2), 2u);
+    CYBOZU_TEST_EQUAL(tq.popBatch(v, 10), 1u);
+    CYBOZU_TEST_EQUAL(v.size(), 3u);
+    CYBOZU_TEST_EQUAL(v[0], "aaa");
+    CYBOZU_TEST_EQUAL(v[1], "bbb");
+    CYBOZU_TEST_EQUAL(v[2], "ccc");
+    CYBOZU_TEST_EQUAL(tq.popBatch(v, 10), 0u);
+
+    tq.quit();
+    CYBOZU_TEST_EQUAL(tq.popBatch(v, 10, 1000), 1u);
+    CYBOZU_TEST_EQUAL(v.back(), "ddd");
+}
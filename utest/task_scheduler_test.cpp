@@ -0,0 +1,135 @@
+#include "cybozu/test.hpp"
+#include "task_scheduler.hpp"
+#include "server_util.hpp"
+#include <map>
+#include <algorithm>
+
+using namespace walb;
+
+CYBOZU_TEST_AUTO(fairTaskSchedulerLimit)
+{
+    FairTaskScheduler sched(2, 1);
+    const std::vector<TaskSchedAttr> attrV = {
+        TaskSchedAttr("a"), TaskSchedAttr("a"), TaskSchedAttr("b"), TaskSchedAttr("c")
+    };
+    CYBOZU_TEST_EQUAL(sched.choose(attrV), 0u);
+    sched.start(attrV[0]);
+    /* "a" has reached the per-group limit. */
+    CYBOZU_TEST_EQUAL(sched.choose(attrV), 2u);
+    sched.start(attrV[2]);
+    CYBOZU_TEST_ASSERT(!sched.hasFreeSlot());
+    CYBOZU_TEST_EQUAL(sched.choose(attrV), attrV.size());
+    CYBOZU_TEST_EQUAL(sched.getRunning().size(), 2u);
+
+    sched.finish("a");
+    /* "c" has not run yet. */
+    CYBOZU_TEST_EQUAL(sched.choose(attrV), 3u);
+    CYBOZU_TEST_EQUAL(sched.nrRunning(), 1u);
+    CYBOZU_TEST_EXCEPTION(sched.finish("a"), cybozu::Exception);
+}
+
+CYBOZU_TEST_AUTO(fairTaskSchedulerPriority)
+{
+    FairTaskScheduler sched(1);
+    std::vector<TaskSchedAttr> attrV = {
+        TaskSchedAttr("a"), TaskSchedAttr("b", 2), TaskSchedAttr("c", 1)
+    };
+    for (size_t expected : {1u, 2u, 0u}) {
+        const size_t i = sched.choose(attrV);
+        CYBOZU_TEST_EQUAL(i, expected);
+        sched.start(attrV[i]);
+        sched.finish(attrV[i].group);
+        attrV[i].priority = -1;
+    }
+}
+
+CYBOZU_TEST_AUTO(fairTaskSchedulerWeight)
+{
+    /* Every group always has a ready task. */
+    FairTaskScheduler sched(1);
+    const std::vector<TaskSchedAttr> attrV = {
+        TaskSchedAttr("a", 0, 1), TaskSchedAttr("b", 0, 3), TaskSchedAttr("c", 0, 1)
+    };
+    std::map<std::string, size_t> cnt;
+    for (size_t i = 0; i < 500; i++) {
+        const size_t j = sched.choose(attrV);
+        CYBOZU_TEST_ASSERT(j < attrV.size());
+        sched.start(attrV[j]);
+        sched.finish(attrV[j].group);
+        cnt[attrV[j].group]++;
+    }
+    CYBOZU_TEST_EQUAL(cnt["a"], 100u);
+    CYBOZU_TEST_EQUAL(cnt["b"], 300u);
+    CYBOZU_TEST_EQUAL(cnt["c"], 100u);
+
+    /* A group idle for a long time does not get saved credits. */
+    const std::vector<TaskSchedAttr> attrV2 = {
+        TaskSchedAttr("a"), TaskSchedAttr("d")
+    };
+    cnt.clear();
+    for (size_t i = 0; i < 10; i++) {
+        const size_t j = sched.choose(attrV2);
+        sched.start(attrV2[j]);
+        sched.finish(attrV2[j].group);
+        cnt[attrV2[j].group]++;
+    }
+    CYBOZU_TEST_EQUAL(cnt["a"], 5u);
+    CYBOZU_TEST_EQUAL(cnt["d"], 5u);
+}
+
+namespace {
+
+std::mutex g_mu;
+std::vector<std::string> g_started;
+std::vector<std::string> g_done;
+std::map<std::string, size_t> g_running;
+size_t g_maxRunningPerGroup = 0;
+
+struct TestWorker
+{
+    const std::string task;
+    explicit TestWorker(const std::string &task) : task(task) {}
+    void operator()() {
+        const std::string group = task.substr(0, 1);
+        {
+            std::lock_guard<std::mutex> lk(g_mu);
+            g_started.push_back(task);
+            g_maxRunningPerGroup = std::max(g_maxRunningPerGroup, ++g_running[group]);
+        }
+        /*
+         * "c1" finishes clearly earlier than the others
+         * so that tasks are not started by the same choice.
+         */
+        util::sleepMs(task == "c1" ? 10 : 50);
+        std::lock_guard<std::mutex> lk(g_mu);
+        g_running[group]--;
+        g_done.push_back(task);
+    }
+};
+
+} // namespace
+
+CYBOZU_TEST_AUTO(dispatchTask)
+{
+    TaskQueue<std::string> tq;
+    for (const char *task : {"a1", "a2", "a3", "a4", "b1", "c1"}) tq.push(task);
+    {
+        DispatchTask<std::string, TestWorker> dispatcher(
+            tq, 2, 1, [](const std::string &task) {
+                return TaskSchedAttr(task.substr(0, 1), task[0] == 'c' ? 1 : 0);
+            });
+        for (size_t i = 0; i < 500; i++) {
+            util::sleepMs(10);
+            std::lock_guard<std::mutex> lk(g_mu);
+            if (g_done.size() == 6) break;
+        }
+        tq.quit();
+    }
+    CYBOZU_TEST_EQUAL(g_done.size(), 6u);
+    CYBOZU_TEST_EQUAL(g_maxRunningPerGroup, 1u);
+    /* The high priority task and the other group start before the rest of "a". */
+    CYBOZU_TEST_EQUAL(g_started.size(), 6u);
+    const std::vector<std::string> head(g_started.begin(), g_started.begin() + 3);
+    CYBOZU_TEST_ASSERT(std::count(head.begin(), head.end(), "c1") == 1);
+    CYBOZU_TEST_ASSERT(std::count(head.begin(), head.end(), "b1") == 1);
+}
@@ -212,3 +212,56 @@ CYBOZU_TEST_AUTO(BoundedQueueResize)
 
     CYBOZU_TEST_EQUAL(total, n);
 }
+
+CYBOZU_TEST_AUTO(ParallelConverter)
+{
+    cybozu::thread::ParallelConverter<size_t, size_t> pconv([](size_t &&x) {
+            return x * 2;
+        });
+    pconv.start(4);
+    const size_t n = 10000;
+    std::exception_ptr ep;
+    std::thread th([&]() {
+            try {
+                for (size_t i = 0; i < n; i++) pconv.push(size_t(i));
+                pconv.sync();
+            } catch (...) {
+                ep = std::current_exception();
+                pconv.fail();
+            }
+        });
+    size_t i = 0, x;
+    while (pconv.pop(x)) {
+        CYBOZU_TEST_EQUAL(x, i * 2);
+        i++;
+    }
+    th.join();
+    CYBOZU_TEST_ASSERT(!ep);
+    CYBOZU_TEST_EQUAL(i, n);
+}
+
+CYBOZU_TEST_AUTO(ParallelConverterError)
+{
+    cybozu::thread::ParallelConverter<size_t, size_t> pconv([](size_t &&x) -> size_t {
+            if (x == 100) throw std::runtime_error("convert error for test.");
+            return x;
+        });
+    pconv.start(2);
+    std::thread th([&]() {
+            try {
+                for (size_t i = 0; i < 1000; i++) pconv.push(size_t(i));
+                pconv.sync();
+            } catch (...) {
+                pconv.fail();
+            }
+        });
+    bool caught = false;
+    try {
+        size_t x;
+        while (pconv.pop(x)) {}
+    } catch (std::runtime_error &e) {
+        caught = std::string(e.what()) == "convert error for test.";
+    }
+    th.join();
+    CYBOZU_TEST_ASSERT(caught);
+}
@@ -4,6 +4,8 @@
 #include "random.hpp"
 #include "for_walb_diff_test.hpp"
 #include <sstream>
+#include <thread>
+#include <atomic>
 
 using namespace walb;
 
@@ -237,3 +239,255 @@ CYBOZU_TEST_AUTO(RandomIndexedDiffFile)
     testRandomIndexedDiffFile(::WALB_DIFF_CMPR_LZ4, nr);
     testRandomIndexedDiffFile(::WALB_DIFF_CMPR_ZSTD, nr);
 }
+
+void testHoldBackIndexedDiffFile(size_t holdBackSize, size_t nrIos, bool expectNoDeadData)
+{
+    const size_t nrBlocks = 256;
+    cybozu::TmpFile tmpFile(".");
+    BlockImage img0(nrBlocks), img1(nrBlocks);
+    uint64_t eliminatedSize, deadSize;
+    {
+        IndexedDiffWriter writer;
+        writer.setFd(tmpFile.fd());
+        writer.setMaxHoldBackSize(holdBackSize);
+        DiffFileHeader header;
+        writer.writeHeader(header);
+        for (size_t i = 0; i < nrIos; i++) {
+            Sio sio;
+            const uint32_t blks = g_rand() % 15 + 1;
+            sio.setRandomly(g_rand() % (nrBlocks - blks), blks);
+            img0.apply(sio.ioAddr, sio.ioBlocks, sio.type, sio.data.data());
+            IndexedDiffRecord rec;
+            AlignedArray data;
+            sio.copyTo(rec, data);
+            writer.compressAndWriteDiff(rec, data.data());
+        }
+        writer.finalize();
+        CYBOZU_TEST_ASSERT(writer.getPeakHoldBackSize() <= holdBackSize + 15 * LOGICAL_BLOCK_SIZE);
+        eliminatedSize = writer.getEliminatedSize();
+        deadSize = writer.getDeadSize();
+    }
+    ::printf("holdBack %zu eliminated %" PRIu64 " dead %" PRIu64 "\n"
+             , holdBackSize, eliminatedSize, deadSize);
+    if (holdBackSize == 0) CYBOZU_TEST_EQUAL(eliminatedSize, 0);
+    if (expectNoDeadData) CYBOZU_TEST_EQUAL(deadSize, 0);
+
+    cybozu::util::File(tmpFile.fd()).lseek(0);
+    IndexedDiffReader reader;
+    IndexedDiffCache cache;
+    cache.setMaxSize(32 * MEBI);
+    reader.setFile(cybozu::util::File(tmpFile.fd()), cache);
+    IndexedDiffRecord rec;
+    AlignedArray data;
+    while (reader.readDiff(rec, data)) {
+        const DiffRecType t = rec.isNormal() ? DiffRecType::NORMAL :
+            (rec.isAllZero() ? DiffRecType::ALLZERO : DiffRecType::DISCARD);
+        img1.apply(rec.io_address, rec.io_blocks, t, data.data());
+    }
+    CYBOZU_TEST_ASSERT(img0 == img1);
+}
+
+CYBOZU_TEST_AUTO(HoldBackIndexedDiffFile)
+{
+    const size_t nr = 1000;
+    testHoldBackIndexedDiffFile(0, nr, false);
+    testHoldBackIndexedDiffFile(LOGICAL_BLOCK_SIZE, nr, false);
+    testHoldBackIndexedDiffFile(16 * KIBI, nr, false);
+    testHoldBackIndexedDiffFile(MEBI, nr, true);
+}
+
+IndexedDiffCache::DataPtr makeCacheData(size_t size, char c)
+{
+    std::shared_ptr<AlignedArray> p(new AlignedArray(size, false));
+    ::memset(p->data(), c, size);
+    return p;
+}
+
+CYBOZU_TEST_AUTO(SortedDiffValidEnd)
+{
+    cybozu::TmpFile tmpFile(".");
+    cybozu::util::File file(tmpFile.fd());
+    cybozu::Uuid uuid;
+    uuid.setRand(g_rand);
+    writeDiffFileHeader(file, uuid);
+
+    std::vector<uint64_t> offV, addrV; // for each pack end.
+    DiffPacker packer;
+    uint64_t addr = 0;
+    for (size_t i = 0; i < 5; i++) {
+        for (size_t j = 0; j < 10; j++) {
+            const uint32_t blks = g_rand() % 16 + 1;
+            AlignedArray data(blks * LOGICAL_BLOCK_SIZE);
+            g_rand.fill(data.data(), data.size());
+            DiffRecord rec;
+            rec.io_address = addr;
+            rec.io_blocks = blks;
+            rec.setNormal();
+            rec.data_size = data.size();
+            rec.checksum = calcDiffIoChecksum(data);
+            CYBOZU_TEST_ASSERT(packer.add(rec, data.data()));
+            addr += blks + g_rand() % 4;
+        }
+        const AlignedArray pack = packer.getPackAsArray();
+        file.write(pack.data(), pack.size());
+        offV.push_back(file.lseek(0, SEEK_CUR));
+        const DiffPackHeader &packH = *(const DiffPackHeader *)pack.data();
+        addrV.push_back(packH[packH.n_records - 1].endIoAddress());
+    }
+    uint64_t endAddr;
+    CYBOZU_TEST_EQUAL(findSortedDiffValidEnd(file, uuid, endAddr), offV[4]);
+    CYBOZU_TEST_EQUAL(endAddr, addrV[4]);
+
+    /* A pack written partially. */
+    file.ftruncate(offV[4] - 1);
+    CYBOZU_TEST_EQUAL(findSortedDiffValidEnd(file, uuid, endAddr), offV[3]);
+    CYBOZU_TEST_EQUAL(endAddr, addrV[3]);
+
+    /* Broken IO data. */
+    const char c = 0x5a;
+    file.pwrite(&c, 1, offV[2] - 1);
+    CYBOZU_TEST_EQUAL(findSortedDiffValidEnd(file, uuid, endAddr), offV[1]);
+    CYBOZU_TEST_EQUAL(endAddr, addrV[1]);
+
+    /* The end pack. */
+    file.ftruncate(offV[0]);
+    file.lseek(offV[0], SEEK_SET);
+    writeDiffEofPack(file);
+    CYBOZU_TEST_EQUAL(findSortedDiffValidEnd(file, uuid, endAddr), offV[0]);
+    CYBOZU_TEST_EQUAL(endAddr, addrV[0]);
+
+    cybozu::Uuid uuid1;
+    uuid1.setRand(g_rand);
+    CYBOZU_TEST_EQUAL(findSortedDiffValidEnd(file, uuid1, endAddr), 0u);
+    file.ftruncate(10);
+    CYBOZU_TEST_EQUAL(findSortedDiffValidEnd(file, uuid, endAddr), 0u);
+    CYBOZU_TEST_EQUAL(endAddr, 0u);
+}
+
+CYBOZU_TEST_AUTO(IndexedDiffCacheEviction)
+{
+    IndexedDiffCache cache;
+    const size_t itemSize = 4 * KIBI;
+    cache.setMaxSize(64 * itemSize); // 4 items per shard.
+    const size_t nr = 1000;
+    for (size_t i = 0; i < nr; i++) {
+        const IndexedDiffCache::Key key{1, 2, 3, i};
+        CYBOZU_TEST_ASSERT(!cache.find(key));
+        IndexedDiffCache::DataPtr p = cache.add(key, makeCacheData(itemSize, char(i)));
+        CYBOZU_TEST_EQUAL((*p)[0], char(i));
+        /* The same key must not be added twice. */
+        IndexedDiffCache::DataPtr p1 = cache.add(key, makeCacheData(itemSize, char(i + 1)));
+        CYBOZU_TEST_ASSERT(p == p1);
+    }
+    IndexedDiffCache::Stat st = cache.getStat();
+    CYBOZU_TEST_EQUAL(st.misses, nr);
+    CYBOZU_TEST_EQUAL(st.hits, 0u);
+    CYBOZU_TEST_ASSERT(st.curBytes <= st.maxBytes);
+    CYBOZU_TEST_EQUAL(st.curBytes, st.nrItems * itemSize);
+    CYBOZU_TEST_EQUAL(st.evictions + st.nrItems, nr);
+
+    /* The last item must remain. */
+    const IndexedDiffCache::Key last{1, 2, 3, nr - 1};
+    CYBOZU_TEST_ASSERT(cache.exists(last));
+    IndexedDiffCache::DataPtr p = cache.find(last);
+    CYBOZU_TEST_ASSERT(p);
+    CYBOZU_TEST_EQUAL((*p)[itemSize - 1], char(nr - 1));
+    CYBOZU_TEST_EQUAL(cache.getStat().hits, 1u);
+    /* Another file. */
+    CYBOZU_TEST_ASSERT(!cache.exists(IndexedDiffCache::Key{1, 2, 4, nr - 1}));
+
+    cache.setMaxSize(0);
+    st = cache.getStat();
+    CYBOZU_TEST_EQUAL(st.curBytes, 0u);
+    CYBOZU_TEST_EQUAL(st.nrItems, 0u);
+    CYBOZU_TEST_EQUAL((*p)[0], char(nr - 1)); // still valid.
+}
+
+CYBOZU_TEST_AUTO(IndexedDiffCacheConcurrent)
+{
+    IndexedDiffCache cache;
+    const size_t itemSize = 512;
+    cache.setMaxSize(32 * itemSize);
+    const size_t nrKeys = 100, nrThreads = 4;
+    std::vector<std::thread> thV;
+    std::atomic<size_t> nrErr(0);
+    for (size_t t = 0; t < nrThreads; t++) {
+        thV.emplace_back([&]() {
+            cybozu::util::Random<size_t> rand;
+            for (size_t i = 0; i < 10000; i++) {
+                const size_t k = rand() % nrKeys;
+                const IndexedDiffCache::Key key{0, 0, 0, k};
+                IndexedDiffCache::DataPtr p = cache.find(key);
+                if (!p) p = cache.add(key, makeCacheData(itemSize, char(k)));
+                if ((*p)[0] != char(k) || (*p)[itemSize - 1] != char(k)) nrErr++;
+            }
+        });
+    }
+    for (std::thread &th : thV) th.join();
+    CYBOZU_TEST_EQUAL(nrErr.load(), 0u);
+    const IndexedDiffCache::Stat st = cache.getStat();
+    CYBOZU_TEST_EQUAL(st.hits + st.misses, nrThreads * 10000);
+    CYBOZU_TEST_EQUAL(st.curBytes, st.nrItems * itemSize);
+    ::printf("%s\n", st.str().c_str());
+}
+
+void testIndexedDiffIoView(int cmprType)
+{
+    const size_t nrBlocks = 256, nrIos = 300;
+    cybozu::TmpFile tmpFile(".");
+    BlockImage img0(nrBlocks), img1(nrBlocks);
+    {
+        IndexedDiffWriter writer;
+        writer.setFd(tmpFile.fd());
+        DiffFileHeader header;
+        writer.writeHeader(header);
+        for (size_t i = 0; i < nrIos; i++) {
+            Sio sio;
+            const uint32_t blks = g_rand() % 15 + 1;
+            sio.setRandomly(g_rand() % (nrBlocks - blks), blks);
+            img0.apply(sio.ioAddr, sio.ioBlocks, sio.type, sio.data.data());
+            IndexedDiffRecord rec;
+            AlignedArray data;
+            sio.copyTo(rec, data);
+            writer.compressAndWriteDiff(rec, data.data(), cmprType);
+        }
+        writer.finalize();
+    }
+    IndexedDiffReader reader;
+    IndexedDiffCache cache;
+    cache.setMaxSize(32 * MEBI);
+    reader.setFile(cybozu::util::File(tmpFile.path(), O_RDONLY), cache);
+    IndexedDiffRecord rec;
+    IndexedDiffReader::IoView view, stored;
+    size_t nrSplit = 0;
+    while (reader.readDiff(rec, view)) {
+        if (rec.io_offset > 0) nrSplit++;
+        const DiffRecType t = rec.isNormal() ? DiffRecType::NORMAL :
+            (rec.isAllZero() ? DiffRecType::ALLZERO : DiffRecType::DISCARD);
+        if (rec.isNormal()) {
+            CYBOZU_TEST_EQUAL(view.size, rec.io_blocks * LOGICAL_BLOCK_SIZE);
+            /* Uncompressed data must not be copied. */
+            CYBOZU_TEST_EQUAL(bool(view.pin), rec.isCompressed());
+            const bool isWhole = rec.io_offset == 0 && rec.io_blocks == rec.orig_blocks;
+            CYBOZU_TEST_EQUAL(reader.getStoredIoView(rec, stored), isWhole);
+            if (isWhole) {
+                CYBOZU_TEST_EQUAL(stored.size, rec.data_size);
+                CYBOZU_TEST_EQUAL(calcDiffIoChecksum(stored.data, stored.size), rec.io_checksum);
+            }
+        } else {
+            CYBOZU_TEST_EQUAL(view.size, 0u);
+        }
+        img1.apply(rec.io_address, rec.io_blocks, t, view.data);
+    }
+    CYBOZU_TEST_ASSERT(img0 == img1);
+    CYBOZU_TEST_ASSERT(nrSplit > 0);
+    if (cmprType == ::WALB_DIFF_CMPR_NONE) {
+        CYBOZU_TEST_EQUAL(cache.getStat().nrItems, 0u);
+    }
+}
+
+CYBOZU_TEST_AUTO(IndexedDiffIoView)
+{
+    testIndexedDiffIoView(::WALB_DIFF_CMPR_NONE);
+    testIndexedDiffIoView(::WALB_DIFF_CMPR_SNAPPY);
+}
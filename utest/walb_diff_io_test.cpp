@@ -0,0 +1,130 @@
+#include "cybozu/test.hpp"
+#include "walb_diff_io.hpp"
+#include "walb_diff_file.hpp"
+#include "for_walb_diff_test.hpp"
+#include "tmp_file.hpp"
+
+using namespace walb;
+
+cybozu::util::Random<size_t> g_rand;
+
+CYBOZU_TEST_AUTO(Setup)
+{
+#if 0
+    g_rand.setSeed(2742957103);
+#endif
+    ::printf("random number generator seed: %zu\n", g_rand.getSeed());
+    setRandForTest(g_rand);
+}
+
+struct TestFile
+{
+    cybozu::TmpFile tmpFile;
+    cybozu::util::File file;
+
+    TestFile(const AlignedArray& init, int flags)
+        : tmpFile(".", flags), file(tmpFile.fd()) {
+        file.pwrite(init.data(), init.size(), 0);
+    }
+    AlignedArray read(size_t size) {
+        AlignedArray buf(size, false);
+        file.pread(buf.data(), buf.size(), 0);
+        return buf;
+    }
+};
+
+/**
+ * Apply the IOs with AsyncDiffIoWriter to an O_DIRECT file
+ * and with issueIo() to another file, then compare them.
+ */
+void testAsyncDiffIoWriter(uint64_t devLb, const std::vector<Sio>& sioV, DiscardType discardType,
+                           size_t bufferSize, size_t maxIoSize)
+{
+    AlignedArray init(devLb * LOGICAL_BLOCK_SIZE, false);
+    g_rand.fill(init.data(), init.size());
+    TestFile f0(init, 0), f1(init, O_DIRECT);
+
+    AlignedArray zero;
+    {
+        AsyncDiffIoWriter writer(f1.file.fd(), discardType, bufferSize, maxIoSize);
+        for (const Sio& sio : sioV) {
+            DiffRecord rec;
+            AlignedArray data;
+            sio.copyTo(rec, data);
+            issueIo(f0.file, discardType, rec, data.data(), zero);
+            writer.add(rec, data.data());
+        }
+        writer.waitForAll();
+    }
+    const AlignedArray buf0 = f0.read(init.size());
+    const AlignedArray buf1 = f1.read(init.size());
+    CYBOZU_TEST_ASSERT(::memcmp(buf0.data(), buf1.data(), buf0.size()) == 0);
+}
+
+Sio makeSio(uint64_t ioAddr, uint32_t ioBlocks, DiffRecType type = DiffRecType::NORMAL)
+{
+    Sio sio;
+    sio.setRandomly(ioAddr, ioBlocks, type);
+    return sio;
+}
+
+CYBOZU_TEST_AUTO(Coalesce)
+{
+    /* Adjacent normal and all-zero IOs crossing maxIoSize. */
+    std::vector<Sio> sioV;
+    uint64_t addr = 3;
+    for (size_t i = 0; i < 20; i++) {
+        const uint32_t blks = g_rand() % 7 + 1;
+        sioV.push_back(makeSio(addr, blks, i % 3 == 2 ? DiffRecType::ALLZERO : DiffRecType::NORMAL));
+        addr += blks;
+    }
+    testAsyncDiffIoWriter(128, sioV, DiscardType::Zero, 64 * KIBI, 8 * LOGICAL_BLOCK_SIZE);
+    testAsyncDiffIoWriter(128, sioV, DiscardType::Zero, 64 * KIBI, MEBI);
+}
+
+CYBOZU_TEST_AUTO(Overlap)
+{
+    /*
+     * in0     1111
+     * in1         22222222  (adjacent to in0)
+     * in2   33333333        (overlapping in0 and in1)
+     * in3 zzzz              (all zero)
+     * in4        44444444
+     * in5 dd                (discard)
+     */
+    const std::vector<Sio> sioV = {
+        makeSio(4, 4), makeSio(8, 8), makeSio(2, 8), makeSio(0, 4, DiffRecType::ALLZERO),
+        makeSio(7, 8), makeSio(0, 2, DiffRecType::DISCARD),
+    };
+    for (DiscardType discardType : {DiscardType::Zero, DiscardType::Ignore}) {
+        testAsyncDiffIoWriter(32, sioV, discardType, 64 * KIBI, 4 * LOGICAL_BLOCK_SIZE);
+        testAsyncDiffIoWriter(32, sioV, discardType, 64 * KIBI, MEBI);
+    }
+}
+
+CYBOZU_TEST_AUTO(Random)
+{
+    /* Passdown is not tested because regular files do not support BLKDISCARD. */
+    const uint64_t devLb = 1024;
+    for (size_t i = 0; i < 20; i++) {
+        std::vector<Sio> sioV;
+        uint64_t addr = g_rand() % devLb;
+        for (size_t j = 0; j < 200; j++) {
+            const size_t r = g_rand() % 4;
+            if (r == 0) {
+                addr = g_rand() % devLb; // random
+            } else if (r == 1 && addr > 0) {
+                addr -= std::min<uint64_t>(addr, g_rand() % 8 + 1); // overlap
+            }
+            // otherwise adjacent.
+            if (addr >= devLb) addr = 0;
+            const uint32_t blks = std::min<uint64_t>(g_rand() % 32 + 1, devLb - addr);
+            Sio sio;
+            sio.setRandomly(addr, blks);
+            sioV.push_back(std::move(sio));
+            addr += blks;
+        }
+        const DiscardType discardType = i % 2 == 0 ? DiscardType::Zero : DiscardType::Ignore;
+        testAsyncDiffIoWriter(devLb, sioV, discardType, 32 * KIBI, (g_rand() % 64 + 1) * LOGICAL_BLOCK_SIZE);
+    }
+}
@@ -37,12 +37,14 @@ void testDiffMemory(size_t diskLen, const Recipe& recipe)
         diffM.add(rec, std::move(data));
     }
     diffM.checkNoOverlappedAndSorted();
+    diffM.checkStatistics();
 
     std::list<Sio> sioList1;
     {
         for (const DiffMemory::Map::value_type& pair : diffM.getMap()) {
             const DiffRecord &rec = pair.second.record();
-            const AlignedArray &buf = pair.second.io();
+            AlignedArray buf(pair.second.size());
+            if (!buf.empty()) ::memcpy(buf.data(), pair.second.data(), buf.size());
             Sio sio;
             sio.copyFrom(rec, buf);
             mergeOrAddSioList(sioList1, std::move(sio));
@@ -86,3 +88,19 @@ CYBOZU_TEST_AUTO(SimpleDiff)
         testDiffMemory(diskLen, recipe);
     }
 }
+
+/**
+ * Overwrite-heavy workload like wlog-gen with a small device.
+ */
+CYBOZU_TEST_AUTO(OverwriteHeavyDiff)
+{
+    const uint64_t devLb = 8 * MEBI / LOGICAL_BLOCK_SIZE;
+    const uint32_t maxIoLb = 32;
+    const size_t nrIo = 8000;
+    Recipe recipe;
+    for (size_t i = 0; i < nrIo; i++) {
+        const uint32_t blks = g_rand() % maxIoLb + 1;
+        recipe.push_back({g_rand() % (devLb - blks), blks});
+    }
+    testDiffMemory(devLb, recipe);
+}
@@ -1,6 +1,7 @@
 #include "cybozu/test.hpp"
 #include "cybozu/array.hpp"
 #include "walb_diff_merge.hpp"
+#include "walb_diff_virt.hpp"
 #include "tmp_file.hpp"
 #include "random.hpp"
 #include "for_walb_diff_test.hpp"
@@ -26,7 +27,7 @@ CYBOZU_TEST_AUTO(Setup)
     setRandForTest(g_rand);
 }
 
-void verifyMergedDiff(size_t len, TmpDiffFileVec &d)
+void verifyMergedDiffDetail(size_t len, TmpDiffFileVec &d, size_t readAheadThreads)
 {
     TmpDisk disk0(len), disk1(len);
 
@@ -36,6 +37,7 @@ void verifyMergedDiff(size_t len, TmpDiffFileVec &d)
 
     TmpDiffFile merged;
     DiffMerger merger(0);
+    merger.setReadAheadThreads(readAheadThreads);
     for (size_t i = 0; i < d.size(); i++) {
         merger.addWdiff(d[i].path());
     }
@@ -45,6 +47,145 @@ void verifyMergedDiff(size_t len, TmpDiffFileVec &d)
     disk0.verifyEquals(disk1);
 }
 
+void verifyMergedDiffInParallel(size_t len, TmpDiffFileVec &d, const CompressOpt &cmpr)
+{
+    TmpDisk disk0(len), disk1(len);
+
+    for (size_t i = 0; i < d.size(); i++) {
+        disk0.apply(d[i].path());
+    }
+
+    TmpDiffFile merged0, merged1;
+    DiffMerger merger0(0), merger1(0);
+    for (size_t i = 0; i < d.size(); i++) {
+        merger0.addWdiff(d[i].path());
+        merger1.addWdiff(d[i].path());
+    }
+    merger0.mergeToFd(merged0.fd());
+    CYBOZU_TEST_ASSERT(merger1.mergeToFdInParallel(merged1.fd(), cmpr));
+    disk1.apply(merged1.path());
+    disk0.verifyEquals(disk1);
+
+    const DiffStatistics &st0 = merger0.statOut(), &st1 = merger1.statOut();
+    CYBOZU_TEST_EQUAL(st1.wdiffNr, 1u);
+    CYBOZU_TEST_EQUAL(st0.normNr, st1.normNr);
+    CYBOZU_TEST_EQUAL(st0.normLb, st1.normLb);
+    CYBOZU_TEST_EQUAL(st0.zeroLb, st1.zeroLb);
+    CYBOZU_TEST_EQUAL(st0.discLb, st1.discLb);
+
+    cybozu::util::File file(merged1.fd());
+    DiffFileHeader header;
+    file.lseek(0);
+    header.readFrom(file);
+    CYBOZU_TEST_ASSERT(header.getUuid() == merger1.header().getUuid());
+}
+
+/**
+ * Re-write all the packs of a sorted wdiff with a stream writer like wdiffTransferServer().
+ */
+void copyPacksToIndexedWdiff(const std::string &sortedPath, int outFd, uint32_t unitLb)
+{
+    cybozu::util::File fileR(sortedPath, O_RDONLY);
+    DiffFileHeader fileH;
+    fileH.readFrom(fileR);
+    IndexedDiffStreamWriter writer;
+    writer.setUnitLb(unitLb);
+    writer.start(outFd, fileH, CompressOpt(::WALB_DIFF_CMPR_SNAPPY, 0, 2));
+    AlignedArray pack;
+    for (;;) {
+        pack.resize(::WALB_DIFF_PACK_SIZE);
+        DiffPackHeader &packH = *reinterpret_cast<DiffPackHeader *>(pack.data());
+        packH.readFrom(fileR);
+        if (packH.isEnd()) break;
+        const size_t totalSize = packH.total_size;
+        pack.resize(::WALB_DIFF_PACK_SIZE + totalSize);
+        fileR.read(pack.data() + ::WALB_DIFF_PACK_SIZE, totalSize);
+        writer.addPack(pack.data(), pack.size());
+    }
+    writer.finalize();
+}
+
+void verifyMergedDiffIndexed(size_t len, TmpDiffFileVec &d, const CompressOpt &cmpr, uint32_t unitLb)
+{
+    TmpDisk disk0(len), disk1(len), disk2(len);
+
+    for (size_t i = 0; i < d.size(); i++) {
+        disk0.apply(d[i].path());
+    }
+
+    TmpDiffFile merged0, merged1, merged2;
+    DiffMerger merger0(0), merger1(0);
+    for (size_t i = 0; i < d.size(); i++) {
+        merger0.addWdiff(d[i].path());
+        merger1.addWdiff(d[i].path());
+    }
+    CYBOZU_TEST_ASSERT(merger0.mergeToFdInParallel(merged0.fd(), cmpr));
+    IndexedDiffStreamWriter writer;
+    writer.setUnitLb(unitLb);
+    writer.setMaxIndexMemSize(sizeof(IndexedDiffRecord) * 3); // spill index records frequently.
+    CYBOZU_TEST_ASSERT(merger1.mergeToIndexedFdInParallel(merged1.fd(), writer, cmpr));
+    disk1.apply(merged1.path());
+    disk0.verifyEquals(disk1);
+
+    const DiffStatistics &st0 = merger0.statOut(), &st1 = merger1.statOut();
+    CYBOZU_TEST_EQUAL(st1.wdiffNr, 1u);
+    CYBOZU_TEST_EQUAL(st0.normLb, st1.normLb);
+    CYBOZU_TEST_EQUAL(st0.zeroLb, st1.zeroLb);
+    CYBOZU_TEST_EQUAL(st0.discLb, st1.discLb);
+    if (st1.normNr + st1.zeroNr + st1.discNr > 3) {
+        CYBOZU_TEST_ASSERT(writer.getSpilledSize() > 0);
+    }
+
+    cybozu::util::File file(merged1.fd());
+    DiffFileHeader header;
+    file.lseek(0);
+    header.readFrom(file);
+    CYBOZU_TEST_ASSERT(header.isIndexed());
+    CYBOZU_TEST_ASSERT(header.getUuid() == merger1.header().getUuid());
+
+    copyPacksToIndexedWdiff(merged0.path(), merged2.fd(), unitLb);
+    disk2.apply(merged2.path());
+    disk0.verifyEquals(disk2);
+}
+
+/**
+ * Range scans must be the same as the corresponding part of the whole scan.
+ */
+void verifyVirtualFullScanRange(size_t len, TmpDiffFileVec &d)
+{
+    TmpDiffFile base;
+    cybozu::util::File(base.fd()).ftruncate(len * LBS);
+    StrVec paths;
+    for (TmpDiffFile &f : d) paths.push_back(f.path());
+
+    AlignedArray all(len * LBS, false);
+    VirtualFullScanner virt0;
+    virt0.init(cybozu::util::File(base.path(), O_RDONLY), paths);
+    virt0.read(all.data(), all.size());
+
+    for (const uint64_t startLb : {size_t(1), len / 3, len / 2 + 1, len - 1}) {
+        const size_t sizeLb = std::min<size_t>(g_rand() % 32 + 1, len - startLb);
+        AlignedArray buf(sizeLb * LBS, false);
+        VirtualFullScanner virt1;
+        virt1.init(cybozu::util::File(base.path(), O_RDONLY), paths, startLb);
+        CYBOZU_TEST_EQUAL(virt1.currentAddr(), startLb);
+        virt1.read(buf.data(), buf.size());
+        CYBOZU_TEST_ASSERT(::memcmp(buf.data(), all.data() + startLb * LBS, buf.size()) == 0);
+    }
+}
+
+void verifyMergedDiff(size_t len, TmpDiffFileVec &d)
+{
+    verifyVirtualFullScanRange(len, d);
+    verifyMergedDiffDetail(len, d, 0);
+    verifyMergedDiffDetail(len, d, 1);
+    verifyMergedDiffDetail(len, d, 4);
+    verifyMergedDiffInParallel(len, d, CompressOpt(::WALB_DIFF_CMPR_SNAPPY, 0, 1));
+    verifyMergedDiffInParallel(len, d, CompressOpt(::WALB_DIFF_CMPR_ZSTD, 3, 3));
+    verifyMergedDiffIndexed(len, d, CompressOpt(::WALB_DIFF_CMPR_SNAPPY, 0, 2), 4);
+    verifyMergedDiffIndexed(len, d, CompressOpt(::WALB_DIFF_CMPR_NONE, 0, 1), 7);
+}
+
 void verifyDiffEquality(size_t len, TmpDiffFileVec &d0, TmpDiffFileVec &d1)
 {
     CYBOZU_TEST_EQUAL(d0.size(), d1.size());
@@ -365,3 +506,115 @@ CYBOZU_TEST_AUTO(wdiffMergeRandom)
         testMerge2(len, recipe);
     }
 }
+
+CYBOZU_TEST_AUTO(wdiffMergeInParallelStop)
+{
+    const size_t len = 512;
+    Recipe recipe;
+    for (size_t j = 0; j < 4; j++) {
+        recipe.emplace_back();
+        for (size_t k = 0; k < 32; k++) {
+            const uint64_t ioAddr = g_rand() % len;
+            const uint32_t ioBlocks = std::min(g_rand() % 16 + 1, len - ioAddr);
+            recipe.back().push_back({ioAddr, ioBlocks});
+        }
+    }
+    SioListVec slv = generateSioListVec(recipe);
+    TmpDiffFileVec d(recipe.size());
+    makeSortedWdiffs2(d, slv);
+
+    TmpDiffFile merged;
+    DiffMerger merger(0);
+    for (TmpDiffFile &f : d) merger.addWdiff(f.path());
+    size_t c = 0;
+    const bool isOk = merger.mergeToFdInParallel(
+        merged.fd(), CompressOpt(::WALB_DIFF_CMPR_SNAPPY, 0, 2), [&]() { return ++c > 10; });
+    CYBOZU_TEST_ASSERT(!isOk);
+}
+
+/**
+ * Merge wdiffs in tiers and verify that applying the result equals applying the original ones.
+ */
+void testMergeWdiffsInTiers(size_t len, TmpDiffFileVec &d, size_t fanIn)
+{
+    TmpDisk disk0(len), disk1(len);
+    for (TmpDiffFile &f : d) disk0.apply(f.path());
+
+    StrVec pathV;
+    for (TmpDiffFile &f : d) pathV.push_back(f.path());
+    std::vector<std::unique_ptr<cybozu::TmpFile> > tmpFileV;
+    size_t nrMerges = 0, nrMerged = 0;
+    CYBOZU_TEST_ASSERT(mergeWdiffsInTiers(
+        pathV, tmpFileV, fanIn, ".", [&](const StrVec &inV, int outFd) {
+            CYBOZU_TEST_ASSERT(2 <= inV.size() && inV.size() <= fanIn);
+            nrMerges++;
+            nrMerged += inV.size();
+            DiffMerger merger;
+            merger.addWdiffs(inV);
+            merger.mergeToFd(outFd);
+            return true;
+        }));
+    CYBOZU_TEST_EQUAL(pathV.size(), std::min(d.size(), fanIn));
+    if (d.size() <= fanIn) {
+        CYBOZU_TEST_EQUAL(nrMerges, 0);
+    } else {
+        /* Each merge reduces the number by (inputs - 1). */
+        CYBOZU_TEST_EQUAL(nrMerged - nrMerges, d.size() - fanIn);
+    }
+    /* Only the temporary wdiffs of the last tier are kept. */
+    for (const std::unique_ptr<cybozu::TmpFile> &f : tmpFileV) {
+        CYBOZU_TEST_ASSERT(std::find(pathV.begin(), pathV.end(), f->path()) != pathV.end());
+    }
+
+    TmpDiffFile merged;
+    DiffMerger merger;
+    merger.addWdiffs(pathV);
+    merger.mergeToFd(merged.fd());
+    disk1.apply(merged.path());
+    disk0.verifyEquals(disk1);
+}
+
+CYBOZU_TEST_AUTO(wdiffMergeInTiers)
+{
+    const size_t len = 512;
+    Recipe recipe;
+    for (size_t j = 0; j < 20; j++) {
+        recipe.emplace_back();
+        for (size_t k = 0; k < 16; k++) {
+            const uint64_t ioAddr = g_rand() % len;
+            const uint32_t ioBlocks = std::min(g_rand() % 16 + 1, len - ioAddr);
+            recipe.back().push_back({ioAddr, ioBlocks});
+        }
+    }
+    SioListVec slv = generateSioListVec(recipe);
+    TmpDiffFileVec d(recipe.size());
+    makeSortedWdiffs2(d, slv);
+    for (size_t fanIn : {2, 3, 4, 7, 19, 20, 32}) {
+        testMergeWdiffsInTiers(len, d, fanIn);
+    }
+    StrVec pathV;
+    std::vector<std::unique_ptr<cybozu::TmpFile> > tmpFileV;
+    CYBOZU_TEST_EXCEPTION(mergeWdiffsInTiers(pathV, tmpFileV, 1, ".", nullptr), cybozu::Exception);
+
+    /* Force stop. */
+    for (TmpDiffFile &f : d) pathV.push_back(f.path());
+    CYBOZU_TEST_ASSERT(!mergeWdiffsInTiers(
+        pathV, tmpFileV, 4, ".", [](const StrVec &, int) { return false; }));
+}
+
+CYBOZU_TEST_AUTO(IndexedDiffStreamWriterUnsorted)
+{
+    TmpDiffFile file;
+    DiffFileHeader fileH;
+    IndexedDiffStreamWriter writer;
+    writer.start(file.fd(), fileH, CompressOpt(::WALB_DIFF_CMPR_SNAPPY, 0, 1));
+    AlignedArray data(LBS * 8, true);
+    DiffRecord rec;
+    rec.io_address = 8;
+    rec.io_blocks = 8;
+    rec.data_size = data.size();
+    writer.add(rec, data.data());
+    rec.io_address = 15;
+    CYBOZU_TEST_EXCEPTION(writer.add(rec, data.data()), cybozu::Exception);
+    writer.fail();
+}
@@ -0,0 +1,196 @@
+#include "cybozu/test.hpp"
+#include "cybozu/socket.hpp"
+#include "wdiff_transfer.hpp"
+#include "walb_diff_mem.hpp"
+#include "tmp_file.hpp"
+#include "for_walb_diff_test.hpp"
+#include <future>
+#include <functional>
+
+using namespace walb;
+
+cybozu::util::Random<size_t> g_rand;
+
+CYBOZU_TEST_AUTO(Setup)
+{
+#if 0
+    g_rand.setSeed(395019343);
+#endif
+    ::printf("random number generator seed: %zu\n", g_rand.getSeed());
+    setRandForTest(g_rand);
+}
+
+int getCompressionTypeRandomly()
+{
+    static const int tbl[] = {
+        ::WALB_DIFF_CMPR_NONE, ::WALB_DIFF_CMPR_SNAPPY, ::WALB_DIFF_CMPR_LZ4, ::WALB_DIFF_CMPR_ZSTD,
+    };
+    return tbl[g_rand() % (sizeof(tbl) / sizeof(tbl[0]))];
+}
+
+std::vector<Sio> generateSioV(size_t nrBlocks, size_t nrIos)
+{
+    std::vector<Sio> sioV(nrIos);
+    for (Sio &sio : sioV) {
+        const uint32_t blks = g_rand() % 31 + 1;
+        sio.setRandomly(g_rand() % (nrBlocks - blks), blks);
+    }
+    return sioV;
+}
+
+/**
+ * @cmprType -1 means random for each IO.
+ */
+void makeSortedWdiff(const std::string &path, const std::vector<Sio> &sioV, int cmprType)
+{
+    DiffMemory diffM;
+    for (const Sio &sio : sioV) {
+        DiffRecord rec;
+        AlignedArray buf;
+        sio.copyTo(rec, buf);
+        diffM.add(rec, std::move(buf));
+    }
+    cybozu::util::File file(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    SortedDiffWriter writer(file.fd());
+    DiffFileHeader fileH;
+    writer.writeHeader(fileH);
+    for (const DiffMemory::Map::value_type &pair : diffM.getMap()) {
+        const int type = cmprType < 0 ? getCompressionTypeRandomly() : cmprType;
+        writer.compressAndWriteDiff(pair.second.record(), pair.second.data(), type);
+    }
+    writer.close();
+}
+
+/**
+ * Overwritten IOs remain partially in the indexed wdiff.
+ * RETURN:
+ *   number of IOs partially overwritten.
+ */
+size_t makeIndexedWdiff(const std::string &path, const std::vector<Sio> &sioV, int cmprType)
+{
+    cybozu::util::File file(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    IndexedDiffWriter writer;
+    writer.setFd(file.fd());
+    DiffFileHeader fileH;
+    writer.writeHeader(fileH);
+    for (const Sio &sio : sioV) {
+        IndexedDiffRecord rec;
+        AlignedArray buf;
+        sio.copyTo(rec, buf);
+        const int type = cmprType < 0 ? getCompressionTypeRandomly() : cmprType;
+        writer.compressAndWriteDiff(rec, buf.data(), type);
+    }
+    writer.finalize();
+    file.close();
+
+    IndexedDiffReader reader;
+    IndexedDiffCache cache;
+    cache.setMaxSize(4 * MEBI);
+    reader.setFile(cybozu::util::File(path, O_RDONLY), cache);
+    IndexedDiffRecord rec;
+    size_t nrSplit = 0;
+    while (reader.readDiffRecord(rec)) {
+        if (rec.isNormal() && (rec.io_offset > 0 || rec.io_blocks != rec.orig_blocks)) nrSplit++;
+    }
+    return nrSplit;
+}
+
+uint16_t bindRandomPort(cybozu::Socket &server)
+{
+    for (;;) {
+        const uint16_t port = 20000 + g_rand() % 40000;
+        try {
+            server.bind(port, cybozu::Socket::allowIPv4);
+            return port;
+        } catch (std::exception &) {
+            server.close();
+        }
+    }
+}
+
+using Client = std::function<bool(packet::Packet &, DiffStatistics &)>;
+
+/**
+ * Send a wdiff with the client to wdiffTransferServer() over a loopback connection.
+ */
+void transfer(const std::string &outPath, Client client, DiffStatistics &statOut)
+{
+    std::atomic<int> stopState(NotStopping);
+    ProcessStatus ps;
+    cybozu::Socket server;
+    const uint16_t port = bindRandomPort(server);
+    std::future<bool> f = std::async(std::launch::async, [&]() {
+            cybozu::Socket sock;
+            server.accept(sock);
+            packet::Packet pkt(sock);
+            cybozu::util::File fileW(outPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            DiffFileHeader fileH;
+            fileH.writeTo(fileW);
+            const bool ret = wdiffTransferServer(pkt, fileW.fd(), stopState, ps, UINT64_MAX);
+            fileW.close();
+            return ret;
+        });
+    cybozu::Socket sock;
+    sock.connect("127.0.0.1", port);
+    packet::Packet pkt(sock);
+    CYBOZU_TEST_ASSERT(client(pkt, statOut));
+    CYBOZU_TEST_ASSERT(f.get());
+}
+
+void testPassThrough(const std::string &inPath, size_t nrBlocks, const BlockImage &expected, int cmprType)
+{
+    const CompressOpt cmpr(cmprType, 0, 2);
+    std::atomic<int> stopState(NotStopping);
+    ProcessStatus ps;
+    cybozu::TmpFile out0("."), out1(".");
+    DiffStatistics stat0, stat1;
+
+    transfer(out0.path(), [&](packet::Packet &pkt, DiffStatistics &statOut) {
+            DiffMerger merger;
+            merger.addWdiffs({inPath});
+            merger.prepare();
+            return wdiffTransferClient(pkt, merger, cmpr, stopState, ps, statOut);
+        }, stat0);
+    transfer(out1.path(), [&](packet::Packet &pkt, DiffStatistics &statOut) {
+            cybozu::util::File fileR(inPath, O_RDONLY);
+            DiffFileHeader fileH;
+            fileH.readFrom(fileR);
+            return wdiffTransferPassThroughClient(pkt, fileR, fileH, cmpr, stopState, ps, statOut);
+        }, stat1);
+
+    BlockImage img0(nrBlocks), img1(nrBlocks);
+    img0.applySortedWdiff(out0.path());
+    img1.applySortedWdiff(out1.path());
+    CYBOZU_TEST_ASSERT(img0 == expected);
+    CYBOZU_TEST_ASSERT(img1 == expected);
+    CYBOZU_TEST_EQUAL(stat0.normLb, stat1.normLb);
+    CYBOZU_TEST_EQUAL(stat0.zeroLb, stat1.zeroLb);
+    CYBOZU_TEST_EQUAL(stat0.discLb, stat1.discLb);
+    CYBOZU_TEST_EQUAL(stat1.wdiffNr, 1u);
+}
+
+CYBOZU_TEST_AUTO(PassThroughSorted)
+{
+    const size_t nrBlocks = 1024, nrIos = 500;
+    for (int cmprType : {int(::WALB_DIFF_CMPR_ZSTD), -1}) {
+        const std::vector<Sio> sioV = generateSioV(nrBlocks, nrIos);
+        BlockImage expected(nrBlocks);
+        for (const Sio &sio : sioV) expected.apply(sio.ioAddr, sio.ioBlocks, sio.type, sio.data.data());
+        cybozu::TmpFile in(".");
+        makeSortedWdiff(in.path(), sioV, cmprType);
+        testPassThrough(in.path(), nrBlocks, expected, ::WALB_DIFF_CMPR_ZSTD);
+    }
+}
+
+CYBOZU_TEST_AUTO(PassThroughIndexed)
+{
+    const size_t nrBlocks = 1024, nrIos = 500;
+    for (int cmprType : {int(::WALB_DIFF_CMPR_ZSTD), -1}) {
+        const std::vector<Sio> sioV = generateSioV(nrBlocks, nrIos);
+        BlockImage expected(nrBlocks);
+        for (const Sio &sio : sioV) expected.apply(sio.ioAddr, sio.ioBlocks, sio.type, sio.data.data());
+        cybozu::TmpFile in(".");
+        CYBOZU_TEST_ASSERT(makeIndexedWdiff(in.path(), sioV, cmprType) > 0);
+        testPassThrough(in.path(), nrBlocks, expected, ::WALB_DIFF_CMPR_ZSTD);
+    }
+}